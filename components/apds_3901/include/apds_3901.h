@@ -3,6 +3,9 @@
 
 #include "esp_err.h"
 #include "hal/i2c_types.h"
+#include "retry.h"
+#include <stdbool.h>
+#include <stdint.h>
 
 /// Register Addresses
 #define APDS_3901_CONTROL_REG 0x80
@@ -12,9 +15,18 @@
 
 /// Config constants
 #define APDS_3901_POW_ON 0x3
+#define APDS_3901_GAIN_16X 0x10
+#define APDS_3901_INT_TIME_13_7_MS 0x00
+#define APDS_3901_INT_TIME_101_MS 0x01
 #define APDS_3901_INT_TIME_402_MS 0x02
 
 esp_err_t init_apds_3901(i2c_port_t bus, uint8_t addr);
 esp_err_t read_lux(float *lux);
 
+/// Non-blocking measurements, so conversions on different sensors overlap
+esp_err_t apds_3901_start_measurement(void);
+bool apds_3901_poll_ready(uint32_t *wait_ms);
+esp_err_t apds_3901_collect(float *lux);
+retry_t *apds_3901_retry(void);
+
 #endif
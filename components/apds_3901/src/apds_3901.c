@@ -1,125 +1,107 @@
 #include "../include/apds_3901.h"
-#include "driver/i2c.h"
+#include "conv.h"
+#include "diag.h"
+#include "esp_attr.h"
 #include "esp_err.h"
 #include "esp_log.h"
-#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "i2c_bus.h"
 #include <string.h>
 
 /// Configuration constants
-#define SET_LOW_GAIN(v) v &= ~0x10
-#define I2C_MAX_WAIT pdMS_TO_TICKS(13)
+#if CONFIG_APDS_3901_AUTO_RANGE
+#define AUTO_RANGE 1
+#else
+#define AUTO_RANGE 0
+#endif
 static const char *TAG = "APDS 3901";
 
+/// Gain and integration time settings
+typedef struct apds_3901_range {
+  uint8_t timing;     // timing register value
+  uint16_t integ_ms;  // integration time, plus margin for the RC clock
+  uint16_t max_count; // ADC count at saturation
+  float scale;        // to counts at nominal 402 ms integration and 16x gain
+} apds_3901_range_t;
+
+/// Ranges from most to least sensitive
+static const apds_3901_range_t RANGES[] = {
+    {APDS_3901_GAIN_16X | APDS_3901_INT_TIME_402_MS, 410, 65535, 1.0f},
+    {APDS_3901_GAIN_16X | APDS_3901_INT_TIME_101_MS, 105, 37177, 322.0f / 81},
+    {APDS_3901_INT_TIME_402_MS, 410, 65535, 16.0f},
+    {APDS_3901_GAIN_16X | APDS_3901_INT_TIME_13_7_MS, 15, 5047, 322.0f / 11},
+    {APDS_3901_INT_TIME_101_MS, 105, 37177, 16 * 322.0f / 81},
+    {APDS_3901_INT_TIME_13_7_MS, 15, 5047, 16 * 322.0f / 11},
+};
+#define N_RANGES (sizeof(RANGES) / sizeof(RANGES[0]))
+#define FIXED_RANGE 2 // low gain, 402 ms integration
+#define LEAST_SENSITIVE (N_RANGES - 1)
+
 /// Representation of sensor
 typedef struct apds_3901 {
   i2c_port_t bus;
   uint8_t addr;
   bool p_on;
+  uint8_t range;    // index into `RANGES`
+  int64_t on_us;    // when the current integration settings took effect
+  int64_t start_us; // when the measurement in progress was started
 } apds_3901_t;
 
-/// Global vars
-static apds_3901_t *SENSOR = NULL;
-
-static esp_err_t set_register(apds_3901_t *sensor, uint8_t reg, uint8_t val) {
-  i2c_cmd_handle_t cmd;
-  esp_err_t err;
-
-  cmd = i2c_cmd_link_create();
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (sensor->addr << 1) | I2C_MASTER_WRITE,
-                        I2C_MASTER_ACK);
-  i2c_master_write_byte(cmd, reg, I2C_MASTER_ACK);
-  i2c_master_write_byte(cmd, val, I2C_MASTER_ACK);
-  i2c_master_stop(cmd);
-  err = i2c_master_cmd_begin(sensor->bus, cmd, I2C_MAX_WAIT);
-  i2c_cmd_link_delete(cmd);
-
-  return err;
-}
-
-static esp_err_t get_register(apds_3901_t *sensor, uint8_t reg, uint8_t *val) {
-  i2c_cmd_handle_t cmd;
-  esp_err_t err;
-
-  cmd = i2c_cmd_link_create();
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (sensor->addr << 1) | I2C_MASTER_WRITE,
-                        I2C_MASTER_ACK);
-  i2c_master_write_byte(cmd, reg, I2C_MASTER_ACK);
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (sensor->addr << 1) | I2C_MASTER_READ,
-                        I2C_MASTER_NACK);
-  i2c_master_read_byte(cmd, val, I2C_MASTER_NACK);
-  i2c_master_stop(cmd);
-  err = i2c_master_cmd_begin(sensor->bus, cmd, I2C_MAX_WAIT);
-  i2c_cmd_link_delete(cmd);
-
-  return err;
-}
-
-static esp_err_t get_two_registers(apds_3901_t *sensor, uint8_t reg,
-                                   uint16_t *dat) {
-  i2c_cmd_handle_t cmd;
-  uint8_t hi = 0, lo = 0;
-  esp_err_t err;
-
-  cmd = i2c_cmd_link_create();
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (sensor->addr << 1) | I2C_MASTER_WRITE,
-                        I2C_MASTER_ACK);
-  i2c_master_write_byte(cmd, 0x20 | reg, I2C_MASTER_ACK);
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (sensor->addr << 1) | I2C_MASTER_READ,
-                        I2C_MASTER_ACK);
-  i2c_master_read_byte(cmd, &lo, I2C_MASTER_ACK);
-  i2c_master_read_byte(cmd, &hi, I2C_MASTER_NACK);
-  i2c_master_stop(cmd);
-  err = i2c_master_cmd_begin(sensor->bus, cmd, I2C_MAX_WAIT);
-  i2c_cmd_link_delete(cmd);
-
-  if (err == ESP_OK) {
-    *dat = lo | (hi << 8);
-  }
-
-  return err;
-}
+/// Global vars, kept in RTC memory so the sensor isn't re-initialized after
+/// waking from deep sleep
+static RTC_DATA_ATTR apds_3901_t SENSOR_STATE;
+static RTC_DATA_ATTR apds_3901_t *SENSOR = NULL;
+static RTC_DATA_ATTR retry_t RETRY = RETRY_INIT("APDS 3901");
 
 static esp_err_t poweron(apds_3901_t *sensor) {
   esp_err_t err;
-  if ((err = set_register(sensor, APDS_3901_CONTROL_REG, APDS_3901_POW_ON)) !=
-      ESP_OK)
+  if ((err = i2c_write_reg(sensor->bus, sensor->addr, APDS_3901_CONTROL_REG,
+                           APDS_3901_POW_ON)) != ESP_OK)
     ESP_LOGE(TAG, "Failed to power on sensor: %s", esp_err_to_name(err));
   return err;
 }
 
-static esp_err_t set_long_integ_time(apds_3901_t *sensor) {
+static esp_err_t set_range(apds_3901_t *sensor, uint8_t range) {
   esp_err_t err;
-  if ((err = set_register(sensor, APDS_3901_TIMING_REG,
-                          APDS_3901_INT_TIME_402_MS)) != ESP_OK)
+
+  if ((err = i2c_write_reg(sensor->bus, sensor->addr, APDS_3901_TIMING_REG,
+                           RANGES[range].timing)) != ESP_OK) {
     ESP_LOGE(TAG, "Failed to configure ADC: %s", esp_err_to_name(err));
+    sensor->p_on = false;
+    return err;
+  }
+
+  // changing the timing register restarts integration
+  sensor->range = range;
+  sensor->on_us = i2c_bus_now_us();
   return err;
 }
 
-static esp_err_t set_low_gain(apds_3901_t *sensor) {
-  uint8_t val;
-  esp_err_t err;
-
-  if ((err = get_register(sensor, APDS_3901_TIMING_REG, &val)) != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to read ADC config: %s", esp_err_to_name(err));
-    return err;
+/// Pick the most sensitive range that would leave headroom, going by ch0 (the
+/// larger channel) in the current range. Only moves to a less sensitive range
+/// when the current one is close to clipping, so readings near a boundary
+/// don't flip-flop.
+static uint8_t pick_range(uint8_t cur, uint16_t ch0) {
+  float norm = ch0 * RANGES[cur].scale;
+  uint8_t next = LEAST_SENSITIVE;
+
+  for (uint8_t i = 0; i < N_RANGES; i++) {
+    if (norm / RANGES[i].scale <= RANGES[i].max_count / 2) {
+      next = i;
+      break;
+    }
   }
 
-  SET_LOW_GAIN(val);
-  if ((err = set_register(sensor, APDS_3901_TIMING_REG, val)) != ESP_OK)
-    ESP_LOGE(TAG, "Failed to set gain on ADC: %s", esp_err_to_name(err));
-
-  return err;
+  if (next > cur && ch0 <= RANGES[cur].max_count / 10 * 9)
+    return cur;
+  return next;
 }
 
 static esp_err_t get_ch0(apds_3901_t *sensor, uint16_t *dat) {
   esp_err_t err;
-  if ((err = get_two_registers(sensor, APDS_3901_DATA0LOW_REG, dat)) !=
-      ESP_OK) {
+  if ((err = i2c_read_wide(sensor->bus, sensor->addr,
+                           0x20 | APDS_3901_DATA0LOW_REG, dat)) != ESP_OK) {
     ESP_LOGW(TAG, "Error reading from ch0: %s", esp_err_to_name(err));
     sensor->p_on = false;
   }
@@ -128,8 +110,8 @@ static esp_err_t get_ch0(apds_3901_t *sensor, uint16_t *dat) {
 
 static esp_err_t get_ch1(apds_3901_t *sensor, uint16_t *dat) {
   esp_err_t err;
-  if ((err = get_two_registers(sensor, APDS_3901_DATA1LOW_REG, dat)) !=
-      ESP_OK) {
+  if ((err = i2c_read_wide(sensor->bus, sensor->addr,
+                           0x20 | APDS_3901_DATA1LOW_REG, dat)) != ESP_OK) {
     ESP_LOGW(TAG, "Error reading from ch1: %s", esp_err_to_name(err));
     sensor->p_on = false;
   }
@@ -145,9 +127,7 @@ static esp_err_t init_sensor(apds_3901_t *sensor, i2c_port_t bus, uint8_t addr)
 
   if ((err = poweron(sensor)) != ESP_OK)
     return err;
-  if ((err = set_low_gain(sensor)) != ESP_OK)
-    return err;
-  if ((err = set_long_integ_time(sensor)) != ESP_OK)
+  if ((err = set_range(sensor, sensor->range)) != ESP_OK)
     return err;
 
   sensor->p_on = true;
@@ -163,7 +143,7 @@ static esp_err_t init_sensor(apds_3901_t *sensor, i2c_port_t bus, uint8_t addr)
  */
 esp_err_t init_apds_3901(i2c_port_t bus, uint8_t addr) {
   esp_err_t err;
-  apds_3901_t sensor;
+  apds_3901_t sensor = {.range = FIXED_RANGE};
 
   if (SENSOR != NULL) {
     if (SENSOR->bus != bus || SENSOR->addr != addr) {
@@ -171,6 +151,9 @@ esp_err_t init_apds_3901(i2c_port_t bus, uint8_t addr) {
       err = ESP_FAIL;
     } else {
       ESP_LOGI(TAG, "Sensor already initialized");
+      // after deep sleep, the sensor kept integrating but the clock restarted
+      SENSOR->on_us =
+          i2c_bus_now_us() - RANGES[SENSOR->range].integ_ms * 1000;
       err = ESP_OK;
     }
     return err;
@@ -181,7 +164,7 @@ esp_err_t init_apds_3901(i2c_port_t bus, uint8_t addr) {
     return err;
   }
 
-  SENSOR = (apds_3901_t *)malloc(sizeof(apds_3901_t));
+  SENSOR = &SENSOR_STATE;
   memcpy(SENSOR, &sensor, sizeof(apds_3901_t));
   ESP_LOGI(TAG, "Sensor initialized on bus %d with address %02x", SENSOR->bus,
            SENSOR->addr);
@@ -189,54 +172,135 @@ esp_err_t init_apds_3901(i2c_port_t bus, uint8_t addr) {
 }
 
 /**
- * @brief Read light intensity in lux from APDS 3901. Must initialize
- * sensor using `init_apds_3901` prior to calling this
- * function.
- * @param float pointer for returning lux value
+ * @brief Start a lux measurement. The ADC integrates continuously once the
+ * sensor is on, so this only powers the sensor back on after a failure.
+ * @note Must initialize sensor with `init_apds_3901` first!
  * @return error
  */
-esp_err_t read_lux(float *lux) {
-  esp_err_t err;
-  uint16_t ch0, ch1;
-  float ch0f, ch1f, ratio;
-
+esp_err_t apds_3901_start_measurement(void) {
   if (SENSOR == NULL) {
     ESP_LOGE(TAG, "Sensor not initialized");
     return ESP_FAIL;
   }
 
+  SENSOR->start_us = i2c_bus_now_us();
+
   // handle power failure on sensor (have to turn it back on)
   if (SENSOR->p_on == false)
-    if ((err = init_sensor(SENSOR, SENSOR->bus, SENSOR->addr)) != ESP_OK)
-      return err;
+    return init_sensor(SENSOR, SENSOR->bus, SENSOR->addr);
+
+  return ESP_OK;
+}
+
+/**
+ * @brief Check whether a full integration cycle has completed since the
+ * sensor was powered on.
+ * @param wait_ms return-arg for time left, if not ready
+ * @return true if ready to collect
+ */
+bool apds_3901_poll_ready(uint32_t *wait_ms) {
+  uint32_t integ_ms;
+  int64_t elapsed_ms;
+
+  if (SENSOR == NULL)
+    return true;
+
+  integ_ms = RANGES[SENSOR->range].integ_ms;
+  elapsed_ms = (i2c_bus_now_us() - SENSOR->on_us) / 1000;
+  if (elapsed_ms < 0 || elapsed_ms >= integ_ms)
+    return true;
+
+  *wait_ms = integ_ms - (uint32_t)elapsed_ms;
+  return false;
+}
+
+/**
+ * @brief Read the latest integration cycle, and calculate lux. With auto-range
+ * enabled, the next reading's gain and integration time are picked from this
+ * one.
+ * @param lux return-arg for lux value
+ * @return error, `ESP_ERR_INVALID_RESPONSE` if a channel saturated and the
+ * reading is being re-measured at a less sensitive range
+ */
+esp_err_t apds_3901_collect(float *lux) {
+  const apds_3901_range_t *range;
+  esp_err_t err;
+  uint16_t ch0, ch1;
+  bool saturated;
+  uint8_t next;
+
+  if (SENSOR == NULL || SENSOR->p_on == false)
+    return ESP_ERR_INVALID_STATE;
 
   if ((err = get_ch0(SENSOR, &ch0)) != ESP_OK)
     return err;
   if ((err = get_ch1(SENSOR, &ch1)) != ESP_OK)
     return err;
 
-  ch1f = (float)ch1;
-  ch0f = (float)ch0;
+  range = &RANGES[SENSOR->range];
+  saturated = ch0 >= range->max_count || ch1 >= range->max_count;
+  if (AUTO_RANGE && saturated && SENSOR->range != LEAST_SENSITIVE) {
+    ESP_LOGD(TAG, "ADC saturated, re-measuring at least sensitive range");
+    if ((err = set_range(SENSOR, LEAST_SENSITIVE)) != ESP_OK)
+      return err;
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+
+  // clipped counts give a meaningless ratio, report the range's full scale
+  if (saturated) {
+    ESP_LOGD(TAG, "Light beyond sensor range");
+    *lux = 0.0304f * range->max_count * range->scale;
+  } else {
+    // scale to nominal 402 ms integration and 16x gain
+    *lux = conv_apds_3901_lux(ch0 * range->scale, ch1 * range->scale);
+  }
+
+  if (AUTO_RANGE && (next = pick_range(SENSOR->range, ch0)) != SENSOR->range) {
+    ESP_LOGD(TAG, "Switching from range %u to %u", SENSOR->range, next);
+    // a failure here powers the sensor back on at the next reading
+    set_range(SENSOR, next);
+  }
+
+  DIAG_CONV(DIAG_APDS_3901, (uint32_t)(i2c_bus_now_us() - SENSOR->start_us));
+  return err;
+}
 
-  // No error check required for long integration time
-  // ESP_ERROR_CHECK((ch0 > 65535) || (ch1 > 65535));
+/**
+ * @brief Read light intensity in lux from APDS 3901. Must initialize
+ * sensor using `init_apds_3901` prior to calling this
+ * function.
+ * @param float pointer for returning lux value
+ * @return error
+ */
+esp_err_t read_lux(float *lux) {
+  uint32_t wait_ms, delay_ms;
+  uint8_t att = 0;
+  esp_err_t err;
 
-  ratio = ch1f / ch0f;
+  if (!retry_begin(&RETRY))
+    return RETRY_ERR_OPEN;
 
-  // Use default "Low" gain
-  ch0f *= 16;
-  ch1f *= 16;
+  for (;;) {
+    if ((err = apds_3901_start_measurement()) == ESP_OK) {
+      // round up, so the wait isn't cut short by tick resolution
+      while (!apds_3901_poll_ready(&wait_ms))
+        vTaskDelay(pdMS_TO_TICKS(wait_ms) + 1);
+      if ((err = apds_3901_collect(lux)) == ESP_OK)
+        break;
+    }
 
-  if (ratio <= 0.5)
-    *lux = (0.0304 * ch0f) - ((0.062 * ch0f) * pow((ch1f / ch0f), 1.4));
-  else if (ratio <= 0.61)
-    *lux = (0.0224 * ch0f) - (0.031 * ch1f);
-  else if (ratio <= 0.8)
-    *lux = (0.0128 * ch0f) - (0.0153 * ch1f);
-  else if (ratio <= 1.3)
-    *lux = (0.00146 * ch0f) - (0.00112 * ch1f);
-  else
-    *lux = 0.0;
+    if (!retry_backoff(&RETRY, ++att, &delay_ms))
+      break;
+    ESP_LOGD(TAG, "Sensor read failed: %s, retrying in %u ms",
+             esp_err_to_name(err), delay_ms);
+    vTaskDelay(pdMS_TO_TICKS(delay_ms));
+  }
 
-  return err;
+  return retry_end(&RETRY, err);
 }
+
+/**
+ * @brief Get the sensor's retry and circuit breaker state.
+ * @return retry state
+ */
+retry_t *apds_3901_retry(void) { return &RETRY; }
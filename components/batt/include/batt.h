@@ -1,6 +1,10 @@
 #ifndef BATT_H
 #define BATT_H
 
+#include "esp_err.h"
+#include <stdint.h>
+
+#if !CONFIG_IDF_TARGET_LINUX
 #include "driver/adc.h"
 
 #if CONFIG_BATT_ADC1_CHANNEL_2
@@ -20,7 +24,10 @@
 #define BATT_ADC_WIDTH_BIT ADC_WIDTH_BIT_12
 #define BATT_ADC_ATTEN ADC_ATTEN_DB_11 // expected input is between 1.5-2.1v
 #define BATT_ADC_UNIT ADC_UNIT_1
-#define BATT_ADC_N_SAMPLES 64 
+#endif
+
+#define BATT_ADC_N_SAMPLES 64
+#define BATT_ADC_TRIM 8 // lowest and highest samples ignored, each
 
 esp_err_t init_batt_adc(void);
 esp_err_t read_batt(uint32_t *);
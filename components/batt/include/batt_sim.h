@@ -0,0 +1,12 @@
+#ifndef BATT_SIM_H
+#define BATT_SIM_H
+
+#include <stdint.h>
+
+/// Battery voltage until `batt_sim_set_voltage` is called
+#define BATT_SIM_DEFAULT_MV 3700
+
+void batt_sim_reset(uint32_t seed);
+void batt_sim_set_voltage(uint32_t mv);
+
+#endif
@@ -1,26 +1,107 @@
 #include "../include/batt.h"
+#include "conv.h"
 #include "driver/adc.h"
 #include "esp_adc_cal.h"
+#include "esp_attr.h"
 #include "esp_err.h"
+#include "esp_idf_version.h"
 #include "esp_log.h"
+#include <stdbool.h>
+
+/// The continuous (DMA) ADC driver needs IDF v4.4, and reads the ESP32's
+/// output format
+#if CONFIG_BATT_ADC_CONTINUOUS && CONFIG_IDF_TARGET_ESP32 &&                 \
+    ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+#define HAVE_ADC_CONTINUOUS 1
+#endif
+
+#if HAVE_ADC_CONTINUOUS
+#define FRAME_BYTES (BATT_ADC_N_SAMPLES * SOC_ADC_DIGI_RESULT_BYTES)
+#define SAMPLE_FREQ_HZ 20000 // the ESP32's lowest continuous rate
+#define READ_TIMEOUT_MS 100
+#endif
 
 static const char *TAG = "Battery Monitor";
-static esp_adc_cal_characteristics_t *adc_chars = NULL;
 static bool batt_adc_init = false;
 
-/**
- * @brief Initialize ADC1 and configured pin for reading battery voltage.
- * @return error
- */
-esp_err_t init_batt_adc(void) {
-  esp_err_t err = ESP_OK;
+// ADC characterization survives deep sleep, so it is only computed on a cold
+// boot
+static RTC_DATA_ATTR esp_adc_cal_characteristics_t adc_chars_state;
+static RTC_DATA_ATTR esp_adc_cal_characteristics_t *adc_chars = NULL;
 
-  if (batt_adc_init)
+#if HAVE_ADC_CONTINUOUS
+static esp_err_t config_adc(void) {
+  esp_err_t err;
+  adc_digi_init_config_t init_conf = {
+      .max_store_buf_size = FRAME_BYTES * 2,
+      .conv_num_each_intr = FRAME_BYTES,
+      .adc1_chan_mask = BIT(BATT_ADC_CHANNEL),
+      .adc2_chan_mask = 0,
+  };
+  adc_digi_pattern_config_t pattern = {
+      .atten = BATT_ADC_ATTEN,
+      .channel = BATT_ADC_CHANNEL,
+      .unit = 0, // ADC1
+      .bit_width = SOC_ADC_DIGI_MAX_BITWIDTH,
+  };
+  adc_digi_configuration_t digi_conf = {
+      .conv_limit_en = 1, // required on the ESP32
+      .conv_limit_num = 250,
+      .pattern_num = 1,
+      .adc_pattern = &pattern,
+      .sample_freq_hz = SAMPLE_FREQ_HZ,
+      .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+      .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1,
+  };
+
+  if ((err = adc_digi_initialize(&init_conf)) != ESP_OK) {
+    ESP_LOGE(TAG, "Error initializing continuous ADC: %s",
+             esp_err_to_name(err));
     return err;
+  }
 
-  adc_chars = calloc(1, sizeof(esp_adc_cal_characteristics_t));
-  esp_adc_cal_characterize(BATT_ADC_UNIT, BATT_ADC_ATTEN, BATT_ADC_WIDTH_BIT,
-                           BATT_ADC_DEFAULT_VREF, adc_chars);
+  if ((err = adc_digi_controller_configure(&digi_conf)) != ESP_OK)
+    ESP_LOGE(TAG, "Error configuring continuous ADC: %s",
+             esp_err_to_name(err));
+  return err;
+}
+
+/// Take `n` raw conversions in one DMA burst
+static esp_err_t read_raw(uint16_t *raw, size_t n) {
+  uint8_t buf[FRAME_BYTES];
+  adc_digi_output_data_t *out;
+  uint32_t len;
+  size_t got = 0;
+  esp_err_t err;
+
+  // drop conversions left over from the last burst
+  while (adc_digi_read_bytes(buf, sizeof(buf), &len, 0) == ESP_OK && len > 0)
+    ;
+
+  if ((err = adc_digi_start()) != ESP_OK)
+    return err;
+
+  while (got < n) {
+    err = adc_digi_read_bytes(buf, sizeof(buf), &len, READ_TIMEOUT_MS);
+    // ESP_ERR_INVALID_STATE means conversions were dropped, the rest are fine
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE)
+      break;
+    err = ESP_OK;
+
+    for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= len && got < n;
+         i += SOC_ADC_DIGI_RESULT_BYTES) {
+      out = (adc_digi_output_data_t *)&buf[i];
+      if (out->type1.channel == BATT_ADC_CHANNEL)
+        raw[got++] = out->type1.data;
+    }
+  }
+
+  adc_digi_stop();
+  return err;
+}
+#else
+static esp_err_t config_adc(void) {
+  esp_err_t err;
 
   if ((err = adc1_config_width(BATT_ADC_WIDTH_BIT)) != ESP_OK) {
     ESP_LOGE(TAG, "Error initializing ADC1 bit width: %s",
@@ -39,31 +120,65 @@ esp_err_t init_batt_adc(void) {
   return err;
 }
 
+/// Take `n` raw conversions back to back
+static esp_err_t read_raw(uint16_t *raw, size_t n) {
+  int reading;
+
+  for (size_t i = 0; i < n; i++) {
+    if ((reading = adc1_get_raw(BATT_ADC_CHANNEL)) < 0)
+      return ESP_ERR_INVALID_STATE;
+    raw[i] = reading;
+  }
+
+  return ESP_OK;
+}
+#endif
+
+/**
+ * @brief Initialize ADC1 and configured pin for reading battery voltage.
+ * @return error
+ */
+esp_err_t init_batt_adc(void) {
+  esp_err_t err = ESP_OK;
+
+  if (batt_adc_init)
+    return err;
+
+  if (adc_chars == NULL) {
+    esp_adc_cal_characterize(BATT_ADC_UNIT, BATT_ADC_ATTEN, BATT_ADC_WIDTH_BIT,
+                             BATT_ADC_DEFAULT_VREF, &adc_chars_state);
+    adc_chars = &adc_chars_state;
+  }
+
+  if ((err = config_adc()) != ESP_OK)
+    return err;
+
+  batt_adc_init = true;
+  return err;
+}
+
 /**
- * @brief Read battery voltage on configured pin using ADC1.
+ * @brief Read battery voltage on configured pin using ADC1. Takes a burst of
+ * raw conversions, filters them, and calibrates the result once.
  * @param voltage return-arg for voltage reading
  * @return error
  */
 esp_err_t read_batt(uint32_t *voltage) {
   esp_err_t err = ESP_OK;
-  uint32_t sum = 0, reading;
+  uint16_t raw[BATT_ADC_N_SAMPLES];
 
   if (!batt_adc_init)
     if ((err = init_batt_adc()) != ESP_OK)
       return err;
 
-  for (int i = 0; i < BATT_ADC_N_SAMPLES; i++) {
-    reading = 0;
-    if ((err = esp_adc_cal_get_voltage(BATT_ADC_CHANNEL, adc_chars,
-                                       &reading)) != ESP_OK) {
-      ESP_LOGE(TAG, "Error reading ADC: %s", esp_err_to_name(err));
-      return err;
-    }
-    sum += reading;
+  if ((err = read_raw(raw, BATT_ADC_N_SAMPLES)) != ESP_OK) {
+    ESP_LOGE(TAG, "Error reading ADC: %s", esp_err_to_name(err));
+    return err;
   }
 
-  *voltage = sum / BATT_ADC_N_SAMPLES;
+  *voltage = esp_adc_cal_raw_to_voltage(
+      conv_trimmed_mean(raw, BATT_ADC_N_SAMPLES, BATT_ADC_TRIM), adc_chars);
   *voltage *= 2; // using a voltage halving circuit
 
   return ESP_OK;
-}
\ No newline at end of file
+}
@@ -0,0 +1,83 @@
+#include "../include/batt.h"
+#include "../include/batt_sim.h"
+#include "conv.h"
+#include "esp_err.h"
+#include <stdbool.h>
+
+/// Ideal 12-bit ADC at 11 dB attenuation, behind the voltage halving circuit
+#define FULL_SCALE_MV 3100
+#define MAX_RAW 4095
+
+/// Every conversion is off by up to `NOISE_RAW` counts, and one in
+/// `SPIKE_EVERY` is garbage, for the trimmed mean to reject
+#define NOISE_RAW 8
+#define SPIKE_EVERY 16
+
+/// Global vars
+static bool BATT_INIT = false;
+static uint32_t VOLTAGE_MV = BATT_SIM_DEFAULT_MV;
+static uint32_t RNG = 1;
+
+/// xorshift32, so noise repeats for a given seed
+static uint32_t next_rand(void) {
+  RNG ^= RNG << 13;
+  RNG ^= RNG >> 17;
+  RNG ^= RNG << 5;
+  return RNG;
+}
+
+static uint16_t convert(void) {
+  int32_t raw = (int32_t)(VOLTAGE_MV / 2) * MAX_RAW / FULL_SCALE_MV;
+
+  if (next_rand() % SPIKE_EVERY == 0)
+    return next_rand() % (MAX_RAW + 1);
+
+  raw += (int32_t)(next_rand() % (2 * NOISE_RAW + 1)) - NOISE_RAW;
+  if (raw < 0)
+    raw = 0;
+  if (raw > MAX_RAW)
+    raw = MAX_RAW;
+  return raw;
+}
+
+/**
+ * @brief Start over with default voltage, and seed the noise generator.
+ * @param seed noise seed, 0 is replaced with 1
+ */
+void batt_sim_reset(uint32_t seed) {
+  VOLTAGE_MV = BATT_SIM_DEFAULT_MV;
+  RNG = seed != 0 ? seed : 1;
+}
+
+/**
+ * @brief Set the simulated battery voltage.
+ * @param mv battery voltage, before the voltage halving circuit
+ */
+void batt_sim_set_voltage(uint32_t mv) { VOLTAGE_MV = mv; }
+
+esp_err_t init_batt_adc(void) {
+  BATT_INIT = true;
+  return ESP_OK;
+}
+
+/**
+ * @brief Read the simulated battery voltage. Takes and filters a burst of
+ * noisy raw conversions, the same way as on the device.
+ * @param voltage return-arg for voltage reading
+ * @return error
+ */
+esp_err_t read_batt(uint32_t *voltage) {
+  uint16_t raw[BATT_ADC_N_SAMPLES];
+
+  if (!BATT_INIT)
+    init_batt_adc();
+
+  for (size_t i = 0; i < BATT_ADC_N_SAMPLES; i++)
+    raw[i] = convert();
+
+  *voltage = conv_trimmed_mean(raw, BATT_ADC_N_SAMPLES, BATT_ADC_TRIM) *
+             FULL_SCALE_MV / MAX_RAW;
+  *voltage *= 2; // using a voltage halving circuit
+
+  return ESP_OK;
+}
@@ -0,0 +1,17 @@
+#ifndef CONV_H
+#define CONV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Largest relative error of `conv_apds_3901_lux`, against double precision
+/// `pow`, over every ch1/ch0 ratio
+#define CONV_LUX_TOLERANCE 0.001f
+
+uint8_t conv_sht_20_crc8(const uint8_t *data, size_t len);
+float conv_sht_20_temp(uint16_t raw);
+float conv_sht_20_humd(uint16_t raw);
+float conv_apds_3901_lux(float ch0, float ch1);
+uint32_t conv_trimmed_mean(uint16_t *samples, size_t n, size_t trim);
+
+#endif
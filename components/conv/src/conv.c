@@ -0,0 +1,142 @@
+#include "../include/conv.h"
+
+/// SHT 20 CRC-8, polynomial x^8 + x^5 + x^4 + 1 (0x31), initial value 0
+static const uint8_t CRC8_TABLE[256] = {
+    0x00, 0x31, 0x62, 0x53, 0xc4, 0xf5, 0xa6, 0x97, 0xb9, 0x88, 0xdb, 0xea,
+    0x7d, 0x4c, 0x1f, 0x2e, 0x43, 0x72, 0x21, 0x10, 0x87, 0xb6, 0xe5, 0xd4,
+    0xfa, 0xcb, 0x98, 0xa9, 0x3e, 0x0f, 0x5c, 0x6d, 0x86, 0xb7, 0xe4, 0xd5,
+    0x42, 0x73, 0x20, 0x11, 0x3f, 0x0e, 0x5d, 0x6c, 0xfb, 0xca, 0x99, 0xa8,
+    0xc5, 0xf4, 0xa7, 0x96, 0x01, 0x30, 0x63, 0x52, 0x7c, 0x4d, 0x1e, 0x2f,
+    0xb8, 0x89, 0xda, 0xeb, 0x3d, 0x0c, 0x5f, 0x6e, 0xf9, 0xc8, 0x9b, 0xaa,
+    0x84, 0xb5, 0xe6, 0xd7, 0x40, 0x71, 0x22, 0x13, 0x7e, 0x4f, 0x1c, 0x2d,
+    0xba, 0x8b, 0xd8, 0xe9, 0xc7, 0xf6, 0xa5, 0x94, 0x03, 0x32, 0x61, 0x50,
+    0xbb, 0x8a, 0xd9, 0xe8, 0x7f, 0x4e, 0x1d, 0x2c, 0x02, 0x33, 0x60, 0x51,
+    0xc6, 0xf7, 0xa4, 0x95, 0xf8, 0xc9, 0x9a, 0xab, 0x3c, 0x0d, 0x5e, 0x6f,
+    0x41, 0x70, 0x23, 0x12, 0x85, 0xb4, 0xe7, 0xd6, 0x7a, 0x4b, 0x18, 0x29,
+    0xbe, 0x8f, 0xdc, 0xed, 0xc3, 0xf2, 0xa1, 0x90, 0x07, 0x36, 0x65, 0x54,
+    0x39, 0x08, 0x5b, 0x6a, 0xfd, 0xcc, 0x9f, 0xae, 0x80, 0xb1, 0xe2, 0xd3,
+    0x44, 0x75, 0x26, 0x17, 0xfc, 0xcd, 0x9e, 0xaf, 0x38, 0x09, 0x5a, 0x6b,
+    0x45, 0x74, 0x27, 0x16, 0x81, 0xb0, 0xe3, 0xd2, 0xbf, 0x8e, 0xdd, 0xec,
+    0x7b, 0x4a, 0x19, 0x28, 0x06, 0x37, 0x64, 0x55, 0xc2, 0xf3, 0xa0, 0x91,
+    0x47, 0x76, 0x25, 0x14, 0x83, 0xb2, 0xe1, 0xd0, 0xfe, 0xcf, 0x9c, 0xad,
+    0x3a, 0x0b, 0x58, 0x69, 0x04, 0x35, 0x66, 0x57, 0xc0, 0xf1, 0xa2, 0x93,
+    0xbd, 0x8c, 0xdf, 0xee, 0x79, 0x48, 0x1b, 0x2a, 0xc1, 0xf0, 0xa3, 0x92,
+    0x05, 0x34, 0x67, 0x56, 0x78, 0x49, 0x1a, 0x2b, 0xbc, 0x8d, 0xde, 0xef,
+    0x82, 0xb3, 0xe0, 0xd1, 0x46, 0x77, 0x24, 0x15, 0x3b, 0x0a, 0x59, 0x68,
+    0xff, 0xce, 0x9d, 0xac,
+};
+
+/// x^1.4 at x = 0, 1/64, ..., 32/64, for the APDS 3901 ch1/ch0 ratio
+#define POW_1_4_STEPS 64
+static const float POW_1_4_TABLE[POW_1_4_STEPS / 2 + 1] = {
+    0.0000000f, 0.0029604f, 0.0078125f, 0.0137822f, 0.0206173f,
+    0.0281777f, 0.0363714f, 0.0451321f, 0.0544094f, 0.0641634f,
+    0.0743615f, 0.0849763f, 0.0959846f, 0.1073665f, 0.1191043f,
+    0.1311825f, 0.1435873f, 0.1563063f, 0.1693283f, 0.1826430f,
+    0.1962411f, 0.2101140f, 0.2242538f, 0.2386531f, 0.2533050f,
+    0.2682033f, 0.2833418f, 0.2987152f, 0.3143180f, 0.3301454f,
+    0.3461926f, 0.3624553f, 0.3789291f,
+};
+
+/**
+ * @brief Calculate SHT 20 checksum.
+ * @param data bytes to check, most significant first
+ * @param len number of bytes
+ * @return CRC-8, equal to the sensor's checksum byte if the data is intact
+ */
+uint8_t conv_sht_20_crc8(const uint8_t *data, size_t len) {
+  uint8_t crc = 0;
+
+  for (size_t i = 0; i < len; i++)
+    crc = CRC8_TABLE[crc ^ data[i]];
+
+  return crc;
+}
+
+/**
+ * @brief Convert a raw SHT 20 temperature measurement.
+ * @param raw measurement, status bits are ignored
+ * @return temperature in degrees Celsius
+ */
+float conv_sht_20_temp(uint16_t raw) {
+  return -46.85f + (raw & 0xfffc) * (175.72f / 65536.0f);
+}
+
+/**
+ * @brief Convert a raw SHT 20 humidity measurement.
+ * @param raw measurement, status bits are ignored
+ * @return relative humidity in percent
+ */
+float conv_sht_20_humd(uint16_t raw) {
+  return -6.0f + (raw & 0xfffc) * (125.0f / 65536.0f);
+}
+
+/// x^1.4 for 0 <= x <= 0.5, interpolated from `POW_1_4_TABLE`
+static float pow_1_4(float x) {
+  float pos = x * POW_1_4_STEPS;
+  int i = (int)pos;
+
+  if (i >= POW_1_4_STEPS / 2)
+    return POW_1_4_TABLE[POW_1_4_STEPS / 2];
+
+  return POW_1_4_TABLE[i] +
+         (pos - i) * (POW_1_4_TABLE[i + 1] - POW_1_4_TABLE[i]);
+}
+
+/**
+ * @brief Calculate lux from APDS 3901 channel counts, using the datasheet's
+ * piecewise approximation.
+ * @param ch0 visible and infrared count, scaled to 402 ms integration and 16x
+ * gain
+ * @param ch1 infrared count, scaled the same way
+ * @return lux
+ */
+float conv_apds_3901_lux(float ch0, float ch1) {
+  float ratio;
+
+  // ch0 reads 0 in the dark, and until the first integration cycle completes
+  if (ch0 <= 0.0f)
+    return 0.0f;
+
+  ratio = ch1 / ch0;
+  if (ratio <= 0.5f)
+    return (0.0304f * ch0) - ((0.062f * ch0) * pow_1_4(ratio));
+  if (ratio <= 0.61f)
+    return (0.0224f * ch0) - (0.031f * ch1);
+  if (ratio <= 0.8f)
+    return (0.0128f * ch0) - (0.0153f * ch1);
+  if (ratio <= 1.3f)
+    return (0.00146f * ch0) - (0.00112f * ch1);
+  return 0.0f;
+}
+
+/**
+ * @brief Average samples, ignoring outliers at either end. Sorts the samples
+ * in place.
+ * @param samples samples, e.g. raw ADC conversions
+ * @param n number of samples
+ * @param trim number of lowest, and of highest, samples to ignore
+ * @return rounded average of the remaining samples
+ */
+uint32_t conv_trimmed_mean(uint16_t *samples, size_t n, size_t trim) {
+  uint32_t sum = 0;
+  uint16_t s;
+  size_t j;
+
+  if (n <= 2 * trim)
+    return 0;
+
+  // insertion sort, n is small
+  for (size_t i = 1; i < n; i++) {
+    s = samples[i];
+    for (j = i; j > 0 && samples[j - 1] > s; j--)
+      samples[j] = samples[j - 1];
+    samples[j] = s;
+  }
+
+  n -= 2 * trim;
+  for (size_t i = 0; i < n; i++)
+    sum += samples[trim + i];
+
+  return (sum + n / 2) / n;
+}
@@ -0,0 +1,32 @@
+#ifndef DEADBAND_H
+#define DEADBAND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct deadband_stats {
+  uint32_t published;  // values reported, including heartbeats
+  uint32_t suppressed; // values within the deadband
+  uint32_t heartbeats; // values reported only because of the heartbeat
+} deadband_stats_t;
+
+/// Report-by-exception filter of one stream
+typedef struct deadband {
+  float abs;            // absolute deadband, 0 to disable
+  float rel;            // fraction of the last value, 0 to disable
+  uint32_t heartbeat_s; // longest time between reports, 0 to disable
+  bool primed;          // a value has been reported
+  float last;           // last reported value
+  uint32_t last_s;      // time of the last report
+  deadband_stats_t stats;
+} deadband_t;
+
+void deadband_init(deadband_t *db, float abs, float rel, uint32_t heartbeat_s);
+bool deadband_due(const deadband_t *db, float value, uint32_t now_s);
+void deadband_commit(deadband_t *db, float value, uint32_t now_s);
+void deadband_suppress(deadband_t *db);
+bool deadband_update(deadband_t *db, float value, uint32_t now_s);
+bool deadband_update_all(deadband_t *dbs, const float *values, uint32_t mask,
+                         uint8_t n, uint32_t now_s);
+
+#endif
@@ -0,0 +1,110 @@
+#include "../include/deadband.h"
+#include <math.h>
+#include <string.h>
+
+/**
+ * @brief Set up a filter that reports its first value.
+ * @param db filter
+ * @param abs report values that moved more than this since the last report
+ * @param rel report values that moved more than this fraction of the last
+ * report. With neither deadband, any change is reported.
+ * @param heartbeat_s report at least this often, even if nothing moved
+ */
+void deadband_init(deadband_t *db, float abs, float rel, uint32_t heartbeat_s) {
+  memset(db, 0, sizeof(deadband_t));
+  db->abs = abs;
+  db->rel = rel;
+  db->heartbeat_s = heartbeat_s;
+}
+
+static bool moved(const deadband_t *db, float value) {
+  float delta = fabsf(value - db->last);
+
+  if (db->abs <= 0 && db->rel <= 0)
+    return delta > 0;
+  return (db->abs > 0 && delta > db->abs) ||
+         (db->rel > 0 && delta > db->rel * fabsf(db->last));
+}
+
+static bool heartbeat_due(const deadband_t *db, uint32_t now_s) {
+  // a clock that stepped backwards wraps around, and is due
+  return db->heartbeat_s > 0 && now_s - db->last_s >= db->heartbeat_s;
+}
+
+/**
+ * @brief Check if a value should be reported, without changing the filter.
+ * @param db filter
+ * @param value new value
+ * @param now_s current time, in seconds
+ * @return true if the value left the deadband or the heartbeat expired
+ */
+bool deadband_due(const deadband_t *db, float value, uint32_t now_s) {
+  return !db->primed || moved(db, value) || heartbeat_due(db, now_s);
+}
+
+/**
+ * @brief Record a reported value, the deadband is now centered on it.
+ * @param db filter
+ * @param value reported value
+ * @param now_s current time, in seconds
+ */
+void deadband_commit(deadband_t *db, float value, uint32_t now_s) {
+  if (db->primed && !moved(db, value))
+    db->stats.heartbeats++;
+  db->stats.published++;
+
+  db->primed = true;
+  db->last = value;
+  db->last_s = now_s;
+}
+
+/**
+ * @brief Record a value that wasn't reported.
+ * @param db filter
+ */
+void deadband_suppress(deadband_t *db) { db->stats.suppressed++; }
+
+/**
+ * @brief Check a value, and record it as reported or suppressed.
+ * @param db filter
+ * @param value new value
+ * @param now_s current time, in seconds
+ * @return true if the value should be reported
+ */
+bool deadband_update(deadband_t *db, float value, uint32_t now_s) {
+  if (!deadband_due(db, value, now_s)) {
+    deadband_suppress(db);
+    return false;
+  }
+
+  deadband_commit(db, value, now_s);
+  return true;
+}
+
+/**
+ * @brief Check values reported together, e.g. in one message: if any of them
+ * is due, all of them are recorded as reported, otherwise all as suppressed.
+ * @param dbs filters, one per value
+ * @param values new values
+ * @param mask bit `i` set if `values[i]` is valid, the others are skipped
+ * @param n number of filters and values, at most 32
+ * @param now_s current time, in seconds
+ * @return true if the values should be reported
+ */
+bool deadband_update_all(deadband_t *dbs, const float *values, uint32_t mask,
+                         uint8_t n, uint32_t now_s) {
+  bool due = false;
+
+  for (uint8_t i = 0; i < n && !due; i++)
+    due = (mask & (1u << i)) && deadband_due(&dbs[i], values[i], now_s);
+
+  for (uint8_t i = 0; i < n; i++) {
+    if (!(mask & (1u << i)))
+      continue;
+    if (due)
+      deadband_commit(&dbs[i], values[i], now_s);
+    else
+      deadband_suppress(&dbs[i]);
+  }
+  return due;
+}
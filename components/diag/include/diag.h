@@ -0,0 +1,95 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stdint.h>
+
+/// Bucket 0 counts times under `DIAG_BUCKET0_US`, each later bucket covers
+/// twice the range of the one before, and the last one counts everything
+/// longer (about 1 s and up)
+#define DIAG_BUCKETS 16
+#define DIAG_BUCKET0_US 64
+
+/// I2C devices with their own histogram, in order of first transaction
+#define DIAG_I2C_DEVICES 4
+
+/// Drivers with conversion histograms and retry counts
+typedef enum diag_driver {
+  DIAG_SHT_20,
+  DIAG_APDS_3901,
+  DIAG_SEESAW_SOIL,
+  DIAG_DRIVERS
+} diag_driver_t;
+
+/// Publishing stages
+typedef enum diag_stage {
+  DIAG_ENCODE, // payload encoding
+  DIAG_PUBACK, // publish to the broker's acknowledgement
+  DIAG_STAGES
+} diag_stage_t;
+
+typedef enum diag_error {
+  DIAG_ERR_NACK,    // device didn't acknowledge
+  DIAG_ERR_TIMEOUT, // bus transaction timed out
+  DIAG_ERR_CRC,     // SHT 20 checksum mismatch
+  DIAG_ERR_INVALID, // Seesaw 0xFFFF reply
+  DIAG_ERRORS
+} diag_error_t;
+
+/// Tasks with their stack high-water mark reported
+typedef enum diag_task {
+  DIAG_TASK_MAIN,
+  DIAG_TASK_SAMPLER,
+  DIAG_TASK_I2C_BUS,
+  DIAG_TASK_MQTT,
+  DIAG_TASK_WIFI,
+  DIAG_TASK_TCPIP,
+  DIAG_TASK_EVENTS,
+  DIAG_TASKS
+} diag_task_t;
+
+typedef struct diag_hist {
+  uint32_t count;
+  uint32_t max_us;
+  uint16_t buckets[DIAG_BUCKETS]; // saturate at UINT16_MAX
+} diag_hist_t;
+
+/// Everything recorded since the last `diag_take`
+typedef struct diag {
+  uint8_t i2c_addr[DIAG_I2C_DEVICES]; // 0 for unused slots
+  diag_hist_t i2c[DIAG_I2C_DEVICES];  // time on the bus
+  diag_hist_t conv[DIAG_DRIVERS];     // conversion start to collect
+  uint32_t retries[DIAG_DRIVERS];
+  diag_hist_t stages[DIAG_STAGES];
+  uint32_t errors[DIAG_ERRORS];
+
+  // memory, sampled when taken
+  uint32_t stack_free[DIAG_TASKS]; // least free stack, 0 if not running
+  uint32_t min_free_heap;          // since boot
+  uint32_t largest_free_block;
+} diag_t;
+
+/// Instrumentation points, no code at all with histograms disabled
+#if CONFIG_DIAG_HISTOGRAMS
+#define DIAG_TIMER(t) int64_t t = diag_now_us()
+#define DIAG_I2C(addr, us) diag_record_i2c((addr), (us))
+#define DIAG_CONV(drv, us) diag_record_conv((drv), (us))
+#define DIAG_STAGE_SINCE(stage, t)                                             \
+  diag_record_stage((stage), (uint32_t)(diag_now_us() - (t)))
+#define DIAG_ERROR(err) diag_count_error(err)
+#else
+#define DIAG_TIMER(t)
+#define DIAG_I2C(addr, us) ((void)0)
+#define DIAG_CONV(drv, us) ((void)0)
+#define DIAG_STAGE_SINCE(stage, t) ((void)0)
+#define DIAG_ERROR(err) ((void)0)
+#endif
+
+int64_t diag_now_us(void);
+void diag_record_i2c(uint8_t addr, uint32_t us);
+void diag_record_conv(diag_driver_t drv, uint32_t us);
+void diag_record_stage(diag_stage_t stage, uint32_t us);
+void diag_count_error(diag_error_t err);
+void diag_count_retries(diag_driver_t drv, uint32_t n);
+void diag_take(diag_t *d);
+
+#endif
@@ -0,0 +1,139 @@
+#include "../include/diag.h"
+
+#if CONFIG_DIAG
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/portmacro.h"
+#include "freertos/task.h"
+#include <string.h>
+
+#if CONFIG_DIAG_MEMORY && !CONFIG_IDF_TARGET_LINUX
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#endif
+
+/// Recorded from the I2C bus, sampler and MQTT tasks, kept in RTC memory so
+/// deep sleep cycles add up to one publishing period
+static RTC_DATA_ATTR diag_t DIAG;
+static portMUX_TYPE DIAG_MUX = portMUX_INITIALIZER_UNLOCKED;
+
+#if CONFIG_DIAG_MEMORY
+/// FreeRTOS names of `diag_task_t` tasks
+static const char *const TASK_NAMES[DIAG_TASKS] = {
+    "main", "sampler_task", "i2c_bus_task", "mqtt_task", "wifi", "tiT",
+    "sys_evt"};
+#endif
+
+#if CONFIG_DIAG_HISTOGRAMS
+static uint8_t bucket(uint32_t us) {
+  uint8_t b = 0;
+
+  for (us /= DIAG_BUCKET0_US; us > 0 && b < DIAG_BUCKETS - 1; us >>= 1)
+    b++;
+  return b;
+}
+
+/// Must be called in a critical section
+static void record(diag_hist_t *h, uint32_t us) {
+  uint8_t b = bucket(us);
+
+  h->count++;
+  if (us > h->max_us)
+    h->max_us = us;
+  if (h->buckets[b] < UINT16_MAX)
+    h->buckets[b]++;
+}
+
+/**
+ * @brief Get the clock diagnostics are timed with.
+ * @return microseconds since boot
+ */
+int64_t diag_now_us(void) { return esp_timer_get_time(); }
+
+/**
+ * @brief Record the bus time of an I2C transaction. Devices past the first
+ * `DIAG_I2C_DEVICES` aren't recorded.
+ * @param addr 7-bit device address
+ * @param us time on the bus
+ */
+void diag_record_i2c(uint8_t addr, uint32_t us) {
+  portENTER_CRITICAL(&DIAG_MUX);
+  for (uint8_t i = 0; i < DIAG_I2C_DEVICES; i++) {
+    if (DIAG.i2c_addr[i] == 0)
+      DIAG.i2c_addr[i] = addr;
+    if (DIAG.i2c_addr[i] == addr) {
+      record(&DIAG.i2c[i], us);
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&DIAG_MUX);
+}
+
+/**
+ * @brief Record the time from starting a conversion to collecting it.
+ * @param drv sensor driver
+ * @param us conversion time, including waiting to collect it
+ */
+void diag_record_conv(diag_driver_t drv, uint32_t us) {
+  portENTER_CRITICAL(&DIAG_MUX);
+  record(&DIAG.conv[drv], us);
+  portEXIT_CRITICAL(&DIAG_MUX);
+}
+
+/**
+ * @brief Record the time a publishing stage took.
+ * @param stage publishing stage
+ * @param us time taken
+ */
+void diag_record_stage(diag_stage_t stage, uint32_t us) {
+  portENTER_CRITICAL(&DIAG_MUX);
+  record(&DIAG.stages[stage], us);
+  portEXIT_CRITICAL(&DIAG_MUX);
+}
+
+void diag_count_error(diag_error_t err) {
+  portENTER_CRITICAL(&DIAG_MUX);
+  DIAG.errors[err]++;
+  portEXIT_CRITICAL(&DIAG_MUX);
+}
+
+void diag_count_retries(diag_driver_t drv, uint32_t n) {
+  portENTER_CRITICAL(&DIAG_MUX);
+  DIAG.retries[drv] += n;
+  portEXIT_CRITICAL(&DIAG_MUX);
+}
+#endif
+
+/// Stack high-water marks and heap usage
+static void sample_memory(diag_t *d) {
+#if CONFIG_DIAG_MEMORY
+  TaskHandle_t task;
+
+  // slow, it walks every task list, but only runs once per period
+  for (uint8_t i = 0; i < DIAG_TASKS; i++)
+    if ((task = xTaskGetHandle(TASK_NAMES[i])) != NULL)
+      d->stack_free[i] = uxTaskGetStackHighWaterMark(task);
+
+#if !CONFIG_IDF_TARGET_LINUX
+  d->min_free_heap = esp_get_minimum_free_heap_size();
+  d->largest_free_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#endif
+#endif
+}
+
+/**
+ * @brief Get everything recorded since the last call, and start over. I2C
+ * devices keep their slots. Stack and heap usage is sampled now.
+ * @param d return-arg for recorded diagnostics
+ */
+void diag_take(diag_t *d) {
+  portENTER_CRITICAL(&DIAG_MUX);
+  memcpy(d, &DIAG, sizeof(diag_t));
+  memset(&DIAG, 0, sizeof(diag_t));
+  memcpy(DIAG.i2c_addr, d->i2c_addr, sizeof(DIAG.i2c_addr));
+  portEXIT_CRITICAL(&DIAG_MUX);
+
+  sample_memory(d);
+}
+#endif
@@ -0,0 +1,44 @@
+#ifndef DUTY_CYCLE_H
+#define DUTY_CYCLE_H
+
+#include <stdint.h>
+
+/// Never sleep for less than this, even if the cycle overran its period
+#define DUTY_CYCLE_MIN_SLEEP_MS 1000
+
+/// What the cycle should be doing next
+typedef enum duty_state {
+  DUTY_SAMPLE = 0,
+  DUTY_CONNECT,
+  DUTY_PUBLISH,
+  DUTY_SLEEP
+} duty_state_t;
+
+/// Progress reported by the firmware during a cycle
+typedef enum duty_event {
+  DUTY_SAMPLED = 0x1,
+  DUTY_CONNECTED = 0x2,
+  DUTY_PUBLISHED = 0x4,
+  DUTY_SKIPPED = 0x8 // nothing to publish this cycle
+} duty_event_t;
+
+/// Wake/sample/publish/sleep state, kept across deep sleep in RTC memory
+typedef struct duty_cycle {
+  uint32_t period_ms;
+  uint32_t timeout_ms;
+  uint32_t wake_ms; // clock reading at the start of this cycle
+  uint8_t events;   // duty_event_t bits seen this cycle
+  uint32_t cycles;
+  uint32_t timeouts;
+  uint32_t last_awake_ms; // awake time of the previous cycle
+} duty_cycle_t;
+
+void duty_cycle_init(duty_cycle_t *dc, uint32_t period_ms,
+                     uint32_t timeout_ms);
+void duty_cycle_begin(duty_cycle_t *dc, uint32_t now_ms);
+void duty_cycle_event(duty_cycle_t *dc, duty_event_t ev);
+duty_state_t duty_cycle_state(const duty_cycle_t *dc, uint32_t now_ms);
+uint32_t duty_cycle_remaining_ms(const duty_cycle_t *dc, uint32_t now_ms);
+uint32_t duty_cycle_end(duty_cycle_t *dc, uint32_t now_ms);
+
+#endif
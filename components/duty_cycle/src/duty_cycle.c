@@ -0,0 +1,81 @@
+#include "../include/duty_cycle.h"
+#include <string.h>
+
+/**
+ * @brief Initialize duty cycle state. Call once, on a cold boot.
+ * @param dc duty cycle state
+ * @param period_ms time from one wakeup to the next
+ * @param timeout_ms give up and sleep after being awake this long
+ */
+void duty_cycle_init(duty_cycle_t *dc, uint32_t period_ms,
+                     uint32_t timeout_ms) {
+  memset(dc, 0, sizeof(duty_cycle_t));
+  dc->period_ms = period_ms;
+  dc->timeout_ms = timeout_ms;
+}
+
+/**
+ * @brief Start a new cycle, after boot or wakeup.
+ * @param dc duty cycle state
+ * @param now_ms current clock reading
+ */
+void duty_cycle_begin(duty_cycle_t *dc, uint32_t now_ms) {
+  dc->wake_ms = now_ms;
+  dc->events = 0;
+  dc->cycles++;
+}
+
+/**
+ * @brief Record progress in the current cycle. Events may arrive in any order,
+ * e.g. the network may connect while sensors are still being sampled.
+ * @param dc duty cycle state
+ * @param ev event
+ */
+void duty_cycle_event(duty_cycle_t *dc, duty_event_t ev) { dc->events |= ev; }
+
+/**
+ * @brief Get what the cycle should do next.
+ * @param dc duty cycle state
+ * @param now_ms current clock reading
+ * @return next state, `DUTY_SLEEP` once published, skipped or timed out
+ */
+duty_state_t duty_cycle_state(const duty_cycle_t *dc, uint32_t now_ms) {
+  if (dc->events & (DUTY_PUBLISHED | DUTY_SKIPPED))
+    return DUTY_SLEEP;
+  if (duty_cycle_remaining_ms(dc, now_ms) == 0)
+    return DUTY_SLEEP;
+  if (!(dc->events & DUTY_SAMPLED))
+    return DUTY_SAMPLE;
+  if (!(dc->events & DUTY_CONNECTED))
+    return DUTY_CONNECT;
+  return DUTY_PUBLISH;
+}
+
+/**
+ * @brief Get time left before the cycle times out.
+ * @param dc duty cycle state
+ * @param now_ms current clock reading
+ * @return milliseconds left, 0 if timed out
+ */
+uint32_t duty_cycle_remaining_ms(const duty_cycle_t *dc, uint32_t now_ms) {
+  uint32_t awake = now_ms - dc->wake_ms;
+  return awake >= dc->timeout_ms ? 0 : dc->timeout_ms - awake;
+}
+
+/**
+ * @brief End the current cycle, recording its awake time.
+ * @param dc duty cycle state
+ * @param now_ms current clock reading
+ * @return time to sleep, in milliseconds, to keep the configured period
+ */
+uint32_t duty_cycle_end(duty_cycle_t *dc, uint32_t now_ms) {
+  uint32_t awake = now_ms - dc->wake_ms;
+
+  if (!(dc->events & (DUTY_PUBLISHED | DUTY_SKIPPED)))
+    dc->timeouts++;
+  dc->last_awake_ms = awake;
+
+  if (awake + DUTY_CYCLE_MIN_SLEEP_MS >= dc->period_ms)
+    return DUTY_CYCLE_MIN_SLEEP_MS;
+  return dc->period_ms - awake;
+}
@@ -0,0 +1,34 @@
+#ifndef CBOR_WRITER_H
+#define CBOR_WRITER_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// CBOR tag for an integer epoch-based date/time (RFC 8949, section 3.4.2)
+#define CBOR_TAG_EPOCH 1
+
+/// Bounded CBOR encoder writing into a caller-owned buffer, never allocates
+typedef struct cbor_writer {
+  uint8_t *buf;
+  size_t len;
+  size_t n;      // bytes written so far
+  bool overflow; // set if a write didn't fit, `n` stops growing
+} cbor_writer_t;
+
+void cbor_write_init(cbor_writer_t *w, uint8_t *buf, size_t len);
+void cbor_write_uint(cbor_writer_t *w, uint64_t val);
+void cbor_write_int(cbor_writer_t *w, int64_t val);
+void cbor_write_text(cbor_writer_t *w, const char *str);
+void cbor_write_map(cbor_writer_t *w, size_t n_pairs);
+void cbor_write_array(cbor_writer_t *w, size_t n_items);
+void cbor_write_tag(cbor_writer_t *w, uint64_t tag);
+void cbor_write_epoch(cbor_writer_t *w, uint32_t seconds);
+void cbor_write_float(cbor_writer_t *w, float val, float max_err);
+esp_err_t cbor_write_finish(const cbor_writer_t *w, size_t *len);
+
+uint16_t cbor_float_to_half(float val);
+float cbor_half_to_float(uint16_t half);
+
+#endif
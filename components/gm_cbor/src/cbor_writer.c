@@ -0,0 +1,226 @@
+#include "../include/cbor_writer.h"
+#include "esp_err.h"
+#include <string.h>
+
+/// Major types (RFC 8949, section 3.1)
+#define CBOR_UINT (0 << 5)
+#define CBOR_NEGINT (1 << 5)
+#define CBOR_TEXT (3 << 5)
+#define CBOR_ARRAY (4 << 5)
+#define CBOR_MAP (5 << 5)
+#define CBOR_TAG (6 << 5)
+#define CBOR_SIMPLE (7 << 5)
+
+/// Additional info for floats
+#define CBOR_HALF (CBOR_SIMPLE | 25)
+#define CBOR_SINGLE (CBOR_SIMPLE | 26)
+
+static void put(cbor_writer_t *w, const uint8_t *src, size_t n) {
+  if (w->overflow || n > w->len - w->n) {
+    w->overflow = true;
+    return;
+  }
+  memcpy(w->buf + w->n, src, n);
+  w->n += n;
+}
+
+static void put_head(cbor_writer_t *w, uint8_t major, uint64_t val) {
+  uint8_t head[9];
+  size_t n;
+
+  if (val < 24) {
+    head[0] = major | (uint8_t)val;
+    n = 1;
+  } else if (val <= 0xff) {
+    head[0] = major | 24;
+    n = 2;
+  } else if (val <= 0xffff) {
+    head[0] = major | 25;
+    n = 3;
+  } else if (val <= 0xffffffff) {
+    head[0] = major | 26;
+    n = 5;
+  } else {
+    head[0] = major | 27;
+    n = 9;
+  }
+
+  // big-endian argument
+  for (size_t i = n - 1; i > 0; i--) {
+    head[i] = val & 0xff;
+    val >>= 8;
+  }
+
+  put(w, head, n);
+}
+
+/**
+ * @brief Initialize a writer over a caller-owned buffer.
+ * @param w writer
+ * @param buf output buffer
+ * @param len size of `buf`
+ */
+void cbor_write_init(cbor_writer_t *w, uint8_t *buf, size_t len) {
+  w->buf = buf;
+  w->len = len;
+  w->n = 0;
+  w->overflow = false;
+}
+
+void cbor_write_uint(cbor_writer_t *w, uint64_t val) {
+  put_head(w, CBOR_UINT, val);
+}
+
+void cbor_write_int(cbor_writer_t *w, int64_t val) {
+  if (val >= 0)
+    put_head(w, CBOR_UINT, (uint64_t)val);
+  else
+    put_head(w, CBOR_NEGINT, (uint64_t)(-1 - val));
+}
+
+void cbor_write_text(cbor_writer_t *w, const char *str) {
+  size_t n = strlen(str);
+  put_head(w, CBOR_TEXT, n);
+  put(w, (const uint8_t *)str, n);
+}
+
+/**
+ * @brief Start a map, which must be followed by `n_pairs` key/value pairs.
+ */
+void cbor_write_map(cbor_writer_t *w, size_t n_pairs) {
+  put_head(w, CBOR_MAP, n_pairs);
+}
+
+/**
+ * @brief Start an array, which must be followed by `n_items` items.
+ */
+void cbor_write_array(cbor_writer_t *w, size_t n_items) {
+  put_head(w, CBOR_ARRAY, n_items);
+}
+
+void cbor_write_tag(cbor_writer_t *w, uint64_t tag) {
+  put_head(w, CBOR_TAG, tag);
+}
+
+/**
+ * @brief Write a date/time as integer seconds since the epoch.
+ */
+void cbor_write_epoch(cbor_writer_t *w, uint32_t seconds) {
+  cbor_write_tag(w, CBOR_TAG_EPOCH);
+  cbor_write_uint(w, seconds);
+}
+
+/**
+ * @brief Write a float as a half-precision float if that's within `max_err`
+ * of `val`, otherwise as a single-precision float.
+ * @param w writer
+ * @param val value
+ * @param max_err largest acceptable error, 0 to only use half precision when
+ * it's exact
+ */
+void cbor_write_float(cbor_writer_t *w, float val, float max_err) {
+  uint8_t out[5];
+  uint16_t half = cbor_float_to_half(val);
+  float err = cbor_half_to_float(half) - val;
+  uint32_t single;
+
+  if (err < 0)
+    err = -err;
+
+  // NaN compares unequal, but half-precision NaN is still NaN
+  if (val != val || err <= max_err) {
+    out[0] = CBOR_HALF;
+    out[1] = half >> 8;
+    out[2] = half & 0xff;
+    put(w, out, 3);
+    return;
+  }
+
+  memcpy(&single, &val, sizeof(single));
+  out[0] = CBOR_SINGLE;
+  out[1] = single >> 24;
+  out[2] = (single >> 16) & 0xff;
+  out[3] = (single >> 8) & 0xff;
+  out[4] = single & 0xff;
+  put(w, out, 5);
+}
+
+/**
+ * @brief Check that everything written fit in the buffer.
+ * @param w writer
+ * @param len return-arg for encoded length
+ * @return error, `ESP_ERR_INVALID_SIZE` if the buffer was too small
+ */
+esp_err_t cbor_write_finish(const cbor_writer_t *w, size_t *len) {
+  if (w->overflow)
+    return ESP_ERR_INVALID_SIZE;
+  *len = w->n;
+  return ESP_OK;
+}
+
+/**
+ * @brief Convert a single-precision float to half precision, rounding to
+ * nearest even.
+ */
+uint16_t cbor_float_to_half(float val) {
+  uint32_t f, mant, rem, halfway;
+  uint16_t sign, half;
+  int32_t exp;
+  int shift;
+
+  memcpy(&f, &val, sizeof(f));
+  sign = (f >> 16) & 0x8000;
+  exp = (int32_t)((f >> 23) & 0xff) - 127 + 15;
+  mant = f & 0x7fffff;
+
+  // infinity and NaN
+  if (((f >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+  // too large, round to infinity
+  if (exp >= 0x1f)
+    return sign | 0x7c00;
+
+  // subnormal half, or too small
+  if (exp <= 0) {
+    if (exp < -10)
+      return sign;
+    mant |= 0x800000;
+    shift = 14 - exp;
+    half = mant >> shift;
+    rem = mant & ((1u << shift) - 1);
+    halfway = 1u << (shift - 1);
+    if (rem > halfway || (rem == halfway && (half & 1)))
+      half++;
+    return sign | half;
+  }
+
+  // a carry out of the mantissa correctly bumps the exponent
+  half = sign | (exp << 10) | (mant >> 13);
+  rem = mant & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (half & 1)))
+    half++;
+  return half;
+}
+
+/**
+ * @brief Convert a half-precision float to single precision, exactly.
+ */
+float cbor_half_to_float(uint16_t half) {
+  uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+  uint32_t exp = (half >> 10) & 0x1f, mant = half & 0x3ff, f;
+  float val;
+
+  if (exp == 0x1f) {
+    f = sign | 0x7f800000 | (mant << 13);
+  } else if (exp == 0) {
+    // subnormal, mant * 2^-24
+    val = (float)mant * (1.0f / 16777216.0f);
+    return sign ? -val : val;
+  } else {
+    f = sign | ((exp + 112) << 23) | (mant << 13);
+  }
+
+  memcpy(&val, &f, sizeof(val));
+  return val;
+}
@@ -1,12 +1,60 @@
 #ifndef MQTT_H
 #define MQTT_H
 
+#include "deadband.h"
+#include "esp_err.h"
+#include "readings.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Encoding of published messages
+typedef enum mqtt_payload_format {
+  MQTT_PAYLOAD_JSON = 0,
+  MQTT_PAYLOAD_CBOR
+} mqtt_payload_format_t;
+
+/// Outbox and store-and-forward counters
+typedef struct mqtt_outbox_stats {
+  uint32_t outbox_bytes; // waiting for acknowledgement, 0 if unknown
+  uint32_t held_back;    // publishes held back by the outbox limit
+  uint16_t buffered;     // readings in the reading buffer
+  uint32_t dropped;      // readings dropped from the full reading buffer
+  uint32_t coalesced;    // readings superseded in the full reading buffer
+} mqtt_outbox_stats_t;
+
+/// Sampling configuration, can be changed at runtime with `mqtt_set_config`
+typedef struct mqtt_config {
+  uint8_t version;
+  bool snapshot;   // publish snapshots instead of per-sensor readings
+  uint8_t enabled; // SENSOR_BIT of every sampled sensor
+  uint32_t snapshot_ms;
+  uint32_t interval_ms[SENSOR_MAX];
+} mqtt_config_t;
+
 void mqtt_publish_temp(void);
 void mqtt_publish_humd(void);
 void mqtt_publish_moist(void);
 void mqtt_publish_lux(void);
 void mqtt_publish_batt(void);
+void mqtt_publish_snapshot(void);
+void mqtt_publish_diag(void);
 
 void mqtt_publish_all(void);
+void mqtt_set_payload_format(mqtt_payload_format_t format);
+void mqtt_get_config(mqtt_config_t *cfg);
+esp_err_t mqtt_set_config(const mqtt_config_t *cfg);
+int64_t mqtt_first_publish_us(void);
+uint32_t mqtt_acked_count(void);
+void mqtt_get_outbox_stats(mqtt_outbox_stats_t *stats);
+
+void mqtt_read_snapshot(snapshot_t *snap);
+void mqtt_buffer_snapshot(const snapshot_t *snap);
+bool mqtt_snapshot_due(const snapshot_t *snap);
+esp_err_t mqtt_get_deadband_stats(sensor_id_t sensor,
+                                  deadband_stats_t *stats);
+esp_err_t mqtt_wait_connected(uint32_t timeout_ms);
+esp_err_t mqtt_publish_snapshot_sync(const snapshot_t *snap,
+                                     uint32_t timeout_ms);
+esp_err_t mqtt_publish_diag_due(void);
 
 #endif
@@ -0,0 +1,255 @@
+#include "config.h"
+#include "payload.h"
+#include <string.h>
+
+/// Read position in a config document, which isn't NUL-terminated
+typedef struct cursor {
+  const char *p;
+  const char *end;
+} cursor_t;
+
+static void skip_space(cursor_t *c) {
+  while (c->p < c->end &&
+         (*c->p == ' ' || *c->p == '\t' || *c->p == '\r' || *c->p == '\n'))
+    c->p++;
+}
+
+/// Consume `ch` if it's the next non-space character
+static bool take(cursor_t *c, char ch) {
+  skip_space(c);
+  if (c->p >= c->end || *c->p != ch)
+    return false;
+  c->p++;
+  return true;
+}
+
+/// Consume `word` if it's next
+static bool take_word(cursor_t *c, const char *word) {
+  size_t n = strlen(word);
+
+  skip_space(c);
+  if ((size_t)(c->end - c->p) < n || memcmp(c->p, word, n) != 0)
+    return false;
+  c->p += n;
+  return true;
+}
+
+/// Strings are keys and enum values, so escapes aren't supported
+static bool read_string(cursor_t *c, char *out, size_t len) {
+  size_t n = 0;
+
+  if (!take(c, '"'))
+    return false;
+  while (c->p < c->end && *c->p != '"') {
+    if (*c->p == '\\' || n + 1 >= len)
+      return false;
+    out[n++] = *c->p++;
+  }
+  if (c->p >= c->end)
+    return false;
+
+  c->p++; // closing quote
+  out[n] = '\0';
+  return true;
+}
+
+static bool read_uint(cursor_t *c, uint32_t *val) {
+  uint64_t n = 0;
+  const char *start;
+
+  skip_space(c);
+  start = c->p;
+  while (c->p < c->end && *c->p >= '0' && *c->p <= '9') {
+    n = n * 10 + (*c->p++ - '0');
+    if (n > UINT32_MAX)
+      return false;
+  }
+
+  *val = (uint32_t)n;
+  return c->p > start;
+}
+
+static bool read_bool(cursor_t *c, bool *val) {
+  if (take_word(c, "true")) {
+    *val = true;
+    return true;
+  }
+  if (take_word(c, "false")) {
+    *val = false;
+    return true;
+  }
+  return false;
+}
+
+/// Decode the value of `key` into `cfg`, unknown keys are rejected
+static bool decode_field(cursor_t *c, const char *key, mqtt_config_t *cfg) {
+  char mode[sizeof(MODE_SNAPSHOT)];
+  size_t n;
+  bool on;
+
+  if (strcmp(key, MODE) == 0) {
+    if (!read_string(c, mode, sizeof(mode)))
+      return false;
+    if (strcmp(mode, MODE_SNAPSHOT) == 0)
+      cfg->snapshot = true;
+    else if (strcmp(mode, MODE_SENSOR) == 0)
+      cfg->snapshot = false;
+    else
+      return false;
+    return true;
+  }
+
+  if (strcmp(key, SNAPSHOT_MS) == 0)
+    return read_uint(c, &cfg->snapshot_ms);
+
+  for (int i = 0; i < SENSOR_MAX; i++) {
+    n = strlen(SENSOR_KEYS[i]);
+    if (strncmp(key, SENSOR_KEYS[i], n) != 0)
+      continue;
+
+    // "<sensor>" enables or disables, "<sensor>_ms" is the interval
+    if (key[n] == '\0') {
+      if (!read_bool(c, &on))
+        return false;
+      cfg->enabled = on ? cfg->enabled | SENSOR_BIT(i)
+                        : cfg->enabled & ~SENSOR_BIT(i);
+      return true;
+    }
+    if (strcmp(&key[n], INTERVAL_SUFFIX) == 0)
+      return read_uint(c, &cfg->interval_ms[i]);
+  }
+
+  return false;
+}
+
+static bool interval_valid(uint32_t ms) {
+  return ms >= MQTT_CONFIG_MIN_MS && ms <= MQTT_CONFIG_MAX_MS;
+}
+
+/**
+ * @brief Check that every interval is in range.
+ * @param cfg configuration
+ * @return true if `cfg` can be applied
+ */
+bool config_valid(const mqtt_config_t *cfg) {
+  if (cfg->version != MQTT_CONFIG_VERSION)
+    return false;
+  if ((cfg->enabled & ~SENSOR_ALL_BITS) != 0)
+    return false;
+  if (!interval_valid(cfg->snapshot_ms))
+    return false;
+  for (int i = 0; i < SENSOR_MAX; i++)
+    if (!interval_valid(cfg->interval_ms[i]))
+      return false;
+  return true;
+}
+
+/**
+ * @brief Compare two configurations, field by field since padding may differ.
+ * @param a configuration
+ * @param b configuration
+ * @return true if `a` and `b` are the same
+ */
+bool config_equal(const mqtt_config_t *a, const mqtt_config_t *b) {
+  return a->version == b->version && a->snapshot == b->snapshot &&
+         a->enabled == b->enabled && a->snapshot_ms == b->snapshot_ms &&
+         memcmp(a->interval_ms, b->interval_ms, sizeof(a->interval_ms)) == 0;
+}
+
+/**
+ * @brief Apply a config document on top of a configuration. The document is a
+ * flat JSON object, and every field is optional, e.g.
+ * `{"mode":"sensor","lux_ms":300000,"battery_voltage":false}`
+ * @param doc config document, not NUL-terminated
+ * @param len length of `doc`
+ * @param cfg configuration to update, left unchanged on error
+ * @return error, `ESP_ERR_INVALID_ARG` if the document is malformed, has
+ * unknown fields, or out of range values
+ */
+esp_err_t decode_config(const char *doc, size_t len, mqtt_config_t *cfg) {
+  cursor_t c = {.p = doc, .end = doc + len};
+  char key[MQTT_CONFIG_KEY_LEN];
+  mqtt_config_t next = *cfg;
+
+  if (!take(&c, '{'))
+    return ESP_ERR_INVALID_ARG;
+
+  if (!take(&c, '}')) {
+    do {
+      if (!read_string(&c, key, sizeof(key)) || !take(&c, ':') ||
+          !decode_field(&c, key, &next))
+        return ESP_ERR_INVALID_ARG;
+    } while (take(&c, ','));
+
+    if (!take(&c, '}'))
+      return ESP_ERR_INVALID_ARG;
+  }
+
+  skip_space(&c);
+  if (c.p != c.end || !config_valid(&next))
+    return ESP_ERR_INVALID_ARG;
+
+  *cfg = next;
+  return ESP_OK;
+}
+
+/**
+ * @brief Decode a log query, e.g.
+ * `{"sensor":"temperature","from":1620000000,"to":1620003600}`. Times are UTC
+ * seconds since the epoch, and "to" is optional.
+ * @param doc query document, not NUL-terminated
+ * @param len length of `doc`
+ * @param sensor return-arg for the queried sensor
+ * @param from_s return-arg for the start of the range
+ * @param to_s return-arg for the end of the range, excluded, `UINT32_MAX` if
+ * open
+ * @return error, `ESP_ERR_INVALID_ARG` if the document is malformed, has
+ * unknown or repeated fields, or an empty range; the return-args are only set
+ * on success
+ */
+esp_err_t decode_log_query(const char *doc, size_t len, sensor_id_t *sensor,
+                           uint32_t *from_s, uint32_t *to_s) {
+  cursor_t c = {.p = doc, .end = doc + len};
+  char key[MQTT_CONFIG_KEY_LEN], name[MQTT_CONFIG_KEY_LEN];
+  bool has_sensor = false, has_from = false, has_to = false;
+  sensor_id_t id = SENSOR_MAX;
+  uint32_t from = 0, to = UINT32_MAX;
+  bool ok;
+
+  if (!take(&c, '{'))
+    return ESP_ERR_INVALID_ARG;
+
+  do {
+    if (!read_string(&c, key, sizeof(key)) || !take(&c, ':'))
+      return ESP_ERR_INVALID_ARG;
+
+    if (strcmp(key, LOG_SENSOR) == 0 && !has_sensor) {
+      ok = read_string(&c, name, sizeof(name));
+      for (int i = 0; ok && id == SENSOR_MAX && i < SENSOR_MAX; i++)
+        if (strcmp(name, SENSOR_KEYS[i]) == 0)
+          id = i;
+      ok = has_sensor = ok && id != SENSOR_MAX;
+    } else if (strcmp(key, LOG_FROM) == 0 && !has_from) {
+      ok = has_from = read_uint(&c, &from);
+    } else if (strcmp(key, LOG_TO) == 0 && !has_to) {
+      ok = has_to = read_uint(&c, &to);
+    } else {
+      ok = false;
+    }
+
+    if (!ok)
+      return ESP_ERR_INVALID_ARG;
+  } while (take(&c, ','));
+
+  if (!take(&c, '}'))
+    return ESP_ERR_INVALID_ARG;
+
+  skip_space(&c);
+  if (c.p != c.end || !has_sensor || !has_from || from >= to)
+    return ESP_ERR_INVALID_ARG;
+
+  *sensor = id;
+  *from_s = from;
+  *to_s = to;
+  return ESP_OK;
+}
@@ -0,0 +1,36 @@
+#ifndef MQTT_CONFIG_H
+#define MQTT_CONFIG_H
+
+#include "../include/mqtt.h"
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Bump when `mqtt_config_t` changes, so stale NVS blobs are ignored
+#define MQTT_CONFIG_VERSION 1
+
+/// Accepted sampling intervals
+#define MQTT_CONFIG_MIN_MS 1000
+#define MQTT_CONFIG_MAX_MS (24 * 60 * 60 * 1000)
+
+/// Longest config document, and config key
+#define MQTT_CONFIG_DOC_LEN 512
+#define MQTT_CONFIG_KEY_LEN 24
+
+/// JSON keys
+#define MODE "mode"
+#define MODE_SENSOR "sensor"
+#define MODE_SNAPSHOT "snapshot"
+#define SNAPSHOT_MS "snapshot_ms"
+#define INTERVAL_SUFFIX "_ms"
+#define LOG_SENSOR "sensor"
+#define LOG_FROM "from"
+#define LOG_TO "to"
+
+bool config_valid(const mqtt_config_t *cfg);
+bool config_equal(const mqtt_config_t *a, const mqtt_config_t *b);
+esp_err_t decode_config(const char *doc, size_t len, mqtt_config_t *cfg);
+esp_err_t decode_log_query(const char *doc, size_t len, sensor_id_t *sensor,
+                           uint32_t *from_s, uint32_t *to_s);
+
+#endif
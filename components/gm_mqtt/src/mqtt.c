@@ -1,28 +1,40 @@
+#include "esp_attr.h"
 #include "esp_err.h"
 #include "esp_event.h"
+#include "esp_idf_version.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 #include "freertos/portmacro.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
 #include "mqtt_client.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "../include/mqtt.h"
 #include "apds_3901.h"
 #include "batt.h"
+#include "config.h"
+#include "deadband.h"
+#include "diag.h"
 #include "nvs.h"
+#include "payload.h"
+#include "reading_buf.h"
+#include "readings.h"
+#include "sampler.h"
 #include "seesaw_soil.h"
 #include "sht_20.h"
+#include "sweep.h"
+#include "timebase.h"
+#include "ts_log.h"
+#include "win_stats.h"
 
 // Config constants
-#define ISO_8601_LEN 32
-#define BUF_LEN 128
-
-#define TEMPERATURE "temperature"
-#define HUMIDITY "humidity"
-#define TIME "timestamp"
-#define LUX "lux"
-#define SOIL_MOISTURE "soil_moisture"
-#define BATTERY_VOLTAGE "battery_voltage"
-
 #define BRKR_URI CONFIG_MQTT_BROKER_URI
 #define TEMP_TOPIC CONFIG_MQTT_TEMPERATURE_TOPIC
 #define HUMD_TOPIC CONFIG_MQTT_HUMIDITY_TOPIC
@@ -30,21 +42,469 @@
 #define SOIL_MOISTURE_TOPIC CONFIG_MQTT_SOIL_MOISTURE_TOPIC
 #define BATTERY_VOLTAGE_TOPIC CONFIG_MQTT_BATTERY_VOLTAGE_TOPIC
 
-#define ONE_MIN pdMS_TO_TICKS(60000)
-#define DELAY ONE_MIN
+#define SNAPSHOT_TOPIC CONFIG_MQTT_SNAPSHOT_TOPIC
+#if CONFIG_MQTT_PUBLISH_SNAPSHOT
+#define SNAPSHOT_INTERVAL CONFIG_MQTT_SNAPSHOT_INTERVAL_MS
+#else
+#define SNAPSHOT_INTERVAL 60000
+#endif
+
+/// Default snapshot interval, in deep sleep mode the duty cycle period
+#if CONFIG_DEEP_SLEEP_MODE
+#define DEFAULT_SNAPSHOT_MS CONFIG_DEEP_SLEEP_PERIOD_MS
+#else
+#define DEFAULT_SNAPSHOT_MS SNAPSHOT_INTERVAL
+#endif
+
+/// Runtime config, stored in NVS and received on a per-device topic
+#define CFG_TOPIC_PREFIX CONFIG_MQTT_CONFIG_TOPIC
+#define CFG_TOPIC_LEN 96
+#define CFG_NVS_NAMESPACE "gm_mqtt"
+#define CFG_NVS_KEY "config"
+
+/// Latency histograms, error counts and memory usage, on their own topic
+#if CONFIG_DIAG
+#define DIAG_TOPIC CONFIG_MQTT_DIAG_TOPIC
+#define DIAG_INTERVAL CONFIG_MQTT_DIAG_INTERVAL_MS
+#define DIAG_JOB "diagnostics"
+#endif
+#if CONFIG_TS_LOG
+#define LOG_TOPIC_PREFIX CONFIG_MQTT_LOG_TOPIC
+#define LOG_REPLY_SUFFIX "/records"
+#define LOG_CHUNK_RECORDS 32 // records per reply message
+#define LOG_MAX_CHUNKS 8     // reply messages per query
+#endif
+#define INFLIGHT_LEN 8 // publishes timed until their PUBACK
+#define ACKS_LEN 16    // recent PUBACKs, for tasks waiting on a message id
+
+/// Buffered readings are published a window at a time, and only removed from
+/// the buffer once acknowledged, the client's outbox doesn't survive deep sleep
+#define BACKLOG_WINDOW 8
+#define BACKLOG_JOB "backlog"
+#define BACKLOG_DRAIN_MS 1000
+/// Unacknowledged readings are sent again after this long, esp-mqtt gives up
+/// on an outbox message after 30 s
+#define BACKLOG_RESEND_US (30 * 1000 * 1000)
+
+/// QoS and retain flag of each stream
+#ifdef CONFIG_MQTT_READING_QOS
+#define READING_QOS CONFIG_MQTT_READING_QOS
+#else
+#define READING_QOS 1
+#endif
+#ifdef CONFIG_MQTT_SNAPSHOT_QOS
+#define SNAPSHOT_QOS CONFIG_MQTT_SNAPSHOT_QOS
+#else
+#define SNAPSHOT_QOS 1
+#endif
+#ifdef CONFIG_MQTT_DIAG_QOS
+#define DIAG_QOS CONFIG_MQTT_DIAG_QOS
+#else
+#define DIAG_QOS 1
+#endif
+
+#if CONFIG_MQTT_READING_RETAIN
+#define READING_RETAIN 1
+#else
+#define READING_RETAIN 0
+#endif
+#if CONFIG_MQTT_SNAPSHOT_RETAIN
+#define SNAPSHOT_RETAIN 1
+#else
+#define SNAPSHOT_RETAIN 0
+#endif
+#if CONFIG_MQTT_DIAG_RETAIN
+#define DIAG_RETAIN 1
+#else
+#define DIAG_RETAIN 0
+#endif
+
+/// Outbox bytes that hold back new publishes, the outbox size is only
+/// available from ESP-IDF v4.4
+#if CONFIG_MQTT_OUTBOX_LIMIT
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+#define OUTBOX_LIMIT CONFIG_MQTT_OUTBOX_LIMIT
+#else
+#warning "CONFIG_MQTT_OUTBOX_LIMIT needs ESP-IDF v4.4 or later, the outbox is not limited"
+#define OUTBOX_LIMIT_UNSUPPORTED 1
+#endif
+#endif
+
+/// Give up on sensors that haven't answered after this long
+#define SNAPSHOT_SWEEP_TIMEOUT_MS 3000
+
+#define CONNECTED_BIT (1 << 0)
+#define PUBLISHED_BIT (1 << 1)
+
+#define TEMP_INTERVAL CONFIG_MQTT_TEMPERATURE_INTERVAL_MS
+#define HUMD_INTERVAL CONFIG_MQTT_HUMIDITY_INTERVAL_MS
+#define LUX_INTERVAL CONFIG_MQTT_LUX_INTERVAL_MS
+#define SOIL_MOISTURE_INTERVAL CONFIG_MQTT_SOIL_MOISTURE_INTERVAL_MS
+#define BATTERY_VOLTAGE_INTERVAL CONFIG_MQTT_BATTERY_VOLTAGE_INTERVAL_MS
+
+/// With summaries, sensors are sampled fast and reported once per interval
+#if CONFIG_MQTT_PUBLISH_SUMMARY
+#define SUMMARY_SAMPLE_MS CONFIG_MQTT_SUMMARY_SAMPLE_MS
+#define SAMPLE_PERIOD(interval) SUMMARY_SAMPLE_MS
+#else
+#define SAMPLE_PERIOD(interval) (interval)
+#endif
+
+/// Report-by-exception deadbands, absolute ones in sensor units
+#if CONFIG_MQTT_DEADBAND
+#define HEARTBEAT_S CONFIG_MQTT_HEARTBEAT_S
+
+static const float DEADBAND_ABS[SENSOR_MAX] = {
+    CONFIG_MQTT_TEMPERATURE_DEADBAND / 100.0f,
+    CONFIG_MQTT_HUMIDITY_DEADBAND / 100.0f, CONFIG_MQTT_LUX_DEADBAND,
+    CONFIG_MQTT_SOIL_MOISTURE_DEADBAND, CONFIG_MQTT_BATTERY_VOLTAGE_DEADBAND};
+static const float DEADBAND_REL[SENSOR_MAX] = {
+    CONFIG_MQTT_TEMPERATURE_DEADBAND_PCT / 100.0f,
+    CONFIG_MQTT_HUMIDITY_DEADBAND_PCT / 100.0f,
+    CONFIG_MQTT_LUX_DEADBAND_PCT / 100.0f,
+    CONFIG_MQTT_SOIL_MOISTURE_DEADBAND_PCT / 100.0f,
+    CONFIG_MQTT_BATTERY_VOLTAGE_DEADBAND_PCT / 100.0f};
+#endif
 
 static const char *TAG = "mqtt_component";
 
+/// Kinds of message, each with its own QoS and retain flag
+typedef enum mqtt_stream {
+  STREAM_READING, // readings and summaries, on the sensor topics
+  STREAM_SNAPSHOT,
+  STREAM_DIAG,
+  STREAM_LOG, // log query replies, acknowledged and never retained
+  STREAMS
+} mqtt_stream_t;
+
+static const int STREAM_QOS[STREAMS] = {READING_QOS, SNAPSHOT_QOS, DIAG_QOS,
+                                        1};
+static const int STREAM_RETAIN[STREAMS] = {READING_RETAIN, SNAPSHOT_RETAIN,
+                                           DIAG_RETAIN, 0};
+
+/// Session state, kept in RTC memory across deep sleep
+typedef struct mqtt_session {
+  bool established; // broker holds a persistent session for this client
+  uint32_t connects;
+} mqtt_session_t;
+
+static RTC_DATA_ATTR mqtt_session_t SESSION = {0};
+
+/// Readings that couldn't be published, kept in RTC memory across deep sleep
+static RTC_DATA_ATTR reading_t BACKLOG_RECORDS[READING_BUF_CAPACITY];
+
+/// RTC slow memory left for the backlog by every other RTC user, with all of
+/// them enabled
+#define BACKLOG_RTC_MAX_BYTES (512 * 9)
+_Static_assert(sizeof(BACKLOG_RECORDS) <= BACKLOG_RTC_MAX_BYTES,
+               "READING_BUF_CAPACITY doesn't fit in RTC slow memory, at most "
+               "512 readings do");
+static RTC_DATA_ATTR reading_buf_t BACKLOG = {0};
+static SemaphoreHandle_t BACKLOG_LOCK = NULL;
+static StaticSemaphore_t BACKLOG_LOCK_BUF;
+/// Message ids of the sent readings, oldest first, 0 once acknowledged or if
+/// there's nothing to wait for at QoS 0. Only valid on the connection they
+/// were sent on.
+static int BACKLOG_IDS[BACKLOG_WINDOW];
+/// Encoded reading, guarded by BACKLOG_LOCK
+static char READING_PAYLOAD[PAYLOAD_BUF_LEN];
+static uint32_t BACKLOG_CONNECTS = 0;
+static int64_t BACKLOG_SENT_US = 0; // oldest unacknowledged send, or last ack
+
+/// Last reported value of each sensor, kept in RTC memory across deep sleep
+#if CONFIG_MQTT_DEADBAND
+static RTC_DATA_ATTR deadband_t DEADBANDS[SENSOR_MAX];
+static RTC_DATA_ATTR bool DEADBANDS_INIT = false;
+#endif
+
+static const char *SENSOR_TOPICS[SENSOR_MAX] = {
+    TEMP_TOPIC, HUMD_TOPIC, LUX_TOPIC, SOIL_MOISTURE_TOPIC,
+    BATTERY_VOLTAGE_TOPIC};
+
+/// Runtime config, read by the sampler and written from the MQTT task
+static mqtt_config_t CFG;
+static bool CFG_INIT = false;
+static portMUX_TYPE CFG_MUX = portMUX_INITIALIZER_UNLOCKED;
+static char CFG_TOPIC[CFG_TOPIC_LEN];
+
+#if CONFIG_DIAG_HISTOGRAMS
+/// Publishes waiting for their PUBACK, written from the publishing tasks and
+/// read from the MQTT task
+typedef struct inflight {
+  int msg_id;
+  int64_t start_us;
+} inflight_t;
+
+static inflight_t INFLIGHT[INFLIGHT_LEN];
+static uint8_t INFLIGHT_NEXT = 0;
+static portMUX_TYPE INFLIGHT_MUX = portMUX_INITIALIZER_UNLOCKED;
+
+/// Retry counters of each driver at the last diagnostics, the counters are
+/// kept in RTC memory by the drivers, so these are too
+static RTC_DATA_ATTR uint32_t DIAG_RETRIES[DIAG_DRIVERS];
+#endif
+
+#if CONFIG_TS_LOG
+/// Log query in progress, queries are answered on the MQTT task
+typedef struct log_query {
+  esp_mqtt_client_handle_t client;
+  sensor_id_t sensor;
+  ts_log_record_t records[LOG_CHUNK_RECORDS];
+  uint8_t n;
+  uint8_t chunks;    // sent so far
+  int64_t resume_ms; // first record past the chunk, -1 if the query's done
+} log_query_t;
+
+static char LOG_TOPIC[CFG_TOPIC_LEN];
+static char LOG_REPLY_TOPIC[CFG_TOPIC_LEN + sizeof(LOG_REPLY_SUFFIX)];
+static log_query_t LOG_QUERY;
+static bool LOG_INIT = false;
+static esp_err_t LOG_ERR = ESP_OK; // of mounting the log
+static char LOG_PAYLOAD[LOG_BUF_LEN];
+#endif
+
+#if CONFIG_DIAG
+static RTC_DATA_ATTR int64_t DIAG_LAST_MS = 0;
+/// Diagnostics are published from the sampler task, or from the main task in
+/// deep sleep mode, never both
+static diag_t DIAG;
+static char DIAG_PAYLOAD[DIAG_BUF_LEN];
+#endif
+
+/// Payloads encoded on the sampler task, kept off its stack
+static char SNAPSHOT_PAYLOAD[SNAPSHOT_BUF_LEN];
+#if CONFIG_MQTT_PUBLISH_SUMMARY
+static char SUMMARY_PAYLOAD[PAYLOAD_BUF_LEN];
+#endif
+
+#if CONFIG_MQTT_PUBLISH_SUMMARY
+/// Reporting window of each sensor, only touched from the sampler task
+typedef struct sensor_window {
+  win_stats_t stats;
+  uint32_t start_ms; // time of the window's first sample
+} sensor_window_t;
+
+static sensor_window_t WINDOWS[SENSOR_MAX];
+#endif
+
+/// Forward declarations
+static uint16_t drain_backlog(esp_mqtt_client_handle_t client);
+static void drain_job(void *client);
+static void handle_config(esp_mqtt_event_handle_t event);
+static void handle_log_query(esp_mqtt_event_handle_t event);
+
+#if CONFIG_MQTT_DEADBAND
+/// Only on a cold boot, otherwise keep the values reported before deep sleep
+static void init_deadbands(void) {
+  if (DEADBANDS_INIT)
+    return;
+
+  for (int i = 0; i < SENSOR_MAX; i++)
+    deadband_init(&DEADBANDS[i], DEADBAND_ABS[i], DEADBAND_REL[i],
+                  HEARTBEAT_S);
+  DEADBANDS_INIT = true;
+}
+#endif
+
+/// Load the config stored in NVS, without waiting for the network
+static void init_config(void) {
+  mqtt_config_t stored;
+  esp_err_t err;
+  uint8_t mac[6];
+
+  if (CFG_INIT)
+    return;
+
+  CFG.version = MQTT_CONFIG_VERSION;
+#if CONFIG_MQTT_PUBLISH_SNAPSHOT || CONFIG_DEEP_SLEEP_MODE
+  CFG.snapshot = true;
+#endif
+  CFG.enabled = SENSOR_ALL_BITS;
+  CFG.snapshot_ms = DEFAULT_SNAPSHOT_MS;
+  CFG.interval_ms[SENSOR_TEMPERATURE] = TEMP_INTERVAL;
+  CFG.interval_ms[SENSOR_HUMIDITY] = HUMD_INTERVAL;
+  CFG.interval_ms[SENSOR_LUX] = LUX_INTERVAL;
+  CFG.interval_ms[SENSOR_SOIL_MOISTURE] = SOIL_MOISTURE_INTERVAL;
+  CFG.interval_ms[SENSOR_BATTERY_VOLTAGE] = BATTERY_VOLTAGE_INTERVAL;
+
+  err = read_nvs_blob(CFG_NVS_NAMESPACE, CFG_NVS_KEY, &stored,
+                      sizeof(mqtt_config_t));
+  if (err == ESP_OK && config_valid(&stored)) {
+    CFG = stored;
+    ESP_LOGI(TAG, "Loaded config from NVS");
+  } else if (err != ESP_ERR_NOT_FOUND) {
+    ESP_LOGW(TAG, "Ignoring stored config: %s",
+             err == ESP_OK ? "invalid" : esp_err_to_name(err));
+  }
+
+  // one config topic per device
+  esp_read_mac(mac, ESP_MAC_WIFI_STA);
+  snprintf(CFG_TOPIC, CFG_TOPIC_LEN, "%s/%02x%02x%02x%02x%02x%02x",
+           CFG_TOPIC_PREFIX, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+  CFG_INIT = true;
+}
+
+/**
+ * @brief Mount the flash log and name its query topics, once per boot.
+ * @return error, readings aren't logged and queries aren't answered if the log
+ * couldn't be mounted
+ */
+static esp_err_t init_log(void) {
+#if CONFIG_TS_LOG
+  uint8_t mac[6];
+
+  if (LOG_INIT)
+    return LOG_ERR;
+
+  // one log topic per device
+  esp_read_mac(mac, ESP_MAC_WIFI_STA);
+  snprintf(LOG_TOPIC, CFG_TOPIC_LEN, "%s/%02x%02x%02x%02x%02x%02x",
+           LOG_TOPIC_PREFIX, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  snprintf(LOG_REPLY_TOPIC, sizeof(LOG_REPLY_TOPIC), "%s%s", LOG_TOPIC,
+           LOG_REPLY_SUFFIX);
+
+  LOG_ERR = ts_log_init();
+  LOG_INIT = true;
+  return LOG_ERR;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+static void get_config(mqtt_config_t *cfg) {
+  init_config();
+  portENTER_CRITICAL(&CFG_MUX);
+  *cfg = CFG;
+  portEXIT_CRITICAL(&CFG_MUX);
+}
+
+/// Sampler period of a sensor's job, 0 pauses it
+static uint32_t sensor_period(sensor_id_t sensor) {
+  mqtt_config_t cfg;
+
+  get_config(&cfg);
+  if (cfg.snapshot || !(cfg.enabled & SENSOR_BIT(sensor)))
+    return 0;
+  return SAMPLE_PERIOD(cfg.interval_ms[sensor]);
+}
+
+/// Sampler period of the snapshot job, 0 pauses it
+static uint32_t snapshot_period(void) {
+  mqtt_config_t cfg;
+
+  get_config(&cfg);
+  return cfg.snapshot ? cfg.snapshot_ms : 0;
+}
+
+/// Retime every sampler job to the current config
+static void apply_schedule(void *arg, uint32_t unused) {
+  // job names are the sensor keys
+  for (int i = 0; i < SENSOR_MAX; i++)
+    sampler_set_period(SENSOR_KEYS[i], sensor_period(i));
+  sampler_set_period(SNAPSHOT, snapshot_period());
+}
+
+/// Pause or resume the backlog job, from the timer task like `apply_schedule`
+static void set_backlog_period(void *arg, uint32_t period_ms) {
+  sampler_set_period(BACKLOG_JOB, period_ms);
+}
+
+static EventGroupHandle_t EVENTS = NULL;
+static StaticEventGroup_t EVENTS_BUF;
+static int64_t FIRST_PUBLISH_US = 0; // boot to the first acknowledged publish
+static uint32_t ACKED = 0;           // publishes acknowledged since boot
+/// Publishes held back by the outbox limit, counted on every publishing task
+static uint32_t HELD_BACK = 0;
+static portMUX_TYPE HELD_BACK_MUX = portMUX_INITIALIZER_UNLOCKED;
+
+/// Message ids of the latest PUBACKs, other messages may be acknowledged
+/// before the one a task waits for, or even before its publish call returns
+static int ACKS[ACKS_LEN];
+static uint8_t ACKS_NEXT = 0;
+static portMUX_TYPE ACKS_MUX = portMUX_INITIALIZER_UNLOCKED;
+
+/// Remember an acknowledged message id, overwriting the oldest
+static void record_ack(int msg_id) {
+  portENTER_CRITICAL(&ACKS_MUX);
+  ACKS[ACKS_NEXT] = msg_id;
+  ACKS_NEXT = (ACKS_NEXT + 1) % ACKS_LEN;
+  portEXIT_CRITICAL(&ACKS_MUX);
+}
+
+/// Check whether a message id was acknowledged, forgetting it if so
+static bool take_ack(int msg_id) {
+  bool acked = false;
+
+  portENTER_CRITICAL(&ACKS_MUX);
+  for (uint8_t i = 0; i < ACKS_LEN; i++) {
+    if (ACKS[i] == msg_id) {
+      ACKS[i] = 0;
+      acked = true;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&ACKS_MUX);
+  return acked;
+}
+
+/// Time a publish from when it was sent to its PUBACK
+static void record_puback(int msg_id) {
+#if CONFIG_DIAG_HISTOGRAMS
+  int64_t start_us = -1;
+
+  portENTER_CRITICAL(&INFLIGHT_MUX);
+  for (uint8_t i = 0; i < INFLIGHT_LEN; i++) {
+    if (INFLIGHT[i].msg_id == msg_id) {
+      start_us = INFLIGHT[i].start_us;
+      INFLIGHT[i].msg_id = 0;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&INFLIGHT_MUX);
+
+  if (start_us >= 0)
+    DIAG_STAGE_SINCE(DIAG_PUBACK, start_us);
+#endif
+}
+
 static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event) {
   switch (event->event_id) {
   case MQTT_EVENT_CONNECTED:
-    ESP_LOGI(TAG, "Connected to MQTT broker");
+    ESP_LOGI(TAG, "Connected to MQTT broker, session present: %d",
+             event->session_present);
+    SESSION.established = true;
+    SESSION.connects++;
+    xEventGroupSetBits(EVENTS, CONNECTED_BIT);
+#if CONFIG_MQTT_REMOTE_CONFIG
+    esp_mqtt_client_subscribe(event->client, CFG_TOPIC, 1);
+#endif
+#if CONFIG_TS_LOG
+    if (init_log() == ESP_OK)
+      esp_mqtt_client_subscribe(event->client, LOG_TOPIC, 1);
+#endif
+#if !CONFIG_DEEP_SLEEP_MODE
+    // the backlog is sent from the sampler task, so a long one doesn't hold up
+    // this one
+    xTimerPendFunctionCall(&set_backlog_period, NULL, BACKLOG_DRAIN_MS, 0);
+#endif
     break;
   case MQTT_EVENT_DISCONNECTED:
     ESP_LOGW(TAG, "Disconnected from MQTT broker");
+    xEventGroupClearBits(EVENTS, CONNECTED_BIT);
     break;
   case MQTT_EVENT_PUBLISHED:
     ESP_LOGD(TAG, "Published event, message id: %d", event->msg_id);
+    record_ack(event->msg_id);
+    record_puback(event->msg_id);
+    ACKED++;
+    if (FIRST_PUBLISH_US == 0)
+      FIRST_PUBLISH_US = esp_timer_get_time();
+    xEventGroupSetBits(EVENTS, PUBLISHED_BIT);
+    break;
+  case MQTT_EVENT_DATA:
+    handle_config(event);
+    handle_log_query(event);
     break;
   case MQTT_EVENT_ERROR:
     ESP_LOGE(TAG, "MQTT_EVENT_ERROR");
@@ -68,8 +528,20 @@ static esp_mqtt_client_handle_t CLIENT = NULL;
 static esp_mqtt_client_handle_t init_mqtt(void) {
   esp_err_t err;
   esp_mqtt_client_handle_t client;
+  // ESP-IDF v5, which the Linux target needs, nests the client config. In
+  // deep sleep mode, keep the session on the broker between wakeups.
   esp_mqtt_client_config_t mqtt_cfg = {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+      .broker.address.uri = BRKR_URI,
+#if CONFIG_DEEP_SLEEP_MODE
+      .session.disable_clean_session = true,
+#endif
+#else
       .uri = BRKR_URI,
+#if CONFIG_DEEP_SLEEP_MODE
+      .disable_clean_session = true,
+#endif
+#endif
   };
 
   if (CLIENT != NULL)
@@ -78,6 +550,34 @@ static esp_mqtt_client_handle_t init_mqtt(void) {
   // initialize dependencies
   esp_event_loop_create_default(); // may or may not already be initialized
   init_nvs();
+  init_config();
+  init_payload();
+#if CONFIG_TS_LOG
+  if ((err = init_log()) != ESP_OK)
+    ESP_LOGW(TAG, "Readings won't be logged: %s", esp_err_to_name(err));
+#endif
+
+  if (EVENTS == NULL)
+    EVENTS = xEventGroupCreateStatic(&EVENTS_BUF);
+  if (BACKLOG_LOCK == NULL)
+    BACKLOG_LOCK = xSemaphoreCreateMutexStatic(&BACKLOG_LOCK_BUF);
+
+  // only on a cold boot, otherwise keep readings buffered before deep sleep
+  if (BACKLOG.capacity == 0)
+    reading_buf_init(&BACKLOG, BACKLOG_RECORDS, READING_BUF_CAPACITY,
+                     READING_BUF_POLICY);
+
+#if CONFIG_MQTT_DEADBAND
+  init_deadbands();
+#endif
+
+  if (SESSION.established)
+    ESP_LOGD(TAG, "Resuming session, %u previous connects", SESSION.connects);
+
+#ifdef OUTBOX_LIMIT_UNSUPPORTED
+  ESP_LOGW(TAG, "Outbox limit of %d bytes ignored, it needs ESP-IDF v4.4",
+           CONFIG_MQTT_OUTBOX_LIMIT);
+#endif
 
   // initialize mqtt client
   client = esp_mqtt_client_init(&mqtt_cfg);
@@ -88,53 +588,263 @@ static esp_mqtt_client_handle_t init_mqtt(void) {
     return NULL;
   }
 
+#if !CONFIG_DEEP_SLEEP_MODE
+  // paused until the client connects
+  sampler_add_job(BACKLOG_JOB, &drain_job, client, 0);
+#endif
+
   CLIENT = client;
   return CLIENT;
 }
 
-static void get_utc_iso_8601(char *t) {
-  time_t now = time(&now);
-  struct tm *gmt = gmtime(&now);
-  strftime(t, ISO_8601_LEN, "%FT%TZ", gmt);
+static bool is_connected(void) {
+  return EVENTS != NULL && (xEventGroupGetBits(EVENTS) & CONNECTED_BIT);
 }
 
-static void json_float(char *buf, const char *key, float val) {
-  char ts[ISO_8601_LEN] = {0};
-  get_utc_iso_8601(ts);
-  sprintf(buf, "{\"%s\":%f,\"%s\":\"%s\"}", key, val, TIME, ts);
+/// Publish a message with its stream's QoS and retain flag. Held back, like a
+/// failed publish, while the outbox is over its limit, so the caller buffers
+/// or drops the message instead of growing the outbox.
+static int publish(esp_mqtt_client_handle_t client, mqtt_stream_t stream,
+                   const char *topic, const char *payload, int len) {
+  DIAG_TIMER(start);
+  int msg_id;
+
+#ifdef OUTBOX_LIMIT
+  if (esp_mqtt_client_get_outbox_size(client) >= OUTBOX_LIMIT) {
+    portENTER_CRITICAL(&HELD_BACK_MUX);
+    HELD_BACK++;
+    portEXIT_CRITICAL(&HELD_BACK_MUX);
+    ESP_LOGD(TAG, "Outbox full, holding back %s message", topic);
+    return -1;
+  }
+#endif
+
+  msg_id = esp_mqtt_client_publish(client, topic, payload, len,
+                                   STREAM_QOS[stream], STREAM_RETAIN[stream]);
+
+#if CONFIG_DIAG_HISTOGRAMS
+  // the oldest is overwritten if its PUBACK never came
+  if (msg_id > 0) {
+    portENTER_CRITICAL(&INFLIGHT_MUX);
+    INFLIGHT[INFLIGHT_NEXT].msg_id = msg_id;
+    INFLIGHT[INFLIGHT_NEXT].start_us = start;
+    INFLIGHT_NEXT = (INFLIGHT_NEXT + 1) % INFLIGHT_LEN;
+    portEXIT_CRITICAL(&INFLIGHT_MUX);
+  }
+#endif
+  return msg_id;
 }
 
-static void json_uint16(char *buf, const char *key, uint16_t val) {
-  char ts[ISO_8601_LEN] = {0};
-  get_utc_iso_8601(ts);
-  sprintf(buf, "{\"%s\":%u,\"%s\":\"%s\"}", key, val, TIME, ts);
+/// Readings are only published once their capture time can be made UTC
+static bool can_publish(void) { return is_connected() && timebase_synced(); }
+
+static void buffer_reading(sensor_id_t sensor, float value,
+                           int64_t captured_ms) {
+  reading_t reading = {.captured_ms = (uint32_t)captured_ms,
+                       .value = value,
+                       .sensor = sensor};
+
+  if (BACKLOG_LOCK == NULL)
+    return;
+
+  xSemaphoreTake(BACKLOG_LOCK, portMAX_DELAY);
+  reading_buf_push(&BACKLOG, &reading);
+  xSemaphoreGive(BACKLOG_LOCK);
 }
 
-static void json_uint32(char *buf, const char *key, uint32_t val) {
-  char ts[ISO_8601_LEN] = {0};
-  get_utc_iso_8601(ts);
-  sprintf(buf, "{\"%s\":%u,\"%s\":\"%s\"}", key, val, TIME, ts);
+/// Encode and publish a reading, returns its message id, -1 on error. Call
+/// with BACKLOG_LOCK held.
+static int publish_encoded(const reading_t *reading,
+                           esp_mqtt_client_handle_t client) {
+  int len;
+
+  if (!timebase_synced())
+    return -1;
+  if ((len = encode_reading(READING_PAYLOAD, PAYLOAD_BUF_LEN, reading)) < 0)
+    return -1;
+  return publish(client, STREAM_READING, SENSOR_TOPICS[reading->sensor],
+                 READING_PAYLOAD, len);
 }
 
-static void read_temp_task(void *client) {
-  esp_err_t err;
-  float temp;
-  char payload[BUF_LEN] = {0};
+/// Backlog sink, keeps the message id to match the reading's PUBACK
+static esp_err_t send_buffered(const reading_t *reading, void *client) {
+  int msg_id;
 
-  client = (esp_mqtt_client_handle_t *)client;
+  if ((msg_id = publish_encoded(reading, client)) < 0)
+    return ESP_FAIL;
+  BACKLOG_IDS[BACKLOG.sent] = msg_id;
+  return ESP_OK;
+}
 
-  for (;;) {
-    if ((err = read_temp(&temp)) == ESP_OK) {
-      json_float(payload, TEMPERATURE, temp);
-      if (esp_mqtt_client_publish(client, TEMP_TOPIC, payload, 0, 1, 1) < 0)
-        ESP_LOGW(TAG, "Error publishing temperature message");
-    } else {
-      ESP_LOGE(TAG, "Error reading temperature: %s", esp_err_to_name(err));
-    }
-    vTaskDelay(DELAY);
+/// Remove acknowledged readings from the front of the backlog. Readings whose
+/// PUBACK won't come, because they were sent on an earlier connection or the
+/// client gave up on them, are sent again. Call with BACKLOG_LOCK held.
+static void settle_backlog(void) {
+  uint16_t n = 0;
+
+  if (BACKLOG_CONNECTS != SESSION.connects ||
+      (BACKLOG.sent > 0 &&
+       esp_timer_get_time() - BACKLOG_SENT_US > BACKLOG_RESEND_US)) {
+    if (BACKLOG.sent > 0)
+      ESP_LOGW(TAG, "Sending %u unacknowledged readings again", BACKLOG.sent);
+    reading_buf_resend(&BACKLOG);
+    BACKLOG_CONNECTS = SESSION.connects;
+    return;
+  }
+
+  // PUBACKs may come out of order, but readings are removed in order
+  for (uint16_t i = 0; i < BACKLOG.sent; i++)
+    if (BACKLOG_IDS[i] != 0 && take_ack(BACKLOG_IDS[i]))
+      BACKLOG_IDS[i] = 0;
+  while (n < BACKLOG.sent && BACKLOG_IDS[n] == 0)
+    n++;
+  if (n == 0)
+    return;
+
+  reading_buf_ack(&BACKLOG, n);
+  memmove(&BACKLOG_IDS[0], &BACKLOG_IDS[n], BACKLOG.sent * sizeof(int));
+  BACKLOG_SENT_US = esp_timer_get_time();
+}
+
+/// Settle the backlog, and publish the next window of buffered readings.
+/// Returns the number of readings still buffered, sent or not.
+static uint16_t drain_backlog(esp_mqtt_client_handle_t client) {
+  uint16_t left;
+  int n = 0;
+
+  if (BACKLOG_LOCK == NULL)
+    return 0;
+
+  xSemaphoreTake(BACKLOG_LOCK, portMAX_DELAY);
+  settle_backlog();
+  if (BACKLOG.count > BACKLOG.sent && can_publish()) {
+    if (BACKLOG.sent == 0)
+      BACKLOG_SENT_US = esp_timer_get_time();
+    n = reading_buf_send(&BACKLOG, &send_buffered, client, BACKLOG_WINDOW);
+  }
+  if (n > 0)
+    ESP_LOGI(TAG, "Published %d buffered readings, %u left, %u dropped", n,
+             BACKLOG.count - BACKLOG.sent, BACKLOG.dropped);
+  left = BACKLOG.count;
+  xSemaphoreGive(BACKLOG_LOCK);
+
+  return left;
+}
+
+/// Sampler job, sends the backlog while connected, pauses itself once it's
+/// been acknowledged
+static void drain_job(void *client) {
+  if (drain_backlog(client) > 0 && is_connected())
+    return;
+
+  // a job can't retime the sampler
+  xTimerPendFunctionCall(&set_backlog_period, NULL, 0, 0);
+}
+
+/// Publish a reading, or buffer it until the broker is reachable again
+static void publish_reading(esp_mqtt_client_handle_t client,
+                            sensor_id_t sensor, float value) {
+  int64_t captured_ms = timebase_now_ms();
+  reading_t reading = {.captured_ms = (uint32_t)captured_ms,
+                       .value = value,
+                       .sensor = sensor};
+  int msg_id;
+
+  // connected, so init_mqtt has created the lock
+  if (can_publish()) {
+    // readings buffered before the clock synced go out first
+    drain_backlog(client);
+    xSemaphoreTake(BACKLOG_LOCK, portMAX_DELAY);
+    msg_id = publish_encoded(&reading, client);
+    xSemaphoreGive(BACKLOG_LOCK);
+    if (msg_id >= 0)
+      return;
   }
 
-  vTaskDelete(NULL);
+  if (timebase_synced())
+    ESP_LOGW(TAG, "Error publishing %s message, buffering",
+             SENSOR_KEYS[sensor]);
+  else
+    ESP_LOGD(TAG, "Clock not synced, buffering %s message",
+             SENSOR_KEYS[sensor]);
+  buffer_reading(sensor, value, captured_ms);
+}
+
+#if CONFIG_MQTT_PUBLISH_SUMMARY
+/// Publish a window summary, or buffer its mean until the broker is reachable
+static void publish_summary(esp_mqtt_client_handle_t client,
+                            sensor_id_t sensor, const win_stats_t *stats) {
+  win_summary_t summary;
+  int64_t now_ms = timebase_now_ms();
+  int len;
+
+  if (!win_stats_summary(stats, &summary))
+    return;
+
+  len = encode_summary(SUMMARY_PAYLOAD, PAYLOAD_BUF_LEN, sensor, &summary,
+                       now_ms);
+  if (len >= 0 && can_publish() &&
+      publish(client, STREAM_READING, SENSOR_TOPICS[sensor], SUMMARY_PAYLOAD,
+              len) >= 0)
+    return;
+
+  ESP_LOGW(TAG, "Error publishing %s summary, buffering its mean",
+           SENSOR_KEYS[sensor]);
+  buffer_reading(sensor, summary.mean, now_ms);
+}
+#endif
+
+/// Append a reading to the flash log, once its capture time can be made UTC
+static void log_reading(sensor_id_t sensor, float value, int64_t captured_ms) {
+#if CONFIG_TS_LOG
+  if (timebase_synced())
+    ts_log_append(sensor, value, timebase_to_utc_ms(captured_ms));
+#endif
+}
+
+/// Publish a sampled reading, or add it to the sensor's summary window. Every
+/// sample is logged.
+static void report_reading(esp_mqtt_client_handle_t client,
+                           sensor_id_t sensor, float value) {
+  log_reading(sensor, value, timebase_now_ms());
+
+#if CONFIG_MQTT_PUBLISH_SUMMARY
+  sensor_window_t *win = &WINDOWS[sensor];
+  uint32_t now_ms = (uint32_t)timebase_now_ms();
+  mqtt_config_t cfg;
+
+  // the window length can change under us, from a config message
+  get_config(&cfg);
+  if (win->stats.count == 0)
+    win->start_ms = now_ms;
+  win_stats_add(&win->stats, value);
+
+  // close the window if the next sample would fall outside it
+  if (now_ms - win->start_ms + SUMMARY_SAMPLE_MS >= cfg.interval_ms[sensor]) {
+    publish_summary(client, sensor, &win->stats);
+    win_stats_reset(&win->stats);
+  }
+#elif CONFIG_MQTT_DEADBAND
+  if (deadband_update(&DEADBANDS[sensor], value,
+                      (uint32_t)(timebase_now_ms() / 1000)))
+    publish_reading(client, sensor, value);
+  else
+    ESP_LOGD(TAG, "%s within deadband, %u suppressed", SENSOR_KEYS[sensor],
+             DEADBANDS[sensor].stats.suppressed);
+#else
+  publish_reading(client, sensor, value);
+#endif
+}
+
+static void sample_temp(void *client) {
+  esp_err_t err;
+  float temp;
+
+  if ((err = read_temp(&temp)) == ESP_OK) {
+    report_reading(client, SENSOR_TEMPERATURE, temp);
+  } else {
+    ESP_LOGE(TAG, "Error reading temperature: %s", esp_err_to_name(err));
+  }
 }
 
 static bool TEMP_INIT = false;
@@ -146,30 +856,23 @@ void mqtt_publish_temp(void) {
     return;
 
   client = init_mqtt();
-  xTaskCreate(&read_temp_task, "read_temp_task", 2048, client, 6, NULL);
+  if (sampler_add_job(TEMPERATURE, &sample_temp, client,
+                      sensor_period(SENSOR_TEMPERATURE)) != ESP_OK)
+    return;
+  sampler_start();
 
   TEMP_INIT = true;
 }
 
-static void read_humd_task(void *client) {
+static void sample_humd(void *client) {
   esp_err_t err;
   float humd;
-  char payload[BUF_LEN] = {0};
-
-  client = (esp_mqtt_client_handle_t *)client;
 
-  for (;;) {
-    if ((err = read_rel_humd(&humd)) == ESP_OK) {
-      json_float(payload, HUMIDITY, humd);
-      if (esp_mqtt_client_publish(client, HUMD_TOPIC, payload, 0, 1, 1) < 0)
-        ESP_LOGW(TAG, "Error publishing humidity message");
-    } else {
-      ESP_LOGE(TAG, "Error reading humidity: %s", esp_err_to_name(err));
-    }
-    vTaskDelay(DELAY);
+  if ((err = read_rel_humd(&humd)) == ESP_OK) {
+    report_reading(client, SENSOR_HUMIDITY, humd);
+  } else {
+    ESP_LOGE(TAG, "Error reading humidity: %s", esp_err_to_name(err));
   }
-
-  vTaskDelete(NULL);
 }
 
 static bool HUMD_INIT = false;
@@ -181,30 +884,23 @@ void mqtt_publish_humd(void) {
     return;
 
   client = init_mqtt();
-  xTaskCreate(&read_humd_task, "read_humd_task", 2048, client, 6, NULL);
+  if (sampler_add_job(HUMIDITY, &sample_humd, client,
+                      sensor_period(SENSOR_HUMIDITY)) != ESP_OK)
+    return;
+  sampler_start();
 
   HUMD_INIT = true;
 }
 
-static void read_lux_task(void *client) {
+static void sample_lux(void *client) {
   esp_err_t err;
   float lux;
-  char payload[BUF_LEN] = {0};
 
-  client = (esp_mqtt_client_handle_t *)client;
-
-  for (;;) {
-    if ((err = read_lux(&lux)) == ESP_OK) {
-      json_float(payload, LUX, lux);
-      if (esp_mqtt_client_publish(client, LUX_TOPIC, payload, 0, 1, 1) < 0)
-        ESP_LOGW(TAG, "Error publishing lux message");
-    } else {
-      ESP_LOGE(TAG, "Error reading lux: %s", esp_err_to_name(err));
-    }
-    vTaskDelay(DELAY);
+  if ((err = read_lux(&lux)) == ESP_OK) {
+    report_reading(client, SENSOR_LUX, lux);
+  } else {
+    ESP_LOGE(TAG, "Error reading lux: %s", esp_err_to_name(err));
   }
-
-  vTaskDelete(NULL);
 }
 
 static bool LUX_INIT = false;
@@ -216,31 +912,23 @@ void mqtt_publish_lux(void) {
     return;
 
   client = init_mqtt();
-  xTaskCreate(&read_lux_task, "read_lux_task", 2048, client, 6, NULL);
+  if (sampler_add_job(LUX, &sample_lux, client, sensor_period(SENSOR_LUX)) !=
+      ESP_OK)
+    return;
+  sampler_start();
 
   LUX_INIT = true;
 }
 
-static void read_soil_moisture_task(void *client) {
+static void sample_soil_moisture(void *client) {
   esp_err_t err;
   uint16_t moist;
-  char payload[BUF_LEN] = {0};
-
-  client = (esp_mqtt_client_handle_t *)client;
-
-  for (;;) {
-    if ((err = read_soil_moisture(&moist)) == ESP_OK) {
-      json_uint16(payload, SOIL_MOISTURE, moist);
-      if (esp_mqtt_client_publish(client, SOIL_MOISTURE_TOPIC, payload, 0, 1,
-                                  1) < 0)
-        ESP_LOGW(TAG, "Error publishing soil moisture message");
-    } else {
-      ESP_LOGE(TAG, "Error reading soil moisture: %s", esp_err_to_name(err));
-    }
-    vTaskDelay(DELAY);
-  }
 
-  vTaskDelete(NULL);
+  if ((err = read_soil_moisture(&moist)) == ESP_OK) {
+    report_reading(client, SENSOR_SOIL_MOISTURE, moist);
+  } else {
+    ESP_LOGE(TAG, "Error reading soil moisture: %s", esp_err_to_name(err));
+  }
 }
 
 static bool MOIST_INIT = false;
@@ -252,32 +940,23 @@ void mqtt_publish_moist(void) {
     return;
 
   client = init_mqtt();
-  xTaskCreate(&read_soil_moisture_task, "read_soil_moisture_task", 2048, client,
-              6, NULL);
+  if (sampler_add_job(SOIL_MOISTURE, &sample_soil_moisture, client,
+                      sensor_period(SENSOR_SOIL_MOISTURE)) != ESP_OK)
+    return;
+  sampler_start();
 
   MOIST_INIT = true;
 }
 
-static void read_battery_voltage_task(void *client) {
+static void sample_battery_voltage(void *client) {
   esp_err_t err;
   uint32_t voltage;
-  char payload[BUF_LEN] = {0};
-
-  client = (esp_mqtt_client_handle_t *)client;
 
-  for (;;) {
-    if ((err = read_batt(&voltage)) == ESP_OK) {
-      json_uint32(payload, BATTERY_VOLTAGE, voltage);
-      if (esp_mqtt_client_publish(client, BATTERY_VOLTAGE_TOPIC, payload, 0, 1,
-                                  1) < 0)
-        ESP_LOGW(TAG, "Error publishing battery voltage message");
-    } else {
-      ESP_LOGE(TAG, "Error reading battery voltage: %s", esp_err_to_name(err));
-    }
-    vTaskDelay(DELAY);
+  if ((err = read_batt(&voltage)) == ESP_OK) {
+    report_reading(client, SENSOR_BATTERY_VOLTAGE, voltage);
+  } else {
+    ESP_LOGE(TAG, "Error reading battery voltage: %s", esp_err_to_name(err));
   }
-
-  vTaskDelete(NULL);
 }
 
 static bool BATTERY_INIT = false;
@@ -289,15 +968,576 @@ void mqtt_publish_batt(void) {
     return;
 
   client = init_mqtt();
-  xTaskCreate(&read_battery_voltage_task, "read_battery_voltage_task", 2048,
-              client, 6, NULL);
+  if (sampler_add_job(BATTERY_VOLTAGE, &sample_battery_voltage, client,
+                      sensor_period(SENSOR_BATTERY_VOLTAGE)) != ESP_OK)
+    return;
+  sampler_start();
+
   BATTERY_INIT = true;
 }
 
+/// Snapshot sensor devices, conversions on different devices overlap
+enum { DEV_SHT_20, DEV_APDS_3901, DEV_SEESAW_SOIL };
+
+static esp_err_t start_temp(void) {
+  return sht_20_start_measurement(SHT_20_TEMP);
+}
+
+static esp_err_t start_humd(void) {
+  return sht_20_start_measurement(SHT_20_HUMD);
+}
+
+static esp_err_t collect_moist(float *val) {
+  uint16_t moist;
+  esp_err_t err;
+
+  if ((err = seesaw_soil_collect(&moist)) == ESP_OK)
+    *val = moist;
+  return err;
+}
+
+/// Sweep steps, in `sensor_id_t` order
+static sweep_t SWEEP;
+static bool SWEEP_INIT = false;
+
+static void init_sweep(void) {
+  if (SWEEP_INIT)
+    return;
+
+  sweep_init(&SWEEP);
+  sweep_add(&SWEEP, "temperature", DEV_SHT_20, &start_temp,
+            &sht_20_poll_ready, &sht_20_collect, sht_20_retry());
+  sweep_add(&SWEEP, "humidity", DEV_SHT_20, &start_humd, &sht_20_poll_ready,
+            &sht_20_collect, sht_20_retry());
+  sweep_add(&SWEEP, "lux", DEV_APDS_3901, &apds_3901_start_measurement,
+            &apds_3901_poll_ready, &apds_3901_collect, apds_3901_retry());
+  sweep_add(&SWEEP, "soil moisture", DEV_SEESAW_SOIL,
+            &seesaw_soil_start_measurement, &seesaw_soil_poll_ready,
+            &collect_moist, seesaw_soil_retry());
+  SWEEP_INIT = true;
+}
+
+/**
+ * @brief Read every sensor once, stamping all readings with the same time.
+ * Conversions on different sensors run concurrently, so this takes about as
+ * long as the slowest sensor. Valid readings are logged.
+ * @param snap return-arg for readings, check `valid` for which succeeded
+ */
+void mqtt_read_snapshot(snapshot_t *snap) {
+  mqtt_config_t cfg;
+  sweep_step_t *step;
+  esp_err_t err;
+  bool logged;
+
+  snap->captured_ms = timebase_now_ms();
+  snap->valid = 0;
+  snap->awake_ms = 0;
+
+  init_sweep();
+  logged = init_log() == ESP_OK;
+  get_config(&cfg);
+  for (uint8_t i = 0; i < SWEEP.n_steps; i++)
+    SWEEP.steps[i].enabled = cfg.enabled & SENSOR_BIT(i);
+
+  sweep_run(&SWEEP, SNAPSHOT_SWEEP_TIMEOUT_MS);
+  for (uint8_t i = 0; i < SWEEP.n_steps; i++) {
+    step = &SWEEP.steps[i];
+    if (step->err == ESP_OK)
+      snap->valid |= SENSOR_BIT(i);
+    else if (step->err != SWEEP_ERR_DISABLED)
+      ESP_LOGE(TAG, "Error reading %s: %s", step->name,
+               esp_err_to_name(step->err));
+  }
+
+  snap->temp = SWEEP.steps[SENSOR_TEMPERATURE].value;
+  snap->humd = SWEEP.steps[SENSOR_HUMIDITY].value;
+  snap->lux = SWEEP.steps[SENSOR_LUX].value;
+  snap->moist = (uint16_t)SWEEP.steps[SENSOR_SOIL_MOISTURE].value;
+
+  if (cfg.enabled & SENSOR_BIT(SENSOR_BATTERY_VOLTAGE)) {
+    if ((err = read_batt(&snap->batt)) == ESP_OK)
+      snap->valid |= SENSOR_BIT(SENSOR_BATTERY_VOLTAGE);
+    else
+      ESP_LOGE(TAG, "Error reading battery voltage: %s", esp_err_to_name(err));
+  }
+
+  for (sensor_id_t s = 0; s < SENSOR_MAX; s++)
+    if (logged && (snap->valid & SENSOR_BIT(s)))
+      log_reading(s, snapshot_value(snap, s), snap->captured_ms);
+}
+
+/**
+ * @brief Buffer every valid reading in a snapshot, to be published once the
+ * broker is reachable again.
+ * @param snap readings that couldn't be published
+ */
+void mqtt_buffer_snapshot(const snapshot_t *snap) {
+  if (snap->valid & SENSOR_BIT(SENSOR_TEMPERATURE))
+    buffer_reading(SENSOR_TEMPERATURE, snap->temp, snap->captured_ms);
+  if (snap->valid & SENSOR_BIT(SENSOR_HUMIDITY))
+    buffer_reading(SENSOR_HUMIDITY, snap->humd, snap->captured_ms);
+  if (snap->valid & SENSOR_BIT(SENSOR_LUX))
+    buffer_reading(SENSOR_LUX, snap->lux, snap->captured_ms);
+  if (snap->valid & SENSOR_BIT(SENSOR_SOIL_MOISTURE))
+    buffer_reading(SENSOR_SOIL_MOISTURE, snap->moist, snap->captured_ms);
+  if (snap->valid & SENSOR_BIT(SENSOR_BATTERY_VOLTAGE))
+    buffer_reading(SENSOR_BATTERY_VOLTAGE, snap->batt, snap->captured_ms);
+}
+
+/**
+ * @brief Check a snapshot against the sensors' deadbands. A snapshot is due if
+ * any reading left its deadband, or any heartbeat expired, and then every
+ * reading in it is recorded as reported.
+ * @param snap sampled readings
+ * @return true if the snapshot should be published, always without deadbands
+ */
+bool mqtt_snapshot_due(const snapshot_t *snap) {
+#if CONFIG_MQTT_DEADBAND
+  uint32_t now_s = (uint32_t)(snap->captured_ms / 1000);
+  float values[SENSOR_MAX];
+  bool due;
+
+  // may be called before the client is started, to decide whether to start it
+  init_deadbands();
+  for (int i = 0; i < SENSOR_MAX; i++)
+    values[i] = snapshot_value(snap, i);
+
+  due = deadband_update_all(DEADBANDS, values, snap->valid, SENSOR_MAX, now_s);
+  if (!due)
+    ESP_LOGD(TAG, "Snapshot within deadbands, not published");
+  return due;
+#else
+  return true;
+#endif
+}
+
+/**
+ * @brief Get report-by-exception counters of one sensor.
+ * @param sensor sensor stream
+ * @param stats return-arg for the counters, zeroed without deadbands
+ * @return error, `ESP_ERR_INVALID_ARG` for an unknown sensor
+ */
+esp_err_t mqtt_get_deadband_stats(sensor_id_t sensor,
+                                  deadband_stats_t *stats) {
+  if (sensor >= SENSOR_MAX)
+    return ESP_ERR_INVALID_ARG;
+
+#if CONFIG_MQTT_DEADBAND
+  *stats = DEADBANDS[sensor].stats;
+#else
+  memset(stats, 0, sizeof(deadband_stats_t));
+#endif
+  return ESP_OK;
+}
+
+static void sample_snapshot(void *client) {
+  snapshot_t snap;
+  int len;
+
+  mqtt_read_snapshot(&snap);
+  if (snap.valid == 0 || !mqtt_snapshot_due(&snap))
+    return;
+
+  len = encode_snapshot(SNAPSHOT_PAYLOAD, SNAPSHOT_BUF_LEN, &snap);
+  if (can_publish())
+    drain_backlog(client);
+  if (len >= 0 && can_publish() &&
+      publish(client, STREAM_SNAPSHOT, SNAPSHOT_TOPIC, SNAPSHOT_PAYLOAD, len) >=
+          0)
+    return;
+
+  ESP_LOGW(TAG, "Error publishing snapshot message, buffering");
+  mqtt_buffer_snapshot(&snap);
+}
+
+static bool SNAPSHOT_INIT = false;
+
+/**
+ * @brief Read every sensor once per interval and publish all readings as a
+ * single message on the snapshot topic.
+ */
+void mqtt_publish_snapshot(void) {
+  esp_mqtt_client_handle_t client;
+
+  if (SNAPSHOT_INIT)
+    return;
+
+  client = init_mqtt();
+  if (sampler_add_job(SNAPSHOT, &sample_snapshot, client, snapshot_period()) !=
+      ESP_OK)
+    return;
+  sampler_start();
+
+  SNAPSHOT_INIT = true;
+}
+
+/**
+ * @brief Wait for the client to connect to the broker, starting it if
+ * necessary.
+ * @param timeout_ms maximum time to wait
+ * @return error, `ESP_ERR_TIMEOUT` if not connected in time
+ */
+esp_err_t mqtt_wait_connected(uint32_t timeout_ms) {
+  EventBits_t bits;
+
+  if (init_mqtt() == NULL)
+    return ESP_FAIL;
+
+  bits = xEventGroupWaitBits(EVENTS, CONNECTED_BIT, pdFALSE, pdTRUE,
+                             pdMS_TO_TICKS(timeout_ms));
+  return (bits & CONNECTED_BIT) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+/**
+ * @brief Publish a snapshot and wait for the broker to acknowledge it.
+ * Buffered readings are published first, for up to half the timeout.
+ * @param snap readings to publish
+ * @param timeout_ms maximum time to wait for the acknowledgement
+ * @return error, `ESP_ERR_TIMEOUT` if not acknowledged in time
+ */
+esp_err_t mqtt_publish_snapshot_sync(const snapshot_t *snap,
+                                     uint32_t timeout_ms) {
+  esp_mqtt_client_handle_t client;
+  char payload[SNAPSHOT_BUF_LEN];
+  TickType_t start = xTaskGetTickCount(), timeout = pdMS_TO_TICKS(timeout_ms);
+  TickType_t elapsed;
+  int msg_id, len;
+
+  if ((client = init_mqtt()) == NULL)
+    return ESP_FAIL;
+
+  // the snapshot can't be stamped in UTC until SNTP has synced
+  if (timebase_wait_synced(timeout_ms) != ESP_OK)
+    return ESP_ERR_TIMEOUT;
+
+  if ((len = encode_snapshot(payload, SNAPSHOT_BUF_LEN, snap)) < 0)
+    return ESP_ERR_INVALID_SIZE;
+
+  // a window at a time, each once the previous one is acknowledged
+  xEventGroupClearBits(EVENTS, PUBLISHED_BIT);
+  while (drain_backlog(client) > 0 &&
+         (elapsed = xTaskGetTickCount() - start) < timeout / 2)
+    xEventGroupWaitBits(EVENTS, PUBLISHED_BIT, pdTRUE, pdTRUE,
+                        timeout / 2 - elapsed);
+
+  xEventGroupClearBits(EVENTS, PUBLISHED_BIT);
+  if ((msg_id = publish(client, STREAM_SNAPSHOT, SNAPSHOT_TOPIC, payload,
+                        len)) < 0) {
+    ESP_LOGW(TAG, "Error publishing snapshot message");
+    return ESP_FAIL;
+  }
+
+  // other messages may be acknowledged first, wait for ours, nothing is
+  // acknowledged at QoS 0
+  while (STREAM_QOS[STREAM_SNAPSHOT] > 0 && !take_ack(msg_id)) {
+    elapsed = xTaskGetTickCount() - start;
+    if (elapsed >= timeout)
+      return ESP_ERR_TIMEOUT;
+    xEventGroupWaitBits(EVENTS, PUBLISHED_BIT, pdTRUE, pdTRUE,
+                        timeout - elapsed);
+  }
+
+  // remove the buffered readings acknowledged meanwhile, before deep sleep
+  xSemaphoreTake(BACKLOG_LOCK, portMAX_DELAY);
+  settle_backlog();
+  xSemaphoreGive(BACKLOG_LOCK);
+  return ESP_OK;
+}
+
+/**
+ * @brief Select the payload format for every message published from now on.
+ * @param format JSON or CBOR
+ */
+void mqtt_set_payload_format(mqtt_payload_format_t format) {
+  set_payload_format(format);
+}
+
+/**
+ * @brief Get the sampling configuration in use.
+ * @param cfg return-arg for the configuration
+ */
+void mqtt_get_config(mqtt_config_t *cfg) { get_config(cfg); }
+
+/**
+ * @brief Apply a sampling configuration to the running jobs, and store it in
+ * NVS to be loaded on the next boot.
+ * @param cfg configuration, `version` must be `MQTT_CONFIG_VERSION`
+ * @return error, `ESP_ERR_INVALID_ARG` if `cfg` is out of range
+ */
+esp_err_t mqtt_set_config(const mqtt_config_t *cfg) {
+  mqtt_config_t cur;
+  esp_err_t err;
+
+  if (!config_valid(cfg))
+    return ESP_ERR_INVALID_ARG;
+
+  // a retained config is delivered on every connect, don't wear the flash
+  get_config(&cur);
+  if (config_equal(&cur, cfg))
+    return ESP_OK;
+
+  portENTER_CRITICAL(&CFG_MUX);
+  CFG = *cfg;
+  portEXIT_CRITICAL(&CFG_MUX);
+
+  if ((err = write_nvs_blob(CFG_NVS_NAMESPACE, CFG_NVS_KEY, cfg,
+                            sizeof(mqtt_config_t))) != ESP_OK)
+    ESP_LOGW(TAG, "Error storing config: %s", esp_err_to_name(err));
+
+  // retiming takes the sampler lock, which a job may hold while it waits on
+  // the MQTT client, so it's deferred to the timer task
+  if (xTimerPendFunctionCall(&apply_schedule, NULL, 0, 0) != pdPASS) {
+    ESP_LOGE(TAG, "Error applying config");
+    return ESP_FAIL;
+  }
+
+  ESP_LOGI(TAG, "Applied config, %s mode, sensors 0x%02x",
+           cfg->snapshot ? MODE_SNAPSHOT : MODE_SENSOR, cfg->enabled);
+  return ESP_OK;
+}
+
+/// Apply a document received on the config topic
+static void handle_config(esp_mqtt_event_handle_t event) {
+#if CONFIG_MQTT_REMOTE_CONFIG
+  mqtt_config_t cfg;
+  esp_err_t err;
+
+  if ((size_t)event->topic_len != strlen(CFG_TOPIC) ||
+      strncmp(event->topic, CFG_TOPIC, event->topic_len) != 0)
+    return;
+
+  // documents are small, a fragmented message is too long anyway
+  if (event->data_len != event->total_data_len ||
+      event->data_len > MQTT_CONFIG_DOC_LEN) {
+    ESP_LOGW(TAG, "Ignoring config of %d bytes", event->total_data_len);
+    return;
+  }
+
+  get_config(&cfg);
+  if ((err = decode_config(event->data, event->data_len, &cfg)) != ESP_OK ||
+      (err = mqtt_set_config(&cfg)) != ESP_OK)
+    ESP_LOGW(TAG, "Rejected config: %s", esp_err_to_name(err));
+#endif
+}
+
+#if CONFIG_TS_LOG
+/// Publish the records collected so far, and start the next chunk
+static bool send_log_chunk(log_query_t *q, uint32_t next_s) {
+  int len = encode_log_chunk(LOG_PAYLOAD, LOG_BUF_LEN, q->sensor, q->records,
+                             q->n, next_s);
+
+  q->n = 0;
+  q->chunks++;
+  return len >= 0 &&
+         publish(q->client, STREAM_LOG, LOG_REPLY_TOPIC, LOG_PAYLOAD, len) >= 0;
+}
+
+/// End a query the log couldn't answer with the error, rather than a last
+/// chunk that looks complete. The records collected since the previous chunk
+/// aren't sent, they start at `next_s`.
+static bool send_log_error(log_query_t *q, uint32_t next_s, esp_err_t err) {
+  int len = encode_log_error(LOG_PAYLOAD, LOG_BUF_LEN, q->sensor, next_s, err);
+
+  return len >= 0 &&
+         publish(q->client, STREAM_LOG, LOG_REPLY_TOPIC, LOG_PAYLOAD, len) >= 0;
+}
+
+/// Collect a record, stopping the query at the first one past a full chunk
+static bool collect_log_record(const ts_log_record_t *rec, int64_t utc_ms,
+                               void *arg) {
+  log_query_t *q = arg;
+
+  if (q->n == LOG_CHUNK_RECORDS) {
+    q->resume_ms = utc_ms;
+    return false;
+  }
+
+  q->records[q->n++] = *rec;
+  return true;
+}
+#endif
+
+/// Answer a query received on the log topic, by streaming matching records on
+/// the reply topic
+static void handle_log_query(esp_mqtt_event_handle_t event) {
+#if CONFIG_TS_LOG
+  log_query_t *q = &LOG_QUERY;
+  uint32_t from_s, to_s, next_s;
+  sensor_id_t sensor;
+  int64_t from_ms;
+  esp_err_t err;
+  bool sent;
+
+  if ((size_t)event->topic_len != strlen(LOG_TOPIC) ||
+      strncmp(event->topic, LOG_TOPIC, event->topic_len) != 0)
+    return;
+
+  if (event->data_len != event->total_data_len ||
+      event->data_len > MQTT_CONFIG_DOC_LEN ||
+      decode_log_query(event->data, event->data_len, &sensor, &from_s,
+                       &to_s) != ESP_OK) {
+    ESP_LOGW(TAG, "Rejected log query");
+    return;
+  }
+
+  memset(q, 0, sizeof(log_query_t));
+  q->client = event->client;
+  q->sensor = sensor;
+  from_ms = (int64_t)from_s * 1000;
+
+  // the log is locked while it's queried, and the sampler appends to it, so
+  // each chunk is collected by a query of its own and published after it.
+  // Chunks say where the next one resumes, records from that second may be
+  // sent again.
+  do {
+    q->resume_ms = -1;
+    err = ts_log_query(SENSOR_BIT(sensor), from_ms, (int64_t)to_s * 1000,
+                       &collect_log_record, q);
+    if (err != ESP_OK) {
+      sent = send_log_error(q, from_ms / 1000, err);
+      break;
+    }
+
+    next_s = q->resume_ms < 0 ? 0 : q->resume_ms / 1000;
+    sent = send_log_chunk(q, next_s);
+    from_ms = q->resume_ms;
+  } while (sent && from_ms >= 0 && q->chunks < LOG_MAX_CHUNKS);
+
+  if (err != ESP_OK || !sent)
+    ESP_LOGW(TAG, "Error answering log query: %s",
+             err != ESP_OK ? esp_err_to_name(err) : "publish failed");
+  else
+    ESP_LOGI(TAG, "Sent %u %s log chunks", q->chunks, SENSOR_KEYS[sensor]);
+#endif
+}
+
+#if CONFIG_DIAG
+/// Count retries since the last diagnostics, from the drivers' counters
+static void take_retries(void) {
+#if CONFIG_DIAG_HISTOGRAMS
+  retry_t *retries[DIAG_DRIVERS] = {sht_20_retry(), apds_3901_retry(),
+                                    seesaw_soil_retry()};
+  retry_stats_t stats;
+
+  for (uint8_t i = 0; i < DIAG_DRIVERS; i++) {
+    retry_get_stats(retries[i], &stats);
+    diag_count_retries(i, stats.retries - DIAG_RETRIES[i]);
+    DIAG_RETRIES[i] = stats.retries;
+  }
+#endif
+}
+
+/// Publish and reset diagnostics, they keep adding up while disconnected
+static esp_err_t publish_diag(esp_mqtt_client_handle_t client) {
+  int len;
+
+  if (!can_publish())
+    return ESP_ERR_INVALID_STATE;
+
+  DIAG_LAST_MS = timebase_now_ms();
+  take_retries();
+  diag_take(&DIAG);
+  if ((len = encode_diag(DIAG_PAYLOAD, DIAG_BUF_LEN, &DIAG, DIAG_LAST_MS)) < 0)
+    return ESP_ERR_INVALID_SIZE;
+  if (publish(client, STREAM_DIAG, DIAG_TOPIC, DIAG_PAYLOAD, len) < 0) {
+    ESP_LOGW(TAG, "Error publishing diagnostics, dropped");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+static void sample_diag(void *client) { publish_diag(client); }
+
+static bool DIAG_INIT = false;
+#endif
+
+/**
+ * @brief Publish diagnostics once per diagnostics interval. Does nothing with
+ * diagnostics disabled.
+ */
+void mqtt_publish_diag(void) {
+#if CONFIG_DIAG
+  esp_mqtt_client_handle_t client;
+
+  if (DIAG_INIT)
+    return;
+
+  client = init_mqtt();
+  if (sampler_add_job(DIAG_JOB, &sample_diag, client, DIAG_INTERVAL) !=
+      ESP_OK)
+    return;
+  sampler_start();
+
+  DIAG_INIT = true;
+#endif
+}
+
+/**
+ * @brief Publish diagnostics if the diagnostics interval has passed since the
+ * last ones, for deep sleep mode, where nothing is scheduled.
+ * @return error, `ESP_OK` if not due yet, `ESP_ERR_NOT_SUPPORTED` with
+ * diagnostics disabled
+ */
+esp_err_t mqtt_publish_diag_due(void) {
+#if CONFIG_DIAG
+  esp_mqtt_client_handle_t client;
+
+  if (timebase_now_ms() - DIAG_LAST_MS < DIAG_INTERVAL)
+    return ESP_OK;
+  if ((client = init_mqtt()) == NULL)
+    return ESP_FAIL;
+  return publish_diag(client);
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * @brief Schedule every publishing job. Jobs the config's publish mode
+ * doesn't use are paused, and resumed if the mode changes.
+ */
 void mqtt_publish_all(void) {
   mqtt_publish_temp();
   mqtt_publish_humd();
   mqtt_publish_lux();
   mqtt_publish_moist();
   mqtt_publish_batt();
+  mqtt_publish_snapshot();
+  mqtt_publish_diag();
+}
+
+/**
+ * @brief Get the time from boot to the first publish the broker acknowledged.
+ * @return microseconds since boot, 0 if nothing was acknowledged yet
+ */
+int64_t mqtt_first_publish_us(void) { return FIRST_PUBLISH_US; }
+
+/**
+ * @brief Get the number of publishes the broker acknowledged since boot.
+ * @return acknowledged publishes
+ */
+uint32_t mqtt_acked_count(void) { return ACKED; }
+
+/**
+ * @brief Get outbox and reading buffer counters.
+ * @param stats return-arg for the counters
+ */
+void mqtt_get_outbox_stats(mqtt_outbox_stats_t *stats) {
+  memset(stats, 0, sizeof(mqtt_outbox_stats_t));
+#ifdef OUTBOX_LIMIT
+  if (CLIENT != NULL)
+    stats->outbox_bytes = esp_mqtt_client_get_outbox_size(CLIENT);
+#endif
+  portENTER_CRITICAL(&HELD_BACK_MUX);
+  stats->held_back = HELD_BACK;
+  portEXIT_CRITICAL(&HELD_BACK_MUX);
+
+  if (BACKLOG_LOCK == NULL)
+    return;
+
+  xSemaphoreTake(BACKLOG_LOCK, portMAX_DELAY);
+  stats->buffered = BACKLOG.count;
+  stats->dropped = BACKLOG.dropped;
+  stats->coalesced = BACKLOG.coalesced;
+  xSemaphoreGive(BACKLOG_LOCK);
 }
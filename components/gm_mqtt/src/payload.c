@@ -0,0 +1,624 @@
+#include "payload.h"
+#include "cbor_writer.h"
+#include "diag.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "json_writer.h"
+#include "readings.h"
+#include "timebase.h"
+#include <time.h>
+
+/// CBOR map keys, sensor readings are keyed by their `sensor_id_t`
+#define CBOR_KEY_TIMESTAMP 0x10
+#define CBOR_KEY_AWAKE_MS 0x11
+#define CBOR_KEY_NEXT 0x12
+#define CBOR_KEY_LOG_ERROR 0x13
+
+/// CBOR summary map keys
+enum {
+  CBOR_KEY_COUNT,
+  CBOR_KEY_MIN,
+  CBOR_KEY_MAX,
+  CBOR_KEY_MEAN,
+  CBOR_KEY_STDDEV,
+  CBOR_KEY_LAST
+};
+
+/// CBOR diagnostics map keys, I2C devices are keyed by their address
+#define CBOR_KEY_STAGE 0x20
+#define CBOR_KEY_CONV 0x30
+#define CBOR_KEY_RETRIES 0x38
+#define CBOR_KEY_ERROR 0x40
+#define CBOR_KEY_STACK 0x50
+#define CBOR_KEY_MIN_FREE_HEAP 0x58
+#define CBOR_KEY_LARGEST_FREE_BLOCK 0x59
+#define CBOR_KEY_I2C 0x80
+
+#if CONFIG_MQTT_PAYLOAD_FORMAT_CBOR
+#define DEFAULT_FORMAT MQTT_PAYLOAD_CBOR
+#else
+#define DEFAULT_FORMAT MQTT_PAYLOAD_JSON
+#endif
+
+const char *const SENSOR_KEYS[SENSOR_MAX] = {
+    TEMPERATURE, HUMIDITY, LUX, SOIL_MOISTURE, BATTERY_VOLTAGE};
+
+/// Sensor resolution, half-precision floats are used when at least this good
+static const float CBOR_MAX_ERR[SENSOR_MAX] = {0.01f, 0.04f, 0.5f, 0, 0};
+
+/// Decimals written in JSON, matching sensor resolution
+static const uint8_t JSON_DECIMALS[SENSOR_MAX] = {2, 2, 2, 0, 0};
+
+static mqtt_payload_format_t FORMAT = DEFAULT_FORMAT;
+
+/// Payloads are encoded from both the sampler and MQTT tasks
+static json_iso_8601_cache_t TS_CACHE = JSON_ISO_8601_CACHE_INIT;
+static SemaphoreHandle_t TS_CACHE_LOCK = NULL;
+static StaticSemaphore_t TS_CACHE_LOCK_BUF;
+
+/**
+ * @brief Create the encoder's lock. Must be called before the first payload
+ * is encoded, and before more than one task encodes.
+ */
+void init_payload(void) {
+  if (TS_CACHE_LOCK == NULL)
+    TS_CACHE_LOCK = xSemaphoreCreateMutexStatic(&TS_CACHE_LOCK_BUF);
+}
+
+void set_payload_format(mqtt_payload_format_t format) { FORMAT = format; }
+
+static bool is_integer(sensor_id_t sensor) {
+  return sensor == SENSOR_SOIL_MOISTURE || sensor == SENSOR_BATTERY_VOLTAGE;
+}
+
+/// "YYYY-MM-DDThh:mm:ss.mmmZ"
+static void json_utc_timestamp(json_writer_t *w, int64_t utc_ms) {
+  char ts[JSON_ISO_8601_LEN + sizeof(".mmm")] = {0};
+  uint32_t ms = (uint32_t)(utc_ms % 1000);
+
+  xSemaphoreTake(TS_CACHE_LOCK, portMAX_DELAY);
+  json_format_iso_8601(&TS_CACHE, (time_t)(utc_ms / 1000), ts);
+  xSemaphoreGive(TS_CACHE_LOCK);
+
+  // replace the trailing 'Z' with the milliseconds
+  ts[JSON_ISO_8601_LEN - 1] = '.';
+  ts[JSON_ISO_8601_LEN] = '0' + ms / 100;
+  ts[JSON_ISO_8601_LEN + 1] = '0' + ms / 10 % 10;
+  ts[JSON_ISO_8601_LEN + 2] = '0' + ms % 10;
+  ts[JSON_ISO_8601_LEN + 3] = 'Z';
+
+  json_write_key(w, TIME);
+  json_write_string(w, ts);
+}
+
+/// Monotonic `captured_ms`, as UTC
+static void json_timestamp(json_writer_t *w, int64_t captured_ms) {
+  json_utc_timestamp(w, timebase_to_utc_ms(captured_ms));
+}
+
+static void json_number(json_writer_t *w, sensor_id_t sensor, float value) {
+  if (is_integer(sensor))
+    json_write_uint(w, (uint32_t)value);
+  else
+    json_write_fixed(w, value, JSON_DECIMALS[sensor]);
+}
+
+static void json_value(json_writer_t *w, sensor_id_t sensor, float value) {
+  json_write_key(w, SENSOR_KEYS[sensor]);
+  json_number(w, sensor, value);
+}
+
+static int json_finish(json_writer_t *w) {
+  size_t n;
+  if (json_write_finish(w, &n) != ESP_OK)
+    return -1;
+  return (int)n;
+}
+
+static int json_reading(char *buf, size_t len, const reading_t *reading) {
+  json_writer_t w;
+
+  json_write_init(&w, buf, len);
+  json_write_begin(&w);
+  json_value(&w, reading->sensor, reading->value);
+  json_timestamp(&w, timebase_unwrap(reading->captured_ms));
+  json_write_end(&w);
+
+  return json_finish(&w);
+}
+
+/**
+ * @brief Get the value of one sensor in a snapshot.
+ * @param snap snapshot
+ * @param sensor sensor
+ * @return value, 0 for an unknown sensor
+ */
+float snapshot_value(const snapshot_t *snap, sensor_id_t sensor) {
+  switch (sensor) {
+  case SENSOR_TEMPERATURE:
+    return snap->temp;
+  case SENSOR_HUMIDITY:
+    return snap->humd;
+  case SENSOR_LUX:
+    return snap->lux;
+  case SENSOR_SOIL_MOISTURE:
+    return snap->moist;
+  case SENSOR_BATTERY_VOLTAGE:
+    return snap->batt;
+  default:
+    return 0;
+  }
+}
+
+static int json_snapshot(char *buf, size_t len, const snapshot_t *snap) {
+  json_writer_t w;
+
+  json_write_init(&w, buf, len);
+  json_write_begin(&w);
+  for (sensor_id_t s = 0; s < SENSOR_MAX; s++)
+    if (snap->valid & SENSOR_BIT(s))
+      json_value(&w, s, snapshot_value(snap, s));
+  if (snap->awake_ms) {
+    json_write_key(&w, AWAKE_MS);
+    json_write_uint(&w, snap->awake_ms);
+  }
+  json_timestamp(&w, snap->captured_ms);
+  json_write_end(&w);
+
+  return json_finish(&w);
+}
+
+/// Mean and standard deviation of integer readings get a decimal place
+static uint8_t json_stat_decimals(sensor_id_t sensor) {
+  return is_integer(sensor) ? 1 : JSON_DECIMALS[sensor];
+}
+
+static void json_stat(json_writer_t *w, const char *key, sensor_id_t sensor,
+                      float value) {
+  json_write_key(w, key);
+  if (is_integer(sensor))
+    json_write_uint(w, (uint32_t)value);
+  else
+    json_write_fixed(w, value, JSON_DECIMALS[sensor]);
+}
+
+static int json_summary(char *buf, size_t len, sensor_id_t sensor,
+                        const win_summary_t *summary, int64_t captured_ms) {
+  json_writer_t w;
+
+  json_write_init(&w, buf, len);
+  json_write_begin(&w);
+  json_write_key(&w, SENSOR_KEYS[sensor]);
+  json_write_begin(&w);
+  json_write_key(&w, COUNT);
+  json_write_uint(&w, summary->count);
+  json_stat(&w, MIN, sensor, summary->min);
+  json_stat(&w, MAX, sensor, summary->max);
+  json_write_key(&w, MEAN);
+  json_write_fixed(&w, summary->mean, json_stat_decimals(sensor));
+  json_write_key(&w, STDDEV);
+  json_write_fixed(&w, summary->stddev, json_stat_decimals(sensor));
+  json_stat(&w, LAST, sensor, summary->last);
+  json_write_end(&w);
+  json_timestamp(&w, captured_ms);
+  json_write_end(&w);
+
+  return json_finish(&w);
+}
+
+static void cbor_number(cbor_writer_t *w, sensor_id_t sensor, float value) {
+  if (is_integer(sensor))
+    cbor_write_uint(w, (uint32_t)value);
+  else
+    cbor_write_float(w, value, CBOR_MAX_ERR[sensor]);
+}
+
+static void cbor_value(cbor_writer_t *w, sensor_id_t sensor, float value) {
+  cbor_write_uint(w, sensor);
+  cbor_number(w, sensor, value);
+}
+
+static int cbor_finish(const cbor_writer_t *w) {
+  size_t n;
+  if (cbor_write_finish(w, &n) != ESP_OK)
+    return -1;
+  return (int)n;
+}
+
+static int cbor_reading(char *buf, size_t len, const reading_t *reading) {
+  cbor_writer_t w;
+
+  cbor_write_init(&w, (uint8_t *)buf, len);
+  cbor_write_map(&w, 2);
+  cbor_value(&w, reading->sensor, reading->value);
+  cbor_write_uint(&w, CBOR_KEY_TIMESTAMP);
+  cbor_write_epoch(&w,
+                   timebase_to_utc_ms(timebase_unwrap(reading->captured_ms)) /
+                       1000);
+
+  return cbor_finish(&w);
+}
+
+static int cbor_snapshot(char *buf, size_t len, const snapshot_t *snap) {
+  cbor_writer_t w;
+  size_t pairs = 1;
+
+  for (sensor_id_t s = 0; s < SENSOR_MAX; s++)
+    if (snap->valid & SENSOR_BIT(s))
+      pairs++;
+  if (snap->awake_ms)
+    pairs++;
+
+  cbor_write_init(&w, (uint8_t *)buf, len);
+  cbor_write_map(&w, pairs);
+  for (sensor_id_t s = 0; s < SENSOR_MAX; s++)
+    if (snap->valid & SENSOR_BIT(s))
+      cbor_value(&w, s, snapshot_value(snap, s));
+  if (snap->awake_ms) {
+    cbor_write_uint(&w, CBOR_KEY_AWAKE_MS);
+    cbor_write_uint(&w, snap->awake_ms);
+  }
+  cbor_write_uint(&w, CBOR_KEY_TIMESTAMP);
+  cbor_write_epoch(&w, timebase_to_utc_ms(snap->captured_ms) / 1000);
+
+  return cbor_finish(&w);
+}
+
+static void cbor_stat(cbor_writer_t *w, uint8_t key, sensor_id_t sensor,
+                      float value) {
+  cbor_write_uint(w, key);
+  cbor_number(w, sensor, value);
+}
+
+static int cbor_summary(char *buf, size_t len, sensor_id_t sensor,
+                        const win_summary_t *summary, int64_t captured_ms) {
+  cbor_writer_t w;
+
+  cbor_write_init(&w, (uint8_t *)buf, len);
+  cbor_write_map(&w, 2);
+  cbor_write_uint(&w, sensor);
+  cbor_write_map(&w, 6);
+  cbor_write_uint(&w, CBOR_KEY_COUNT);
+  cbor_write_uint(&w, summary->count);
+  cbor_stat(&w, CBOR_KEY_MIN, sensor, summary->min);
+  cbor_stat(&w, CBOR_KEY_MAX, sensor, summary->max);
+  cbor_write_uint(&w, CBOR_KEY_MEAN);
+  cbor_write_float(&w, summary->mean, CBOR_MAX_ERR[sensor]);
+  cbor_write_uint(&w, CBOR_KEY_STDDEV);
+  cbor_write_float(&w, summary->stddev, CBOR_MAX_ERR[sensor]);
+  cbor_stat(&w, CBOR_KEY_LAST, sensor, summary->last);
+  cbor_write_uint(&w, CBOR_KEY_TIMESTAMP);
+  cbor_write_epoch(&w, timebase_to_utc_ms(captured_ms) / 1000);
+
+  return cbor_finish(&w);
+}
+
+/// Record time, as an offset from the chunk's first second
+static uint32_t log_offset_ms(const ts_log_record_t *recs,
+                              const ts_log_record_t *rec) {
+  return (rec->time_s - recs[0].time_s) * 1000 + TS_LOG_MS(rec);
+}
+
+static int json_log_chunk(char *buf, size_t len, sensor_id_t sensor,
+                          const ts_log_record_t *recs, size_t n,
+                          uint32_t next_s, esp_err_t err) {
+  json_writer_t w;
+
+  json_write_init(&w, buf, len);
+  json_write_begin(&w);
+  json_write_key(&w, SENSOR_KEYS[sensor]);
+  json_write_array_begin(&w);
+  for (size_t i = 0; i < n; i++) {
+    json_write_item(&w);
+    json_write_array_begin(&w);
+    json_write_item(&w);
+    json_write_uint(&w, log_offset_ms(recs, &recs[i]));
+    json_write_item(&w);
+    json_number(&w, sensor, recs[i].value);
+    json_write_array_end(&w);
+  }
+  json_write_array_end(&w);
+  if (n > 0)
+    json_utc_timestamp(&w, (int64_t)recs[0].time_s * 1000);
+  if (next_s) {
+    json_write_key(&w, NEXT);
+    json_write_uint(&w, next_s);
+  }
+  if (err != ESP_OK) {
+    json_write_key(&w, LOG_ERROR);
+    json_write_string(&w, esp_err_to_name(err));
+  }
+  json_write_end(&w);
+
+  return json_finish(&w);
+}
+
+static int cbor_log_chunk(char *buf, size_t len, sensor_id_t sensor,
+                          const ts_log_record_t *recs, size_t n,
+                          uint32_t next_s, esp_err_t err) {
+  cbor_writer_t w;
+
+  cbor_write_init(&w, (uint8_t *)buf, len);
+  cbor_write_map(&w, 1 + (n > 0) + (next_s > 0) + (err != ESP_OK));
+  cbor_write_uint(&w, sensor);
+  cbor_write_array(&w, n);
+  for (size_t i = 0; i < n; i++) {
+    cbor_write_array(&w, 2);
+    cbor_write_uint(&w, log_offset_ms(recs, &recs[i]));
+    cbor_number(&w, sensor, recs[i].value);
+  }
+  if (n > 0) {
+    cbor_write_uint(&w, CBOR_KEY_TIMESTAMP);
+    cbor_write_epoch(&w, recs[0].time_s);
+  }
+  if (next_s) {
+    cbor_write_uint(&w, CBOR_KEY_NEXT);
+    cbor_write_uint(&w, next_s);
+  }
+  if (err != ESP_OK) {
+    cbor_write_uint(&w, CBOR_KEY_LOG_ERROR);
+    cbor_write_text(&w, esp_err_to_name(err));
+  }
+
+  return cbor_finish(&w);
+}
+
+#if CONFIG_DIAG
+/// JSON diagnostics keys, I2C devices are keyed "i2c_" and their hex address
+static const char *const DIAG_CONV_KEYS[DIAG_DRIVERS] = {
+    "conv_sht_20", "conv_apds_3901", "conv_seesaw_soil"};
+static const char *const DIAG_RETRY_KEYS[DIAG_DRIVERS] = {
+    "retry_sht_20", "retry_apds_3901", "retry_seesaw_soil"};
+static const char *const DIAG_STAGE_KEYS[DIAG_STAGES] = {"encode", "puback"};
+static const char *const DIAG_ERROR_KEYS[DIAG_ERRORS] = {"nack", "timeout",
+                                                         "crc", "invalid"};
+static const char *const DIAG_STACK_KEYS[DIAG_TASKS] = {
+    "stack_main", "stack_sampler", "stack_i2c_bus", "stack_mqtt",
+    "stack_wifi", "stack_tcpip", "stack_events"};
+
+/// Buckets up to the last non-empty one
+static uint8_t hist_len(const diag_hist_t *h) {
+  uint8_t n = DIAG_BUCKETS;
+
+  while (n > 0 && h->buckets[n - 1] == 0)
+    n--;
+  return n;
+}
+
+/// [count, max_us, buckets...], empty histograms are left out
+static void json_hist(json_writer_t *w, const char *key,
+                      const diag_hist_t *h) {
+  uint8_t n = hist_len(h);
+
+  if (h->count == 0)
+    return;
+
+  json_write_key(w, key);
+  json_write_array_begin(w);
+  json_write_item(w);
+  json_write_uint(w, h->count);
+  json_write_item(w);
+  json_write_uint(w, h->max_us);
+  for (uint8_t i = 0; i < n; i++) {
+    json_write_item(w);
+    json_write_uint(w, h->buckets[i]);
+  }
+  json_write_array_end(w);
+}
+
+/// Zero counts are left out
+static void json_count(json_writer_t *w, const char *key, uint32_t count) {
+  if (count == 0)
+    return;
+  json_write_key(w, key);
+  json_write_uint(w, count);
+}
+
+static int json_diag(char *buf, size_t len, const diag_t *d,
+                     int64_t captured_ms) {
+  static const char HEX[] = "0123456789abcdef";
+  char key[] = "i2c_00";
+  json_writer_t w;
+
+  json_write_init(&w, buf, len);
+  json_write_begin(&w);
+  for (uint8_t i = 0; i < DIAG_I2C_DEVICES; i++) {
+    key[4] = HEX[d->i2c_addr[i] >> 4];
+    key[5] = HEX[d->i2c_addr[i] & 0xf];
+    json_hist(&w, key, &d->i2c[i]);
+  }
+  for (uint8_t i = 0; i < DIAG_DRIVERS; i++) {
+    json_hist(&w, DIAG_CONV_KEYS[i], &d->conv[i]);
+    json_count(&w, DIAG_RETRY_KEYS[i], d->retries[i]);
+  }
+  for (uint8_t i = 0; i < DIAG_STAGES; i++)
+    json_hist(&w, DIAG_STAGE_KEYS[i], &d->stages[i]);
+  for (uint8_t i = 0; i < DIAG_ERRORS; i++)
+    json_count(&w, DIAG_ERROR_KEYS[i], d->errors[i]);
+  for (uint8_t i = 0; i < DIAG_TASKS; i++)
+    json_count(&w, DIAG_STACK_KEYS[i], d->stack_free[i]);
+  json_count(&w, MIN_FREE_HEAP, d->min_free_heap);
+  json_count(&w, LARGEST_FREE_BLOCK, d->largest_free_block);
+  json_timestamp(&w, captured_ms);
+  json_write_end(&w);
+
+  return json_finish(&w);
+}
+
+static size_t cbor_diag_pairs(const diag_t *d) {
+  size_t pairs = 1; // timestamp
+
+  for (uint8_t i = 0; i < DIAG_I2C_DEVICES; i++)
+    pairs += d->i2c[i].count > 0;
+  for (uint8_t i = 0; i < DIAG_DRIVERS; i++)
+    pairs += (d->conv[i].count > 0) + (d->retries[i] > 0);
+  for (uint8_t i = 0; i < DIAG_STAGES; i++)
+    pairs += d->stages[i].count > 0;
+  for (uint8_t i = 0; i < DIAG_ERRORS; i++)
+    pairs += d->errors[i] > 0;
+  for (uint8_t i = 0; i < DIAG_TASKS; i++)
+    pairs += d->stack_free[i] > 0;
+  pairs += (d->min_free_heap > 0) + (d->largest_free_block > 0);
+  return pairs;
+}
+
+static void cbor_hist(cbor_writer_t *w, uint8_t key, const diag_hist_t *h) {
+  uint8_t n = hist_len(h);
+
+  if (h->count == 0)
+    return;
+
+  cbor_write_uint(w, key);
+  cbor_write_array(w, 2 + n);
+  cbor_write_uint(w, h->count);
+  cbor_write_uint(w, h->max_us);
+  for (uint8_t i = 0; i < n; i++)
+    cbor_write_uint(w, h->buckets[i]);
+}
+
+static void cbor_count(cbor_writer_t *w, uint8_t key, uint32_t count) {
+  if (count == 0)
+    return;
+  cbor_write_uint(w, key);
+  cbor_write_uint(w, count);
+}
+
+static int cbor_diag(char *buf, size_t len, const diag_t *d,
+                     int64_t captured_ms) {
+  cbor_writer_t w;
+
+  cbor_write_init(&w, (uint8_t *)buf, len);
+  cbor_write_map(&w, cbor_diag_pairs(d));
+  for (uint8_t i = 0; i < DIAG_I2C_DEVICES; i++)
+    cbor_hist(&w, CBOR_KEY_I2C | d->i2c_addr[i], &d->i2c[i]);
+  for (uint8_t i = 0; i < DIAG_DRIVERS; i++) {
+    cbor_hist(&w, CBOR_KEY_CONV + i, &d->conv[i]);
+    cbor_count(&w, CBOR_KEY_RETRIES + i, d->retries[i]);
+  }
+  for (uint8_t i = 0; i < DIAG_STAGES; i++)
+    cbor_hist(&w, CBOR_KEY_STAGE + i, &d->stages[i]);
+  for (uint8_t i = 0; i < DIAG_ERRORS; i++)
+    cbor_count(&w, CBOR_KEY_ERROR + i, d->errors[i]);
+  for (uint8_t i = 0; i < DIAG_TASKS; i++)
+    cbor_count(&w, CBOR_KEY_STACK + i, d->stack_free[i]);
+  cbor_count(&w, CBOR_KEY_MIN_FREE_HEAP, d->min_free_heap);
+  cbor_count(&w, CBOR_KEY_LARGEST_FREE_BLOCK, d->largest_free_block);
+  cbor_write_uint(&w, CBOR_KEY_TIMESTAMP);
+  cbor_write_epoch(&w, timebase_to_utc_ms(captured_ms) / 1000);
+
+  return cbor_finish(&w);
+}
+#endif
+
+/**
+ * @brief Encode a single reading in the current payload format.
+ * @param buf output buffer
+ * @param len size of `buf`
+ * @param reading reading to encode
+ * @return encoded length, or -1 if `buf` is too small
+ */
+int encode_reading(char *buf, size_t len, const reading_t *reading) {
+  DIAG_TIMER(start);
+  int n;
+
+  if (FORMAT == MQTT_PAYLOAD_CBOR)
+    n = cbor_reading(buf, len, reading);
+  else
+    n = json_reading(buf, len, reading);
+  DIAG_STAGE_SINCE(DIAG_ENCODE, start);
+  return n;
+}
+
+/**
+ * @brief Encode a snapshot in the current payload format.
+ * @param buf output buffer
+ * @param len size of `buf`
+ * @param snap readings to encode, only valid readings are included
+ * @return encoded length, or -1 if `buf` is too small
+ */
+int encode_snapshot(char *buf, size_t len, const snapshot_t *snap) {
+  DIAG_TIMER(start);
+  int n;
+
+  if (FORMAT == MQTT_PAYLOAD_CBOR)
+    n = cbor_snapshot(buf, len, snap);
+  else
+    n = json_snapshot(buf, len, snap);
+  DIAG_STAGE_SINCE(DIAG_ENCODE, start);
+  return n;
+}
+
+/**
+ * @brief Encode a window summary of one sensor in the current payload format.
+ * @param buf output buffer
+ * @param len size of `buf`
+ * @param sensor summarized sensor
+ * @param summary window summary
+ * @param captured_ms monotonic time of the end of the window
+ * @return encoded length, or -1 if `buf` is too small
+ */
+int encode_summary(char *buf, size_t len, sensor_id_t sensor,
+                   const win_summary_t *summary, int64_t captured_ms) {
+  DIAG_TIMER(start);
+  int n;
+
+  if (FORMAT == MQTT_PAYLOAD_CBOR)
+    n = cbor_summary(buf, len, sensor, summary, captured_ms);
+  else
+    n = json_summary(buf, len, sensor, summary, captured_ms);
+  DIAG_STAGE_SINCE(DIAG_ENCODE, start);
+  return n;
+}
+
+/**
+ * @brief Encode a chunk of logged records of one sensor in the current payload
+ * format, as [offset_ms, value] pairs from the first record's second.
+ * @param buf output buffer
+ * @param len size of `buf`
+ * @param sensor logged sensor
+ * @param recs records, in time order
+ * @param n number of records, may be 0
+ * @param next_s UTC second to resume the query from, 0 for the last chunk
+ * @return encoded length, or -1 if `buf` is too small
+ */
+int encode_log_chunk(char *buf, size_t len, sensor_id_t sensor,
+                     const ts_log_record_t *recs, size_t n, uint32_t next_s) {
+  if (FORMAT == MQTT_PAYLOAD_CBOR)
+    return cbor_log_chunk(buf, len, sensor, recs, n, next_s, ESP_OK);
+  return json_log_chunk(buf, len, sensor, recs, n, next_s, ESP_OK);
+}
+
+/**
+ * @brief Encode the end of a log query that failed, in the current payload
+ * format: an empty chunk with the error's name.
+ * @param buf output buffer
+ * @param len size of `buf`
+ * @param sensor logged sensor
+ * @param next_s UTC second of the first record not sent, 0 if unknown
+ * @param err why the query failed
+ * @return encoded length, or -1 if `buf` is too small
+ */
+int encode_log_error(char *buf, size_t len, sensor_id_t sensor,
+                     uint32_t next_s, esp_err_t err) {
+  if (FORMAT == MQTT_PAYLOAD_CBOR)
+    return cbor_log_chunk(buf, len, sensor, NULL, 0, next_s, err);
+  return json_log_chunk(buf, len, sensor, NULL, 0, next_s, err);
+}
+
+#if CONFIG_DIAG
+/**
+ * @brief Encode diagnostics in the current payload format. Empty histograms
+ * and zero counts are left out.
+ * @param buf output buffer
+ * @param len size of `buf`
+ * @param d diagnostics to encode
+ * @param captured_ms monotonic time of the end of the period
+ * @return encoded length, or -1 if `buf` is too small
+ */
+int encode_diag(char *buf, size_t len, const diag_t *d, int64_t captured_ms) {
+  if (FORMAT == MQTT_PAYLOAD_CBOR)
+    return cbor_diag(buf, len, d, captured_ms);
+  return json_diag(buf, len, d, captured_ms);
+}
+#endif
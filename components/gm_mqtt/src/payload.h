@@ -0,0 +1,51 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include "../include/mqtt.h"
+#include "diag.h"
+#include "readings.h"
+#include "ts_log.h"
+#include "win_stats.h"
+#include <stddef.h>
+
+#define PAYLOAD_BUF_LEN 128
+#define SNAPSHOT_BUF_LEN 256
+#define DIAG_BUF_LEN 1024
+#define LOG_BUF_LEN 768
+
+/// JSON keys
+#define TEMPERATURE "temperature"
+#define HUMIDITY "humidity"
+#define TIME "timestamp"
+#define LUX "lux"
+#define SOIL_MOISTURE "soil_moisture"
+#define BATTERY_VOLTAGE "battery_voltage"
+#define SNAPSHOT "snapshot"
+#define AWAKE_MS "awake_ms"
+#define NEXT "next"
+#define LOG_ERROR "error"
+#define COUNT "count"
+#define MIN "min"
+#define MAX "max"
+#define MEAN "mean"
+#define STDDEV "stddev"
+#define LAST "last"
+#define MIN_FREE_HEAP "min_free_heap"
+#define LARGEST_FREE_BLOCK "largest_free_block"
+
+extern const char *const SENSOR_KEYS[SENSOR_MAX];
+
+void init_payload(void);
+void set_payload_format(mqtt_payload_format_t format);
+float snapshot_value(const snapshot_t *snap, sensor_id_t sensor);
+int encode_reading(char *buf, size_t len, const reading_t *reading);
+int encode_snapshot(char *buf, size_t len, const snapshot_t *snap);
+int encode_summary(char *buf, size_t len, sensor_id_t sensor,
+                   const win_summary_t *summary, int64_t captured_ms);
+int encode_log_chunk(char *buf, size_t len, sensor_id_t sensor,
+                     const ts_log_record_t *recs, size_t n, uint32_t next_s);
+int encode_log_error(char *buf, size_t len, sensor_id_t sensor,
+                     uint32_t next_s, esp_err_t err);
+int encode_diag(char *buf, size_t len, const diag_t *d, int64_t captured_ms);
+
+#endif
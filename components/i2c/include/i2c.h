@@ -3,7 +3,10 @@
 
 #include "esp_err.h"
 #include "hal/i2c_types.h"
+
+#if !CONFIG_IDF_TARGET_LINUX
 #include "driver/i2c.h"
+#endif
 
 #if CONFIG_SDA_NUM_2
 #define I2C_SDA_PIN GPIO_NUM_2
@@ -0,0 +1,100 @@
+#ifndef I2C_BUS_H
+#define I2C_BUS_H
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "hal/i2c_types.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#if CONFIG_I2C_BUS_QUEUE_LEN
+#define I2C_BUS_QUEUE_LEN CONFIG_I2C_BUS_QUEUE_LEN
+#else
+#define I2C_BUS_QUEUE_LEN 8
+#endif
+
+#if CONFIG_I2C_BUS_MAX_BATCH
+#define I2C_BUS_MAX_BATCH CONFIG_I2C_BUS_MAX_BATCH
+#else
+#define I2C_BUS_MAX_BATCH 4
+#endif
+
+#if CONFIG_I2C_BUS_TASK_STACK_SIZE
+#define I2C_BUS_TASK_STACK_SIZE CONFIG_I2C_BUS_TASK_STACK_SIZE
+#else
+#define I2C_BUS_TASK_STACK_SIZE 2048
+#endif
+
+#if CONFIG_I2C_CMD_POOL_SIZE
+#define I2C_CMD_POOL_SIZE CONFIG_I2C_CMD_POOL_SIZE
+#else
+#define I2C_CMD_POOL_SIZE 1
+#endif
+
+#define I2C_TXN_MAX_OPS 2
+#define I2C_TXN_DEFAULT_TIMEOUT_MS 13
+
+typedef enum i2c_op_kind { I2C_OP_WRITE, I2C_OP_READ } i2c_op_kind_t;
+
+/// One segment of a transaction, consecutive ops are joined by a repeated
+/// start
+typedef struct i2c_op {
+  i2c_op_kind_t kind;
+  uint8_t *data;
+  size_t len;
+} i2c_op_t;
+
+/// Transaction descriptor, owned by the submitting task until it completes
+typedef struct i2c_txn {
+  i2c_port_t port;
+  uint8_t addr; // 7-bit address
+  i2c_op_t ops[I2C_TXN_MAX_OPS];
+  uint8_t n_ops;
+  uint32_t timeout_ms;
+
+  // results, filled in by the bus manager
+  esp_err_t err;
+  uint32_t wait_us; // time spent queued
+  uint32_t xfer_us; // time spent on the bus
+
+  // private
+  int64_t queued_us;
+  SemaphoreHandle_t done;
+  StaticSemaphore_t done_buf;
+} i2c_txn_t;
+
+typedef struct i2c_bus_stats {
+  uint32_t txns;
+  uint32_t errors;
+  uint32_t timeouts;
+  uint32_t wakeups;   // manager wakeups, each runs a batch of transactions
+  uint32_t max_batch; // most transactions run in one wakeup
+  uint32_t max_wait_us;
+  uint64_t busy_us; // total time spent on the bus
+
+  uint32_t pool_links; // command links taken from the static pool
+  uint32_t heap_links; // command links allocated from the heap
+} i2c_bus_stats_t;
+
+esp_err_t init_i2c_bus(void);
+void i2c_txn_init(i2c_txn_t *txn, i2c_port_t port, uint8_t addr);
+void i2c_txn_write(i2c_txn_t *txn, uint8_t *data, size_t len);
+void i2c_txn_read(i2c_txn_t *txn, uint8_t *data, size_t len);
+esp_err_t i2c_bus_submit(i2c_txn_t *txn);
+esp_err_t i2c_bus_write(i2c_port_t port, uint8_t addr, uint8_t *data,
+                        size_t len);
+esp_err_t i2c_bus_read(i2c_port_t port, uint8_t addr, uint8_t *data,
+                       size_t len);
+esp_err_t i2c_bus_write_read(i2c_port_t port, uint8_t addr, uint8_t *wdata,
+                             size_t wlen, uint8_t *rdata, size_t rlen);
+esp_err_t i2c_write_reg(i2c_port_t port, uint8_t addr, uint8_t reg,
+                        uint8_t val);
+esp_err_t i2c_read_reg(i2c_port_t port, uint8_t addr, uint8_t reg,
+                       uint8_t *val);
+esp_err_t i2c_read_wide(i2c_port_t port, uint8_t addr, uint8_t reg,
+                        uint16_t *val);
+void i2c_bus_get_stats(i2c_bus_stats_t *stats);
+int64_t i2c_bus_now_us(void);
+
+#endif
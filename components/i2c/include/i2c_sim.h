@@ -0,0 +1,49 @@
+#ifndef I2C_SIM_H
+#define I2C_SIM_H
+
+#include "esp_err.h"
+#include <stdint.h>
+
+/// Simulated device addresses
+#define I2C_SIM_SHT_20_ADDR 0x40
+#define I2C_SIM_APDS_3901_ADDR 0x39
+#define I2C_SIM_SEESAW_ADDR 0x36
+
+/// Conversion times, the datasheet maximums
+#define I2C_SIM_SHT_20_TEMP_US 85000
+#define I2C_SIM_SHT_20_HUMD_US 29000
+#define I2C_SIM_SEESAW_TOUCH_US 5000
+
+typedef enum i2c_sim_fault {
+  I2C_SIM_FAULT_NONE,
+  I2C_SIM_FAULT_NACK,    // device doesn't acknowledge its address
+  I2C_SIM_FAULT_TIMEOUT, // bus is held for the whole transaction timeout
+  I2C_SIM_FAULT_BAD_CRC, // read data is corrupted, only consumed by reads
+} i2c_sim_fault_t;
+
+/// What the simulated sensors are measuring
+typedef struct i2c_sim_env {
+  float temp;        // degrees Celsius
+  float humd;        // relative humidity, percent
+  uint32_t ch0, ch1; // APDS counts at low gain and 402 ms integration, can
+                     // be more than the ADC holds, to simulate saturation
+  uint16_t moist;    // Seesaw capacitive reading
+} i2c_sim_env_t;
+
+typedef struct i2c_sim_stats {
+  uint32_t txns;
+  uint32_t nacks; // injected, or from reading before a conversion finished
+  uint32_t timeouts;
+  uint32_t bad_crcs;
+  uint32_t invalid; // Seesaw 0xFFFF replies
+} i2c_sim_stats_t;
+
+void i2c_sim_reset(uint32_t seed);
+void i2c_sim_set_env(const i2c_sim_env_t *env);
+esp_err_t i2c_sim_inject(uint8_t addr, i2c_sim_fault_t fault, uint32_t count);
+esp_err_t i2c_sim_set_fault_rate(uint8_t addr, i2c_sim_fault_t fault,
+                                 uint16_t per_mille);
+void i2c_sim_set_invalid_rate(uint16_t per_mille);
+esp_err_t i2c_sim_get_stats(uint8_t addr, i2c_sim_stats_t *stats);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef I2C_BACKEND_H
+#define I2C_BACKEND_H
+
+#include "../include/i2c_bus.h"
+#include "esp_err.h"
+#include "hal/i2c_types.h"
+#include <stdint.h>
+
+/// Bus backend, one is linked in: the ESP-IDF I2C driver on target, or the
+/// device simulator on Linux. Only called from the bus manager task, apart
+/// from `i2c_backend_get_stats`.
+esp_err_t i2c_backend_init(i2c_port_t port);
+esp_err_t i2c_backend_transfer(const i2c_txn_t *txn);
+int64_t i2c_backend_now_us(void);
+void i2c_backend_get_stats(i2c_bus_stats_t *stats);
+
+#endif
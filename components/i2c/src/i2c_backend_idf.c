@@ -0,0 +1,105 @@
+#include "../include/i2c.h"
+#include "../include/i2c_bus.h"
+#include "driver/gpio.h"
+#include "driver/i2c.h"
+#include "esp_err.h"
+#include "esp_idf_version.h"
+#include "esp_timer.h"
+#include "i2c_backend.h"
+
+/// Statically allocated command links need IDF v4.4
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+#define HAVE_STATIC_CMD_LINK 1
+#endif
+
+/// Room for the links of the largest transaction
+#define CMD_LINK_SIZE I2C_LINK_RECOMMENDED_SIZE(I2C_TXN_MAX_OPS)
+
+/// Command link pool
+#if HAVE_STATIC_CMD_LINK
+static uint8_t CMD_POOL[I2C_CMD_POOL_SIZE][CMD_LINK_SIZE];
+static bool CMD_POOL_USED[I2C_CMD_POOL_SIZE];
+#endif
+static uint32_t POOL_LINKS = 0;
+static uint32_t HEAP_LINKS = 0;
+
+/// Get a command link, from the pool if possible. `slot` is set to the pool
+/// index, or -1 if the link came from the heap.
+static i2c_cmd_handle_t cmd_link_acquire(int *slot) {
+#if HAVE_STATIC_CMD_LINK
+  for (int i = 0; i < I2C_CMD_POOL_SIZE; i++) {
+    if (!CMD_POOL_USED[i]) {
+      CMD_POOL_USED[i] = true;
+      *slot = i;
+      POOL_LINKS++;
+      return i2c_cmd_link_create_static(CMD_POOL[i], CMD_LINK_SIZE);
+    }
+  }
+#endif
+
+  *slot = -1;
+  HEAP_LINKS++;
+  return i2c_cmd_link_create();
+}
+
+static void cmd_link_release(i2c_cmd_handle_t cmd, int slot) {
+#if HAVE_STATIC_CMD_LINK
+  if (slot >= 0) {
+    i2c_cmd_link_delete_static(cmd);
+    CMD_POOL_USED[slot] = false;
+    return;
+  }
+#endif
+
+  i2c_cmd_link_delete(cmd);
+}
+
+esp_err_t i2c_backend_init(i2c_port_t port) {
+  esp_err_t err;
+  i2c_config_t i2c_conf = {.mode = I2C_MODE_MASTER,
+                           .sda_io_num = I2C_SDA_PIN,
+                           .scl_io_num = I2C_SCL_PIN,
+                           .sda_pullup_en = GPIO_PULLUP_ENABLE,
+                           .scl_pullup_en = GPIO_PULLUP_ENABLE,
+                           .master.clk_speed = 400000};
+
+  if ((err = i2c_param_config(port, &i2c_conf)) != ESP_OK)
+    return err;
+
+  return i2c_driver_install(port, I2C_MODE_MASTER, 0, 0, 0);
+}
+
+esp_err_t i2c_backend_transfer(const i2c_txn_t *txn) {
+  const i2c_op_t *op;
+  i2c_cmd_handle_t cmd;
+  esp_err_t err;
+  int slot;
+
+  if ((cmd = cmd_link_acquire(&slot)) == NULL)
+    return ESP_ERR_NO_MEM;
+
+  for (uint8_t i = 0; i < txn->n_ops; i++) {
+    op = &txn->ops[i];
+    i2c_master_start(cmd);
+    if (op->kind == I2C_OP_WRITE) {
+      i2c_master_write_byte(cmd, (txn->addr << 1) | I2C_MASTER_WRITE, true);
+      if (op->len > 0)
+        i2c_master_write(cmd, op->data, op->len, true);
+    } else {
+      i2c_master_write_byte(cmd, (txn->addr << 1) | I2C_MASTER_READ, true);
+      i2c_master_read(cmd, op->data, op->len, I2C_MASTER_LAST_NACK);
+    }
+  }
+  i2c_master_stop(cmd);
+
+  err = i2c_master_cmd_begin(txn->port, cmd, pdMS_TO_TICKS(txn->timeout_ms));
+  cmd_link_release(cmd, slot);
+  return err;
+}
+
+int64_t i2c_backend_now_us(void) { return esp_timer_get_time(); }
+
+void i2c_backend_get_stats(i2c_bus_stats_t *stats) {
+  stats->pool_links = POOL_LINKS;
+  stats->heap_links = HEAP_LINKS;
+}
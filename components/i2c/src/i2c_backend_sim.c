@@ -0,0 +1,443 @@
+#include "../include/i2c_bus.h"
+#include "../include/i2c_sim.h"
+#include "esp_err.h"
+#include "i2c_backend.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/// SHT 20 commands
+#define SHT_20_TEMP_NOHOLD 0xf3
+#define SHT_20_HUMD_NOHOLD 0xf5
+#define SHT_20_WRITE_USER 0xe6
+#define SHT_20_READ_USER 0xe7
+#define SHT_20_USER_DEFAULT 0x02
+#define SHT_20_STATUS_HUMD 0x02
+#define SHT_20_CRC_POLY 0x31
+
+/// APDS 3901 command byte and registers
+#define APDS_3901_CMD_WORD 0x20
+#define APDS_3901_CMD_REG(c) ((c)&0x0f)
+#define APDS_3901_CONTROL 0x0
+#define APDS_3901_TIMING 0x1
+#define APDS_3901_DATA0LOW 0xc
+#define APDS_3901_DATA1LOW 0xe
+#define APDS_3901_POWER_ON 0x3
+#define APDS_3901_GAIN_HIGH 0x10
+#define APDS_3901_INTEG(t) ((t)&0x3)
+#define APDS_3901_FULL_INTEG_US 402000
+
+/// Integration time and full-scale count, by TIMING register INTEG field.
+/// Manual integration (3) is treated as the longest.
+static const uint32_t APDS_3901_INTEG_US[] = {13700, 101000, 402000, 402000};
+static const uint32_t APDS_3901_MAX_COUNT[] = {5047, 37177, 65535, 65535};
+
+/// Seesaw touch module
+#define SEESAW_TOUCH_BASE 0x0f
+#define SEESAW_INVALID 0xffff
+
+#define N_DEVICES 3
+
+/// One simulated device, its register model and fault state
+typedef struct sim_device {
+  uint8_t addr;
+  uint8_t regs[16]; // APDS register file, SHT-20 user register in regs[0]
+  uint8_t cmd;      // last command byte written, 0 if none pending
+  int64_t cmd_us;   // when `cmd` was written, or APDS power-on time
+
+  i2c_sim_fault_t fault; // injected, for the next `fault_count` transactions
+  uint32_t fault_count;
+  i2c_sim_fault_t rate_fault; // injected at random
+  uint16_t rate_per_mille;
+
+  i2c_sim_stats_t stats;
+} sim_device_t;
+
+#define DEVICE_DEFAULTS                                                        \
+  {                                                                            \
+    {.addr = I2C_SIM_SHT_20_ADDR, .regs = {SHT_20_USER_DEFAULT}},              \
+        {.addr = I2C_SIM_APDS_3901_ADDR}, {.addr = I2C_SIM_SEESAW_ADDR},       \
+  }
+
+#define ENV_DEFAULTS                                                           \
+  { .temp = 21.5f, .humd = 45.0f, .ch0 = 1000, .ch1 = 200, .moist = 600 }
+
+/// Global vars
+static sim_device_t DEVICES[N_DEVICES] = DEVICE_DEFAULTS;
+static i2c_sim_env_t ENV = ENV_DEFAULTS;
+static uint16_t INVALID_PER_MILLE = 0;
+static uint32_t RNG = 1;
+static pthread_mutex_t LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+/// xorshift32, so fault sequences repeat for a given seed
+static uint32_t roll_per_mille(void) {
+  RNG ^= RNG << 13;
+  RNG ^= RNG >> 17;
+  RNG ^= RNG << 5;
+  return RNG % 1000;
+}
+
+static sim_device_t *find_device(uint8_t addr) {
+  for (int i = 0; i < N_DEVICES; i++)
+    if (DEVICES[i].addr == addr)
+      return &DEVICES[i];
+  return NULL;
+}
+
+/// Take the fault for this transaction, if any
+static i2c_sim_fault_t next_fault(sim_device_t *dev, bool reads) {
+  if (dev->fault_count > 0 && (dev->fault != I2C_SIM_FAULT_BAD_CRC || reads)) {
+    dev->fault_count--;
+    return dev->fault;
+  }
+
+  if (dev->rate_per_mille > 0 &&
+      (dev->rate_fault != I2C_SIM_FAULT_BAD_CRC || reads) &&
+      roll_per_mille() < dev->rate_per_mille)
+    return dev->rate_fault;
+
+  return I2C_SIM_FAULT_NONE;
+}
+
+static uint8_t sht_20_crc(const uint8_t *data, size_t len) {
+  uint8_t crc = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 0x80) ? (crc << 1) ^ SHT_20_CRC_POLY : crc << 1;
+  }
+
+  return crc;
+}
+
+static uint16_t sht_20_raw(uint8_t cmd) {
+  float raw;
+
+  if (cmd == SHT_20_TEMP_NOHOLD)
+    raw = (ENV.temp + 46.85f) * (65536.0f / 175.72f);
+  else
+    raw = (ENV.humd + 6.0f) * (65536.0f / 125.0f);
+
+  if (raw < 0)
+    raw = 0;
+  if (raw > 65535)
+    raw = 65535;
+
+  return ((uint16_t)raw & 0xfffc) |
+         (cmd == SHT_20_HUMD_NOHOLD ? SHT_20_STATUS_HUMD : 0);
+}
+
+static esp_err_t sht_20_xfer(sim_device_t *dev, const i2c_op_t *wr,
+                             const i2c_op_t *rd, int64_t now, bool bad_crc) {
+  uint32_t conv_us;
+  uint8_t out[3];
+  uint16_t raw;
+
+  if (wr != NULL && wr->len > 0) {
+    if (wr->data[0] == SHT_20_WRITE_USER) {
+      if (wr->len > 1)
+        dev->regs[0] = wr->data[1];
+      dev->cmd = 0;
+    } else {
+      dev->cmd = wr->data[0];
+      dev->cmd_us = now;
+    }
+  }
+
+  if (rd == NULL)
+    return ESP_OK;
+
+  if (dev->cmd == SHT_20_READ_USER) {
+    memset(rd->data, dev->regs[0], rd->len);
+    return ESP_OK;
+  }
+
+  if (dev->cmd != SHT_20_TEMP_NOHOLD && dev->cmd != SHT_20_HUMD_NOHOLD) {
+    dev->stats.nacks++;
+    return ESP_FAIL;
+  }
+
+  // no-hold mode, the sensor NACKs its address until conversion is done
+  conv_us = dev->cmd == SHT_20_TEMP_NOHOLD ? I2C_SIM_SHT_20_TEMP_US
+                                           : I2C_SIM_SHT_20_HUMD_US;
+  if (now - dev->cmd_us < conv_us) {
+    dev->stats.nacks++;
+    return ESP_FAIL;
+  }
+
+  raw = sht_20_raw(dev->cmd);
+  out[0] = raw >> 8;
+  out[1] = raw & 0xff;
+  out[2] = sht_20_crc(out, 2);
+  if (bad_crc) {
+    out[2] ^= 0xff;
+    dev->stats.bad_crcs++;
+  }
+  memcpy(rd->data, out, rd->len < sizeof(out) ? rd->len : sizeof(out));
+  dev->cmd = 0;
+
+  return ESP_OK;
+}
+
+static uint16_t apds_3901_count(const sim_device_t *dev, uint32_t base) {
+  uint8_t timing = dev->regs[APDS_3901_TIMING];
+  uint8_t integ = APDS_3901_INTEG(timing);
+  uint64_t count = base;
+
+  count = count * APDS_3901_INTEG_US[integ] / APDS_3901_FULL_INTEG_US;
+  if (timing & APDS_3901_GAIN_HIGH)
+    count *= 16;
+  if (count > APDS_3901_MAX_COUNT[integ])
+    count = APDS_3901_MAX_COUNT[integ];
+
+  return (uint16_t)count;
+}
+
+static uint8_t apds_3901_reg(const sim_device_t *dev, uint8_t reg,
+                             int64_t now) {
+  uint8_t integ = APDS_3901_INTEG(dev->regs[APDS_3901_TIMING]);
+  uint16_t count;
+
+  if (reg < APDS_3901_DATA0LOW)
+    return dev->regs[reg];
+
+  // data registers read 0 until the first integration cycle completes
+  if ((dev->regs[APDS_3901_CONTROL] & APDS_3901_POWER_ON) !=
+          APDS_3901_POWER_ON ||
+      now - dev->cmd_us < APDS_3901_INTEG_US[integ])
+    return 0;
+
+  count = apds_3901_count(dev, reg < APDS_3901_DATA1LOW ? ENV.ch0 : ENV.ch1);
+  return (reg & 1) ? count >> 8 : count & 0xff;
+}
+
+static esp_err_t apds_3901_xfer(sim_device_t *dev, const i2c_op_t *wr,
+                                const i2c_op_t *rd, int64_t now,
+                                bool bad_crc) {
+  uint8_t reg;
+
+  if (wr != NULL && wr->len > 0) {
+    dev->cmd = wr->data[0];
+    reg = APDS_3901_CMD_REG(dev->cmd);
+    if (wr->len > 1 && dev->regs[reg] != wr->data[1]) {
+      dev->regs[reg] = wr->data[1];
+      // power-on and timing changes restart integration
+      if (reg == APDS_3901_CONTROL || reg == APDS_3901_TIMING)
+        dev->cmd_us = now;
+    }
+  }
+
+  if (rd == NULL)
+    return ESP_OK;
+
+  reg = APDS_3901_CMD_REG(dev->cmd);
+  for (size_t i = 0; i < rd->len; i++)
+    rd->data[i] = apds_3901_reg(
+        dev, (dev->cmd & APDS_3901_CMD_WORD) ? (reg + i) & 0x0f : reg, now);
+
+  if (bad_crc && rd->len > 0) {
+    rd->data[0] ^= 0x01;
+    dev->stats.bad_crcs++;
+  }
+
+  return ESP_OK;
+}
+
+static esp_err_t seesaw_xfer(sim_device_t *dev, const i2c_op_t *wr,
+                             const i2c_op_t *rd, int64_t now, bool bad_crc) {
+  uint16_t val;
+
+  if (wr != NULL && wr->len >= 2 && wr->data[0] == SEESAW_TOUCH_BASE) {
+    dev->cmd = wr->data[1];
+    dev->cmd_us = now;
+  }
+
+  if (rd == NULL)
+    return ESP_OK;
+
+  if (dev->cmd == 0) {
+    dev->stats.nacks++;
+    return ESP_FAIL;
+  }
+
+  // too early, or just flaky
+  if (now - dev->cmd_us < I2C_SIM_SEESAW_TOUCH_US ||
+      (INVALID_PER_MILLE > 0 && roll_per_mille() < INVALID_PER_MILLE)) {
+    val = SEESAW_INVALID;
+    dev->stats.invalid++;
+  } else {
+    val = ENV.moist;
+    dev->cmd = 0;
+  }
+
+  if (bad_crc) {
+    val ^= 0x0001;
+    dev->stats.bad_crcs++;
+  }
+
+  if (rd->len > 0)
+    rd->data[0] = val >> 8;
+  if (rd->len > 1)
+    rd->data[1] = val & 0xff;
+
+  return ESP_OK;
+}
+
+esp_err_t i2c_backend_init(i2c_port_t port) { return ESP_OK; }
+
+esp_err_t i2c_backend_transfer(const i2c_txn_t *txn) {
+  const i2c_op_t *wr = NULL, *rd = NULL;
+  i2c_sim_fault_t fault;
+  sim_device_t *dev;
+  int64_t now = i2c_backend_now_us();
+  esp_err_t err;
+
+  for (uint8_t i = 0; i < txn->n_ops; i++) {
+    if (txn->ops[i].kind == I2C_OP_WRITE)
+      wr = &txn->ops[i];
+    else
+      rd = &txn->ops[i];
+  }
+
+  pthread_mutex_lock(&LOCK);
+
+  // nothing at this address
+  if ((dev = find_device(txn->addr)) == NULL) {
+    pthread_mutex_unlock(&LOCK);
+    return ESP_FAIL;
+  }
+
+  dev->stats.txns++;
+  fault = next_fault(dev, rd != NULL);
+
+  if (fault == I2C_SIM_FAULT_NACK) {
+    dev->stats.nacks++;
+    err = ESP_FAIL;
+  } else if (fault == I2C_SIM_FAULT_TIMEOUT) {
+    dev->stats.timeouts++;
+    err = ESP_ERR_TIMEOUT;
+  } else if (dev->addr == I2C_SIM_SHT_20_ADDR) {
+    err = sht_20_xfer(dev, wr, rd, now, fault == I2C_SIM_FAULT_BAD_CRC);
+  } else if (dev->addr == I2C_SIM_APDS_3901_ADDR) {
+    err = apds_3901_xfer(dev, wr, rd, now, fault == I2C_SIM_FAULT_BAD_CRC);
+  } else {
+    err = seesaw_xfer(dev, wr, rd, now, fault == I2C_SIM_FAULT_BAD_CRC);
+  }
+
+  pthread_mutex_unlock(&LOCK);
+
+  // a stuck bus holds the caller for the whole timeout
+  if (fault == I2C_SIM_FAULT_TIMEOUT)
+    usleep(txn->timeout_ms * 1000);
+
+  return err;
+}
+
+int64_t i2c_backend_now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void i2c_backend_get_stats(i2c_bus_stats_t *stats) {
+  stats->pool_links = 0;
+  stats->heap_links = 0;
+}
+
+/**
+ * @brief Reset every simulated device, the environment, and injected faults.
+ * @param seed seed for random faults and Seesaw replies, 0 is treated as 1
+ */
+void i2c_sim_reset(uint32_t seed) {
+  const sim_device_t devices[N_DEVICES] = DEVICE_DEFAULTS;
+  const i2c_sim_env_t env = ENV_DEFAULTS;
+
+  pthread_mutex_lock(&LOCK);
+  memcpy(DEVICES, devices, sizeof(DEVICES));
+  ENV = env;
+  INVALID_PER_MILLE = 0;
+  RNG = seed ? seed : 1;
+  pthread_mutex_unlock(&LOCK);
+}
+
+/**
+ * @brief Set what the simulated sensors measure.
+ * @param env environment
+ */
+void i2c_sim_set_env(const i2c_sim_env_t *env) {
+  pthread_mutex_lock(&LOCK);
+  ENV = *env;
+  pthread_mutex_unlock(&LOCK);
+}
+
+/**
+ * @brief Fail the next `count` transactions to a device.
+ * @param addr device address
+ * @param fault fault to inject, bad CRCs are only injected into reads
+ * @param count number of transactions
+ * @return error, `ESP_ERR_NOT_FOUND` if no device is simulated at `addr`
+ */
+esp_err_t i2c_sim_inject(uint8_t addr, i2c_sim_fault_t fault, uint32_t count) {
+  sim_device_t *dev;
+
+  pthread_mutex_lock(&LOCK);
+  if ((dev = find_device(addr)) != NULL) {
+    dev->fault = fault;
+    dev->fault_count = count;
+  }
+  pthread_mutex_unlock(&LOCK);
+
+  return dev != NULL ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+/**
+ * @brief Fail transactions to a device at random.
+ * @param addr device address
+ * @param fault fault to inject
+ * @param per_mille chance of each transaction failing, out of 1000
+ * @return error, `ESP_ERR_NOT_FOUND` if no device is simulated at `addr`
+ */
+esp_err_t i2c_sim_set_fault_rate(uint8_t addr, i2c_sim_fault_t fault,
+                                 uint16_t per_mille) {
+  sim_device_t *dev;
+
+  pthread_mutex_lock(&LOCK);
+  if ((dev = find_device(addr)) != NULL) {
+    dev->rate_fault = fault;
+    dev->rate_per_mille = per_mille;
+  }
+  pthread_mutex_unlock(&LOCK);
+
+  return dev != NULL ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+/**
+ * @brief Make the Seesaw reply 0xFFFF at random, as the real one does.
+ * @param per_mille chance of each read being invalid, out of 1000
+ */
+void i2c_sim_set_invalid_rate(uint16_t per_mille) {
+  pthread_mutex_lock(&LOCK);
+  INVALID_PER_MILLE = per_mille;
+  pthread_mutex_unlock(&LOCK);
+}
+
+/**
+ * @brief Get a simulated device's counters.
+ * @param addr device address
+ * @param stats return-arg for counters
+ * @return error, `ESP_ERR_NOT_FOUND` if no device is simulated at `addr`
+ */
+esp_err_t i2c_sim_get_stats(uint8_t addr, i2c_sim_stats_t *stats) {
+  sim_device_t *dev;
+
+  pthread_mutex_lock(&LOCK);
+  if ((dev = find_device(addr)) != NULL)
+    *stats = dev->stats;
+  pthread_mutex_unlock(&LOCK);
+
+  return dev != NULL ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
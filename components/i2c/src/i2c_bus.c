@@ -0,0 +1,268 @@
+#include "../include/i2c_bus.h"
+#include "diag.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "i2c_backend.h"
+#include <string.h>
+
+static const char *TAG = "i2c_bus_component";
+
+/// Global vars, the queue and task are statically allocated
+static QueueHandle_t QUEUE = NULL;
+static StaticQueue_t QUEUE_BUF;
+static uint8_t QUEUE_STORAGE[I2C_BUS_QUEUE_LEN * sizeof(i2c_txn_t *)];
+static TaskHandle_t TASK = NULL;
+static StaticTask_t TASK_BUF;
+static StackType_t TASK_STACK[I2C_BUS_TASK_STACK_SIZE];
+static i2c_bus_stats_t STATS;
+static portMUX_TYPE STATS_MUX = portMUX_INITIALIZER_UNLOCKED;
+
+static void run_txn(i2c_txn_t *txn) {
+  int64_t start = i2c_backend_now_us();
+
+  txn->wait_us = (uint32_t)(start - txn->queued_us);
+  txn->err = i2c_backend_transfer(txn);
+  txn->xfer_us = (uint32_t)(i2c_backend_now_us() - start);
+
+  portENTER_CRITICAL(&STATS_MUX);
+  STATS.txns++;
+  if (txn->err != ESP_OK)
+    STATS.errors++;
+  if (txn->err == ESP_ERR_TIMEOUT)
+    STATS.timeouts++;
+  if (txn->wait_us > STATS.max_wait_us)
+    STATS.max_wait_us = txn->wait_us;
+  STATS.busy_us += txn->xfer_us;
+  portEXIT_CRITICAL(&STATS_MUX);
+
+  // the driver reports a missing ACK as a generic failure
+  DIAG_I2C(txn->addr, txn->xfer_us);
+  if (txn->err == ESP_FAIL)
+    DIAG_ERROR(DIAG_ERR_NACK);
+  else if (txn->err == ESP_ERR_TIMEOUT)
+    DIAG_ERROR(DIAG_ERR_TIMEOUT);
+
+  if (txn->err != ESP_OK)
+    ESP_LOGD(TAG, "Transaction to %02x failed: %s", txn->addr,
+             esp_err_to_name(txn->err));
+}
+
+static void i2c_bus_task(void *arg) {
+  i2c_txn_t *txn;
+  uint32_t batch;
+
+  for (;;) {
+    xQueueReceive(QUEUE, &txn, portMAX_DELAY);
+
+    // run whatever else is already queued before blocking again
+    batch = 0;
+    do {
+      run_txn(txn);
+      xSemaphoreGive(txn->done); // `txn` may go out of scope after this
+      batch++;
+    } while (batch < I2C_BUS_MAX_BATCH &&
+             xQueueReceive(QUEUE, &txn, 0) == pdTRUE);
+
+    portENTER_CRITICAL(&STATS_MUX);
+    STATS.wakeups++;
+    if (batch > STATS.max_batch)
+      STATS.max_batch = batch;
+    portEXIT_CRITICAL(&STATS_MUX);
+  }
+
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Start the bus manager task, which owns all access to the I2C bus.
+ * Safe to call more than once.
+ * @return error
+ */
+esp_err_t init_i2c_bus(void) {
+  if (TASK != NULL)
+    return ESP_OK;
+
+  if (QUEUE == NULL)
+    QUEUE = xQueueCreateStatic(I2C_BUS_QUEUE_LEN, sizeof(i2c_txn_t *),
+                               QUEUE_STORAGE, &QUEUE_BUF);
+
+  if ((TASK = xTaskCreateStatic(&i2c_bus_task, "i2c_bus_task",
+                                I2C_BUS_TASK_STACK_SIZE, NULL, 7, TASK_STACK,
+                                &TASK_BUF)) == NULL) {
+    ESP_LOGE(TAG, "Error creating I2C bus task");
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  return ESP_OK;
+}
+
+/**
+ * @brief Initialize an empty transaction.
+ * @param txn transaction
+ * @param port I2C bus
+ * @param addr 7-bit device address
+ */
+void i2c_txn_init(i2c_txn_t *txn, i2c_port_t port, uint8_t addr) {
+  memset(txn, 0, sizeof(i2c_txn_t));
+  txn->port = port;
+  txn->addr = addr;
+  txn->timeout_ms = I2C_TXN_DEFAULT_TIMEOUT_MS;
+}
+
+static void add_op(i2c_txn_t *txn, i2c_op_kind_t kind, uint8_t *data,
+                   size_t len) {
+  if (txn->n_ops >= I2C_TXN_MAX_OPS) {
+    txn->err = ESP_ERR_INVALID_ARG;
+    return;
+  }
+  txn->ops[txn->n_ops].kind = kind;
+  txn->ops[txn->n_ops].data = data;
+  txn->ops[txn->n_ops].len = len;
+  txn->n_ops++;
+}
+
+/**
+ * @brief Append a write to a transaction, after a (repeated) start.
+ */
+void i2c_txn_write(i2c_txn_t *txn, uint8_t *data, size_t len) {
+  add_op(txn, I2C_OP_WRITE, data, len);
+}
+
+/**
+ * @brief Append a read to a transaction, after a (repeated) start. The last
+ * byte is NACKed.
+ */
+void i2c_txn_read(i2c_txn_t *txn, uint8_t *data, size_t len) {
+  add_op(txn, I2C_OP_READ, data, len);
+}
+
+/**
+ * @brief Queue a transaction on the bus manager, and block until it
+ * completes. Transactions from different tasks never overlap on the bus.
+ * @param txn transaction, timing is filled in on return
+ * @return error
+ */
+esp_err_t i2c_bus_submit(i2c_txn_t *txn) {
+  if (txn->err != ESP_OK || txn->n_ops == 0)
+    return ESP_ERR_INVALID_ARG;
+  if (QUEUE == NULL) {
+    ESP_LOGE(TAG, "I2C bus not initialized");
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  txn->done = xSemaphoreCreateBinaryStatic(&txn->done_buf);
+  txn->queued_us = i2c_backend_now_us();
+  xQueueSend(QUEUE, &txn, portMAX_DELAY);
+  xSemaphoreTake(txn->done, portMAX_DELAY);
+
+  return txn->err;
+}
+
+/**
+ * @brief Write `len` bytes to a device.
+ * @return error
+ */
+esp_err_t i2c_bus_write(i2c_port_t port, uint8_t addr, uint8_t *data,
+                        size_t len) {
+  i2c_txn_t txn;
+
+  i2c_txn_init(&txn, port, addr);
+  i2c_txn_write(&txn, data, len);
+  return i2c_bus_submit(&txn);
+}
+
+/**
+ * @brief Read `len` bytes from a device.
+ * @return error
+ */
+esp_err_t i2c_bus_read(i2c_port_t port, uint8_t addr, uint8_t *data,
+                       size_t len) {
+  i2c_txn_t txn;
+
+  i2c_txn_init(&txn, port, addr);
+  i2c_txn_read(&txn, data, len);
+  return i2c_bus_submit(&txn);
+}
+
+/**
+ * @brief Write `wlen` bytes to a device, then read `rlen` bytes after a
+ * repeated start.
+ * @return error
+ */
+esp_err_t i2c_bus_write_read(i2c_port_t port, uint8_t addr, uint8_t *wdata,
+                             size_t wlen, uint8_t *rdata, size_t rlen) {
+  i2c_txn_t txn;
+
+  i2c_txn_init(&txn, port, addr);
+  i2c_txn_write(&txn, wdata, wlen);
+  i2c_txn_read(&txn, rdata, rlen);
+  return i2c_bus_submit(&txn);
+}
+
+/**
+ * @brief Write a single register.
+ * @param port I2C bus
+ * @param addr 7-bit device address
+ * @param reg register address
+ * @param val value to write
+ * @return error
+ */
+esp_err_t i2c_write_reg(i2c_port_t port, uint8_t addr, uint8_t reg,
+                        uint8_t val) {
+  uint8_t buf[2] = {reg, val};
+  return i2c_bus_write(port, addr, buf, sizeof(buf));
+}
+
+/**
+ * @brief Read a single register.
+ * @param port I2C bus
+ * @param addr 7-bit device address
+ * @param reg register address
+ * @param val return-arg for register value
+ * @return error
+ */
+esp_err_t i2c_read_reg(i2c_port_t port, uint8_t addr, uint8_t reg,
+                       uint8_t *val) {
+  return i2c_bus_write_read(port, addr, &reg, 1, val, 1);
+}
+
+/**
+ * @brief Read a 16-bit word, low byte first, starting at a register.
+ * @param port I2C bus
+ * @param addr 7-bit device address
+ * @param reg register address, including any command bits
+ * @param val return-arg for word, only set on success
+ * @return error
+ */
+esp_err_t i2c_read_wide(i2c_port_t port, uint8_t addr, uint8_t reg,
+                        uint16_t *val) {
+  uint8_t buf[2]; // lo, hi
+  esp_err_t err;
+
+  if ((err = i2c_bus_write_read(port, addr, &reg, 1, buf, sizeof(buf))) ==
+      ESP_OK)
+    *val = buf[0] | (buf[1] << 8);
+  return err;
+}
+
+/**
+ * @brief Get a copy of the bus statistics.
+ * @param stats return-arg for statistics
+ */
+void i2c_bus_get_stats(i2c_bus_stats_t *stats) {
+  portENTER_CRITICAL(&STATS_MUX);
+  memcpy(stats, &STATS, sizeof(i2c_bus_stats_t));
+  portEXIT_CRITICAL(&STATS_MUX);
+  i2c_backend_get_stats(stats);
+}
+
+/**
+ * @brief Get the bus clock, for timing conversions. On Linux this is the
+ * simulator's clock.
+ * @return microseconds since boot
+ */
+int64_t i2c_bus_now_us(void) { return i2c_backend_now_us(); }
@@ -0,0 +1,52 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/// "YYYY-MM-DDThh:mm:ssZ"
+#define JSON_ISO_8601_LEN 20
+
+/// Bounded JSON writer over a caller-owned buffer, never allocates
+typedef struct json_writer {
+  char *buf;
+  size_t len;
+  size_t n;      // bytes written so far, excluding the terminating NUL
+  bool overflow; // set if a write didn't fit, `n` stops growing
+  bool need_sep; // next key needs a leading ','
+} json_writer_t;
+
+/// Last formatted timestamp, so only the changed fields are re-rendered
+typedef struct json_iso_8601_cache {
+  int64_t minute; // minutes since the epoch of `text`, INT64_MIN if empty
+  int64_t day;    // days since the epoch of `text`
+  char text[JSON_ISO_8601_LEN];
+} json_iso_8601_cache_t;
+
+/// Static initializer, equivalent to `json_iso_8601_cache_init`
+#define JSON_ISO_8601_CACHE_INIT                                               \
+  { .minute = INT64_MIN }
+
+void json_write_init(json_writer_t *w, char *buf, size_t len);
+void json_write_begin(json_writer_t *w);
+void json_write_end(json_writer_t *w);
+void json_write_key(json_writer_t *w, const char *key);
+void json_write_array_begin(json_writer_t *w);
+void json_write_array_end(json_writer_t *w);
+void json_write_item(json_writer_t *w);
+void json_write_string(json_writer_t *w, const char *str);
+void json_write_uint(json_writer_t *w, uint32_t val);
+void json_write_int(json_writer_t *w, int32_t val);
+void json_write_fixed(json_writer_t *w, float val, uint8_t decimals);
+void json_write_iso_8601(json_writer_t *w, json_iso_8601_cache_t *cache,
+                         time_t when);
+esp_err_t json_write_finish(json_writer_t *w, size_t *len);
+
+void json_iso_8601_cache_init(json_iso_8601_cache_t *cache);
+void json_format_iso_8601(json_iso_8601_cache_t *cache, time_t when,
+                          char out[JSON_ISO_8601_LEN]);
+
+#endif
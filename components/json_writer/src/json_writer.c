@@ -0,0 +1,260 @@
+#include "../include/json_writer.h"
+#include "esp_err.h"
+#include <string.h>
+
+#define SECS_PER_DAY 86400
+#define MAX_DECIMALS 6
+
+static const uint32_t POW10[MAX_DECIMALS + 1] = {1,     10,     100,    1000,
+                                                 10000, 100000, 1000000};
+
+static void put(json_writer_t *w, const char *src, size_t n) {
+  // always leave room for the terminating NUL
+  if (w->overflow || n >= w->len - w->n) {
+    w->overflow = true;
+    return;
+  }
+  memcpy(w->buf + w->n, src, n);
+  w->n += n;
+}
+
+static void put_char(json_writer_t *w, char c) { put(w, &c, 1); }
+
+/// Write `val` as exactly `width` digits, or as few as needed if `width` is 0
+static void put_digits(json_writer_t *w, uint32_t val, uint8_t width) {
+  char digits[10];
+  uint8_t i = sizeof(digits);
+
+  do {
+    digits[--i] = '0' + (val % 10);
+    val /= 10;
+  } while ((val > 0 || sizeof(digits) - i < width) && i > 0);
+
+  put(w, digits + i, sizeof(digits) - i);
+}
+
+/// Write two digits at `dst`
+static void render_2(char *dst, uint32_t val) {
+  dst[0] = '0' + (val / 10);
+  dst[1] = '0' + (val % 10);
+}
+
+/**
+ * @brief Initialize a writer over a caller-owned buffer. The buffer is always
+ * NUL-terminated by `json_write_finish`.
+ * @param w writer
+ * @param buf output buffer
+ * @param len size of `buf`, including room for the NUL
+ */
+void json_write_init(json_writer_t *w, char *buf, size_t len) {
+  w->buf = buf;
+  w->len = len;
+  w->n = 0;
+  w->overflow = len == 0;
+  w->need_sep = false;
+}
+
+void json_write_begin(json_writer_t *w) {
+  put_char(w, '{');
+  w->need_sep = false;
+}
+
+void json_write_end(json_writer_t *w) {
+  put_char(w, '}');
+  w->need_sep = true;
+}
+
+/**
+ * @brief Write an object key, with a leading ',' if it isn't the first.
+ */
+void json_write_key(json_writer_t *w, const char *key) {
+  if (w->need_sep)
+    put_char(w, ',');
+  json_write_string(w, key);
+  put_char(w, ':');
+  w->need_sep = true;
+}
+
+void json_write_array_begin(json_writer_t *w) {
+  put_char(w, '[');
+  w->need_sep = false;
+}
+
+void json_write_array_end(json_writer_t *w) {
+  put_char(w, ']');
+  w->need_sep = true;
+}
+
+/**
+ * @brief Start an array element, with a leading ',' if it isn't the first.
+ */
+void json_write_item(json_writer_t *w) {
+  if (w->need_sep)
+    put_char(w, ',');
+  w->need_sep = true;
+}
+
+void json_write_string(json_writer_t *w, const char *str) {
+  const char *start = str;
+
+  put_char(w, '"');
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      put(w, start, str - start);
+      put_char(w, '\\');
+      start = str;
+    }
+  }
+  put(w, start, str - start);
+  put_char(w, '"');
+}
+
+void json_write_uint(json_writer_t *w, uint32_t val) { put_digits(w, val, 0); }
+
+void json_write_int(json_writer_t *w, int32_t val) {
+  if (val < 0) {
+    put_char(w, '-');
+    put_digits(w, (uint32_t)(-(int64_t)val), 0);
+  } else {
+    put_digits(w, (uint32_t)val, 0);
+  }
+}
+
+/**
+ * @brief Write a float with a fixed number of decimals, rounding half away
+ * from zero. Uses single-precision math only, and no printf. Values that can't
+ * be represented in JSON (NaN, infinities, or more than 32 bits of integer
+ * part) are written as `null`.
+ * @param w writer
+ * @param val value
+ * @param decimals digits after the decimal point, at most 6
+ */
+void json_write_fixed(json_writer_t *w, float val, uint8_t decimals) {
+  uint32_t ip, fp;
+  float frac;
+
+  if (decimals > MAX_DECIMALS)
+    decimals = MAX_DECIMALS;
+
+  // NaN compares unequal to itself
+  if (val != val || val >= 4294967295.0f || val <= -4294967295.0f) {
+    put(w, "null", 4);
+    return;
+  }
+
+  if (val < 0) {
+    val = -val;
+    // don't write "-0.00"
+    if (val * POW10[decimals] >= 0.5f)
+      put_char(w, '-');
+  }
+
+  ip = (uint32_t)val;
+  frac = val - (float)ip;
+  fp = (uint32_t)(frac * POW10[decimals] + 0.5f);
+  if (fp >= POW10[decimals]) {
+    ip++;
+    fp -= POW10[decimals];
+  }
+
+  put_digits(w, ip, 0);
+  if (decimals > 0) {
+    put_char(w, '.');
+    put_digits(w, fp, decimals);
+  }
+}
+
+/**
+ * @brief Write a quoted ISO-8601 UTC timestamp, re-using the cached date.
+ * @param w writer
+ * @param cache timestamp cache
+ * @param when seconds since the epoch
+ */
+void json_write_iso_8601(json_writer_t *w, json_iso_8601_cache_t *cache,
+                         time_t when) {
+  char ts[JSON_ISO_8601_LEN];
+
+  json_format_iso_8601(cache, when, ts);
+  put_char(w, '"');
+  put(w, ts, JSON_ISO_8601_LEN);
+  put_char(w, '"');
+}
+
+/**
+ * @brief NUL-terminate the output and check that everything fit.
+ * @param w writer
+ * @param len return-arg for output length, excluding the NUL
+ * @return error, `ESP_ERR_INVALID_SIZE` if the buffer was too small
+ */
+esp_err_t json_write_finish(json_writer_t *w, size_t *len) {
+  if (w->len > 0)
+    w->buf[w->n] = '\0';
+  if (w->overflow)
+    return ESP_ERR_INVALID_SIZE;
+  *len = w->n;
+  return ESP_OK;
+}
+
+void json_iso_8601_cache_init(json_iso_8601_cache_t *cache) {
+  memset(cache, 0, sizeof(json_iso_8601_cache_t));
+  cache->minute = INT64_MIN;
+}
+
+/// Convert days since the epoch to a civil date, after H. Hinnant's
+/// `civil_from_days`
+static void civil_from_days(int64_t z, int32_t *y, uint32_t *m, uint32_t *d) {
+  int64_t era, doe, yoe, doy, mp;
+
+  z += 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = z - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  *d = (uint32_t)(doy - (153 * mp + 2) / 5 + 1);
+  *m = (uint32_t)(mp < 10 ? mp + 3 : mp - 9);
+  *y = (int32_t)(yoe + era * 400 + (*m <= 2));
+}
+
+/**
+ * @brief Format a UTC timestamp as "YYYY-MM-DDThh:mm:ssZ" (not NUL-terminated).
+ * Only the seconds are re-rendered if the minute matches the cached
+ * timestamp, and only the time of day if the day matches.
+ * @param cache timestamp cache
+ * @param when seconds since the epoch
+ * @param out output, exactly `JSON_ISO_8601_LEN` characters
+ */
+void json_format_iso_8601(json_iso_8601_cache_t *cache, time_t when,
+                          char out[JSON_ISO_8601_LEN]) {
+  int64_t t = (int64_t)when;
+  int64_t minute = (t >= 0 ? t : t - 59) / 60;
+  int64_t day = (t >= 0 ? t : t - SECS_PER_DAY + 1) / SECS_PER_DAY;
+  uint32_t secs = (uint32_t)(t - day * SECS_PER_DAY), m, d;
+  int32_t y;
+  char *text = cache->text;
+
+  if (cache->minute == INT64_MIN || day != cache->day) {
+    civil_from_days(day, &y, &m, &d);
+    render_2(text, (uint32_t)(y / 100) % 100);
+    render_2(text + 2, (uint32_t)y % 100);
+    text[4] = '-';
+    render_2(text + 5, m);
+    text[7] = '-';
+    render_2(text + 8, d);
+    text[10] = 'T';
+    text[13] = ':';
+    text[16] = ':';
+    text[19] = 'Z';
+    cache->day = day;
+    cache->minute = INT64_MIN;
+  }
+
+  if (minute != cache->minute) {
+    render_2(text + 11, secs / 3600);
+    render_2(text + 14, (secs / 60) % 60);
+    cache->minute = minute;
+  }
+
+  render_2(text + 17, secs % 60);
+  memcpy(out, text, JSON_ISO_8601_LEN);
+}
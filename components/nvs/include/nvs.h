@@ -1,6 +1,13 @@
 #ifndef NVS_H
 #define NVS_H
 
+#include "esp_err.h"
+#include <stddef.h>
+
 void init_nvs(void);
+esp_err_t read_nvs_blob(const char *ns, const char *key, void *buf,
+                        size_t len);
+esp_err_t write_nvs_blob(const char *ns, const char *key, const void *buf,
+                         size_t len);
 
 #endif
@@ -20,3 +20,55 @@ void init_nvs(void) {
 
   NVS_INIT = true;
 }
+
+/**
+ * @brief Read a fixed-size blob.
+ * @param ns NVS namespace
+ * @param key blob key
+ * @param buf return-arg for the blob
+ * @param len size of `buf`, the stored blob must be exactly this size
+ * @return error, `ESP_ERR_NOT_FOUND` if nothing is stored, and
+ * `ESP_ERR_INVALID_SIZE` if the stored blob is a different size
+ */
+esp_err_t read_nvs_blob(const char *ns, const char *key, void *buf,
+                        size_t len) {
+  nvs_handle_t handle;
+  size_t stored = len;
+  esp_err_t err;
+
+  init_nvs();
+  // a namespace that was never written doesn't exist yet
+  if ((err = nvs_open(ns, NVS_READONLY, &handle)) == ESP_OK) {
+    err = nvs_get_blob(handle, key, buf, &stored);
+    nvs_close(handle);
+  }
+
+  if (err == ESP_ERR_NVS_NOT_FOUND)
+    return ESP_ERR_NOT_FOUND;
+  if (err == ESP_ERR_NVS_INVALID_LENGTH || (err == ESP_OK && stored != len))
+    return ESP_ERR_INVALID_SIZE;
+  return err;
+}
+
+/**
+ * @brief Write and commit a blob.
+ * @param ns NVS namespace
+ * @param key blob key
+ * @param buf blob
+ * @param len size of `buf`
+ * @return error
+ */
+esp_err_t write_nvs_blob(const char *ns, const char *key, const void *buf,
+                         size_t len) {
+  nvs_handle_t handle;
+  esp_err_t err;
+
+  init_nvs();
+  if ((err = nvs_open(ns, NVS_READWRITE, &handle)) != ESP_OK)
+    return err;
+
+  if ((err = nvs_set_blob(handle, key, buf, len)) == ESP_OK)
+    err = nvs_commit(handle);
+  nvs_close(handle);
+  return err;
+}
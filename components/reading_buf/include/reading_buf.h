@@ -0,0 +1,56 @@
+#ifndef READING_BUF_H
+#define READING_BUF_H
+
+#include "esp_err.h"
+#include "readings.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#if CONFIG_READING_BUF_CAPACITY
+#define READING_BUF_CAPACITY CONFIG_READING_BUF_CAPACITY
+#else
+#define READING_BUF_CAPACITY 128
+#endif
+
+#if CONFIG_READING_BUF_DROP_NEWEST
+#define READING_BUF_POLICY READING_BUF_DROP_NEWEST
+#elif CONFIG_READING_BUF_COALESCE
+#define READING_BUF_POLICY READING_BUF_COALESCE
+#else
+#define READING_BUF_POLICY READING_BUF_DROP_OLDEST
+#endif
+
+/// What to do with a new reading when the buffer is full
+typedef enum reading_buf_policy {
+  READING_BUF_DROP_OLDEST = 0,
+  READING_BUF_DROP_NEWEST,
+  READING_BUF_COALESCE // keep only the latest reading of each sensor
+} reading_buf_policy_t;
+
+typedef struct reading_buf {
+  reading_t *records;
+  uint16_t capacity;
+  uint16_t head; // index of oldest reading
+  uint16_t count;
+  uint16_t sent; // oldest readings passed to a sink, waiting to be acked
+  reading_buf_policy_t policy;
+  uint32_t pushed;
+  uint32_t dropped;
+  uint32_t coalesced; // superseded by a later reading of the same sensor
+  uint32_t drained;   // acknowledged and removed
+  uint32_t resent;    // sent again after their acknowledgement never came
+} reading_buf_t;
+
+/// Called for each sent reading, oldest first. Return an error to stop
+/// sending, the reading stays unsent.
+typedef esp_err_t (*reading_buf_sink_t)(const reading_t *reading, void *arg);
+
+void reading_buf_init(reading_buf_t *buf, reading_t *records,
+                      uint16_t capacity, reading_buf_policy_t policy);
+bool reading_buf_push(reading_buf_t *buf, const reading_t *reading);
+int reading_buf_send(reading_buf_t *buf, reading_buf_sink_t sink, void *arg,
+                     uint16_t window);
+uint16_t reading_buf_ack(reading_buf_t *buf, uint16_t n);
+void reading_buf_resend(reading_buf_t *buf);
+
+#endif
@@ -0,0 +1,156 @@
+#include "../include/reading_buf.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "reading_buf_component";
+
+/**
+ * @brief Initialize an empty buffer.
+ * @param buf buffer to initialize
+ * @param records storage for `capacity` readings, e.g. in RTC memory
+ * @param capacity number of readings that fit in `records`
+ * @param policy what to do with a new reading when the buffer is full
+ */
+void reading_buf_init(reading_buf_t *buf, reading_t *records,
+                      uint16_t capacity, reading_buf_policy_t policy) {
+  memset(buf, 0, sizeof(reading_buf_t));
+  buf->records = records;
+  buf->capacity = capacity;
+  buf->policy = policy;
+}
+
+/// Remove every unsent reading that has a later one of the same sensor,
+/// keeping the rest in order
+static void coalesce(reading_buf_t *buf) {
+  uint16_t last[SENSOR_MAX] = {0}, n = buf->sent;
+  reading_t *r;
+
+  for (uint16_t i = buf->sent; i < buf->count; i++) {
+    r = &buf->records[(buf->head + i) % buf->capacity];
+    if (r->sensor < SENSOR_MAX)
+      last[r->sensor] = i;
+  }
+
+  // kept readings only ever move towards the head, so nothing is overwritten
+  // before it's copied
+  for (uint16_t i = buf->sent; i < buf->count; i++) {
+    r = &buf->records[(buf->head + i) % buf->capacity];
+    if (r->sensor >= SENSOR_MAX || last[r->sensor] != i)
+      continue;
+    buf->records[(buf->head + n) % buf->capacity] = *r;
+    n++;
+  }
+
+  buf->coalesced += buf->count - n;
+  buf->count = n;
+}
+
+/// Remove the oldest unsent reading, sent readings move up into its slot so
+/// they stay in front
+static void drop_oldest(reading_buf_t *buf) {
+  for (uint16_t i = buf->sent; i > 0; i--)
+    buf->records[(buf->head + i) % buf->capacity] =
+        buf->records[(buf->head + i - 1) % buf->capacity];
+  buf->head = (buf->head + 1) % buf->capacity;
+  buf->count--;
+}
+
+/**
+ * @brief Add a reading to the buffer, applying the overflow policy if full.
+ * Readings waiting to be acknowledged are never dropped or coalesced, if
+ * they fill the buffer the new reading is dropped.
+ * @param buf buffer
+ * @param reading reading to add
+ * @return false if a reading was dropped or coalesced
+ */
+bool reading_buf_push(reading_buf_t *buf, const reading_t *reading) {
+  uint16_t tail;
+  bool kept_all = true, newest;
+
+  buf->pushed++;
+
+  if (buf->count == buf->capacity && buf->policy == READING_BUF_COALESCE) {
+    coalesce(buf);
+    kept_all = false;
+#if CONFIG_READING_BUF_LOG_DROPS
+    ESP_LOGW(TAG, "Buffer full, kept the latest reading of each sensor (%u "
+             "coalesced)",
+             buf->coalesced);
+#endif
+  }
+
+  if (buf->count == buf->capacity) {
+    newest = buf->policy == READING_BUF_DROP_NEWEST || buf->sent == buf->count;
+    buf->dropped++;
+#if CONFIG_READING_BUF_LOG_DROPS
+    ESP_LOGW(TAG, "Buffer full, dropping %s reading (%u dropped)",
+             newest ? "newest" : "oldest", buf->dropped);
+#endif
+    if (newest)
+      return false;
+    drop_oldest(buf);
+    kept_all = false;
+  }
+
+  tail = (buf->head + buf->count) % buf->capacity;
+  buf->records[tail] = *reading;
+  buf->count++;
+  return kept_all;
+}
+
+/**
+ * @brief Pass unsent readings to `sink`, oldest first, until `window` readings
+ * are waiting to be acknowledged. Sent readings stay in the buffer until
+ * `reading_buf_ack`. Stops at the first reading that `sink` rejects.
+ * @param buf buffer
+ * @param sink called for each reading
+ * @param arg argument passed to `sink`
+ * @param window most readings waiting to be acknowledged at once, keep it
+ * below the capacity so that new readings still fit
+ * @return number of readings sent
+ */
+int reading_buf_send(reading_buf_t *buf, reading_buf_sink_t sink, void *arg,
+                     uint16_t window) {
+  int n = 0;
+
+  while (buf->sent < buf->count && buf->sent < window) {
+    if (sink(&buf->records[(buf->head + buf->sent) % buf->capacity], arg) !=
+        ESP_OK)
+      break;
+    buf->sent++;
+    n++;
+  }
+
+  return n;
+}
+
+/**
+ * @brief Remove the oldest sent readings, once they're acknowledged.
+ * @param buf buffer
+ * @param n number of readings acknowledged, oldest first
+ * @return number of readings removed, at most the number sent
+ */
+uint16_t reading_buf_ack(reading_buf_t *buf, uint16_t n) {
+  if (n > buf->sent)
+    n = buf->sent;
+
+  buf->head = (buf->head + n) % buf->capacity;
+  buf->count -= n;
+  buf->sent -= n;
+  buf->drained += n;
+  if (buf->count == 0)
+    buf->head = 0;
+
+  return n;
+}
+
+/**
+ * @brief Send every sent reading again on the next `reading_buf_send`, when
+ * their acknowledgements won't come, e.g. after a reconnect.
+ * @param buf buffer
+ */
+void reading_buf_resend(reading_buf_t *buf) {
+  buf->resent += buf->sent;
+  buf->sent = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef READINGS_H
+#define READINGS_H
+
+#include <stdint.h>
+
+/// Sensor streams published by the garden monitor
+typedef enum sensor_id {
+  SENSOR_TEMPERATURE = 0,
+  SENSOR_HUMIDITY,
+  SENSOR_LUX,
+  SENSOR_SOIL_MOISTURE,
+  SENSOR_BATTERY_VOLTAGE,
+  SENSOR_MAX
+} sensor_id_t;
+
+#define SENSOR_BIT(id) (1 << (id))
+#define SENSOR_ALL_BITS (SENSOR_BIT(SENSOR_MAX) - 1)
+
+/// Compact record of a single reading
+typedef struct __attribute__((packed)) reading {
+  uint32_t captured_ms; // low 32 bits of the capture `timebase_now_ms`
+  float value;
+  uint8_t sensor; // sensor_id_t
+} reading_t;
+
+/// One reading of every sensor, stamped once
+typedef struct snapshot {
+  int64_t captured_ms; // `timebase_now_ms` when sampling started
+  uint8_t valid; // SENSOR_BIT of every successful reading
+  float temp;
+  float humd;
+  float lux;
+  uint16_t moist;
+  uint32_t batt;
+  uint32_t awake_ms; // previous duty cycle's awake time, 0 if unknown
+} snapshot_t;
+
+#endif
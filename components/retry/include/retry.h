@@ -0,0 +1,76 @@
+#ifndef RETRY_H
+#define RETRY_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Config constants
+#if CONFIG_RETRY_MAX_ATTEMPTS
+#define RETRY_MAX_ATTEMPTS CONFIG_RETRY_MAX_ATTEMPTS
+#else
+#define RETRY_MAX_ATTEMPTS 5
+#endif
+
+#if CONFIG_RETRY_BASE_MS
+#define RETRY_BASE_MS CONFIG_RETRY_BASE_MS
+#else
+#define RETRY_BASE_MS 10
+#endif
+
+#if CONFIG_RETRY_MAX_MS
+#define RETRY_MAX_MS CONFIG_RETRY_MAX_MS
+#else
+#define RETRY_MAX_MS 320
+#endif
+
+#if CONFIG_RETRY_TRIP_FAILURES
+#define RETRY_TRIP_FAILURES CONFIG_RETRY_TRIP_FAILURES
+#else
+#define RETRY_TRIP_FAILURES 3
+#endif
+
+#if CONFIG_RETRY_OPEN_READS
+#define RETRY_OPEN_READS CONFIG_RETRY_OPEN_READS
+#else
+#define RETRY_OPEN_READS 5
+#endif
+
+/// Returned in place of a read while the device's breaker is open
+#define RETRY_ERR_OPEN ESP_ERR_INVALID_STATE
+
+typedef enum retry_breaker {
+  RETRY_CLOSED = 0, // reads go ahead
+  RETRY_OPEN,       // reads are skipped
+  RETRY_HALF_OPEN   // one single-attempt probe read
+} retry_breaker_t;
+
+typedef struct retry_stats {
+  uint32_t reads;    // reads allowed by the breaker
+  uint32_t retries;  // attempts after the first
+  uint32_t failures; // reads that used up their attempts
+  uint32_t trips;    // times the breaker opened
+  uint32_t skipped;  // reads skipped while the breaker was open
+} retry_stats_t;
+
+/// Retry and circuit breaker state of one device
+typedef struct retry {
+  const char *name;
+  retry_breaker_t state;
+  uint8_t failures;  // failed reads in a row
+  uint8_t skip_left; // reads left to skip while open
+  retry_stats_t stats;
+} retry_t;
+
+/// Static initializer, e.g. for state kept in RTC memory
+#define RETRY_INIT(n)                                                          \
+  { .name = (n), .state = RETRY_CLOSED }
+
+void retry_init(retry_t *r, const char *name);
+bool retry_begin(retry_t *r);
+bool retry_backoff(retry_t *r, uint8_t attempts, uint32_t *delay_ms);
+esp_err_t retry_end(retry_t *r, esp_err_t err);
+bool retry_is_open(const retry_t *r);
+void retry_get_stats(const retry_t *r, retry_stats_t *stats);
+
+#endif
@@ -0,0 +1,170 @@
+#include "../include/retry.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/portmacro.h"
+#include <string.h>
+
+static const char *TAG = "retry_component";
+
+/// Drivers are read from more than one task
+static portMUX_TYPE RETRY_MUX = portMUX_INITIALIZER_UNLOCKED;
+
+/// Jitter only has to keep retries from lining up, not be unpredictable, but
+/// devices sharing a bus or a broker shouldn't all retry in step. Seeded on
+/// first use.
+static uint32_t JITTER_STATE = 0;
+
+static uint32_t jitter_seed(void) {
+  uint32_t seed;
+#if CONFIG_IDF_TARGET_LINUX
+  uint8_t mac[6] = {0};
+
+  esp_read_mac(mac, ESP_MAC_WIFI_STA);
+  seed = (uint32_t)mac[2] << 24 | (uint32_t)mac[3] << 16 |
+         (uint32_t)mac[4] << 8 | mac[5];
+#else
+  seed = esp_random();
+#endif
+  // xorshift never leaves 0
+  return seed != 0 ? seed : 0x9e3779b9;
+}
+
+/// Call under RETRY_MUX
+static uint32_t jitter(void) {
+  uint32_t x = JITTER_STATE;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  JITTER_STATE = x;
+  return x;
+}
+
+/**
+ * @brief Initialize retry state, with the breaker closed.
+ * @param r retry state
+ * @param name device name, used in log messages
+ */
+void retry_init(retry_t *r, const char *name) {
+  memset(r, 0, sizeof(retry_t));
+  r->name = name;
+}
+
+/**
+ * @brief Start a read. While the breaker is open, reads are skipped until
+ * `RETRY_OPEN_READS` have gone by, then a single probe is let through.
+ * @param r retry state
+ * @return true if the device should be read, false to skip it
+ */
+bool retry_begin(retry_t *r) {
+  bool allow = true;
+
+  portENTER_CRITICAL(&RETRY_MUX);
+  if (r->state == RETRY_OPEN) {
+    if (r->skip_left > 0) {
+      r->skip_left--;
+      r->stats.skipped++;
+      allow = false;
+    } else {
+      r->state = RETRY_HALF_OPEN;
+    }
+  }
+  if (allow)
+    r->stats.reads++;
+  portEXIT_CRITICAL(&RETRY_MUX);
+
+  return allow;
+}
+
+/**
+ * @brief Decide whether to retry a failed attempt, and how long to wait
+ * first. Delays double from `RETRY_BASE_MS` up to `RETRY_MAX_MS`, and are
+ * jittered down by up to half.
+ * @param r retry state
+ * @param attempts failed attempts so far, in this read
+ * @param delay_ms return-arg for time to wait before retrying
+ * @return true to retry, false once out of attempts, or unless the breaker
+ * is closed
+ */
+bool retry_backoff(retry_t *r, uint8_t attempts, uint32_t *delay_ms) {
+  uint32_t delay = RETRY_BASE_MS;
+  bool again;
+
+  // seeded outside the critical section, a racing seed is as good as any
+  if (JITTER_STATE == 0)
+    JITTER_STATE = jitter_seed();
+
+  portENTER_CRITICAL(&RETRY_MUX);
+  // a probe gets a single attempt, and an open breaker none
+  again = r->state == RETRY_CLOSED && attempts < RETRY_MAX_ATTEMPTS;
+  if (again) {
+    r->stats.retries++;
+    for (uint8_t i = 1; i < attempts && delay < RETRY_MAX_MS; i++)
+      delay <<= 1;
+    if (delay > RETRY_MAX_MS)
+      delay = RETRY_MAX_MS;
+    *delay_ms = delay - jitter() % (delay / 2 + 1);
+  }
+  portEXIT_CRITICAL(&RETRY_MUX);
+
+  return again;
+}
+
+/**
+ * @brief Finish a read, updating the breaker.
+ * @param r retry state
+ * @param err result of the read
+ * @return `err`, for convenience
+ */
+esp_err_t retry_end(retry_t *r, esp_err_t err) {
+  bool tripped = false;
+
+  portENTER_CRITICAL(&RETRY_MUX);
+  if (err == ESP_OK) {
+    r->state = RETRY_CLOSED;
+    r->failures = 0;
+  } else {
+    r->stats.failures++;
+    if (r->failures < UINT8_MAX)
+      r->failures++;
+    if (r->state == RETRY_HALF_OPEN || r->failures >= RETRY_TRIP_FAILURES) {
+      tripped = r->state != RETRY_OPEN;
+      r->state = RETRY_OPEN;
+      r->skip_left = RETRY_OPEN_READS;
+      r->stats.trips += tripped;
+    }
+  }
+  portEXIT_CRITICAL(&RETRY_MUX);
+
+  if (tripped)
+    ESP_LOGW(TAG, "%s failed %u reads in a row, skipping the next %u",
+             r->name, r->failures, RETRY_OPEN_READS);
+  return err;
+}
+
+/**
+ * @brief Check whether a device's breaker is open, so reads are skipped.
+ * @param r retry state
+ * @return true if open
+ */
+bool retry_is_open(const retry_t *r) {
+  bool open;
+
+  portENTER_CRITICAL(&RETRY_MUX);
+  open = r->state == RETRY_OPEN;
+  portEXIT_CRITICAL(&RETRY_MUX);
+
+  return open;
+}
+
+/**
+ * @brief Get a copy of a device's retry counters.
+ * @param r retry state
+ * @param stats return-arg for counters
+ */
+void retry_get_stats(const retry_t *r, retry_stats_t *stats) {
+  portENTER_CRITICAL(&RETRY_MUX);
+  memcpy(stats, &r->stats, sizeof(retry_stats_t));
+  portEXIT_CRITICAL(&RETRY_MUX);
+}
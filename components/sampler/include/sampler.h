@@ -0,0 +1,58 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#if CONFIG_SAMPLER_COALESCE_MS
+#define SAMPLER_COALESCE_MS CONFIG_SAMPLER_COALESCE_MS
+#else
+#define SAMPLER_COALESCE_MS 1000
+#endif
+
+#if CONFIG_SAMPLER_TASK_STACK_SIZE
+#define SAMPLER_TASK_STACK_SIZE CONFIG_SAMPLER_TASK_STACK_SIZE
+#else
+#define SAMPLER_TASK_STACK_SIZE 2048
+#endif
+
+#define SAMPLER_MAX_JOBS 8
+
+/// Periodic job, run from the sampler task
+typedef void (*sampler_fn_t)(void *arg);
+
+typedef struct sampler_job {
+  const char *name;
+  sampler_fn_t fn;
+  void *arg;
+  uint32_t period_ms; // 0 while paused
+  uint32_t deadline_ms;
+} sampler_job_t;
+
+/// Deadline-ordered timer queue, independent of FreeRTOS
+typedef struct sampler_queue {
+  sampler_job_t jobs[SAMPLER_MAX_JOBS];
+  uint8_t order[SAMPLER_MAX_JOBS]; // job indices, earliest deadline first
+  uint8_t n_jobs;
+  uint8_t n_ordered; // jobs in `order`, paused jobs aren't
+  uint32_t coalesce_ms;
+  uint32_t wakeups; // number of `sampler_queue_run_due` calls that ran a job
+  uint32_t runs;    // number of jobs run
+} sampler_queue_t;
+
+void sampler_queue_init(sampler_queue_t *q, uint32_t coalesce_ms);
+esp_err_t sampler_queue_add(sampler_queue_t *q, const char *name,
+                            sampler_fn_t fn, void *arg, uint32_t period_ms,
+                            uint32_t now_ms);
+esp_err_t sampler_queue_set_period(sampler_queue_t *q, const char *name,
+                                   uint32_t period_ms, uint32_t now_ms);
+bool sampler_queue_next(const sampler_queue_t *q, uint32_t *deadline_ms);
+int sampler_queue_run_due(sampler_queue_t *q, uint32_t now_ms);
+
+esp_err_t sampler_add_job(const char *name, sampler_fn_t fn, void *arg,
+                          uint32_t period_ms);
+esp_err_t sampler_set_period(const char *name, uint32_t period_ms);
+esp_err_t sampler_start(void);
+
+#endif
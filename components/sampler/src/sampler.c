@@ -0,0 +1,141 @@
+#include "../include/sampler.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "timebase.h"
+
+static const char *TAG = "sampler_component";
+
+/// Global vars, the lock and task are statically allocated
+static sampler_queue_t QUEUE;
+static SemaphoreHandle_t LOCK = NULL;
+static StaticSemaphore_t LOCK_BUF;
+static TaskHandle_t TASK = NULL;
+static StaticTask_t TASK_BUF;
+static StackType_t TASK_STACK[SAMPLER_TASK_STACK_SIZE];
+
+/// Job periods are in monotonic time, which the Linux simulation speeds up
+static uint32_t now_ms(void) { return (uint32_t)timebase_now_ms(); }
+
+static esp_err_t init_sampler(void) {
+  if (LOCK != NULL)
+    return ESP_OK;
+
+  LOCK = xSemaphoreCreateMutexStatic(&LOCK_BUF);
+
+  sampler_queue_init(&QUEUE, SAMPLER_COALESCE_MS);
+  return ESP_OK;
+}
+
+static void sampler_task(void *arg) {
+  uint32_t deadline, now;
+  TickType_t wait;
+  bool pending;
+  int ran;
+
+  for (;;) {
+    xSemaphoreTake(LOCK, portMAX_DELAY);
+    ran = sampler_queue_run_due(&QUEUE, now_ms());
+    pending = sampler_queue_next(&QUEUE, &deadline);
+    xSemaphoreGive(LOCK);
+
+    ESP_LOGD(TAG, "Ran %d job(s), %u wakeups so far", ran, QUEUE.wakeups);
+
+    wait = portMAX_DELAY;
+    if (pending) {
+      now = now_ms();
+      wait = (int32_t)(deadline - now) > 0
+                 ? pdMS_TO_TICKS((deadline - now) / TIMEBASE_SCALE)
+                 : 0;
+    }
+
+    // woken early by `sampler_add_job`, or at the next deadline
+    ulTaskNotifyTake(pdTRUE, wait);
+  }
+
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Schedule a periodic job on the sampler task. The job runs as soon as
+ * the sampler is started, and then every `period_ms`.
+ * @param name job name, for logging
+ * @param fn job function
+ * @param arg argument passed to `fn`
+ * @param period_ms interval between runs
+ * @return error
+ */
+esp_err_t sampler_add_job(const char *name, sampler_fn_t fn, void *arg,
+                          uint32_t period_ms) {
+  esp_err_t err;
+
+  if ((err = init_sampler()) != ESP_OK)
+    return err;
+
+  xSemaphoreTake(LOCK, portMAX_DELAY);
+  err = sampler_queue_add(&QUEUE, name, fn, arg, period_ms, now_ms());
+  xSemaphoreGive(LOCK);
+
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Error adding job %s: %s", name, esp_err_to_name(err));
+    return err;
+  }
+
+  if (TASK != NULL)
+    xTaskNotifyGive(TASK);
+
+  ESP_LOGI(TAG, "Added job %s, period %u ms", name, period_ms);
+  return err;
+}
+
+/**
+ * @brief Change the period of a scheduled job, see `sampler_queue_set_period`.
+ * Don't call from a job, or from a task a job may block on.
+ * @param name job name
+ * @param period_ms new interval between runs, 0 to pause the job
+ * @return error, `ESP_ERR_NOT_FOUND` if there's no job called `name`
+ */
+esp_err_t sampler_set_period(const char *name, uint32_t period_ms) {
+  esp_err_t err;
+
+  if ((err = init_sampler()) != ESP_OK)
+    return err;
+
+  xSemaphoreTake(LOCK, portMAX_DELAY);
+  err = sampler_queue_set_period(&QUEUE, name, period_ms, now_ms());
+  xSemaphoreGive(LOCK);
+
+  if (err != ESP_OK)
+    return err;
+
+  if (TASK != NULL)
+    xTaskNotifyGive(TASK);
+
+  ESP_LOGI(TAG, "Job %s, period %u ms", name, period_ms);
+  return err;
+}
+
+/**
+ * @brief Start the sampler task. Safe to call more than once.
+ * @return error
+ */
+esp_err_t sampler_start(void) {
+  esp_err_t err;
+
+  if (TASK != NULL)
+    return ESP_OK;
+
+  if ((err = init_sampler()) != ESP_OK)
+    return err;
+
+  if ((TASK = xTaskCreateStatic(&sampler_task, "sampler_task",
+                                SAMPLER_TASK_STACK_SIZE, NULL, 6, TASK_STACK,
+                                &TASK_BUF)) == NULL) {
+    ESP_LOGE(TAG, "Error creating sampler task");
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  return ESP_OK;
+}
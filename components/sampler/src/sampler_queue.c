@@ -0,0 +1,163 @@
+#include "../include/sampler.h"
+#include "esp_err.h"
+#include <string.h>
+
+/// Paused jobs are left out of q->order
+#define IS_PAUSED(job) ((job)->period_ms == 0)
+
+/// Wrap-safe "a is at or before b" for millisecond tick counts
+#define AT_OR_BEFORE(a, b) ((int32_t)((a) - (b)) <= 0)
+
+/// Insert job `idx` into the first `len` entries of q->order, by deadline
+static void insert_ordered(sampler_queue_t *q, uint8_t len, uint8_t idx) {
+  uint32_t deadline = q->jobs[idx].deadline_ms;
+  uint8_t pos = 0;
+
+  while (pos < len &&
+         AT_OR_BEFORE(q->jobs[q->order[pos]].deadline_ms, deadline))
+    pos++;
+
+  memmove(&q->order[pos + 1], &q->order[pos], len - pos);
+  q->order[pos] = idx;
+}
+
+/**
+ * @brief Initialize an empty timer queue.
+ * @param q queue to initialize
+ * @param coalesce_ms jobs due within this window of `now` run in the same
+ * wakeup
+ */
+void sampler_queue_init(sampler_queue_t *q, uint32_t coalesce_ms) {
+  memset(q, 0, sizeof(sampler_queue_t));
+  q->coalesce_ms = coalesce_ms;
+}
+
+/**
+ * @brief Add a periodic job to the queue. The job is first due at `now_ms`.
+ * @param q queue
+ * @param name job name, for logging and `sampler_queue_set_period`
+ * @param fn job function
+ * @param arg argument passed to `fn`
+ * @param period_ms interval between runs, 0 to add the job paused
+ * @param now_ms current time in milliseconds
+ * @return error
+ */
+esp_err_t sampler_queue_add(sampler_queue_t *q, const char *name,
+                            sampler_fn_t fn, void *arg, uint32_t period_ms,
+                            uint32_t now_ms) {
+  sampler_job_t *job;
+
+  if (fn == NULL)
+    return ESP_ERR_INVALID_ARG;
+  if (q->n_jobs >= SAMPLER_MAX_JOBS)
+    return ESP_ERR_NO_MEM;
+
+  job = &q->jobs[q->n_jobs];
+  job->name = name;
+  job->fn = fn;
+  job->arg = arg;
+  job->period_ms = period_ms;
+  job->deadline_ms = now_ms;
+
+  if (!IS_PAUSED(job))
+    insert_ordered(q, q->n_ordered++, q->n_jobs);
+  q->n_jobs++;
+  return ESP_OK;
+}
+
+/**
+ * @brief Change the period of a job, pausing or resuming it. The next run is
+ * one new period after the last, or `now_ms` if that has already passed; a
+ * resumed job runs at `now_ms`.
+ * @param q queue
+ * @param name job name
+ * @param period_ms new interval between runs, 0 to pause the job
+ * @param now_ms current time in milliseconds
+ * @return error, `ESP_ERR_NOT_FOUND` if there's no job called `name`
+ */
+esp_err_t sampler_queue_set_period(sampler_queue_t *q, const char *name,
+                                   uint32_t period_ms, uint32_t now_ms) {
+  sampler_job_t *job = NULL;
+  uint8_t idx, pos;
+
+  for (idx = 0; idx < q->n_jobs; idx++) {
+    if (strcmp(q->jobs[idx].name, name) == 0) {
+      job = &q->jobs[idx];
+      break;
+    }
+  }
+  if (job == NULL)
+    return ESP_ERR_NOT_FOUND;
+
+  if (IS_PAUSED(job)) {
+    job->deadline_ms = now_ms;
+  } else {
+    for (pos = 0; q->order[pos] != idx; pos++)
+      ;
+    q->n_ordered--;
+    memmove(&q->order[pos], &q->order[pos + 1], q->n_ordered - pos);
+
+    job->deadline_ms = job->deadline_ms - job->period_ms + period_ms;
+    if (AT_OR_BEFORE(job->deadline_ms, now_ms))
+      job->deadline_ms = now_ms;
+  }
+
+  job->period_ms = period_ms;
+  if (!IS_PAUSED(job))
+    insert_ordered(q, q->n_ordered++, idx);
+  return ESP_OK;
+}
+
+/**
+ * @brief Get the deadline of the earliest job in the queue.
+ * @param q queue
+ * @param deadline_ms return-arg for earliest deadline
+ * @return false if queue is empty
+ */
+bool sampler_queue_next(const sampler_queue_t *q, uint32_t *deadline_ms) {
+  if (q->n_ordered == 0)
+    return false;
+  *deadline_ms = q->jobs[q->order[0]].deadline_ms;
+  return true;
+}
+
+/**
+ * @brief Run every job that is due at `now_ms` (within the coalescing window)
+ * exactly once, and reschedule each for its next period.
+ * @param q queue
+ * @param now_ms current time in milliseconds
+ * @return number of jobs run
+ */
+int sampler_queue_run_due(sampler_queue_t *q, uint32_t now_ms) {
+  uint8_t due[SAMPLER_MAX_JOBS];
+  uint8_t n_due = 0;
+  uint32_t limit = now_ms + q->coalesce_ms;
+  sampler_job_t *job;
+
+  // pop due jobs first, so that a short period can't run a job twice
+  while (n_due < q->n_ordered &&
+         AT_OR_BEFORE(q->jobs[q->order[n_due]].deadline_ms, limit)) {
+    due[n_due] = q->order[n_due];
+    n_due++;
+  }
+  if (n_due == 0)
+    return 0;
+
+  memmove(&q->order[0], &q->order[n_due], q->n_ordered - n_due);
+
+  for (uint8_t i = 0; i < n_due; i++) {
+    job = &q->jobs[due[i]];
+    job->fn(job->arg);
+
+    // keep phase, unless we've fallen a full period behind
+    job->deadline_ms += job->period_ms;
+    if (AT_OR_BEFORE(job->deadline_ms, now_ms))
+      job->deadline_ms = now_ms + job->period_ms;
+
+    insert_ordered(q, q->n_ordered - n_due + i, due[i]);
+  }
+
+  q->wakeups++;
+  q->runs += n_due;
+  return n_due;
+}
@@ -3,6 +3,9 @@
 
 #include "esp_err.h"
 #include "hal/i2c_types.h"
+#include "retry.h"
+#include <stdbool.h>
+#include <stdint.h>
 
 /// Register addresses
 #define SEESAW_TOUCH_BASE 0x0f
@@ -12,4 +15,10 @@
 esp_err_t init_soil_sensor(i2c_port_t bus, uint8_t addr);
 esp_err_t read_soil_moisture(uint16_t *moist);
 
+/// Non-blocking measurements, so conversions on different sensors overlap
+esp_err_t seesaw_soil_start_measurement(void);
+bool seesaw_soil_poll_ready(uint32_t *wait_ms);
+esp_err_t seesaw_soil_collect(uint16_t *moist);
+retry_t *seesaw_soil_retry(void);
+
 #endif
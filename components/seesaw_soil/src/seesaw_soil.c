@@ -1,93 +1,104 @@
 #include "../include/seesaw_soil.h"
-#include "driver/i2c.h"
+#include "diag.h"
+#include "esp_attr.h"
 #include "esp_err.h"
 #include "esp_log.h"
-#include "freertos/projdefs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "i2c_bus.h"
 
 // Config constants
 #define SEESAW_DELAY_MS 1000
-#define I2C_MAX_WAIT pdMS_TO_TICKS(13)
 static const char *TAG = "Adafruit Seesaw soil sensor";
 
 /// Representation of sensor
 typedef struct seesaw_soil {
   i2c_port_t bus;
   uint8_t addr;
+  bool pending;     // touch read in progress
+  int64_t start_us; // when the touch read was requested
 } seesaw_soil_t;
 
-/// Global vars
-static seesaw_soil_t *SENSOR = NULL;
+/// Global vars, kept in RTC memory so the sensor isn't re-initialized after
+/// waking from deep sleep
+static RTC_DATA_ATTR seesaw_soil_t SENSOR_STATE;
+static RTC_DATA_ATTR seesaw_soil_t *SENSOR = NULL;
+static RTC_DATA_ATTR retry_t RETRY = RETRY_INIT("Seesaw soil");
 
-static esp_err_t get_wide_register(seesaw_soil_t *sensor, uint8_t reg_h,
-                                   uint8_t reg_l, uint16_t *dat,
-                                   uint32_t delay) {
-  i2c_cmd_handle_t cmd;
-  uint8_t hi = 0xff, lo = 0xff;
-  esp_err_t err = ESP_OK;
-
-  // initialize return var
-  *dat = 65535;
+/**
+ * @brief Request a moisture reading, without waiting for it.
+ * @note must initialize sensor with `init_soil_sensor`
+ * @return error
+ */
+esp_err_t seesaw_soil_start_measurement(void) {
+  uint8_t reg[2] = {SEESAW_TOUCH_BASE,
+                    SEESAW_TOUCH_CHANNEL_OFFSET + SEESAW_TOUCH_PIN};
+  esp_err_t err;
 
-  // request sensor touch sensor read
-  // this thing is really flaky, just retry until it works
-  for (;;) {
-    cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (sensor->addr << 1) | I2C_MASTER_WRITE,
-                          I2C_MASTER_ACK);
-    i2c_master_write_byte(cmd, reg_h, I2C_MASTER_ACK);
-    i2c_master_write_byte(cmd, reg_l, I2C_MASTER_ACK);
-    i2c_master_stop(cmd);
-
-    if ((err = i2c_master_cmd_begin(sensor->bus, cmd, I2C_MAX_WAIT)) ==
-        ESP_OK) {
-      i2c_cmd_link_delete(cmd);
-      break;
-    }
-    ESP_LOGD(TAG, "Error requesting sensor reading: %s, retrying...",
-             esp_err_to_name(err));
-    i2c_cmd_link_delete(cmd);
-    vTaskDelay(pdMS_TO_TICKS(10));
+  if (SENSOR == NULL) {
+    ESP_LOGE(TAG, "Sensor not initialized");
+    return ESP_FAIL;
   }
 
-  // wait for sensor reading
-  vTaskDelay(pdMS_TO_TICKS(delay));
+  if ((err = i2c_bus_write(SENSOR->bus, SENSOR->addr, reg, sizeof(reg))) !=
+      ESP_OK)
+    return err;
 
-  // this thing is really flaky, just retry until it works
-  for (;;) {
-    cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (sensor->addr << 1) | I2C_MASTER_READ,
-                          I2C_MASTER_ACK);
-    i2c_master_read_byte(cmd, &hi, I2C_MASTER_ACK);
-    i2c_master_read_byte(cmd, &lo, I2C_MASTER_ACK);
-    i2c_master_stop(cmd);
-
-    if ((err = i2c_master_cmd_begin(sensor->bus, cmd, I2C_MAX_WAIT)) ==
-        ESP_OK) {
-      ESP_LOGD(TAG, "Wide register lo: %02x", lo);
-      ESP_LOGD(TAG, "Wide register hi: %02x", hi);
-      *dat = lo | (hi << 8);
-      if (*dat == 65535) {
-        ESP_LOGD(TAG, "Invalid data from sensor, retrying...");
-        err = ESP_FAIL;
-      } else {
-        i2c_cmd_link_delete(cmd);
-        break;
-      }
-    } else {
-      ESP_LOGD(TAG, "Error reading from sensor: %s, retrying...",
-               esp_err_to_name(err));
-    }
+  SENSOR->pending = true;
+  SENSOR->start_us = i2c_bus_now_us();
+  return err;
+}
 
-    i2c_cmd_link_delete(cmd);
-    vTaskDelay(pdMS_TO_TICKS(10));
-  }
+/**
+ * @brief Check whether the requested reading should be done.
+ * @param wait_ms return-arg for time left, if not ready
+ * @return true if ready to collect
+ */
+bool seesaw_soil_poll_ready(uint32_t *wait_ms) {
+  int64_t elapsed_ms;
+
+  if (SENSOR == NULL || !SENSOR->pending)
+    return true;
+
+  elapsed_ms = (i2c_bus_now_us() - SENSOR->start_us) / 1000;
+  if (elapsed_ms < 0 || elapsed_ms >= SEESAW_DELAY_MS)
+    return true;
+
+  *wait_ms = SEESAW_DELAY_MS - (uint32_t)elapsed_ms;
+  return false;
+}
+
+/**
+ * @brief Read the requested moisture reading. The sensor sometimes replies
+ * 0xFFFF, so this may be retried.
+ * @param moist return-arg value for moisture in range 0 (very dry) to 1023
+ * (very wet)
+ * @return error, `ESP_ERR_INVALID_RESPONSE` on an invalid reply
+ */
+esp_err_t seesaw_soil_collect(uint16_t *moist) {
+  uint8_t buf[2]; // hi, lo
+  uint16_t dat;
+  esp_err_t err;
 
-  if (err != ESP_OK) {
-    ESP_LOGE(TAG, "Error reading data from sensor: %s", esp_err_to_name(err));
+  if (SENSOR == NULL || !SENSOR->pending)
+    return ESP_ERR_INVALID_STATE;
+
+  if ((err = i2c_bus_read(SENSOR->bus, SENSOR->addr, buf, sizeof(buf))) !=
+      ESP_OK)
+    return err;
+
+  ESP_LOGD(TAG, "Wide register lo: %02x", buf[1]);
+  ESP_LOGD(TAG, "Wide register hi: %02x", buf[0]);
+  dat = buf[1] | (buf[0] << 8);
+  if (dat == 65535) {
+    DIAG_ERROR(DIAG_ERR_INVALID);
+    return ESP_ERR_INVALID_RESPONSE;
   }
 
+  DIAG_CONV(DIAG_SEESAW_SOIL,
+            (uint32_t)(i2c_bus_now_us() - SENSOR->start_us));
+  *moist = dat;
+  SENSOR->pending = false;
   return err;
 }
 
@@ -95,22 +106,54 @@ static esp_err_t get_wide_register(seesaw_soil_t *sensor, uint8_t reg_h,
  * @brief Read Soil moisture.
  * @note must initialize sensor with `init_soil_sensor`
  * @note moisture readings take 1s to complete
- * @note blocks until a read is successful
  * @param moist return-arg value for moisture in range 0 (very dry) to 1023
  * (very wet)
  * @return error
  */
 esp_err_t read_soil_moisture(uint16_t *moist) {
+  uint32_t wait_ms, delay_ms;
+  uint8_t att = 0;
+  esp_err_t err;
+
   if (SENSOR == NULL) {
     ESP_LOGE(TAG, "Sensor not initialized");
     return ESP_FAIL;
   }
 
-  return get_wide_register(SENSOR, SEESAW_TOUCH_BASE,
-                           SEESAW_TOUCH_CHANNEL_OFFSET + SEESAW_TOUCH_PIN,
-                           moist, SEESAW_DELAY_MS);
+  // initialize return var
+  *moist = 65535;
+
+  if (!retry_begin(&RETRY))
+    return RETRY_ERR_OPEN;
+
+  // this thing is really flaky, retry requests and reads separately so an
+  // invalid reply doesn't cost another conversion
+  for (;;) {
+    if (!SENSOR->pending && (err = seesaw_soil_start_measurement()) == ESP_OK)
+      while (!seesaw_soil_poll_ready(&wait_ms))
+        vTaskDelay(pdMS_TO_TICKS(wait_ms) + 1);
+
+    if (SENSOR->pending && (err = seesaw_soil_collect(moist)) == ESP_OK)
+      break;
+
+    if (!retry_backoff(&RETRY, ++att, &delay_ms))
+      break;
+    ESP_LOGD(TAG, "Error reading from sensor: %s, retrying in %u ms",
+             esp_err_to_name(err), delay_ms);
+    vTaskDelay(pdMS_TO_TICKS(delay_ms));
+  }
+
+  if (err != ESP_OK)
+    SENSOR->pending = false;
+  return retry_end(&RETRY, err);
 }
 
+/**
+ * @brief Get the sensor's retry and circuit breaker state.
+ * @return retry state
+ */
+retry_t *seesaw_soil_retry(void) { return &RETRY; }
+
 /**
  * @brief Initialize a Adafruit STEMMA soil sensor build on their Seesaw
  * platform.
@@ -132,9 +175,10 @@ esp_err_t init_soil_sensor(i2c_port_t bus, uint8_t addr) {
     return err;
   }
 
-  SENSOR = (seesaw_soil_t *)malloc(sizeof(seesaw_soil_t));
+  SENSOR = &SENSOR_STATE;
   SENSOR->bus = bus;
   SENSOR->addr = addr;
+  SENSOR->pending = false;
 
   return ESP_OK;
 }
@@ -3,6 +3,9 @@
 
 #include "esp_err.h"
 #include "hal/i2c_types.h"
+#include "retry.h"
+#include <stdbool.h>
+#include <stdint.h>
 
 /// SHT 20's I2C address is non-configurable
 #define SHT_20_I2C_ADDR 0x40
@@ -16,8 +19,19 @@
 /// Configuration constants
 #define SHT_20_USER_REGISTER_RESOLUTION_RH12_TEMP14 0x3f
 
+typedef enum sht_20_measurement {
+  SHT_20_TEMP,
+  SHT_20_HUMD
+} sht_20_measurement_t;
+
 esp_err_t init_sht_20(i2c_port_t bus);
 esp_err_t read_rel_humd(float *humd);
 esp_err_t read_temp(float *temp);
 
+/// Non-blocking measurements, so conversions on different sensors overlap
+esp_err_t sht_20_start_measurement(sht_20_measurement_t m);
+bool sht_20_poll_ready(uint32_t *wait_ms);
+esp_err_t sht_20_collect(float *val);
+retry_t *sht_20_retry(void);
+
 #endif
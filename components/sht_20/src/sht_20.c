@@ -1,169 +1,183 @@
 #include "../include/sht_20.h"
-#include "driver/i2c.h"
+#include "conv.h"
+#include "diag.h"
+#include "esp_attr.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "i2c_bus.h"
 #include <string.h>
 
 /// Configuration constants
 #define RH_READ_WAIT_MS 30 // datasheet specifies max 29ms to get a reading
 #define T_READ_WAIT_MS 86  // datasheet specifies max 85ms to get a reading
-#define I2C_MAX_WAIT pdMS_TO_TICKS(13) // i2c timeout is 13ms
-#define MAX_RETRIES 10
 static const char *TAG = "SHT 20";
 
 /// Representation of sensor
 typedef struct sht_20 {
   i2c_port_t bus;
   bool init;
+  uint8_t pending;  // measurement command in progress, 0 if none
+  int64_t start_us; // when `pending` was started
 } sht_20_t;
 
 /// Forward declarations
 static esp_err_t init_sensor(sht_20_t *sensor, i2c_port_t bus);
 
-/// Global vars
-static sht_20_t *SENSOR = NULL;
+/// Global vars, kept in RTC memory so the sensor isn't re-initialized after
+/// waking from deep sleep
+static RTC_DATA_ATTR sht_20_t SENSOR_STATE;
+static RTC_DATA_ATTR sht_20_t *SENSOR = NULL;
+static RTC_DATA_ATTR retry_t RETRY = RETRY_INIT("SHT 20");
 
-static esp_err_t get_register(sht_20_t *sensor, uint8_t reg, uint8_t *val) {
-  i2c_cmd_handle_t cmd;
+static esp_err_t set_resolution(sht_20_t *sensor) {
   esp_err_t err;
+  uint8_t val;
 
-  cmd = i2c_cmd_link_create();
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (SHT_20_I2C_ADDR << 1) | I2C_MASTER_WRITE,
-                        I2C_MASTER_ACK);
-  i2c_master_write_byte(cmd, reg, I2C_MASTER_ACK);
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (SHT_20_I2C_ADDR << 1) | I2C_MASTER_READ,
-                        I2C_MASTER_ACK);
-  i2c_master_read_byte(cmd, val, I2C_MASTER_NACK);
-  i2c_master_stop(cmd);
-  err = i2c_master_cmd_begin(sensor->bus, cmd, I2C_MAX_WAIT);
-  i2c_cmd_link_delete(cmd);
+  if ((err = i2c_read_reg(sensor->bus, SHT_20_I2C_ADDR, SHT_20_READ_USER_REG,
+                          &val)) != ESP_OK)
+    return err;
 
-  return err;
+  val &= SHT_20_USER_REGISTER_RESOLUTION_RH12_TEMP14;
+  return i2c_write_reg(sensor->bus, SHT_20_I2C_ADDR, SHT_20_WRITE_USER_REG,
+                       val);
 }
 
-static esp_err_t set_register(sht_20_t *sensor, uint8_t reg, uint8_t val) {
-  i2c_cmd_handle_t cmd;
+/**
+ * @brief Start a temperature or humidity measurement, without waiting for it.
+ * @note Must initialize sensor with `init_sht_20` first!
+ * @param m measurement
+ * @return error
+ */
+esp_err_t sht_20_start_measurement(sht_20_measurement_t m) {
+  uint8_t cmd = m == SHT_20_TEMP ? SHT_20_TEMP_MEASURE_NOHOLD
+                                 : SHT_20_HUMD_MEASURE_NOHOLD;
   esp_err_t err;
 
-  cmd = i2c_cmd_link_create();
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (SHT_20_I2C_ADDR << 1) | I2C_MASTER_WRITE,
-                        I2C_MASTER_ACK);
-  i2c_master_write_byte(cmd, reg, I2C_MASTER_ACK);
-  i2c_master_write_byte(cmd, val, I2C_MASTER_ACK);
-  i2c_master_stop(cmd);
-  err = i2c_master_cmd_begin(sensor->bus, cmd, I2C_MAX_WAIT);
-  i2c_cmd_link_delete(cmd);
+  if (SENSOR == NULL) {
+    ESP_LOGE(TAG, "Sensor not initialized");
+    return ESP_FAIL;
+  }
+
+  if (!(SENSOR->init))
+    if ((err = init_sensor(SENSOR, SENSOR->bus)) != ESP_OK)
+      return err;
+
+  if ((err = i2c_bus_write(SENSOR->bus, SHT_20_I2C_ADDR, &cmd, 1)) != ESP_OK) {
+    ESP_LOGD(TAG, "Error requesting sensor reading: %s", esp_err_to_name(err));
+    SENSOR->init = false;
+    return err;
+  }
 
+  SENSOR->pending = cmd;
+  SENSOR->start_us = i2c_bus_now_us();
   return err;
 }
 
-static uint8_t check_crc(uint16_t dat, uint8_t checksum) {
-  uint32_t remainder = ((uint32_t)dat << 8), divisor = 0x988000;
+/**
+ * @brief Check whether the measurement in progress should be done, going by
+ * the datasheet conversion time.
+ * @param wait_ms return-arg for time left, if not ready
+ * @return true if ready to collect
+ */
+bool sht_20_poll_ready(uint32_t *wait_ms) {
+  uint32_t conv_ms;
+  int64_t elapsed_ms;
 
-  remainder |= checksum;
-  for (int i = 0; i < 16; i++) {
-    if (remainder & ((uint32_t)1 << (23 - i)))
-      remainder ^= divisor;
-    divisor >>= 1;
-  }
+  if (SENSOR == NULL || SENSOR->pending == 0)
+    return true;
 
-  return (uint8_t)remainder;
+  conv_ms = SENSOR->pending == SHT_20_TEMP_MEASURE_NOHOLD ? T_READ_WAIT_MS
+                                                          : RH_READ_WAIT_MS;
+  elapsed_ms = (i2c_bus_now_us() - SENSOR->start_us) / 1000;
+  if (elapsed_ms < 0 || elapsed_ms >= conv_ms)
+    return true;
+
+  *wait_ms = conv_ms - (uint32_t)elapsed_ms;
+  return false;
 }
 
-static esp_err_t get_wide_register(sht_20_t *sensor, uint8_t reg, uint16_t *dat,
-                                   uint32_t delay) {
-  i2c_cmd_handle_t cmd;
-  uint8_t hi, lo, checksum, att = 0;
+/**
+ * @brief Read the result of the measurement in progress. The sensor NACKs
+ * until the measurement is done, so this may be retried. A bad checksum
+ * consumes the result, so the measurement has to be started again.
+ * @param val return-arg for temperature in degrees Celsius, or relative
+ * humidity in percent
+ * @return error, `ESP_ERR_INVALID_CRC` on a bad checksum
+ */
+esp_err_t sht_20_collect(float *val) {
+  uint8_t buf[3]; // hi, lo, checksum
+  uint16_t dat;
   esp_err_t err;
 
-  cmd = i2c_cmd_link_create();
-  i2c_master_start(cmd);
-  i2c_master_write_byte(cmd, (SHT_20_I2C_ADDR << 1) | I2C_MASTER_WRITE,
-                        I2C_MASTER_ACK);
-  i2c_master_write_byte(cmd, reg, I2C_MASTER_ACK);
-  i2c_master_stop(cmd);
-  err = i2c_master_cmd_begin(sensor->bus, cmd, I2C_MAX_WAIT);
-  i2c_cmd_link_delete(cmd);
-  if (err != ESP_OK) {
-    ESP_LOGD(TAG, "Error requesting sensor reading: %s", esp_err_to_name(err));
+  if (SENSOR == NULL || SENSOR->pending == 0)
+    return ESP_ERR_INVALID_STATE;
+
+  if ((err = i2c_bus_read(SENSOR->bus, SHT_20_I2C_ADDR, buf, sizeof(buf))) !=
+      ESP_OK)
     return err;
-  }
 
-  // wait for sensor reading
-  vTaskDelay(pdMS_TO_TICKS(delay));
-
-  // poll for reading, attempt up to 10 times
-  while (att < MAX_RETRIES) {
-    cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (SHT_20_I2C_ADDR << 1) | I2C_MASTER_READ,
-                          I2C_MASTER_ACK);
-    i2c_master_read_byte(cmd, &hi, I2C_MASTER_ACK);
-    i2c_master_read_byte(cmd, &lo, I2C_MASTER_ACK);
-    i2c_master_read_byte(cmd, &checksum, I2C_MASTER_NACK);
-    i2c_master_stop(cmd);
-    err = i2c_master_cmd_begin(sensor->bus, cmd, I2C_MAX_WAIT);
-    i2c_cmd_link_delete(cmd);
-
-    if (err == ESP_OK) {
-      *dat = lo | (hi << 8);
-      if (check_crc(*dat, checksum) != 0) {
-        ESP_LOGD(TAG, "Bad data checksum from sensor, retrying...");
-        err = ESP_FAIL;
-      } else {
-        *dat = (*dat & 0xfffc); // clear temp/humd bits
-        break;
-      }
-    } else {
-      ESP_LOGD(TAG, "Sensor read failed, retrying...");
-    }
-    att++;
-    vTaskDelay(pdMS_TO_TICKS(10));
+  if (conv_sht_20_crc8(buf, 2) != buf[2]) {
+    DIAG_ERROR(DIAG_ERR_CRC);
+    SENSOR->pending = 0;
+    return ESP_ERR_INVALID_CRC;
   }
 
+  dat = buf[1] | (buf[0] << 8);
+  if (SENSOR->pending == SHT_20_TEMP_MEASURE_NOHOLD)
+    *val = conv_sht_20_temp(dat);
+  else
+    *val = conv_sht_20_humd(dat);
+
+  DIAG_CONV(DIAG_SHT_20, (uint32_t)(i2c_bus_now_us() - SENSOR->start_us));
+  SENSOR->pending = 0;
   return err;
 }
 
-static esp_err_t set_resolution(sht_20_t *sensor) {
+static esp_err_t measure(sht_20_measurement_t m, float *val) {
+  uint32_t wait_ms;
   esp_err_t err;
-  uint8_t val;
 
-  if ((err = get_register(sensor, SHT_20_READ_USER_REG, &val)) != ESP_OK)
+  if ((err = sht_20_start_measurement(m)) != ESP_OK)
     return err;
 
-  val &= SHT_20_USER_REGISTER_RESOLUTION_RH12_TEMP14;
-  return set_register(sensor, SHT_20_WRITE_USER_REG, val);
+  // round up, so the wait isn't cut short by tick resolution
+  while (!sht_20_poll_ready(&wait_ms))
+    vTaskDelay(pdMS_TO_TICKS(wait_ms) + 1);
+
+  return sht_20_collect(val);
 }
 
-/**
- * @brief Calculate temperature in degrees Celsius.
- * @note Must initialize sensor with `init_sht_20` first!
- * @param return-arg pointer to temperature in degrees Celsius
- * @return error
- */
-esp_err_t read_temp(float *temp) {
+static esp_err_t read_blocking(sht_20_measurement_t m, float *val) {
+  uint32_t delay_ms;
+  uint8_t att = 0;
   esp_err_t err;
-  uint16_t dat;
 
-  if (!(SENSOR->init))
-    if ((err = init_sensor(SENSOR, SENSOR->bus)) != ESP_OK)
-      return err;
+  if (!retry_begin(&RETRY))
+    return RETRY_ERR_OPEN;
 
-  if ((err = get_wide_register(SENSOR, SHT_20_TEMP_MEASURE_NOHOLD, &dat,
-                               T_READ_WAIT_MS)) != ESP_OK) {
-    SENSOR->init = false;
-    return err;
+  while ((err = measure(m, val)) != ESP_OK) {
+    if (!retry_backoff(&RETRY, ++att, &delay_ms))
+      break;
+    ESP_LOGD(TAG, "Sensor read failed: %s, retrying in %u ms",
+             esp_err_to_name(err), delay_ms);
+    vTaskDelay(pdMS_TO_TICKS(delay_ms));
   }
 
-  // calc T
-  *temp = -46.85 + (dat * (175.72 / 65536.0));
-
-  return err;
+  if (err != ESP_OK && SENSOR != NULL)
+    SENSOR->init = false;
+  return retry_end(&RETRY, err);
 }
 
+/**
+ * @brief Calculate temperature in degrees Celsius.
+ * @note Must initialize sensor with `init_sht_20` first!
+ * @param return-arg pointer to temperature in degrees Celsius
+ * @return error
+ */
+esp_err_t read_temp(float *temp) { return read_blocking(SHT_20_TEMP, temp); }
+
 /**
  * @brief Calculate relative humidity.
  * @note Must initialize sensor with `init_sht_20` first!
@@ -171,30 +185,21 @@ esp_err_t read_temp(float *temp) {
  * @return error
  */
 esp_err_t read_rel_humd(float *humd) {
-  esp_err_t err;
-  uint16_t dat;
-
-  if (!(SENSOR->init))
-    if ((err = init_sensor(SENSOR, SENSOR->bus)) != ESP_OK)
-      return err;
-
-  if ((err = get_wide_register(SENSOR, SHT_20_HUMD_MEASURE_NOHOLD, &dat,
-                               RH_READ_WAIT_MS)) != ESP_OK) {
-    SENSOR->init = false;
-    return err;
-  }
-
-  // calc RH
-  *humd = -6.0 + (dat * (125.0 / 65536.0));
-
-  return err;
+  return read_blocking(SHT_20_HUMD, humd);
 }
 
+/**
+ * @brief Get the sensor's retry and circuit breaker state.
+ * @return retry state
+ */
+retry_t *sht_20_retry(void) { return &RETRY; }
+
 static esp_err_t init_sensor(sht_20_t *sensor, i2c_port_t bus) {
   esp_err_t err;
 
   sensor->bus = bus;
   sensor->init = false;
+  sensor->pending = 0;
 
   if ((err = set_resolution(sensor)) != ESP_OK)
     return err;
@@ -228,7 +233,7 @@ esp_err_t init_sht_20(i2c_port_t bus) {
     return err;
   }
 
-  SENSOR = (sht_20_t *)malloc(sizeof(sht_20_t));
+  SENSOR = &SENSOR_STATE;
   memcpy(SENSOR, &sensor, sizeof(sht_20_t));
   ESP_LOGI(TAG, "Sensor initialized on bus %d with address %02x", SENSOR->bus,
            SHT_20_I2C_ADDR);
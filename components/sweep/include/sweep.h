@@ -0,0 +1,56 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "esp_err.h"
+#include "retry.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Maximum number of measurements in a sweep
+#define SWEEP_MAX_STEPS 8
+
+/// Error of a step that was disabled when the sweep began
+#define SWEEP_ERR_DISABLED ESP_ERR_NOT_SUPPORTED
+
+typedef enum sweep_state {
+  SWEEP_PENDING = 0,
+  SWEEP_STARTED,
+  SWEEP_DONE
+} sweep_state_t;
+
+/// One measurement: start a conversion, wait until ready, collect the result
+typedef struct sweep_step {
+  const char *name;
+  uint8_t device; // steps on the same device run one at a time, in order
+  esp_err_t (*start)(void);
+  bool (*poll_ready)(uint32_t *wait_ms);
+  esp_err_t (*collect)(float *val);
+  retry_t *retry; // retry policy and circuit breaker, may be shared by steps
+  bool enabled;   // disabled steps are skipped, without touching the device
+  sweep_state_t state;
+  uint8_t attempts; // failed starts or collects
+  uint32_t retry_ms; // don't retry before this clock reading
+  float value;
+  esp_err_t err;
+  uint32_t start_ms; // conversion started
+  uint32_t done_ms;  // result collected, or given up on
+  bool ended;        // the breaker has been updated, this sweep
+} sweep_step_t;
+
+/// Measurements on different devices, run so their conversions overlap
+typedef struct sweep {
+  sweep_step_t steps[SWEEP_MAX_STEPS];
+  uint8_t n_steps;
+  uint32_t begin_ms;
+} sweep_t;
+
+void sweep_init(sweep_t *s);
+esp_err_t sweep_add(sweep_t *s, const char *name, uint8_t device,
+                    esp_err_t (*start)(void),
+                    bool (*poll_ready)(uint32_t *wait_ms),
+                    esp_err_t (*collect)(float *val), retry_t *retry);
+void sweep_begin(sweep_t *s, uint32_t now_ms);
+bool sweep_poll(sweep_t *s, uint32_t now_ms, uint32_t *wait_ms);
+esp_err_t sweep_run(sweep_t *s, uint32_t timeout_ms);
+
+#endif
@@ -0,0 +1,267 @@
+#include "../include/sweep.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <string.h>
+
+static const char *TAG = "sweep_component";
+
+static uint32_t now_ms(void) {
+  return (uint32_t)(xTaskGetTickCount() * portTICK_PERIOD_MS);
+}
+
+/**
+ * @brief Initialize an empty sweep.
+ * @param s sweep
+ */
+void sweep_init(sweep_t *s) { memset(s, 0, sizeof(sweep_t)); }
+
+/**
+ * @brief Add a measurement to a sweep. Steps run in the order they're added.
+ * @param s sweep
+ * @param name used in log messages
+ * @param device steps sharing a device never overlap, must be < 32
+ * @param start begin a conversion
+ * @param poll_ready check whether the conversion should be done, setting
+ * `wait_ms` to the time left if not
+ * @param collect read the result of the conversion. Failing with
+ * `ESP_ERR_INVALID_STATE` or `ESP_ERR_INVALID_CRC` means the result is gone,
+ * and the conversion is started again.
+ * @param retry retry policy and circuit breaker of the device
+ * @return error, `ESP_ERR_NO_MEM` if the sweep is full
+ */
+esp_err_t sweep_add(sweep_t *s, const char *name, uint8_t device,
+                    esp_err_t (*start)(void),
+                    bool (*poll_ready)(uint32_t *wait_ms),
+                    esp_err_t (*collect)(float *val), retry_t *retry) {
+  sweep_step_t *step;
+
+  if (device >= 32)
+    return ESP_ERR_INVALID_ARG;
+  if (s->n_steps >= SWEEP_MAX_STEPS)
+    return ESP_ERR_NO_MEM;
+
+  step = &s->steps[s->n_steps++];
+  memset(step, 0, sizeof(sweep_step_t));
+  step->name = name;
+  step->device = device;
+  step->start = start;
+  step->poll_ready = poll_ready;
+  step->collect = collect;
+  step->retry = retry;
+  step->enabled = true;
+  return ESP_OK;
+}
+
+/// First enabled step sharing a step's circuit breaker, maybe the step itself
+static sweep_step_t *first_sibling(sweep_t *s, sweep_step_t *step) {
+  for (uint8_t i = 0; i < s->n_steps; i++)
+    if (s->steps[i].enabled && s->steps[i].retry == step->retry)
+      return &s->steps[i];
+  return step;
+}
+
+/**
+ * @brief Reset every step, to run the sweep again. Disabled steps, and steps
+ * on devices with an open circuit breaker, are skipped. Steps sharing a
+ * breaker count as one read of the device.
+ * @param s sweep
+ * @param now_ms current clock reading
+ */
+void sweep_begin(sweep_t *s, uint32_t now_ms) {
+  sweep_step_t *step, *first;
+
+  s->begin_ms = now_ms;
+  for (uint8_t i = 0; i < s->n_steps; i++) {
+    step = &s->steps[i];
+    step->state = SWEEP_PENDING;
+    step->attempts = 0;
+    step->retry_ms = now_ms;
+    step->value = 0;
+    step->err = ESP_OK;
+    step->start_ms = now_ms;
+    step->done_ms = now_ms;
+    step->ended = false;
+    if (!step->enabled) {
+      step->state = SWEEP_DONE;
+      step->err = SWEEP_ERR_DISABLED;
+      continue;
+    }
+
+    // only the first step on a breaker asks it, the others follow along
+    first = first_sibling(s, step);
+    if (first == step ? !retry_begin(step->retry)
+                      : first->err == RETRY_ERR_OPEN) {
+      step->state = SWEEP_DONE;
+      step->err = RETRY_ERR_OPEN;
+      step->ended = true;
+    }
+  }
+}
+
+/// Update a breaker once per sweep: with the first failure of the steps
+/// sharing it, or once they've all succeeded. If that opens it, the steps
+/// still to run are skipped.
+static void end_breaker(sweep_t *s, sweep_step_t *step, esp_err_t err,
+                        uint32_t now_ms) {
+  sweep_step_t *sibling;
+  bool open;
+
+  retry_end(step->retry, err);
+  open = retry_is_open(step->retry);
+  for (uint8_t i = 0; i < s->n_steps; i++) {
+    sibling = &s->steps[i];
+    if (!sibling->enabled || sibling->retry != step->retry)
+      continue;
+    sibling->ended = true;
+    if (open && sibling->state != SWEEP_DONE) {
+      sibling->state = SWEEP_DONE;
+      sibling->err = RETRY_ERR_OPEN;
+      sibling->done_ms = now_ms;
+    }
+  }
+}
+
+static void step_done(sweep_t *s, sweep_step_t *step, esp_err_t err,
+                      uint32_t now_ms) {
+  sweep_step_t *sibling;
+  bool last = true;
+
+  step->err = err;
+  step->state = SWEEP_DONE;
+  step->done_ms = now_ms;
+  if (step->ended)
+    return;
+
+  for (uint8_t i = 0; i < s->n_steps && last; i++) {
+    sibling = &s->steps[i];
+    last = !sibling->enabled || sibling->retry != step->retry ||
+           sibling->state == SWEEP_DONE;
+  }
+  if (err != ESP_OK || last)
+    end_breaker(s, step, err, now_ms);
+}
+
+/// Count a failed start or collect, giving up once out of attempts
+static void step_failed(sweep_t *s, sweep_step_t *step, esp_err_t err,
+                        uint32_t now_ms) {
+  uint32_t delay_ms;
+
+  ESP_LOGD(TAG, "%s failed: %s", step->name, esp_err_to_name(err));
+  if (!retry_backoff(step->retry, ++step->attempts, &delay_ms)) {
+    step_done(s, step, err, now_ms);
+    return;
+  }
+
+  step->err = err;
+  step->retry_ms = now_ms + delay_ms;
+  if (err == ESP_ERR_INVALID_STATE || err == ESP_ERR_INVALID_CRC)
+    step->state = SWEEP_PENDING;
+}
+
+/**
+ * @brief Advance every step as far as it can go without waiting. Starts
+ * conversions on idle devices and collects finished ones.
+ * @param s sweep
+ * @param now_ms current clock reading
+ * @param wait_ms return-arg for time until the next step can advance
+ * @return true once every step is done
+ */
+bool sweep_poll(sweep_t *s, uint32_t now_ms, uint32_t *wait_ms) {
+  sweep_step_t *step;
+  uint32_t busy = 0; // devices with an earlier step still running
+  uint32_t wait = UINT32_MAX;
+  uint32_t ready_in;
+  bool done = true;
+  esp_err_t err;
+
+  for (uint8_t i = 0; i < s->n_steps; i++) {
+    step = &s->steps[i];
+    if (step->state == SWEEP_DONE)
+      continue;
+
+    done = false;
+    if (busy & (1u << step->device))
+      continue;
+    busy |= 1u << step->device;
+
+    if ((int32_t)(step->retry_ms - now_ms) > 0) {
+      if (step->retry_ms - now_ms < wait)
+        wait = step->retry_ms - now_ms;
+      continue;
+    }
+
+    if (step->state == SWEEP_PENDING) {
+      if ((err = step->start()) != ESP_OK) {
+        step_failed(s, step, err, now_ms);
+        if (step->state != SWEEP_DONE && step->retry_ms - now_ms < wait)
+          wait = step->retry_ms - now_ms;
+        continue;
+      }
+      step->state = SWEEP_STARTED;
+      step->start_ms = now_ms;
+    }
+
+    ready_in = 0;
+    if (!step->poll_ready(&ready_in)) {
+      if (ready_in < wait)
+        wait = ready_in;
+      continue;
+    }
+
+    if ((err = step->collect(&step->value)) != ESP_OK) {
+      step_failed(s, step, err, now_ms);
+      if (step->state != SWEEP_DONE && step->retry_ms - now_ms < wait)
+        wait = step->retry_ms - now_ms;
+      continue;
+    }
+
+    step_done(s, step, ESP_OK, now_ms);
+    // the device is free, so a later step on it may start right away
+    wait = 0;
+  }
+
+  *wait_ms = wait == UINT32_MAX ? 0 : wait;
+  return done;
+}
+
+/**
+ * @brief Run a sweep to completion, sleeping between polls.
+ * @param s sweep
+ * @param timeout_ms give up on unfinished steps after this long
+ * @return error, `ESP_ERR_TIMEOUT` if any step didn't finish. Check each
+ * step's `err` for which measurements succeeded.
+ */
+esp_err_t sweep_run(sweep_t *s, uint32_t timeout_ms) {
+  sweep_step_t *step;
+  uint32_t now, wait_ms;
+  TickType_t ticks;
+  esp_err_t err = ESP_OK;
+
+  now = now_ms();
+  sweep_begin(s, now);
+  while (!sweep_poll(s, now, &wait_ms)) {
+    if (now - s->begin_ms >= timeout_ms) {
+      err = ESP_ERR_TIMEOUT;
+      break;
+    }
+    if (wait_ms > 0) {
+      if (wait_ms > timeout_ms - (now - s->begin_ms))
+        wait_ms = timeout_ms - (now - s->begin_ms);
+      ticks = pdMS_TO_TICKS(wait_ms);
+      vTaskDelay(ticks > 0 ? ticks : 1);
+    }
+    now = now_ms();
+  }
+
+  for (uint8_t i = 0; i < s->n_steps; i++) {
+    step = &s->steps[i];
+    if (step->state != SWEEP_DONE)
+      step_done(s, step, ESP_ERR_TIMEOUT, now);
+    ESP_LOGD(TAG, "%s: started +%u ms, done +%u ms, %s", step->name,
+             step->start_ms - s->begin_ms, step->done_ms - s->begin_ms,
+             esp_err_to_name(step->err));
+  }
+
+  return err;
+}
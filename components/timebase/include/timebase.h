@@ -0,0 +1,26 @@
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Poll interval of `timebase_wait_synced`
+#define TIMEBASE_POLL_MS 10
+
+/// Monotonic time runs this many times faster than the host clock. Only the
+/// Linux simulation speeds it up, so idle time between samples passes quickly.
+#if CONFIG_SIM_TIME_SCALE
+#define TIMEBASE_SCALE CONFIG_SIM_TIME_SCALE
+#else
+#define TIMEBASE_SCALE 1
+#endif
+
+int64_t timebase_now_ms(void);
+int64_t timebase_unwrap(uint32_t mono_ms);
+void timebase_sync(int64_t utc_ms);
+bool timebase_synced(void);
+int64_t timebase_to_utc_ms(int64_t mono_ms);
+esp_err_t timebase_wait_synced(uint32_t timeout_ms);
+
+#endif
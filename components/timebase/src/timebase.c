@@ -0,0 +1,93 @@
+#include "../include/timebase.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#if CONFIG_IDF_TARGET_ESP32
+#include "esp32/clk.h"
+#endif
+
+static const char *TAG = "timebase_component";
+
+/// UTC minus monotonic time, kept in RTC memory across deep sleep along with
+/// the RTC counter the monotonic clock is anchored to
+static RTC_DATA_ATTR int64_t UTC_OFFSET_MS = 0;
+static RTC_DATA_ATTR bool SYNCED = false;
+
+/// RTC counter at esp_timer's zero, esp_timer restarts on every wakeup
+static int64_t BOOT_US = -1;
+
+/**
+ * @brief Get the monotonic time, for stamping readings when they're captured.
+ * Counts from the last power-on, keeps counting across deep sleep, and is
+ * never stepped by SNTP or `settimeofday`. Runs `TIMEBASE_SCALE` times faster
+ * than esp_timer.
+ * @return milliseconds since power-on
+ */
+int64_t timebase_now_ms(void) {
+  if (BOOT_US < 0) {
+#if CONFIG_IDF_TARGET_ESP32
+    BOOT_US = (int64_t)esp_clk_rtc_time() - esp_timer_get_time();
+#else
+    BOOT_US = 0;
+#endif
+  }
+  return (BOOT_US + esp_timer_get_time() * TIMEBASE_SCALE) / 1000;
+}
+
+/**
+ * @brief Recover a full monotonic time from its low 32 bits, as stored in
+ * `reading_t`. Only valid for times less than 49 days ago.
+ * @param mono_ms low 32 bits of a past `timebase_now_ms`
+ * @return monotonic time in milliseconds
+ */
+int64_t timebase_unwrap(uint32_t mono_ms) {
+  int64_t now = timebase_now_ms();
+  return now - (uint32_t)((uint32_t)now - mono_ms);
+}
+
+/**
+ * @brief Record the UTC time of this instant, e.g. from an SNTP sync. Readings
+ * captured before, and still unpublished, are converted with the new offset.
+ * @param utc_ms milliseconds since the epoch
+ */
+void timebase_sync(int64_t utc_ms) {
+  int64_t offset = utc_ms - timebase_now_ms();
+
+  if (SYNCED)
+    ESP_LOGD(TAG, "Clock resynced, off by %lld ms",
+             (long long)(offset - UTC_OFFSET_MS));
+  UTC_OFFSET_MS = offset;
+  SYNCED = true;
+}
+
+/**
+ * @brief Check if monotonic times can be converted to UTC.
+ * @return true once synced since power-on
+ */
+bool timebase_synced(void) { return SYNCED; }
+
+/**
+ * @brief Convert a monotonic time to UTC, with the latest sync.
+ * @param mono_ms monotonic time from `timebase_now_ms`
+ * @return milliseconds since the epoch, meaningless until synced
+ */
+int64_t timebase_to_utc_ms(int64_t mono_ms) { return mono_ms + UTC_OFFSET_MS; }
+
+/**
+ * @brief Wait until monotonic times can be converted to UTC.
+ * @param timeout_ms maximum time to wait
+ * @return error, `ESP_ERR_TIMEOUT` if not synced in time
+ */
+esp_err_t timebase_wait_synced(uint32_t timeout_ms) {
+  TickType_t start = xTaskGetTickCount(), timeout = pdMS_TO_TICKS(timeout_ms);
+
+  while (!SYNCED) {
+    if (xTaskGetTickCount() - start >= timeout)
+      return ESP_ERR_TIMEOUT;
+    vTaskDelay(pdMS_TO_TICKS(TIMEBASE_POLL_MS));
+  }
+  return ESP_OK;
+}
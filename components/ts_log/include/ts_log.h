@@ -0,0 +1,49 @@
+#ifndef TS_LOG_H
+#define TS_LOG_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Label of the data partition the log is kept in
+#define TS_LOG_PARTITION "tslog"
+
+/// Flash layout: the partition is a ring of sectors, each a header followed by
+/// fixed-size records in time order
+#define TS_LOG_SECTOR_SIZE 4096
+#define TS_LOG_HEADER_SIZE 16
+#define TS_LOG_RECORD_SIZE 12
+#define TS_LOG_RECORDS_PER_SECTOR                                              \
+  ((TS_LOG_SECTOR_SIZE - TS_LOG_HEADER_SIZE) / TS_LOG_RECORD_SIZE)
+
+/// One logged reading, as stored in flash
+typedef struct __attribute__((packed)) ts_log_record {
+  uint32_t time_s; // UTC seconds since the epoch, 0xFFFFFFFF if erased
+  float value;
+  uint16_t tag; // milliseconds past `time_s` (bits 0-9), sensor (bits 10-14)
+  uint16_t crc; // CRC-16 of the bytes before it, a mismatch is a torn write
+} ts_log_record_t;
+
+#define TS_LOG_MS(rec) ((rec)->tag & 0x3ff)
+#define TS_LOG_SENSOR(rec) (((rec)->tag >> 10) & 0x1f)
+
+typedef struct ts_log_stats {
+  uint16_t sectors;      // in the partition, 0 if the log isn't mounted
+  uint16_t used_sectors; // holding records, oldest are erased to make room
+  uint32_t appended;     // since boot
+  uint32_t erases;       // since boot
+  uint32_t torn;         // records skipped by queries since boot
+} ts_log_stats_t;
+
+/// Called for each record of a query, in time order. Return false to stop the
+/// query before this record.
+typedef bool (*ts_log_visit_t)(const ts_log_record_t *rec, int64_t utc_ms,
+                               void *arg);
+
+esp_err_t ts_log_init(void);
+esp_err_t ts_log_append(uint8_t sensor, float value, int64_t utc_ms);
+esp_err_t ts_log_query(uint32_t sensors, int64_t from_ms, int64_t to_ms,
+                       ts_log_visit_t visit, void *arg);
+void ts_log_get_stats(ts_log_stats_t *stats);
+
+#endif
@@ -0,0 +1,409 @@
+#include "../include/ts_log.h"
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <string.h>
+
+#define MAGIC 0x314c5354 // "TSL1", bump with the layout
+#define RECORDS TS_LOG_RECORDS_PER_SECTOR
+
+/// Records read from flash at once by queries
+#define QUERY_BATCH 16
+
+static const char *TAG = "ts_log_component";
+
+/// Sector header, written along with the sector's first record
+typedef struct __attribute__((packed)) sector_header {
+  uint32_t magic;
+  uint32_t seq; // one more than the previous sector's
+  uint32_t first_s;
+  uint16_t first_ms;
+  uint16_t crc;
+} sector_header_t;
+
+/// Write position, kept in RTC memory so deep sleep wakeups don't rescan the
+/// partition
+typedef struct ts_log {
+  bool mounted;
+  uint16_t sectors;
+  uint16_t head;   // sector being written
+  uint16_t used;   // sectors holding records, the newest is `head`
+  uint32_t seq;    // sequence number of `head`
+  uint16_t next;   // next free slot in `head`, `RECORDS` when full
+  int64_t last_ms; // time of the newest record
+} ts_log_t;
+
+typedef enum slot {
+  SLOT_VALID,
+  SLOT_ERASED,
+  SLOT_TORN,
+} slot_t;
+
+/// Global vars, the lock is statically allocated
+static RTC_DATA_ATTR ts_log_t LOG = {0};
+static const esp_partition_t *PART = NULL;
+static SemaphoreHandle_t LOCK = NULL;
+static StaticSemaphore_t LOCK_BUF;
+static ts_log_stats_t STATS = {0};
+
+static uint32_t sector_addr(uint16_t sector) {
+  return (uint32_t)sector * TS_LOG_SECTOR_SIZE;
+}
+
+static uint32_t record_addr(uint16_t sector, uint16_t slot) {
+  return sector_addr(sector) + TS_LOG_HEADER_SIZE +
+         (uint32_t)slot * TS_LOG_RECORD_SIZE;
+}
+
+/// Sector `k` of the log, counting from the oldest
+static uint16_t ring_sector(uint16_t k) {
+  return (LOG.head + LOG.sectors - LOG.used + 1 + k) % LOG.sectors;
+}
+
+/// Records written to sector `k` of the log
+static uint16_t ring_records(uint16_t k) {
+  return k == LOG.used - 1 ? LOG.next : RECORDS;
+}
+
+/// CRC-16/CCITT, lets through one in 65536 torn writes
+static uint16_t crc16(const void *data, size_t len) {
+  const uint8_t *p = data;
+  uint16_t crc = 0xffff;
+
+  while (len--) {
+    crc ^= (uint16_t)*p++ << 8;
+    for (uint8_t i = 0; i < 8; i++)
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+static int64_t record_ms(const ts_log_record_t *rec) {
+  return (int64_t)rec->time_s * 1000 + TS_LOG_MS(rec);
+}
+
+static bool read_header(uint16_t sector, sector_header_t *h) {
+  if (esp_partition_read(PART, sector_addr(sector), h,
+                         sizeof(sector_header_t)) != ESP_OK)
+    return false;
+  return h->magic == MAGIC &&
+         h->crc == crc16(h, sizeof(sector_header_t) - sizeof(uint16_t));
+}
+
+static slot_t check_record(const ts_log_record_t *rec) {
+  const uint8_t *bytes = (const uint8_t *)rec;
+  bool erased = true;
+
+  for (size_t i = 0; i < sizeof(ts_log_record_t) && erased; i++)
+    erased = bytes[i] == 0xff;
+
+  if (erased)
+    return SLOT_ERASED;
+
+  // a torn write leaves the trailing bytes erased, which the top bit of `tag`
+  // catches even when the CRC doesn't
+  if (rec->crc != crc16(rec, sizeof(ts_log_record_t) - sizeof(uint16_t)) ||
+      (rec->tag & 0x8000) || TS_LOG_MS(rec) > 999)
+    return SLOT_TORN;
+  return SLOT_VALID;
+}
+
+static slot_t read_record(uint16_t sector, uint16_t slot,
+                          ts_log_record_t *rec) {
+  if (esp_partition_read(PART, record_addr(sector, slot), rec,
+                         sizeof(ts_log_record_t)) != ESP_OK)
+    return SLOT_TORN;
+  return check_record(rec);
+}
+
+/// Find the newest sector, and the sectors before it that make up the log.
+/// Must be called with the lock held.
+static void mount(void) {
+  sector_header_t h;
+  ts_log_record_t rec;
+  uint16_t lo = 0, hi = RECORDS, mid;
+  bool found = false;
+
+  memset(&LOG, 0, sizeof(ts_log_t));
+  LOG.sectors = PART->size / TS_LOG_SECTOR_SIZE;
+
+  for (uint16_t i = 0; i < LOG.sectors; i++) {
+    if (read_header(i, &h) && (!found || (int32_t)(h.seq - LOG.seq) > 0)) {
+      LOG.head = i;
+      LOG.seq = h.seq;
+      found = true;
+    }
+  }
+
+  // empty, start writing at sector 0
+  if (!found) {
+    LOG.head = LOG.sectors - 1;
+    LOG.next = RECORDS;
+    LOG.mounted = true;
+    return;
+  }
+
+  // older sectors are part of the log while their sequence numbers run on,
+  // anything else is left over from an interrupted erase
+  LOG.used = 1;
+  while (LOG.used < LOG.sectors &&
+         read_header((LOG.head + LOG.sectors - LOG.used) % LOG.sectors, &h) &&
+         h.seq == LOG.seq - LOG.used)
+    LOG.used++;
+
+  // slots are written in order, so the erased ones are all at the end
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (read_record(LOG.head, mid, &rec) == SLOT_ERASED)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  LOG.next = lo;
+
+  if (read_header(LOG.head, &h))
+    LOG.last_ms = (int64_t)h.first_s * 1000 + h.first_ms;
+  if (lo > 0 && read_record(LOG.head, lo - 1, &rec) == SLOT_VALID)
+    LOG.last_ms = record_ms(&rec);
+
+  LOG.mounted = true;
+}
+
+/// Erase the sector after the head, and start it with `rec`'s time. When the
+/// partition is full, that's the oldest sector.
+static esp_err_t open_sector(const ts_log_record_t *rec) {
+  uint16_t sector = (LOG.head + 1) % LOG.sectors;
+  sector_header_t h = {.magic = MAGIC,
+                       .seq = LOG.seq + 1,
+                       .first_s = rec->time_s,
+                       .first_ms = TS_LOG_MS(rec)};
+  esp_err_t err;
+
+  if (LOG.used == LOG.sectors)
+    LOG.used--;
+
+  if ((err = esp_partition_erase_range(PART, sector_addr(sector),
+                                       TS_LOG_SECTOR_SIZE)) != ESP_OK)
+    return err;
+  STATS.erases++;
+
+  // on failure, the next append erases the sector again
+  h.crc = crc16(&h, sizeof(sector_header_t) - sizeof(uint16_t));
+  if ((err = esp_partition_write(PART, sector_addr(sector), &h,
+                                 sizeof(sector_header_t))) != ESP_OK)
+    return err;
+
+  LOG.head = sector;
+  LOG.seq = h.seq;
+  LOG.used++;
+  LOG.next = 0;
+  return ESP_OK;
+}
+
+/**
+ * @brief Find the log partition, and the write position in it. Only scans the
+ * partition on a cold boot.
+ * @return error, `ESP_ERR_NOT_FOUND` if there's no log partition
+ */
+esp_err_t ts_log_init(void) {
+  if (PART != NULL)
+    return ESP_OK;
+
+  if (LOCK == NULL)
+    LOCK = xSemaphoreCreateMutexStatic(&LOCK_BUF);
+
+  PART = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                  ESP_PARTITION_SUBTYPE_ANY, TS_LOG_PARTITION);
+  if (PART == NULL) {
+    ESP_LOGW(TAG, "No \"%s\" partition, readings won't be logged",
+             TS_LOG_PARTITION);
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (PART->size < 2 * TS_LOG_SECTOR_SIZE) {
+    ESP_LOGE(TAG, "\"%s\" partition is too small", TS_LOG_PARTITION);
+    PART = NULL;
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  xSemaphoreTake(LOCK, portMAX_DELAY);
+  if (!LOG.mounted || LOG.sectors != PART->size / TS_LOG_SECTOR_SIZE)
+    mount();
+  xSemaphoreGive(LOCK);
+
+  ESP_LOGI(TAG, "Mounted, %u of %u sectors used", LOG.used, LOG.sectors);
+  return ESP_OK;
+}
+
+/**
+ * @brief Append a reading to the log, erasing the oldest sector if the
+ * partition is full. Times before the newest record are logged as the newest
+ * record's time, so the log stays in time order.
+ * @param sensor sensor id, less than 32
+ * @param value reading
+ * @param utc_ms capture time, milliseconds since the epoch
+ * @return error, `ESP_ERR_INVALID_STATE` if the log isn't initialized
+ */
+esp_err_t ts_log_append(uint8_t sensor, float value, int64_t utc_ms) {
+  ts_log_record_t rec;
+  esp_err_t err = ESP_OK;
+
+  if (PART == NULL)
+    return ESP_ERR_INVALID_STATE;
+  if (sensor >= 32)
+    return ESP_ERR_INVALID_ARG;
+
+  xSemaphoreTake(LOCK, portMAX_DELAY);
+
+  // e.g. after SNTP corrects the clock
+  if (utc_ms < LOG.last_ms)
+    utc_ms = LOG.last_ms;
+
+  rec.time_s = (uint32_t)(utc_ms / 1000);
+  rec.value = value;
+  rec.tag = (uint16_t)(utc_ms % 1000) | (uint16_t)sensor << 10;
+  rec.crc = crc16(&rec, sizeof(ts_log_record_t) - sizeof(uint16_t));
+
+  if (LOG.next == RECORDS)
+    err = open_sector(&rec);
+
+  if (err == ESP_OK) {
+    err = esp_partition_write(PART, record_addr(LOG.head, LOG.next), &rec,
+                              sizeof(ts_log_record_t));
+
+    // a failed write may leave part of a record, which queries skip, or
+    // nothing, and then the slot is used again so mounting finds no gaps
+    if (err == ESP_OK) {
+      LOG.last_ms = utc_ms;
+      STATS.appended++;
+      LOG.next++;
+    } else if (read_record(LOG.head, LOG.next, &rec) != SLOT_ERASED) {
+      LOG.next++;
+    }
+  }
+
+  xSemaphoreGive(LOCK);
+
+  if (err != ESP_OK)
+    ESP_LOGW(TAG, "Error logging reading: %s", esp_err_to_name(err));
+  return err;
+}
+
+/// Time of sector `k`'s first record, from its header
+static int64_t sector_first_ms(uint16_t k) {
+  sector_header_t h;
+
+  if (!read_header(ring_sector(k), &h))
+    return INT64_MIN;
+  return (int64_t)h.first_s * 1000 + h.first_ms;
+}
+
+/// First slot of sector `k` that may hold a record at or after `from_ms`
+static uint16_t find_slot(uint16_t k, int64_t from_ms) {
+  uint16_t sector = ring_sector(k), lo = 0, hi = ring_records(k), mid, i;
+  ts_log_record_t rec;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+
+    // compare with the first valid record from `mid` on
+    for (i = mid; i < hi && read_record(sector, i, &rec) != SLOT_VALID; i++)
+      ;
+    if (i < hi && record_ms(&rec) < from_ms)
+      lo = i + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/**
+ * @brief Pass every record of the given sensors, from `from_ms` up to but not
+ * including `to_ms`, to `visit`, oldest first. Sectors are found with a binary
+ * search on their headers, and records within a sector with a binary search on
+ * their times. Appends wait until the query is done.
+ * @param sensors bit mask of sensor ids
+ * @param from_ms start time, milliseconds since the epoch
+ * @param to_ms end time, milliseconds since the epoch
+ * @param visit called for each record
+ * @param arg argument passed to `visit`
+ * @return error, `ESP_ERR_INVALID_STATE` if the log isn't initialized, or the
+ * flash read error that stopped the query part way
+ */
+esp_err_t ts_log_query(uint32_t sensors, int64_t from_ms, int64_t to_ms,
+                       ts_log_visit_t visit, void *arg) {
+  ts_log_record_t batch[QUERY_BATCH];
+  uint16_t lo = 0, hi, mid, first, k, sector, slot, n, len;
+  esp_err_t err = ESP_OK;
+  int64_t ms;
+
+  if (PART == NULL)
+    return ESP_ERR_INVALID_STATE;
+
+  xSemaphoreTake(LOCK, portMAX_DELAY);
+
+  // the last sector starting at or before `from_ms`
+  hi = LOG.used;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (sector_first_ms(mid) <= from_ms)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  first = lo > 0 ? lo - 1 : 0;
+
+  for (k = first; k < LOG.used; k++) {
+    sector = ring_sector(k);
+    n = ring_records(k);
+    slot = k == first ? find_slot(k, from_ms) : 0;
+
+    for (; slot < n; slot += len) {
+      len = n - slot < QUERY_BATCH ? n - slot : QUERY_BATCH;
+      // stop rather than leave a gap the caller can't see
+      if ((err = esp_partition_read(PART, record_addr(sector, slot), batch,
+                                    len * sizeof(ts_log_record_t))) != ESP_OK)
+        goto done;
+
+      for (uint16_t i = 0; i < len; i++) {
+        slot_t state = check_record(&batch[i]);
+        if (state == SLOT_TORN)
+          STATS.torn++;
+        if (state != SLOT_VALID)
+          continue;
+
+        ms = record_ms(&batch[i]);
+        if (ms >= to_ms)
+          goto done;
+        if (ms < from_ms || !(sensors & (1u << TS_LOG_SENSOR(&batch[i]))))
+          continue;
+        if (!visit(&batch[i], ms, arg))
+          goto done;
+      }
+    }
+  }
+
+done:
+  xSemaphoreGive(LOCK);
+
+  if (err != ESP_OK)
+    ESP_LOGW(TAG, "Error reading log: %s", esp_err_to_name(err));
+  return err;
+}
+
+/**
+ * @brief Get the log's size and counters.
+ * @param stats return-arg for the counters
+ */
+void ts_log_get_stats(ts_log_stats_t *stats) {
+  *stats = STATS;
+  if (PART == NULL)
+    return;
+
+  stats->sectors = LOG.sectors;
+  stats->used_sectors = LOG.used;
+}
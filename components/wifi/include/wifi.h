@@ -1,6 +1,18 @@
 #ifndef WIFI_H
 #define WIFI_H
 
+#include <stdint.h>
+
+/// Connection counters, kept across deep sleep
+typedef struct wifi_stats {
+  uint32_t fast_connects; // direct connects to the cached AP
+  uint32_t fast_failures; // direct connects that fell back to a scan
+  uint32_t full_scans;    // connects that scanned every channel
+  uint32_t leases_reused; // connects that skipped DHCP with a cached lease
+  int64_t ip_us;          // boot to IP address this boot, 0 until connected
+} wifi_stats_t;
+
 void init_wifi(void);
+void wifi_get_stats(wifi_stats_t *stats);
 
 #endif
@@ -1,3 +1,4 @@
+#include "esp_attr.h"
 #include "esp_event.h"
 #include "esp_interface.h"
 #include "esp_log.h"
@@ -8,9 +9,13 @@
 #include "esp_wifi_types.h"
 #include "esp_wpa2.h"
 #include "esp_sntp.h"
+#include "esp_timer.h"
+#include <string.h>
+#include <time.h>
 
 #include "../include/wifi.h"
 #include "nvs.h"
+#include "timebase.h"
 
 // Config constants
 #define WIFI_SSID CONFIG_WIFI_SSID
@@ -18,6 +23,17 @@
 
 #define LISTEN_INTERVAL CONFIG_WIFI_LISTEN_INTERVAL
 
+#if CONFIG_WIFI_LEASE_REUSE_S
+#define LEASE_REUSE_S CONFIG_WIFI_LEASE_REUSE_S
+#else
+#define LEASE_REUSE_S 3600
+#endif
+
+/// Last good connection in NVS, for cold boots
+#define CACHE_NVS_NAMESPACE "wifi"
+#define CACHE_NVS_KEY "cache"
+#define CACHE_VERSION 1
+
 #if CONFIG_POWER_SAVE_MIN_MODEM
 #define PS_MODE WIFI_PS_MIN_MODEM
 #elif CONFIG_POWER_SAVE_MAX_MODEM
@@ -30,19 +46,171 @@
 
 static const char *TAG = "wifi_component";
 
+/// Last good connection, to reconnect without a scan or a DHCP exchange
+typedef struct wifi_cache {
+  uint8_t version;
+  bool valid;
+  uint8_t bssid[6];
+  uint8_t channel;
+  esp_netif_ip_info_t ip; // last DHCP lease, zero if none
+  uint32_t dns;
+  uint32_t lease_s; // `timebase_now_ms` in seconds when the lease was acquired
+} wifi_cache_t;
+
 // Global vars
 static bool WIFI_INIT = false;
+static esp_netif_t *NETIF = NULL;
+static bool FAST_CONNECT = false; // connecting straight to the cached AP
+static bool STATIC_IP = false;    // DHCP client is stopped
+static bool GOT_IP = false;
+
+/// Kept in RTC memory across deep sleep
+static RTC_DATA_ATTR wifi_cache_t CACHE = {0};
+static RTC_DATA_ATTR wifi_stats_t STATS = {0};
+
+/// Only on a cold boot, otherwise RTC memory has the latest connection. The
+/// lease is dropped: its time is from a clock that restarted at power-on, so
+/// its age is unknown.
+static void load_cache(void) {
+  wifi_cache_t stored;
+
+  if (CACHE.version == CACHE_VERSION)
+    return;
+
+  memset(&CACHE, 0, sizeof(wifi_cache_t));
+  CACHE.version = CACHE_VERSION;
+  if (read_nvs_blob(CACHE_NVS_NAMESPACE, CACHE_NVS_KEY, &stored,
+                    sizeof(wifi_cache_t)) == ESP_OK &&
+      stored.version == CACHE_VERSION) {
+    CACHE = stored;
+    memset(&CACHE.ip, 0, sizeof(CACHE.ip));
+    CACHE.dns = 0;
+    CACHE.lease_s = 0;
+  }
+}
+
+/// Write the cache to NVS, only if the AP changed. Leases aren't loaded back
+/// from NVS, so a new one doesn't need a write.
+static void store_cache(const wifi_cache_t *prev) {
+  esp_err_t err;
+
+  if (prev->valid == CACHE.valid && prev->channel == CACHE.channel &&
+      memcmp(prev->bssid, CACHE.bssid, sizeof(CACHE.bssid)) == 0)
+    return;
+
+  if ((err = write_nvs_blob(CACHE_NVS_NAMESPACE, CACHE_NVS_KEY, &CACHE,
+                            sizeof(wifi_cache_t))) != ESP_OK)
+    ESP_LOGW(TAG, "Error storing connection: %s", esp_err_to_name(err));
+}
+
+/// Address to use without DHCP, the configured static one or a recent lease
+static bool fixed_ip(esp_netif_ip_info_t *ip, uint32_t *dns) {
+#if CONFIG_WIFI_STATIC_IP
+  esp_ip4_addr_t addr;
+
+  if (esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_IP_ADDR, &ip->ip) != ESP_OK ||
+      esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_NETMASK, &ip->netmask) !=
+          ESP_OK ||
+      esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_GATEWAY, &ip->gw) != ESP_OK ||
+      esp_netif_str_to_ip4(CONFIG_WIFI_STATIC_DNS, &addr) != ESP_OK) {
+    ESP_LOGE(TAG, "Invalid static IP configuration, using DHCP");
+    return false;
+  }
+  *dns = addr.addr;
+  return true;
+#elif CONFIG_WIFI_REUSE_LEASE
+  // only leases from before deep sleep, which the clock keeps counting through
+  if (!CACHE.valid || CACHE.ip.ip.addr == 0 ||
+      (uint32_t)(timebase_now_ms() / 1000) - CACHE.lease_s > LEASE_REUSE_S)
+    return false;
+  *ip = CACHE.ip;
+  *dns = CACHE.dns;
+  return true;
+#else
+  return false;
+#endif
+}
+
+static void use_fixed_ip(void) {
+  esp_netif_ip_info_t ip;
+  esp_netif_dns_info_t dns = {.ip.type = ESP_IPADDR_TYPE_V4};
+  esp_err_t err;
+
+  if (!fixed_ip(&ip, &dns.ip.u_addr.ip4.addr))
+    return;
+
+  if ((err = esp_netif_dhcpc_stop(NETIF)) != ESP_OK ||
+      (err = esp_netif_set_ip_info(NETIF, &ip)) != ESP_OK ||
+      (err = esp_netif_set_dns_info(NETIF, ESP_NETIF_DNS_MAIN, &dns)) !=
+          ESP_OK) {
+    ESP_LOGE(TAG, "Error setting IP address, using DHCP: %s",
+             esp_err_to_name(err));
+    esp_netif_dhcpc_start(NETIF);
+    return;
+  }
+
+  STATIC_IP = true;
+#if CONFIG_WIFI_REUSE_LEASE
+  STATS.leases_reused++;
+#endif
+  ESP_LOGI(TAG, "Using IP address " IPSTR " without DHCP", IP2STR(&ip.ip));
+}
+
+/// Scan every channel for the configured SSID, forgetting the cached AP
+static void connect_full_scan(void) {
+  wifi_config_t wifi_config;
+
+  esp_wifi_get_config(ESP_IF_WIFI_STA, &wifi_config);
+  wifi_config.sta.bssid_set = false;
+  wifi_config.sta.channel = 0;
+  wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+
+  FAST_CONNECT = false;
+  STATS.full_scans++;
+  esp_wifi_connect();
+}
+
+/// Anchor the monotonic capture clock to UTC
+static void time_synced(struct timeval *tv) {
+  timebase_sync((int64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000);
+  ESP_LOGI(TAG, "Time synchronized");
+}
 
 static void ip_event_handler(void *arg, esp_event_base_t event_base,
                              int32_t event_id, void *event_data) {
+  ip_event_got_ip_t *got_ip;
+  esp_netif_dns_info_t dns;
+  wifi_cache_t prev;
+
   if (event_base == IP_EVENT) {
     switch (event_id) {
     case IP_EVENT_STA_GOT_IP:
-      ESP_LOGI(TAG, "Network connected, IP address assigned");
-      // setup ntp server
-      sntp_setoperatingmode(SNTP_OPMODE_POLL);
-      sntp_setservername(0, "pool.ntp.org");
-      sntp_init();
+      if (!GOT_IP) {
+        STATS.ip_us = esp_timer_get_time();
+        GOT_IP = true;
+      }
+      ESP_LOGI(TAG, "Network connected, IP address assigned after %u ms",
+               (uint32_t)(STATS.ip_us / 1000));
+
+      // remember a fresh lease, to skip DHCP on the next wakeup
+      if (!STATIC_IP) {
+        got_ip = (ip_event_got_ip_t *)event_data;
+        prev = CACHE;
+        CACHE.ip = got_ip->ip_info;
+        CACHE.lease_s = (uint32_t)(timebase_now_ms() / 1000);
+        if (esp_netif_get_dns_info(NETIF, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK)
+          CACHE.dns = dns.ip.u_addr.ip4.addr;
+        store_cache(&prev);
+      }
+
+      // setup ntp server, once per boot
+      if (!sntp_enabled()) {
+        sntp_setoperatingmode(SNTP_OPMODE_POLL);
+        sntp_setservername(0, "pool.ntp.org");
+        sntp_set_time_sync_notification_cb(time_synced);
+        sntp_init();
+      }
       break;
     case IP_EVENT_STA_LOST_IP:
       ESP_LOGW(TAG, "Network disconnected, IP address lost");
@@ -55,6 +223,10 @@ static void ip_event_handler(void *arg, esp_event_base_t event_base,
 
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
+  wifi_event_sta_connected_t *connected;
+  wifi_event_sta_disconnected_t *disconnected;
+  wifi_cache_t prev;
+
   if (event_base == WIFI_EVENT) {
     switch (event_id) {
     case WIFI_EVENT_STA_START:
@@ -69,9 +241,31 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
       break;
     case WIFI_EVENT_STA_CONNECTED:
       ESP_LOGI(TAG, "WiFi station connected to AP");
+      connected = (wifi_event_sta_connected_t *)event_data;
+      prev = CACHE;
+      CACHE.valid = true;
+      memcpy(CACHE.bssid, connected->bssid, sizeof(CACHE.bssid));
+      CACHE.channel = connected->channel;
+      store_cache(&prev);
       break;
     case WIFI_EVENT_STA_DISCONNECTED:
-      ESP_LOGI(TAG, "WiFi disconnected from AP");
+      disconnected = (wifi_event_sta_disconnected_t *)event_data;
+      ESP_LOGI(TAG, "WiFi disconnected from AP, reason %d",
+               disconnected->reason);
+      if (FAST_CONNECT && !GOT_IP) {
+        // the cached AP is gone or moved, and its lease may not be valid
+        ESP_LOGW(TAG, "Direct connect failed, scanning");
+        STATS.fast_failures++;
+        CACHE.valid = false;
+#if CONFIG_WIFI_REUSE_LEASE
+        if (STATIC_IP) {
+          esp_netif_dhcpc_start(NETIF);
+          STATIC_IP = false;
+        }
+#endif
+        connect_full_scan();
+        break;
+      }
       esp_wifi_connect();
       break;
     default:
@@ -89,10 +283,13 @@ void init_wifi(void) {
     return;
 
   init_nvs();
+  load_cache();
+  STATS.ip_us = 0;
 
   ESP_ERROR_CHECK(esp_netif_init());
   esp_event_loop_create_default(); // may or may not already be initialized
-  esp_netif_create_default_wifi_sta();
+  NETIF = esp_netif_create_default_wifi_sta();
+  use_fixed_ip();
 
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -113,6 +310,21 @@ void init_wifi(void) {
               .threshold.authmode = WIFI_AUTH_WPA2_PSK},
   };
 
+#if CONFIG_WIFI_FAST_CONNECT
+  // straight to the last good AP, without scanning every channel
+  if (CACHE.valid) {
+    wifi_config.sta.bssid_set = true;
+    memcpy(wifi_config.sta.bssid, CACHE.bssid, sizeof(CACHE.bssid));
+    wifi_config.sta.channel = CACHE.channel;
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    FAST_CONNECT = true;
+  }
+#endif
+  if (FAST_CONNECT)
+    STATS.fast_connects++;
+  else
+    STATS.full_scans++;
+
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
   ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
   ESP_ERROR_CHECK(esp_wifi_start());
@@ -120,3 +332,10 @@ void init_wifi(void) {
 
   WIFI_INIT = true;
 }
+
+/**
+ * @brief Get connection counters, kept across deep sleep, and this boot's
+ * time to an IP address.
+ * @param stats return-arg for the counters
+ */
+void wifi_get_stats(wifi_stats_t *stats) { *stats = STATS; }
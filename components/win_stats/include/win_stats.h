@@ -0,0 +1,26 @@
+#ifndef WIN_STATS_H
+#define WIN_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Running statistics of one reporting window, O(1) memory
+typedef struct win_stats {
+  uint32_t count;
+  float min, max, last;
+  float mean;
+  float m2;           // sum of squared differences from the mean
+  float mean_c, m2_c; // rounding error carried by `mean` and `m2`
+} win_stats_t;
+
+/// Summary of a window
+typedef struct win_summary {
+  uint32_t count;
+  float min, max, mean, stddev, last;
+} win_summary_t;
+
+void win_stats_reset(win_stats_t *s);
+void win_stats_add(win_stats_t *s, float x);
+bool win_stats_summary(const win_stats_t *s, win_summary_t *out);
+
+#endif
@@ -0,0 +1,61 @@
+#include "../include/win_stats.h"
+#include <math.h>
+#include <string.h>
+
+/**
+ * @brief Start a new, empty window.
+ * @param s window statistics
+ */
+void win_stats_reset(win_stats_t *s) { memset(s, 0, sizeof(win_stats_t)); }
+
+/// Add `x` to `*sum`, carrying the rounding error in `*c` (Kahan summation).
+/// Over a long window, a drifting mean's small increments are otherwise lost
+/// to rounding.
+static void add_compensated(float *sum, float *c, float x) {
+  float y = x - *c;
+  float t = *sum + y;
+
+  *c = (t - *sum) - y;
+  *sum = t;
+}
+
+/**
+ * @brief Add a sample, using Welford's update so the variance stays accurate
+ * in single precision even when the spread is small next to the mean.
+ * @param s window statistics
+ * @param x sample
+ */
+void win_stats_add(win_stats_t *s, float x) {
+  float delta;
+
+  if (s->count == 0 || x < s->min)
+    s->min = x;
+  if (s->count == 0 || x > s->max)
+    s->max = x;
+  s->last = x;
+
+  s->count++;
+  delta = x - s->mean;
+  add_compensated(&s->mean, &s->mean_c, delta / s->count);
+  add_compensated(&s->m2, &s->m2_c, delta * (x - s->mean));
+}
+
+/**
+ * @brief Summarize a window.
+ * @param s window statistics
+ * @param out return-arg for the summary, stddev is the sample standard
+ * deviation, 0 for a single sample
+ * @return false if the window is empty
+ */
+bool win_stats_summary(const win_stats_t *s, win_summary_t *out) {
+  if (s->count == 0)
+    return false;
+
+  out->count = s->count;
+  out->min = s->min;
+  out->max = s->max;
+  out->mean = s->mean;
+  out->last = s->last;
+  out->stddev = s->count > 1 ? sqrtf(s->m2 / (s->count - 1)) : 0.0f;
+  return true;
+}
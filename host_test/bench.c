@@ -0,0 +1,338 @@
+// Host micro-benchmarks of the per-reading path:
+//   ./bench [--json] [filter]
+// runs every benchmark whose name contains `filter`, and prints its time and
+// heap allocations per operation, as CSV (`benchmark,ns_per_op,
+// allocs_per_op`) or as a JSON array. Allocations are counted by wrapping
+// malloc, calloc and realloc at link time. Host numbers only compare
+// implementations, they're not ESP32 cycle counts.
+
+#include "batt.h"
+#include "bench.h"
+#include "cbor_writer.h"
+#include "conv.h"
+#include "conv_ref.h"
+#include "deadband.h"
+#include "json_writer.h"
+#include "payload.h"
+#include "reading_buf.h"
+#include "win_stats.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// Each benchmark runs for at least this long
+#define BENCH_MIN_NS 200000000ULL
+
+/// Global vars
+static const char *FILTER = NULL;
+static bool JSON = false;
+static int RESULTS = 0;
+
+/// Heap allocations since start
+static uint64_t ALLOCS = 0;
+
+/// Keep the compiler from optimizing a result away
+static volatile uint32_t SINK;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  ALLOCS++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  ALLOCS++;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  ALLOCS++;
+  return __real_realloc(ptr, size);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void bench_run(const char *name, bench_fn_t fn, void *arg) {
+  uint32_t iters = 1;
+  uint64_t start, ns, allocs;
+
+  if (FILTER != NULL && strstr(name, FILTER) == NULL)
+    return;
+
+  // double the iterations until the run is long enough to time
+  for (;;) {
+    allocs = ALLOCS;
+    start = now_ns();
+    fn(arg, iters);
+    ns = now_ns() - start;
+    allocs = ALLOCS - allocs;
+    if (ns >= BENCH_MIN_NS || iters >= (1u << 30))
+      break;
+    iters *= 2;
+  }
+
+  if (JSON)
+    printf("%s\n  {\"benchmark\": \"%s\", \"ns_per_op\": %.1f, "
+           "\"allocs_per_op\": %.3f}",
+           RESULTS > 0 ? "," : "[", name, (double)ns / iters,
+           (double)allocs / iters);
+  else
+    printf("%s,%.1f,%.3f\n", name, (double)ns / iters,
+           (double)allocs / iters);
+  RESULTS++;
+}
+
+static esp_err_t accept(const reading_t *reading, void *arg) {
+  SINK = reading->captured_ms;
+  return ESP_OK;
+}
+
+/// Reading buffer in steady state: push a reading, send and ack a window
+static void bench_reading_buf(void *arg, uint32_t iters) {
+  static reading_t records[READING_BUF_CAPACITY];
+  reading_buf_policy_t policy = *(reading_buf_policy_t *)arg;
+  reading_buf_t buf;
+  reading_t r = {.value = 21.5f};
+
+  reading_buf_init(&buf, records, READING_BUF_CAPACITY, policy);
+  for (uint32_t i = 0; i < iters; i++) {
+    r.captured_ms = i;
+    r.sensor = i % SENSOR_MAX;
+    reading_buf_push(&buf, &r);
+    // a window of 8 is acked every 16 readings, so the buffer fills up and
+    // overflows with readings in flight
+    if ((i & 15) == 15) {
+      reading_buf_ack(&buf, buf.sent);
+      reading_buf_send(&buf, &accept, NULL, 8);
+    }
+  }
+  SINK = buf.count;
+}
+
+/// Drain a full buffer, a window at a time
+static void bench_reading_buf_send_ack(void *arg, uint32_t iters) {
+  static reading_t records[READING_BUF_CAPACITY];
+  reading_buf_t buf;
+  reading_t r = {.value = 21.5f};
+  uint32_t done = 0;
+
+  reading_buf_init(&buf, records, READING_BUF_CAPACITY,
+                   READING_BUF_DROP_OLDEST);
+  while (done < iters) {
+    while (buf.count < READING_BUF_CAPACITY) {
+      r.captured_ms = done + buf.count;
+      reading_buf_push(&buf, &r);
+    }
+    while (buf.count > 0 && done < iters) {
+      done += reading_buf_send(&buf, &accept, NULL, 8);
+      reading_buf_ack(&buf, buf.sent);
+    }
+  }
+}
+
+/// A typical snapshot, every sensor valid
+static const snapshot_t SNAP = {.captured_ms = 8500,
+                                .valid = SENSOR_ALL_BITS,
+                                .temp = 23.45f,
+                                .humd = 61.3f,
+                                .lux = 1234.5f,
+                                .moist = 812,
+                                .batt = 3987,
+                                .awake_ms = 1500};
+
+static void bench_encode_reading(void *arg, uint32_t iters) {
+  char buf[PAYLOAD_BUF_LEN];
+  reading_t r = {.value = 21.37f, .sensor = SENSOR_TEMPERATURE};
+
+  set_payload_format(*(mqtt_payload_format_t *)arg);
+  for (uint32_t i = 0; i < iters; i++) {
+    // a new timestamp every reading, a new minute every 60
+    r.captured_ms = i * 1000;
+    SINK = encode_reading(buf, sizeof(buf), &r);
+  }
+}
+
+static void bench_encode_snapshot(void *arg, uint32_t iters) {
+  char buf[SNAPSHOT_BUF_LEN];
+  snapshot_t snap = SNAP;
+
+  set_payload_format(*(mqtt_payload_format_t *)arg);
+  for (uint32_t i = 0; i < iters; i++) {
+    snap.captured_ms = i * 1000;
+    SINK = encode_snapshot(buf, sizeof(buf), &snap);
+  }
+}
+
+/// Raw readings and channel counts cycling through their ranges, so branches
+/// and table lookups aren't all predicted from one input
+static uint16_t raw_input(uint32_t i) { return (uint16_t)(i * 40503u); }
+
+static void bench_crc8(void *arg, uint32_t iters) {
+  uint8_t data[3] = {0};
+  uint16_t raw;
+
+  for (uint32_t i = 0; i < iters; i++) {
+    raw = raw_input(i);
+    data[0] = raw >> 8;
+    data[1] = raw & 0xff;
+    SINK = conv_sht_20_crc8(data, sizeof(data));
+  }
+}
+
+static void bench_crc8_bitwise(void *arg, uint32_t iters) {
+  for (uint32_t i = 0; i < iters; i++)
+    SINK = conv_ref_check_crc(raw_input(i), 0);
+}
+
+static void bench_sht_20_temp(void *arg, uint32_t iters) {
+  for (uint32_t i = 0; i < iters; i++)
+    SINK = (uint32_t)conv_sht_20_temp(raw_input(i));
+}
+
+static void bench_sht_20_temp_double(void *arg, uint32_t iters) {
+  for (uint32_t i = 0; i < iters; i++)
+    SINK = (uint32_t)conv_ref_sht_20_temp(raw_input(i));
+}
+
+static void bench_lux(void *arg, uint32_t iters) {
+  uint16_t ch0;
+
+  for (uint32_t i = 0; i < iters; i++) {
+    ch0 = raw_input(i);
+    SINK = (uint32_t)conv_apds_3901_lux(ch0, ch0 * (i & 7) / 10);
+  }
+}
+
+static void bench_lux_double_pow(void *arg, uint32_t iters) {
+  uint16_t ch0;
+
+  for (uint32_t i = 0; i < iters; i++) {
+    ch0 = raw_input(i);
+    SINK = (uint32_t)conv_ref_lux(ch0, ch0 * (i & 7) / 10);
+  }
+}
+
+static void bench_json_fixed(void *arg, uint32_t iters) {
+  char buf[32];
+  json_writer_t w;
+
+  for (uint32_t i = 0; i < iters; i++) {
+    json_write_init(&w, buf, sizeof(buf));
+    json_write_fixed(&w, (int32_t)raw_input(i) * 0.01f - 100, 2);
+    SINK = w.n;
+  }
+}
+
+static void bench_json_uint(void *arg, uint32_t iters) {
+  char buf[32];
+  json_writer_t w;
+
+  for (uint32_t i = 0; i < iters; i++) {
+    json_write_init(&w, buf, sizeof(buf));
+    json_write_uint(&w, i * 2654435761u);
+    SINK = w.n;
+  }
+}
+
+/// A timestamp a second after the last one, as readings are stamped
+static void bench_json_iso_8601(void *arg, uint32_t iters) {
+  json_iso_8601_cache_t cache = JSON_ISO_8601_CACHE_INIT;
+  char buf[JSON_ISO_8601_LEN + 1];
+
+  for (uint32_t i = 0; i < iters; i++) {
+    json_format_iso_8601(&cache, 1700000000 + i, buf);
+    SINK = buf[18];
+  }
+}
+
+static void bench_cbor_float(void *arg, uint32_t iters) {
+  uint8_t buf[16];
+  cbor_writer_t w;
+
+  for (uint32_t i = 0; i < iters; i++) {
+    cbor_write_init(&w, buf, sizeof(buf));
+    cbor_write_float(&w, (int32_t)raw_input(i) * 0.01f - 100, 0.005f);
+    SINK = w.n;
+  }
+}
+
+/// The battery monitor's filter: a trimmed mean of a burst of conversions
+static void bench_batt_trimmed_mean(void *arg, uint32_t iters) {
+  uint16_t samples[BATT_ADC_N_SAMPLES];
+
+  for (uint32_t i = 0; i < iters; i++) {
+    for (size_t j = 0; j < BATT_ADC_N_SAMPLES; j++)
+      samples[j] = 2400 + raw_input(i * BATT_ADC_N_SAMPLES + j) % 16;
+    SINK = conv_trimmed_mean(samples, BATT_ADC_N_SAMPLES, BATT_ADC_TRIM);
+  }
+}
+
+static void bench_win_stats_add(void *arg, uint32_t iters) {
+  win_stats_t s;
+
+  win_stats_reset(&s);
+  for (uint32_t i = 0; i < iters; i++)
+    win_stats_add(&s, 50000 + raw_input(i) * 1e-4f);
+  SINK = s.count;
+}
+
+/// A slowly drifting value, mostly within its deadband
+static void bench_deadband_update(void *arg, uint32_t iters) {
+  deadband_t db;
+  uint32_t published = 0;
+
+  deadband_init(&db, 0.2f, 0, 3600);
+  for (uint32_t i = 0; i < iters; i++)
+    published += deadband_update(&db, 20 + (i % 1000) * 0.01f, i * 60);
+  SINK = published;
+}
+
+int main(int argc, char **argv) {
+  reading_buf_policy_t drop_oldest = READING_BUF_DROP_OLDEST;
+  reading_buf_policy_t coalesce = READING_BUF_COALESCE;
+  mqtt_payload_format_t json = MQTT_PAYLOAD_JSON, cbor = MQTT_PAYLOAD_CBOR;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0)
+      JSON = true;
+    else
+      FILTER = argv[i];
+  }
+  init_payload();
+
+  if (!JSON)
+    printf("benchmark,ns_per_op,allocs_per_op\n");
+  bench_run("reading_buf_push_drop_oldest", &bench_reading_buf, &drop_oldest);
+  bench_run("reading_buf_push_coalesce", &bench_reading_buf, &coalesce);
+  bench_run("reading_buf_send_ack", &bench_reading_buf_send_ack, NULL);
+  bench_run("encode_reading_json", &bench_encode_reading, &json);
+  bench_run("encode_reading_cbor", &bench_encode_reading, &cbor);
+  bench_run("encode_snapshot_json", &bench_encode_snapshot, &json);
+  bench_run("encode_snapshot_cbor", &bench_encode_snapshot, &cbor);
+  bench_run("sht_20_crc8", &bench_crc8, NULL);
+  bench_run("sht_20_crc8_bitwise", &bench_crc8_bitwise, NULL);
+  bench_run("sht_20_temp", &bench_sht_20_temp, NULL);
+  bench_run("sht_20_temp_double", &bench_sht_20_temp_double, NULL);
+  bench_run("apds_3901_lux", &bench_lux, NULL);
+  bench_run("apds_3901_lux_double_pow", &bench_lux_double_pow, NULL);
+  bench_run("batt_trimmed_mean", &bench_batt_trimmed_mean, NULL);
+  bench_run("json_fixed", &bench_json_fixed, NULL);
+  bench_run("json_uint", &bench_json_uint, NULL);
+  bench_run("json_iso_8601", &bench_json_iso_8601, NULL);
+  bench_run("cbor_float", &bench_cbor_float, NULL);
+  bench_run("win_stats_add", &bench_win_stats_add, NULL);
+  bench_run("deadband_update", &bench_deadband_update, NULL);
+  if (JSON)
+    printf("%s]\n", RESULTS > 0 ? "\n" : "[");
+  return 0;
+}
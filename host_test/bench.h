@@ -0,0 +1,13 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Host micro-benchmarks, one CSV line per benchmark
+
+#include <stdint.h>
+
+/// Run the benchmarked operation `iters` times
+typedef void (*bench_fn_t)(void *arg, uint32_t iters);
+
+void bench_run(const char *name, bench_fn_t fn, void *arg);
+
+#endif
@@ -0,0 +1,42 @@
+#include "conv_ref.h"
+#include <math.h>
+
+/// The SHT-20 driver's bit-at-a-time check, 0 if intact
+uint8_t conv_ref_check_crc(uint16_t dat, uint8_t checksum) {
+  uint32_t remainder = ((uint32_t)dat << 8), divisor = 0x988000;
+
+  remainder |= checksum;
+  for (int i = 0; i < 16; i++) {
+    if (remainder & ((uint32_t)1 << (23 - i)))
+      remainder ^= divisor;
+    divisor >>= 1;
+  }
+
+  return (uint8_t)remainder;
+}
+
+double conv_ref_sht_20_temp(uint16_t raw) {
+  return -46.85 + ((raw & 0xfffc) * (175.72 / 65536.0));
+}
+
+double conv_ref_sht_20_humd(uint16_t raw) {
+  return -6.0 + ((raw & 0xfffc) * (125.0 / 65536.0));
+}
+
+/// The APDS-3901 driver's double-precision lux, with `pow`
+double conv_ref_lux(double ch0, double ch1) {
+  double ratio;
+
+  if (ch0 <= 0)
+    return 0;
+  ratio = ch1 / ch0;
+  if (ratio <= 0.5)
+    return (0.0304 * ch0) - ((0.062 * ch0) * pow(ratio, 1.4));
+  if (ratio <= 0.61)
+    return (0.0224 * ch0) - (0.031 * ch1);
+  if (ratio <= 0.8)
+    return (0.0128 * ch0) - (0.0153 * ch1);
+  if (ratio <= 1.3)
+    return (0.00146 * ch0) - (0.00112 * ch1);
+  return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef CONV_REF_H
+#define CONV_REF_H
+
+// The drivers' original conversion math, the reference for the conv kernels
+
+#include <stdint.h>
+
+uint8_t conv_ref_check_crc(uint16_t dat, uint8_t checksum);
+double conv_ref_sht_20_temp(uint16_t raw);
+double conv_ref_sht_20_humd(uint16_t raw);
+double conv_ref_lux(double ch0, double ch1);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef DRIVER_ADC_H
+#define DRIVER_ADC_H
+
+// Host stand-in for the one-shot ADC1 driver, conversions come from the test
+
+#include "esp_err.h"
+
+typedef enum { ADC1_CHANNEL_2 = 2, ADC1_CHANNEL_6 = 6 } adc1_channel_t;
+typedef enum { ADC_WIDTH_BIT_12 = 3 } adc_bits_width_t;
+typedef enum { ADC_ATTEN_DB_11 = 3 } adc_atten_t;
+typedef enum { ADC_UNIT_1 = 1 } adc_unit_t;
+
+esp_err_t adc1_config_width(adc_bits_width_t width_bit);
+esp_err_t adc1_config_channel_atten(adc1_channel_t channel, adc_atten_t atten);
+int adc1_get_raw(adc1_channel_t channel);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef ESP_ATTR_H
+#define ESP_ATTR_H
+
+// Host stand-in, there's no RTC memory or IRAM, so these are plain data
+
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define IRAM_ATTR
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef ESP_IDF_VERSION_H
+#define ESP_IDF_VERSION_H
+
+// Host stand-in, the oldest version with every API the components use
+
+#define ESP_IDF_VERSION_VAL(major, minor, patch)                               \
+  (((major) << 16) | ((minor) << 8) | (patch))
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(4, 4, 0)
+
+#endif
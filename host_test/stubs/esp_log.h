@@ -0,0 +1,29 @@
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+
+// Host stand-in for ESP-IDF's esp_log.h, logs to stderr when GM_LOG is set
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+__attribute__((format(printf, 3, 4))) static inline void
+esp_log_host(char level, const char *tag, const char *fmt, ...) {
+  va_list args;
+
+  if (getenv("GM_LOG") == NULL)
+    return;
+  va_start(args, fmt);
+  fprintf(stderr, "%c (%s) ", level, tag);
+  vfprintf(stderr, fmt, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+#define ESP_LOGE(tag, fmt, ...) esp_log_host('E', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) esp_log_host('W', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) esp_log_host('I', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) esp_log_host('D', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) esp_log_host('V', tag, fmt, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef ESP_PARTITION_H
+#define ESP_PARTITION_H
+
+// Host stand-in for ESP-IDF's esp_partition.h: one data partition on a NOR
+// flash emulated in a file, see esp_partition_host.c
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+  ESP_PARTITION_TYPE_APP = 0x00,
+  ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef enum {
+  ESP_PARTITION_SUBTYPE_ANY = 0xff,
+} esp_partition_subtype_t;
+
+typedef struct {
+  esp_partition_type_t type;
+  esp_partition_subtype_t subtype;
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+  bool encrypted;
+} esp_partition_t;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+                                                esp_partition_subtype_t subtype,
+                                                const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t src_offset,
+                             void *dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t dst_offset,
+                              const void *src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset,
+                                    size_t size);
+
+/// Exit status of a process whose power was cut
+#define HOST_FLASH_POWER_CUT 99
+
+/// Programs and erases, as counted by power cuts and traces
+typedef enum host_flash_op {
+  HOST_FLASH_WRITE,
+  HOST_FLASH_ERASE,
+} host_flash_op_t;
+
+void host_flash_open(const char *path, const char *label, uint32_t size);
+void host_flash_power_cut(uint32_t op, uint32_t bytes);
+void host_flash_trace(host_flash_op_t *ops, uint32_t max, uint32_t *n);
+void host_flash_fail_reads(uint32_t offset, uint32_t size);
+
+#endif
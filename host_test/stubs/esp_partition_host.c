@@ -0,0 +1,162 @@
+// NOR flash stand-in for esp_partition.h, backed by a file so its contents
+// outlive the process: programming can only clear bits, erasing sets whole
+// sectors to 0xff, and the power can be cut part way through a program or
+// erase, which ends the process like a brown-out would.
+
+#include "esp_partition.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// Global vars
+static esp_partition_t PART = {.type = ESP_PARTITION_TYPE_DATA,
+                               .subtype = ESP_PARTITION_SUBTYPE_ANY};
+static int FD = -1;
+static uint32_t OPS = 0;               // programs and erases so far
+static uint32_t CUT_OP = UINT32_MAX;   // op the power is cut during
+static uint32_t CUT_BYTES = 0;         // bytes of it that make it to flash
+static host_flash_op_t *TRACE = NULL;  // kind of each op, if tracing
+static uint32_t TRACE_MAX = 0;
+static uint32_t *TRACE_N = NULL;
+static uint32_t BAD_START = 0, BAD_END = 0; // reads of these bytes fail
+
+/**
+ * @brief Open, or create erased, the file holding the flash.
+ * @param path file
+ * @param label partition label, for `esp_partition_find_first`
+ * @param size partition size, a multiple of the sector size
+ */
+void host_flash_open(const char *path, const char *label, uint32_t size) {
+  uint8_t erased[SPI_FLASH_SEC_SIZE];
+  off_t len;
+
+  if ((FD = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+    abort();
+
+  len = lseek(FD, 0, SEEK_END);
+  memset(erased, 0xff, sizeof(erased));
+  for (; len < (off_t)size; len += SPI_FLASH_SEC_SIZE)
+    if (pwrite(FD, erased, sizeof(erased), len) != sizeof(erased))
+      abort();
+
+  strncpy(PART.label, label, sizeof(PART.label) - 1);
+  PART.size = size;
+}
+
+/**
+ * @brief Cut the power during a later program or erase.
+ * @param op index of the op, counting from 0 since the process started
+ * @param bytes bytes of it done before the power goes, from its start
+ */
+void host_flash_power_cut(uint32_t op, uint32_t bytes) {
+  CUT_OP = op;
+  CUT_BYTES = bytes;
+}
+
+/**
+ * @brief Record the kind of each program and erase.
+ * @param ops where to record them
+ * @param max size of `ops`
+ * @param n set to the number of ops so far, which may be more than `max`
+ */
+void host_flash_trace(host_flash_op_t *ops, uint32_t max, uint32_t *n) {
+  TRACE = ops;
+  TRACE_MAX = max;
+  TRACE_N = n;
+  *n = 0;
+}
+
+/**
+ * @brief Fail reads of a range of the partition, e.g. after an ECC error.
+ * @param offset start of the range
+ * @param size length of the range, 0 to read everything again
+ */
+void host_flash_fail_reads(uint32_t offset, uint32_t size) {
+  BAD_START = offset;
+  BAD_END = offset + size;
+}
+
+/// Count an op of `size` bytes, returning how many of them get done
+static size_t begin_op(host_flash_op_t kind, size_t size) {
+  if (TRACE != NULL) {
+    if (*TRACE_N < TRACE_MAX)
+      TRACE[*TRACE_N] = kind;
+    (*TRACE_N)++;
+  }
+  if (OPS++ != CUT_OP)
+    return size;
+  return CUT_BYTES < size ? CUT_BYTES : size;
+}
+
+/// The power goes once the bytes that made it are on flash
+static void end_op(size_t done, size_t size) {
+  if (done < size)
+    _exit(HOST_FLASH_POWER_CUT);
+}
+
+static bool in_range(const esp_partition_t *part, size_t offset, size_t size) {
+  return part == &PART && FD >= 0 && offset <= PART.size &&
+         size <= PART.size - offset;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+                                                esp_partition_subtype_t subtype,
+                                                const char *label) {
+  if (FD < 0 || type != PART.type || strcmp(label, PART.label) != 0)
+    return NULL;
+  return &PART;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t src_offset,
+                             void *dst, size_t size) {
+  if (!in_range(part, src_offset, size))
+    return ESP_ERR_INVALID_ARG;
+  if (src_offset < BAD_END && src_offset + size > BAD_START)
+    return ESP_FAIL;
+  if (pread(FD, dst, size, src_offset) != (ssize_t)size)
+    return ESP_FAIL;
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t dst_offset,
+                              const void *src, size_t size) {
+  const uint8_t *bytes = src;
+  uint8_t cells[SPI_FLASH_SEC_SIZE];
+  size_t done;
+
+  if (!in_range(part, dst_offset, size) || size > sizeof(cells))
+    return ESP_ERR_INVALID_ARG;
+
+  // programming only clears bits
+  done = begin_op(HOST_FLASH_WRITE, size);
+  if (pread(FD, cells, done, dst_offset) != (ssize_t)done)
+    return ESP_FAIL;
+  for (size_t i = 0; i < done; i++)
+    cells[i] &= bytes[i];
+  if (pwrite(FD, cells, done, dst_offset) != (ssize_t)done)
+    return ESP_FAIL;
+  end_op(done, size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset,
+                                    size_t size) {
+  uint8_t erased[SPI_FLASH_SEC_SIZE];
+  size_t done;
+
+  if (!in_range(part, offset, size) || offset % SPI_FLASH_SEC_SIZE ||
+      size % SPI_FLASH_SEC_SIZE)
+    return ESP_ERR_INVALID_ARG;
+
+  // an interrupted erase leaves the start of the range erased
+  done = begin_op(HOST_FLASH_ERASE, size);
+  memset(erased, 0xff, sizeof(erased));
+  for (size_t i = 0; i < done; i += SPI_FLASH_SEC_SIZE) {
+    size_t n = done - i < sizeof(erased) ? done - i : sizeof(erased);
+    if (pwrite(FD, erased, n, offset + i) != (ssize_t)n)
+      return ESP_FAIL;
+  }
+  end_op(done, size);
+  return ESP_OK;
+}
@@ -0,0 +1,22 @@
+#ifndef ESP_SYSTEM_H
+#define ESP_SYSTEM_H
+
+// Host stand-in. Random numbers are from a fixed seed, so runs repeat.
+
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef enum { ESP_MAC_WIFI_STA } esp_mac_type_t;
+
+static inline uint32_t esp_random(void) { return (uint32_t)random(); }
+
+static inline esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type) {
+  static const uint8_t MAC[6] = {0x02, 0x00, 0x00, 0x12, 0x34, 0x56};
+
+  for (int i = 0; i < 6; i++)
+    mac[i] = MAC[i];
+  return ESP_OK;
+}
+
+#endif
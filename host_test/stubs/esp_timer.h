@@ -0,0 +1,10 @@
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+
+// Host stand-in, microseconds of the FreeRTOS stand-in's virtual clock
+
+#include "freertos/FreeRTOS.h"
+
+static inline int64_t esp_timer_get_time(void) { return host_now_us(); }
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+// Host stand-in for the FreeRTOS API the components use, on pthreads. Ticks
+// are milliseconds of a virtual clock, which only moves when a task delays, so
+// tests run as fast as the host allows and don't depend on its scheduling.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint8_t StackType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+
+#define portMAX_DELAY UINT32_MAX
+#define portTICK_PERIOD_MS 1
+#define configTICK_RATE_HZ 1000
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+#include "freertos/portmacro.h"
+
+/// Virtual clock, shared with the `esp_timer.h` stand-in
+int64_t host_now_us(void);
+void host_advance_us(int64_t us);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef PORTMACRO_H
+#define PORTMACRO_H
+
+// Critical sections are one process-wide recursive lock on the host
+
+typedef struct {
+  int unused;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+
+void host_critical_enter(void);
+void host_critical_exit(void);
+
+#define portENTER_CRITICAL(mux) ((void)(mux), host_critical_enter())
+#define portEXIT_CRITICAL(mux) ((void)(mux), host_critical_exit())
+
+#endif
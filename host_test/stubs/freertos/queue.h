@@ -0,0 +1,25 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "freertos/FreeRTOS.h"
+#include <pthread.h>
+
+typedef struct host_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint8_t *storage;
+  uint32_t item_size;
+  uint32_t len;
+  uint32_t head;
+  uint32_t count;
+} StaticQueue_t;
+
+typedef StaticQueue_t *QueueHandle_t;
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t len, UBaseType_t item_size,
+                                 uint8_t *storage, StaticQueue_t *buf);
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef SEMPHR_H
+#define SEMPHR_H
+
+#include "freertos/FreeRTOS.h"
+#include <pthread.h>
+
+/// Counting semaphore, a mutex starts at 1 and has no priority inheritance
+typedef struct host_semaphore {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t count;
+} StaticSemaphore_t;
+
+typedef StaticSemaphore_t *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf);
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "freertos/FreeRTOS.h"
+#include <pthread.h>
+
+typedef void (*TaskFunction_t)(void *arg);
+
+typedef struct host_task {
+  pthread_t thread;
+  TaskFunction_t fn;
+  void *arg;
+  const char *name;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t notified;
+} StaticTask_t;
+
+typedef StaticTask_t *TaskHandle_t;
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t fn, const char *name,
+                               uint32_t stack_size, void *arg,
+                               UBaseType_t priority, StackType_t *stack,
+                               StaticTask_t *task);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+TaskHandle_t xTaskGetHandle(const char *name);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+void xTaskNotifyGive(TaskHandle_t task);
+
+#endif
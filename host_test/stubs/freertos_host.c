@@ -0,0 +1,278 @@
+// FreeRTOS stand-in on pthreads, see freertos/FreeRTOS.h
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_TASKS 8
+
+/// Global vars
+static pthread_mutex_t CLOCK_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static int64_t NOW_US = 0;
+static pthread_mutex_t CRITICAL;
+static pthread_once_t CRITICAL_ONCE = PTHREAD_ONCE_INIT;
+static TaskHandle_t TASKS[MAX_TASKS];
+static int N_TASKS = 0;
+static __thread TaskHandle_t CURRENT = NULL;
+
+int64_t host_now_us(void) {
+  int64_t now;
+
+  pthread_mutex_lock(&CLOCK_LOCK);
+  now = NOW_US;
+  pthread_mutex_unlock(&CLOCK_LOCK);
+  return now;
+}
+
+void host_advance_us(int64_t us) {
+  pthread_mutex_lock(&CLOCK_LOCK);
+  NOW_US += us;
+  pthread_mutex_unlock(&CLOCK_LOCK);
+}
+
+/// The I2C simulator's clock and bus timeouts, which are renamed to these in
+/// host builds so simulated conversions take virtual time
+int host_clock_gettime(clockid_t clk, struct timespec *ts) {
+  int64_t now = host_now_us();
+
+  ts->tv_sec = now / 1000000;
+  ts->tv_nsec = (now % 1000000) * 1000;
+  return 0;
+}
+
+int host_usleep(useconds_t us) {
+  host_advance_us(us);
+  return 0;
+}
+
+static void init_critical(void) {
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&CRITICAL, &attr);
+}
+
+void host_critical_enter(void) {
+  pthread_once(&CRITICAL_ONCE, &init_critical);
+  pthread_mutex_lock(&CRITICAL);
+}
+
+void host_critical_exit(void) { pthread_mutex_unlock(&CRITICAL); }
+
+/// Block on `cond` until `ready` or the timeout. A finite timeout waits that
+/// long in real time, and then moves the virtual clock past it.
+static bool wait_until(pthread_mutex_t *lock, pthread_cond_t *cond,
+                       bool (*ready)(void *), void *arg, TickType_t ticks) {
+  struct timespec deadline;
+
+  if (ticks == portMAX_DELAY) {
+    while (!ready(arg))
+      pthread_cond_wait(cond, lock);
+    return true;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += ticks / 1000;
+  deadline.tv_nsec += (long)(ticks % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  while (!ready(arg)) {
+    if (ticks == 0 ||
+        pthread_cond_timedwait(cond, lock, &deadline) == ETIMEDOUT) {
+      if (ready(arg))
+        return true;
+      host_advance_us((int64_t)ticks * 1000);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void init_sync(pthread_mutex_t *lock, pthread_cond_t *cond) {
+  pthread_mutex_init(lock, NULL);
+  pthread_cond_init(cond, NULL);
+}
+
+static void *run_task(void *arg) {
+  TaskHandle_t task = arg;
+
+  CURRENT = task;
+  task->fn(task->arg);
+  return NULL;
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t fn, const char *name,
+                               uint32_t stack_size, void *arg,
+                               UBaseType_t priority, StackType_t *stack,
+                               StaticTask_t *task) {
+  memset(task, 0, sizeof(StaticTask_t));
+  task->fn = fn;
+  task->arg = arg;
+  task->name = name;
+  init_sync(&task->lock, &task->cond);
+
+  host_critical_enter();
+  if (N_TASKS < MAX_TASKS)
+    TASKS[N_TASKS++] = task;
+  host_critical_exit();
+
+  if (pthread_create(&task->thread, NULL, &run_task, task) != 0)
+    return NULL;
+  pthread_detach(task->thread);
+  return task;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  if (task == NULL)
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+  host_advance_us((int64_t)ticks * 1000);
+  sched_yield();
+}
+
+TickType_t xTaskGetTickCount(void) { return (TickType_t)(host_now_us() / 1000); }
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) { return CURRENT; }
+
+TaskHandle_t xTaskGetHandle(const char *name) {
+  TaskHandle_t found = NULL;
+
+  host_critical_enter();
+  for (int i = 0; i < N_TASKS; i++)
+    if (strcmp(TASKS[i]->name, name) == 0)
+      found = TASKS[i];
+  host_critical_exit();
+  return found;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) { return 0; }
+
+static bool notified(void *arg) { return ((TaskHandle_t)arg)->notified > 0; }
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+  TaskHandle_t task = CURRENT;
+  uint32_t value = 0;
+
+  pthread_mutex_lock(&task->lock);
+  if (wait_until(&task->lock, &task->cond, &notified, task, ticks)) {
+    value = task->notified;
+    task->notified = clear ? 0 : task->notified - 1;
+  }
+  pthread_mutex_unlock(&task->lock);
+  return value;
+}
+
+void xTaskNotifyGive(TaskHandle_t task) {
+  pthread_mutex_lock(&task->lock);
+  task->notified++;
+  pthread_cond_broadcast(&task->cond);
+  pthread_mutex_unlock(&task->lock);
+}
+
+static SemaphoreHandle_t create_semaphore(StaticSemaphore_t *buf,
+                                          uint32_t count) {
+  init_sync(&buf->lock, &buf->cond);
+  buf->count = count;
+  return buf;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf) {
+  return create_semaphore(buf, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf) {
+  return create_semaphore(buf, 0);
+}
+
+static bool available(void *arg) {
+  return ((SemaphoreHandle_t)arg)->count > 0;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+  BaseType_t taken = pdFALSE;
+
+  pthread_mutex_lock(&sem->lock);
+  if (wait_until(&sem->lock, &sem->cond, &available, sem, ticks)) {
+    sem->count--;
+    taken = pdTRUE;
+  }
+  pthread_mutex_unlock(&sem->lock);
+  return taken;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+  pthread_mutex_lock(&sem->lock);
+  sem->count++;
+  pthread_cond_broadcast(&sem->cond);
+  pthread_mutex_unlock(&sem->lock);
+  return pdTRUE;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t len, UBaseType_t item_size,
+                                 uint8_t *storage, StaticQueue_t *buf) {
+  memset(buf, 0, sizeof(StaticQueue_t));
+  init_sync(&buf->lock, &buf->cond);
+  buf->storage = storage;
+  buf->item_size = item_size;
+  buf->len = len;
+  return buf;
+}
+
+static bool has_room(void *arg) {
+  QueueHandle_t q = arg;
+  return q->count < q->len;
+}
+
+static bool has_item(void *arg) { return ((QueueHandle_t)arg)->count > 0; }
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks) {
+  BaseType_t sent = pdFALSE;
+
+  pthread_mutex_lock(&q->lock);
+  if (wait_until(&q->lock, &q->cond, &has_room, q, ticks)) {
+    memcpy(&q->storage[((q->head + q->count) % q->len) * q->item_size], item,
+           q->item_size);
+    q->count++;
+    pthread_cond_broadcast(&q->cond);
+    sent = pdTRUE;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return sent;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks) {
+  BaseType_t received = pdFALSE;
+
+  pthread_mutex_lock(&q->lock);
+  if (wait_until(&q->lock, &q->cond, &has_item, q, ticks)) {
+    memcpy(item, &q->storage[q->head * q->item_size], q->item_size);
+    q->head = (q->head + 1) % q->len;
+    q->count--;
+    pthread_cond_broadcast(&q->cond);
+    received = pdTRUE;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return received;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+  UBaseType_t n;
+
+  pthread_mutex_lock(&q->lock);
+  n = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return n;
+}
@@ -0,0 +1,11 @@
+#ifndef HAL_I2C_TYPES_H
+#define HAL_I2C_TYPES_H
+
+// Host stand-in for ESP-IDF's hal/i2c_types.h
+
+typedef int i2c_port_t;
+
+#define I2C_NUM_0 0
+#define I2C_NUM_1 1
+
+#endif
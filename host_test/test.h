@@ -0,0 +1,27 @@
+#ifndef TEST_H
+#define TEST_H
+
+// Minimal assertions for the host tests, a failed check ends the test
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+#define CHECK_EQ(a, b)                                                         \
+  do {                                                                         \
+    long long a_ = (long long)(a), b_ = (long long)(b);                        \
+    if (a_ != b_) {                                                            \
+      fprintf(stderr, "%s:%d: %s == %s failed, %lld != %lld\n", __FILE__,      \
+              __LINE__, #a, #b, a_, b_);                                       \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+#endif
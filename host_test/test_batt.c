@@ -0,0 +1,156 @@
+// Battery reading path, on a fake one-shot ADC with a nonlinear calibration
+// curve: the burst's trimmed mean calibrated once, against the per-sample
+// calibration it replaced, on the same noisy conversions
+
+#include "batt.h"
+#include "driver/adc.h"
+#include "esp_adc_cal.h"
+#include "test.h"
+#include <math.h>
+#include <stdbool.h>
+
+/// Conversions for the next reading, and which one is next
+static uint16_t SAMPLES[BATT_ADC_N_SAMPLES];
+static size_t NEXT_SAMPLE;
+static bool ADC_FAIL;
+static int CHARACTERIZED, CONFIGURED;
+
+/// Global vars
+static uint64_t RNG = 0x9e3779b97f4a7c15ULL;
+
+/// xorshift64, uniform in [0, 1)
+static double rnd(void) {
+  RNG ^= RNG << 13;
+  RNG ^= RNG >> 7;
+  RNG ^= RNG << 17;
+  return (RNG >> 11) * 0x1p-53;
+}
+
+/// Gaussian, Box-Muller
+static double rnd_normal(double sigma) {
+  return sigma * sqrt(-2 * log(1 - rnd())) * cos(2 * M_PI * rnd());
+}
+
+/// An ESP32-like curve at 11 dB: linear, bending upwards at the top
+static double calibrate(double raw) {
+  double bend = raw > 2048 ? (raw - 2048) * (raw - 2048) / 40000 : 0;
+
+  return raw * 49614 / 65536 + 142 + bend;
+}
+
+esp_adc_cal_value_t
+esp_adc_cal_characterize(adc_unit_t adc_num, adc_atten_t atten,
+                         adc_bits_width_t bit_width, uint32_t default_vref,
+                         esp_adc_cal_characteristics_t *chars) {
+  CHARACTERIZED++;
+  chars->vref = default_vref;
+  return ESP_ADC_CAL_VAL_DEFAULT_VREF;
+}
+
+uint32_t esp_adc_cal_raw_to_voltage(uint32_t adc_reading,
+                                    const esp_adc_cal_characteristics_t *chars) {
+  return (uint32_t)calibrate(adc_reading);
+}
+
+esp_err_t adc1_config_width(adc_bits_width_t width_bit) {
+  CONFIGURED++;
+  return ESP_OK;
+}
+
+esp_err_t adc1_config_channel_atten(adc1_channel_t channel, adc_atten_t atten) {
+  return ESP_OK;
+}
+
+int adc1_get_raw(adc1_channel_t channel) {
+  if (ADC_FAIL)
+    return -1;
+  CHECK(NEXT_SAMPLE < BATT_ADC_N_SAMPLES);
+  return SAMPLES[NEXT_SAMPLE++];
+}
+
+/// Fill the next burst around a true raw value, with a fraction of
+/// `spike_rate` of conversions off by +-150
+static void fill(double raw, double spike_rate) {
+  double s;
+
+  for (size_t i = 0; i < BATT_ADC_N_SAMPLES; i++) {
+    s = round(raw + rnd_normal(6));
+    if (rnd() < spike_rate)
+      s += rnd() < 0.5 ? -150 : 150;
+    SAMPLES[i] = s < 0 ? 0 : s > 4095 ? 4095 : (uint16_t)s;
+  }
+  NEXT_SAMPLE = 0;
+}
+
+/// The previous method: calibrate every conversion, average the voltages
+static uint32_t per_sample_mv(void) {
+  uint32_t sum = 0;
+
+  for (size_t i = 0; i < BATT_ADC_N_SAMPLES; i++)
+    sum += esp_adc_cal_raw_to_voltage(SAMPLES[i], NULL);
+  return sum / BATT_ADC_N_SAMPLES * 2;
+}
+
+/// Sweep the pin across 1.5-2.1 V, comparing both methods' errors
+static void compare(double spike_rate, double *mean_err, double *max_err,
+                    double *old_mean_err, double *old_max_err) {
+  double truth, err, sum = 0, old_sum = 0;
+  uint32_t mv;
+  int n = 0;
+
+  *max_err = *old_max_err = 0;
+  for (double raw = 1800; raw <= 2600; raw += 0.37, n++) {
+    truth = 2 * calibrate(raw);
+    fill(raw, spike_rate);
+    CHECK_EQ(read_batt(&mv), ESP_OK);
+    CHECK_EQ(NEXT_SAMPLE, BATT_ADC_N_SAMPLES);
+
+    err = fabs(mv - truth);
+    sum += err;
+    *max_err = fmax(err, *max_err);
+    err = fabs(per_sample_mv() - truth);
+    old_sum += err;
+    *old_max_err = fmax(err, *old_max_err);
+  }
+  *mean_err = sum / n;
+  *old_mean_err = old_sum / n;
+}
+
+static void test_accuracy(void) {
+  double mean, max, old_mean, old_max;
+
+  compare(0, &mean, &max, &old_mean, &old_max);
+  printf("noise: mean %.2f mV, max %.2f mV; per sample %.2f, %.2f mV\n", mean,
+         max, old_mean, old_max);
+  CHECK(mean <= old_mean);
+  CHECK(max <= 6);
+
+  compare(0.03, &mean, &max, &old_mean, &old_max);
+  printf("spikes: mean %.2f mV, max %.2f mV; per sample %.2f, %.2f mV\n", mean,
+         max, old_mean, old_max);
+  CHECK(mean <= old_mean / 2);
+  CHECK(max <= 8);
+}
+
+/// The ADC is configured and characterized once, not on every reading
+static void test_init_once(void) {
+  uint32_t mv;
+
+  CHECK_EQ(CHARACTERIZED, 1);
+  CHECK_EQ(CONFIGURED, 1);
+
+  fill(2000, 0);
+  ADC_FAIL = true;
+  CHECK(read_batt(&mv) != ESP_OK);
+  ADC_FAIL = false;
+  CHECK_EQ(read_batt(&mv), ESP_OK);
+  CHECK_EQ(CHARACTERIZED, 1);
+  CHECK_EQ(CONFIGURED, 1);
+}
+
+int main(void) {
+  CHECK_EQ(init_batt_adc(), ESP_OK);
+  test_accuracy();
+  test_init_once();
+  return 0;
+}
@@ -0,0 +1,337 @@
+// Config documents arrive from the broker, and what they decode to is stored
+// in NVS and applied to the schedule: decoding must apply exactly the fields
+// given, and reject anything malformed or out of range without touching the
+// configuration. Log queries arrive the same way.
+
+#include "config.h"
+#include "payload.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+/// A valid configuration, with unequal intervals so moved fields show up
+static void base(mqtt_config_t *cfg) {
+  memset(cfg, 0, sizeof(mqtt_config_t));
+  cfg->version = MQTT_CONFIG_VERSION;
+  cfg->enabled = SENSOR_ALL_BITS;
+  cfg->snapshot_ms = 600000;
+  for (int i = 0; i < SENSOR_MAX; i++)
+    cfg->interval_ms[i] = 60000 + i * 1000;
+}
+
+/// Decode `doc` from a buffer of exactly its length, without a terminator
+static esp_err_t decode(const char *doc, size_t len, mqtt_config_t *cfg) {
+  char *buf = malloc(len > 0 ? len : 1);
+  esp_err_t err;
+
+  CHECK(buf != NULL);
+  memcpy(buf, doc, len);
+  err = decode_config(buf, len, cfg);
+  free(buf);
+  return err;
+}
+
+/// Apply `doc` to the base configuration, expecting it to succeed
+static void accept(const char *doc, mqtt_config_t *cfg) {
+  base(cfg);
+  CHECK_EQ(decode(doc, strlen(doc), cfg), ESP_OK);
+  CHECK(config_valid(cfg));
+}
+
+/// `doc` fails, and leaves the configuration as it was, padding included
+static void reject_len(const char *doc, size_t len) {
+  mqtt_config_t cfg, before;
+
+  base(&cfg);
+  memcpy(&before, &cfg, sizeof(mqtt_config_t));
+  if (decode(doc, len, &cfg) != ESP_ERR_INVALID_ARG) {
+    fprintf(stderr, "accepted \"%.*s\"\n", (int)len, doc);
+    exit(1);
+  }
+  CHECK(memcmp(&cfg, &before, sizeof(mqtt_config_t)) == 0);
+}
+
+static void reject(const char *doc) { reject_len(doc, strlen(doc)); }
+
+/// Fields left out of a document keep their values
+static void test_partial(void) {
+  mqtt_config_t cfg, want;
+
+  accept("{\"lux_ms\":300000}", &cfg);
+  base(&want);
+  want.interval_ms[SENSOR_LUX] = 300000;
+  CHECK(config_equal(&cfg, &want));
+
+  accept(" {\n\t\"mode\" : \"snapshot\" ,\r\n \"snapshot_ms\":900000 } ", &cfg);
+  base(&want);
+  want.snapshot = true;
+  want.snapshot_ms = 900000;
+  CHECK(config_equal(&cfg, &want));
+
+  accept("{\"mode\":\"sensor\",\"temperature_ms\":1000,"
+         "\"battery_voltage_ms\":86400000}",
+         &cfg);
+  base(&want);
+  want.interval_ms[SENSOR_TEMPERATURE] = 1000;
+  want.interval_ms[SENSOR_BATTERY_VOLTAGE] = 86400000;
+  CHECK(config_equal(&cfg, &want));
+
+  // empty objects change nothing
+  base(&want);
+  accept("{}", &cfg);
+  CHECK(config_equal(&cfg, &want));
+  accept(" { } ", &cfg);
+  CHECK(config_equal(&cfg, &want));
+}
+
+/// "<sensor>": true/false sets or clears just that sensor's bit
+static void test_enabled(void) {
+  const char *on = "{\"soil_moisture\":true}";
+  mqtt_config_t cfg;
+
+  accept("{\"battery_voltage\":false}", &cfg);
+  CHECK_EQ(cfg.enabled, SENSOR_ALL_BITS & ~SENSOR_BIT(SENSOR_BATTERY_VOLTAGE));
+
+  accept("{\"lux\":false,\"humidity\":false,\"lux\":true}", &cfg);
+  CHECK_EQ(cfg.enabled, SENSOR_ALL_BITS & ~SENSOR_BIT(SENSOR_HUMIDITY));
+
+  base(&cfg);
+  cfg.enabled = 0;
+  CHECK_EQ(decode(on, strlen(on), &cfg), ESP_OK);
+  CHECK_EQ(cfg.enabled, SENSOR_BIT(SENSOR_SOIL_MOISTURE));
+
+  for (int i = 0; i < SENSOR_MAX; i++) {
+    char doc[64];
+
+    snprintf(doc, sizeof(doc), "{\"%s\":false}", SENSOR_KEYS[i]);
+    accept(doc, &cfg);
+    CHECK_EQ(cfg.enabled, SENSOR_ALL_BITS & ~SENSOR_BIT(i));
+  }
+}
+
+/// Keys and values that aren't part of the format
+static void test_unknown(void) {
+  reject("{\"foo\":1}");
+  reject("{\"lux_ms\":3000,\"foo\":1}");
+  reject("{\"lux_mss\":3000}");
+  reject("{\"luxx\":true}");
+  reject("{\"_ms\":3000}");
+  reject("{\"\":3000}");
+  reject("{\"mode\":\"other\"}");
+  reject("{\"mode\":\"snapshots\"}");
+  reject("{\"mode\":snapshot}");
+  reject("{\"lux\":1}");
+  reject("{\"lux\":\"true\"}");
+  reject("{\"lux\":tru}");
+  reject("{\"lux_ms\":true}");
+  reject("{\"lux_ms\":\"3000\"}");
+  reject("{\"lux_ms\":-3000}");
+  reject("{\"lux_ms\":3000.5}");
+  reject("{\"lux_ms\":null}");
+  reject("{\"lu\\u0078_ms\":3000}");
+  reject("{\"temperature_ms_and_then_some\":3000}");
+}
+
+/// Intervals are 1000..86400000 ms, and numbers must fit in 32 bits
+static void test_range(void) {
+  const uint32_t OK[] = {MQTT_CONFIG_MIN_MS, MQTT_CONFIG_MIN_MS + 1,
+                         MQTT_CONFIG_MAX_MS - 1, MQTT_CONFIG_MAX_MS};
+  // including 2^32 + 60000 and 2^64 + 1000, which wrap around to valid ones
+  const char *const BAD[] = {"0",
+                             "999",
+                             "86400001",
+                             "4294967295",
+                             "4294967296",
+                             "4295027296",
+                             "18446744073709552616",
+                             "99999999999999999999999"};
+  char doc[96], key[32];
+  mqtt_config_t cfg;
+
+  for (int i = 0; i <= SENSOR_MAX; i++) {
+    if (i < SENSOR_MAX)
+      snprintf(key, sizeof(key), "%s%s", SENSOR_KEYS[i], INTERVAL_SUFFIX);
+    else
+      snprintf(key, sizeof(key), "%s", SNAPSHOT_MS);
+
+    for (size_t j = 0; j < sizeof(OK) / sizeof(OK[0]); j++) {
+      snprintf(doc, sizeof(doc), "{\"%s\":%u}", key, OK[j]);
+      accept(doc, &cfg);
+      CHECK_EQ(i < SENSOR_MAX ? cfg.interval_ms[i] : cfg.snapshot_ms, OK[j]);
+    }
+    for (size_t j = 0; j < sizeof(BAD) / sizeof(BAD[0]); j++) {
+      snprintf(doc, sizeof(doc), "{\"%s\":%s}", key, BAD[j]);
+      reject(doc);
+    }
+  }
+
+  // leading zeros don't overflow
+  accept("{\"lux_ms\":0000000000000000000001000}", &cfg);
+  CHECK_EQ(cfg.interval_ms[SENSOR_LUX], 1000);
+}
+
+/// Anything but whitespace after the object, and broken objects
+static void test_malformed(void) {
+  reject("");
+  reject(" ");
+  reject("{");
+  reject("}");
+  reject("[]");
+  reject("{}x");
+  reject("{}{}");
+  reject("{\"lux_ms\":3000}}");
+  reject("{\"lux_ms\":3000},");
+  reject("{\"lux_ms\":3000} 0");
+  reject("{\"lux_ms\":3000,}");
+  reject("{,\"lux_ms\":3000}");
+  reject("{\"lux_ms\" 3000}");
+  reject("{\"lux_ms\":}");
+  reject("{\"lux_ms\":3000 \"lux\":true}");
+  reject("{lux_ms:3000}");
+  reject("{\"lux_ms:3000}");
+  reject_len("{\"lux_ms\":3000}\0", 16);
+}
+
+/// Every cut short document fails, even when the bytes past its end would
+/// complete it
+static void test_truncated(void) {
+  const char *const DOCS[] = {
+      "{\"lux_ms\":300000}",
+      "{\"mode\":\"snapshot\",\"snapshot_ms\":900000,\"lux\":false}",
+      " { \"temperature\" : true , \"humidity_ms\" : 5000 } "};
+  mqtt_config_t cfg;
+
+  for (size_t i = 0; i < sizeof(DOCS) / sizeof(DOCS[0]); i++) {
+    size_t len = strlen(DOCS[i]);
+    bool closed = false;
+
+    for (size_t n = 0; n < len; n++) {
+      // trailing whitespace after the object may go
+      closed |= n > 0 && DOCS[i][n - 1] == '}';
+      if (closed)
+        continue;
+
+      reject_len(DOCS[i], n);
+
+      // the document carries on in memory, past `n`
+      base(&cfg);
+      CHECK_EQ(decode_config(DOCS[i], n, &cfg), ESP_ERR_INVALID_ARG);
+    }
+    accept(DOCS[i], &cfg);
+  }
+}
+
+/// Checks of a whole configuration, as loaded from NVS
+static void test_valid(void) {
+  mqtt_config_t cfg;
+
+  base(&cfg);
+  CHECK(config_valid(&cfg));
+
+  cfg.version = MQTT_CONFIG_VERSION + 1;
+  CHECK(!config_valid(&cfg));
+
+  base(&cfg);
+  cfg.enabled = SENSOR_BIT(SENSOR_MAX);
+  CHECK(!config_valid(&cfg));
+
+  for (int i = 0; i <= SENSOR_MAX; i++) {
+    uint32_t *ms = i < SENSOR_MAX ? &cfg.interval_ms[i] : &cfg.snapshot_ms;
+
+    base(&cfg);
+    *ms = MQTT_CONFIG_MIN_MS - 1;
+    CHECK(!config_valid(&cfg));
+    *ms = MQTT_CONFIG_MAX_MS + 1;
+    CHECK(!config_valid(&cfg));
+  }
+}
+
+/// Decode a log query, expecting it to succeed
+static void query(const char *doc, sensor_id_t sensor, uint32_t from_s,
+                  uint32_t to_s) {
+  sensor_id_t got_sensor;
+  uint32_t got_from, got_to;
+
+  CHECK_EQ(decode_log_query(doc, strlen(doc), &got_sensor, &got_from, &got_to),
+           ESP_OK);
+  CHECK_EQ(got_sensor, sensor);
+  CHECK_EQ(got_from, from_s);
+  CHECK_EQ(got_to, to_s);
+}
+
+/// A log query fails, and leaves the return-args as they were
+static void reject_query(const char *doc) {
+  sensor_id_t sensor = SENSOR_MAX;
+  uint32_t from_s = 7, to_s = 8;
+
+  if (decode_log_query(doc, strlen(doc), &sensor, &from_s, &to_s) !=
+      ESP_ERR_INVALID_ARG) {
+    fprintf(stderr, "accepted \"%s\"\n", doc);
+    exit(1);
+  }
+  CHECK_EQ(sensor, SENSOR_MAX);
+  CHECK_EQ(from_s, 7);
+  CHECK_EQ(to_s, 8);
+}
+
+/// Log queries need a known sensor and a non-empty range, "to" is optional
+static void test_log_query(void) {
+  query("{\"sensor\":\"lux\",\"from\":1620000000,\"to\":1620003600}",
+        SENSOR_LUX, 1620000000, 1620003600);
+  query(" { \"to\" : 2 , \"from\" : 1 , \"sensor\" : \"humidity\" } ",
+        SENSOR_HUMIDITY, 1, 2);
+  query("{\"sensor\":\"temperature\",\"from\":0}", SENSOR_TEMPERATURE, 0,
+        UINT32_MAX);
+  for (int i = 0; i < SENSOR_MAX; i++) {
+    char doc[64];
+
+    snprintf(doc, sizeof(doc), "{\"sensor\":\"%s\",\"from\":5}",
+             SENSOR_KEYS[i]);
+    query(doc, i, 5, UINT32_MAX);
+  }
+
+  // missing fields
+  reject_query("{}");
+  reject_query("{\"from\":1,\"to\":2}");
+  reject_query("{\"sensor\":\"lux\",\"to\":2}");
+  reject_query("{\"sensor\":\"lux\"}");
+
+  // empty ranges
+  reject_query("{\"sensor\":\"lux\",\"from\":2,\"to\":2}");
+  reject_query("{\"sensor\":\"lux\",\"from\":3,\"to\":2}");
+  reject_query("{\"sensor\":\"lux\",\"from\":4294967295}");
+
+  // unknown sensors and fields
+  reject_query("{\"sensor\":\"luxx\",\"from\":1}");
+  reject_query("{\"sensor\":\"lu\",\"from\":1}");
+  reject_query("{\"sensor\":\"\",\"from\":1}");
+  reject_query("{\"sensor\":\"lux_ms\",\"from\":1}");
+  reject_query("{\"sensor\":1,\"from\":1}");
+  reject_query("{\"sensor\":\"lux\",\"from\":1,\"until\":2}");
+  reject_query("{\"sensor\":\"lux\",\"from\":-1}");
+  reject_query("{\"sensor\":\"lux\",\"from\":4294967296}");
+
+  // repeated fields, even with the same value
+  reject_query("{\"sensor\":\"lux\",\"sensor\":\"lux\",\"from\":1}");
+  reject_query("{\"sensor\":\"lux\",\"sensor\":\"humidity\",\"from\":1}");
+  reject_query("{\"sensor\":\"lux\",\"from\":1,\"from\":2}");
+  reject_query("{\"sensor\":\"lux\",\"from\":1,\"to\":3,\"to\":4}");
+
+  // malformed
+  reject_query("");
+  reject_query("{\"sensor\":\"lux\",\"from\":1");
+  reject_query("{\"sensor\":\"lux\",\"from\":1,}");
+  reject_query("{\"sensor\":\"lux\",\"from\":1}x");
+}
+
+int main(void) {
+  test_partial();
+  test_enabled();
+  test_unknown();
+  test_range();
+  test_malformed();
+  test_truncated();
+  test_valid();
+  test_log_query();
+  return 0;
+}
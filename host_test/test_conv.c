@@ -0,0 +1,123 @@
+// Sensor conversion kernels against the double-precision math and bitwise
+// CRC they replaced, across the full raw input ranges
+
+#include "conv.h"
+#include "conv_ref.h"
+#include "test.h"
+#include <math.h>
+#include <string.h>
+
+/// Largest errors of the SHT-20 conversions, well under the sensor's 0.01
+/// degree and 0.04 %RH resolution
+#define TEMP_TOLERANCE 1e-4
+#define HUMD_TOLERANCE 1e-4
+
+/// Global vars
+static uint64_t RNG = 0x9e3779b97f4a7c15ULL;
+
+/// xorshift64
+static uint32_t rnd(void) {
+  RNG ^= RNG << 13;
+  RNG ^= RNG >> 7;
+  RNG ^= RNG << 17;
+  return (uint32_t)(RNG >> 32);
+}
+
+/// Every 16-bit reading, with every checksum byte: only the right one passes
+static void test_crc8(void) {
+  uint8_t data[3];
+
+  for (uint32_t dat = 0; dat <= UINT16_MAX; dat++) {
+    data[0] = dat >> 8;
+    data[1] = dat & 0xff;
+    data[2] = conv_sht_20_crc8(data, 2);
+    CHECK_EQ(conv_ref_check_crc(dat, data[2]), 0);
+    CHECK_EQ(conv_sht_20_crc8(data, 3), 0);
+    for (uint32_t checksum = 0; checksum <= UINT8_MAX; checksum++)
+      CHECK_EQ(conv_ref_check_crc(dat, checksum) == 0, checksum == data[2]);
+  }
+}
+
+static void test_sht_20(void) {
+  for (uint32_t raw = 0; raw <= UINT16_MAX; raw++) {
+    CHECK(fabs(conv_sht_20_temp(raw) - conv_ref_sht_20_temp(raw)) <=
+          TEMP_TOLERANCE);
+    CHECK(fabs(conv_sht_20_humd(raw) - conv_ref_sht_20_humd(raw)) <=
+          HUMD_TOLERANCE);
+  }
+}
+
+/// Relative error of lux from raw counts, 0 if both are 0
+static double lux_error(uint32_t ch0, uint32_t ch1) {
+  double ref = conv_ref_lux(ch0, ch1);
+  float lux = conv_apds_3901_lux(ch0, ch1);
+
+  if (ref == 0)
+    return lux == 0 ? 0 : INFINITY;
+  return fabs(lux - ref) / ref;
+}
+
+/// Every ch1 against a few ch0 counts, then every ch0 against random ch1
+/// counts, up to the 16-bit ADC's full scale and past the last ratio
+static void test_lux(void) {
+  static const uint32_t CH0[] = {1, 2, 3, 7, 100, 1000, 4095, 37177, 65535};
+  double err, max_err = 0;
+  uint32_t ch1;
+
+  for (size_t i = 0; i < sizeof(CH0) / sizeof(CH0[0]); i++) {
+    for (ch1 = 0; ch1 <= UINT16_MAX; ch1++) {
+      err = lux_error(CH0[i], ch1);
+      CHECK(err <= CONV_LUX_TOLERANCE);
+      max_err = fmax(err, max_err);
+    }
+  }
+  for (uint32_t ch0 = 0; ch0 <= UINT16_MAX; ch0++) {
+    for (int i = 0; i < 64; i++) {
+      ch1 = rnd() % (ch0 * 14 / 10 + 2);
+      err = lux_error(ch0, ch1);
+      CHECK(err <= CONV_LUX_TOLERANCE);
+      max_err = fmax(err, max_err);
+    }
+  }
+  printf("lux: max relative error %.2g, tolerance %.2g\n", max_err,
+         CONV_LUX_TOLERANCE);
+}
+
+static int cmp_u16(const void *a, const void *b) {
+  return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+/// Random 12-bit ADC samples against sorting and averaging in double
+static void test_trimmed_mean(void) {
+  uint16_t samples[64], sorted[64];
+  size_t n, trim;
+  double sum;
+
+  for (int i = 0; i < 100000; i++) {
+    n = 1 + rnd() % 64;
+    trim = rnd() % (n / 2 + 1);
+    for (size_t j = 0; j < n; j++)
+      samples[j] = rnd() % 4096;
+    memcpy(sorted, samples, n * sizeof(uint16_t));
+    qsort(sorted, n, sizeof(uint16_t), &cmp_u16);
+
+    if (n <= 2 * trim) {
+      CHECK_EQ(conv_trimmed_mean(samples, n, trim), 0);
+      continue;
+    }
+    sum = 0;
+    for (size_t j = trim; j < n - trim; j++)
+      sum += sorted[j];
+    CHECK_EQ(conv_trimmed_mean(samples, n, trim),
+             floor(sum / (n - 2 * trim) + 0.5));
+    CHECK(memcmp(samples, sorted, n * sizeof(uint16_t)) == 0);
+  }
+}
+
+int main(void) {
+  test_crc8();
+  test_sht_20();
+  test_lux();
+  test_trimmed_mean();
+  return 0;
+}
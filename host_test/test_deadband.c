@@ -0,0 +1,228 @@
+// Report-by-exception filters: a value is reported when it leaves the
+// deadband around the last reported one, or when the heartbeat expires, and
+// the counters say which of the two it was
+
+#include "deadband.h"
+#include "test.h"
+#include <string.h>
+
+/// Report `value`, expecting `want`
+static void update(deadband_t *db, float value, uint32_t now_s, bool want) {
+  deadband_t before = *db;
+
+  // checking doesn't change the filter
+  CHECK_EQ(deadband_due(db, value, now_s), want);
+  CHECK(memcmp(db, &before, sizeof(deadband_t)) == 0);
+
+  CHECK_EQ(deadband_update(db, value, now_s), want);
+  if (want) {
+    CHECK(db->last == value);
+    CHECK_EQ(db->last_s, now_s);
+  } else {
+    CHECK(db->last == before.last);
+    CHECK_EQ(db->last_s, before.last_s);
+  }
+}
+
+/// The first value goes out whatever it is
+static void test_first(void) {
+  deadband_t db;
+
+  deadband_init(&db, 1000, 1000, 0);
+  CHECK(!db.primed);
+  update(&db, 0, 0, true);
+  CHECK(db.primed);
+  CHECK_EQ(db.stats.heartbeats, 0);
+  update(&db, 0, 0, false);
+
+  deadband_init(&db, 1, 0, 0);
+  update(&db, -5, 12345, true);
+}
+
+/// Values must move strictly more than the deadband
+static void test_abs(void) {
+  deadband_t db;
+
+  deadband_init(&db, 0.5f, 0, 0);
+  update(&db, 20, 0, true);
+  update(&db, 20.5f, 1, false);
+  update(&db, 19.5f, 2, false);
+  update(&db, 20.75f, 3, true);
+  // centered on the last report, not the first
+  update(&db, 21.25f, 4, false);
+  update(&db, 20.25f, 5, false);
+  update(&db, 20.24f, 6, true);
+}
+
+/// The deadband is a fraction of the last report's magnitude
+static void test_rel(void) {
+  deadband_t db;
+
+  deadband_init(&db, 0, 0.25f, 0);
+  update(&db, -100, 0, true);
+  update(&db, -125, 1, false);
+  update(&db, -75, 2, false);
+  update(&db, -74, 3, true);
+  // the band shrinks with the value
+  update(&db, -92, 4, false);
+  update(&db, -93, 5, true);
+
+  // a zero last report has no band at all
+  deadband_init(&db, 0, 0.5f, 0);
+  update(&db, 0, 0, true);
+  update(&db, 0, 1, false);
+  update(&db, 0.001f, 2, true);
+}
+
+/// Either deadband is enough to report
+static void test_abs_or_rel(void) {
+  deadband_t db;
+
+  deadband_init(&db, 10, 0.01f, 0);
+  update(&db, 100, 0, true);
+  update(&db, 101, 1, false);
+  update(&db, 101.5f, 2, true);
+
+  deadband_init(&db, 1, 0.5f, 0);
+  update(&db, 10, 0, true);
+  update(&db, 11, 1, false);
+  update(&db, 11.01f, 2, true);
+}
+
+/// With neither deadband, any change is reported
+static void test_any_change(void) {
+  deadband_t db;
+
+  deadband_init(&db, 0, 0, 0);
+  update(&db, 3, 0, true);
+  update(&db, 3, 1, false);
+  update(&db, 3.0000002f, 2, true);
+  update(&db, 3.0000002f, 3, false);
+  update(&db, -3.0000002f, 4, true);
+
+  // negative deadbands are disabled too
+  deadband_init(&db, -1, -1, 0);
+  update(&db, 3, 0, true);
+  update(&db, 3, 1, false);
+  update(&db, 3.5f, 2, true);
+}
+
+/// Unchanged values go out once the heartbeat expires, counting from the last
+/// report of either kind
+static void test_heartbeat(void) {
+  deadband_t db;
+
+  deadband_init(&db, 1, 0, 60);
+  update(&db, 20, 1000, true);
+  update(&db, 20, 1059, false);
+  update(&db, 20, 1060, true);
+  update(&db, 20, 1119, false);
+  update(&db, 22, 1100, true);
+  update(&db, 22, 1159, false);
+  update(&db, 22, 1160, true);
+
+  // no heartbeat, ever
+  deadband_init(&db, 1, 0, 0);
+  update(&db, 20, 0, true);
+  update(&db, 20, UINT32_MAX, false);
+}
+
+/// Times wrap around, and a clock that stepped backwards is due
+static void test_heartbeat_wrap(void) {
+  deadband_t db;
+
+  deadband_init(&db, 1, 0, 60);
+  update(&db, 20, UINT32_MAX - 10, true);
+  update(&db, 20, 48, false);
+  update(&db, 20, 49, true);
+
+  update(&db, 20, 40, true);
+  CHECK_EQ(db.last_s, 40);
+  update(&db, 20, 41, false);
+}
+
+/// Each value is counted once, as published or suppressed, and published ones
+/// only because of the heartbeat are heartbeats
+static void test_stats(void) {
+  deadband_t db;
+
+  deadband_init(&db, 1, 0, 10);
+  update(&db, 5, 0, true);     // first
+  update(&db, 5, 1, false);    // suppressed
+  update(&db, 5.5f, 2, false); // suppressed
+  update(&db, 7, 3, true);     // moved
+  update(&db, 7, 13, true);    // heartbeat
+  update(&db, 9, 23, true);    // moved as the heartbeat expired
+  update(&db, 9, 24, false);   // suppressed
+
+  CHECK_EQ(db.stats.published, 4);
+  CHECK_EQ(db.stats.suppressed, 3);
+  CHECK_EQ(db.stats.heartbeats, 1);
+}
+
+/// Values reported together go out together, and the filters of the ones left
+/// out don't change
+static void test_update_all(void) {
+  const float START[3] = {10, 20, 30};
+  deadband_t dbs[3], before[3];
+  float values[3];
+
+  for (int i = 0; i < 3; i++)
+    deadband_init(&dbs[i], 1, 0, 100);
+
+  // the first group primes every valid filter
+  CHECK(deadband_update_all(dbs, START, 0x5, 3, 0));
+  CHECK(dbs[0].primed && !dbs[1].primed && dbs[2].primed);
+  CHECK_EQ(dbs[1].stats.published + dbs[1].stats.suppressed, 0);
+
+  // nothing moved: all suppressed
+  memcpy(values, START, sizeof(values));
+  values[0] = 10.5f;
+  CHECK(!deadband_update_all(dbs, values, 0x5, 3, 1));
+  CHECK(dbs[0].last == 10);
+  CHECK_EQ(dbs[0].stats.suppressed, 1);
+  CHECK_EQ(dbs[2].stats.suppressed, 1);
+
+  // one moved: all reported, and recentered on what was sent
+  values[2] = 32;
+  CHECK(deadband_update_all(dbs, values, 0x5, 3, 2));
+  CHECK(dbs[0].last == 10.5f);
+  CHECK(dbs[2].last == 32);
+  CHECK_EQ(dbs[0].stats.published, 2);
+  CHECK_EQ(dbs[0].stats.heartbeats, 1);
+  CHECK_EQ(dbs[2].stats.heartbeats, 0);
+
+  // a value that moved, but isn't valid, doesn't count
+  memcpy(before, dbs, sizeof(dbs));
+  values[0] = 50;
+  CHECK(!deadband_update_all(dbs, values, 0x4, 3, 3));
+  CHECK(memcmp(&dbs[0], &before[0], sizeof(deadband_t)) == 0);
+  CHECK(memcmp(&dbs[1], &before[1], sizeof(deadband_t)) == 0);
+
+  // a filter that was never primed is due
+  CHECK(deadband_update_all(dbs, values, 0x2, 3, 4));
+  CHECK(dbs[1].primed);
+  CHECK(dbs[1].last == 20);
+
+  // one heartbeat brings the rest along
+  dbs[0].last_s = 0;
+  dbs[1].last_s = 4;
+  dbs[2].last_s = 4;
+  values[0] = 10.5f;
+  CHECK(deadband_update_all(dbs, values, 0x7, 3, 100));
+  CHECK_EQ(dbs[1].last_s, 100);
+  CHECK_EQ(dbs[2].last_s, 100);
+}
+
+int main(void) {
+  test_first();
+  test_abs();
+  test_rel();
+  test_abs_or_rel();
+  test_any_change();
+  test_heartbeat();
+  test_heartbeat_wrap();
+  test_stats();
+  test_update_all();
+  return 0;
+}
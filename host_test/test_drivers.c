@@ -0,0 +1,291 @@
+// Sensor drivers on the I2C device simulator, through the bus manager, with
+// injected faults. Conversions and retry delays take virtual time.
+
+#include "apds_3901.h"
+#include "conv.h"
+#include "freertos/FreeRTOS.h"
+#include "i2c.h"
+#include "i2c_sim.h"
+#include "retry.h"
+#include "seesaw_soil.h"
+#include "sht_20.h"
+#include "test.h"
+#include <math.h>
+
+/// Longest I2C transaction timeout, held by an injected bus timeout
+#define TIMEOUT_MS 13
+
+static const uint8_t ADDRS[] = {I2C_SIM_SHT_20_ADDR, I2C_SIM_APDS_3901_ADDR,
+                                I2C_SIM_SEESAW_ADDR};
+
+/// Clear faults and retry state. The simulator is only reset once, before the
+/// drivers are initialized, since a reset powers the simulated sensors off.
+static void setup(void) {
+  i2c_sim_env_t env = {
+      .temp = 21.5f, .humd = 45.0f, .ch0 = 1000, .ch1 = 200, .moist = 600};
+
+  i2c_sim_set_env(&env);
+  for (size_t i = 0; i < sizeof(ADDRS); i++) {
+    CHECK_EQ(i2c_sim_inject(ADDRS[i], I2C_SIM_FAULT_NONE, 0), ESP_OK);
+    CHECK_EQ(i2c_sim_set_fault_rate(ADDRS[i], I2C_SIM_FAULT_NONE, 0), ESP_OK);
+  }
+  i2c_sim_set_invalid_rate(0);
+  retry_init(sht_20_retry(), "SHT 20");
+  retry_init(apds_3901_retry(), "APDS 3901");
+  retry_init(seesaw_soil_retry(), "Seesaw soil");
+}
+
+static i2c_sim_stats_t sim_stats(uint8_t addr) {
+  i2c_sim_stats_t stats;
+
+  CHECK_EQ(i2c_sim_get_stats(addr, &stats), ESP_OK);
+  return stats;
+}
+
+static retry_stats_t retry_stats(const retry_t *r) {
+  retry_stats_t stats;
+
+  retry_get_stats(r, &stats);
+  return stats;
+}
+
+static int64_t now_ms(void) { return host_now_us() / 1000; }
+
+/// Lux the driver should report for simulated counts, at low gain and 402 ms
+static float expected_lux(uint32_t ch0, uint32_t ch1) {
+  return conv_apds_3901_lux(ch0 * 16.0f, ch1 * 16.0f);
+}
+
+static void test_readings(void) {
+  i2c_sim_env_t env = {
+      .temp = 21.5f, .humd = 45.0f, .ch0 = 1000, .ch1 = 200, .moist = 600};
+  float temp, humd, lux;
+  uint16_t moist;
+
+  setup();
+  for (int i = 0; i < 3; i++) {
+    i2c_sim_set_env(&env);
+    CHECK_EQ(read_temp(&temp), ESP_OK);
+    CHECK(fabsf(temp - env.temp) < 0.05f);
+    CHECK_EQ(read_rel_humd(&humd), ESP_OK);
+    CHECK(fabsf(humd - env.humd) < 0.1f);
+    CHECK_EQ(read_lux(&lux), ESP_OK);
+    CHECK(fabsf(lux - expected_lux(env.ch0, env.ch1)) <
+          0.01f * expected_lux(env.ch0, env.ch1));
+    CHECK_EQ(read_soil_moisture(&moist), ESP_OK);
+    CHECK_EQ(moist, env.moist);
+
+    env.temp -= 30.25f;
+    env.humd += 20;
+    env.ch0 *= 2;
+    env.moist += 123;
+  }
+
+  CHECK_EQ(retry_stats(sht_20_retry()).retries, 0);
+  CHECK_EQ(retry_stats(apds_3901_retry()).retries, 0);
+  CHECK_EQ(retry_stats(seesaw_soil_retry()).retries, 0);
+}
+
+/// A NACK, a corrupted reading, or a stuck bus costs one retry each
+static void test_sht_20_faults(void) {
+  static const i2c_sim_fault_t FAULTS[] = {
+      I2C_SIM_FAULT_NACK, I2C_SIM_FAULT_BAD_CRC, I2C_SIM_FAULT_TIMEOUT};
+  i2c_sim_stats_t before, after;
+  int64_t start;
+  float temp;
+
+  for (size_t i = 0; i < sizeof(FAULTS) / sizeof(FAULTS[0]); i++) {
+    setup();
+    before = sim_stats(I2C_SIM_SHT_20_ADDR);
+    CHECK_EQ(i2c_sim_inject(I2C_SIM_SHT_20_ADDR, FAULTS[i], 1), ESP_OK);
+    start = now_ms();
+    CHECK_EQ(read_temp(&temp), ESP_OK);
+    CHECK(fabsf(temp - 21.5f) < 0.05f);
+    CHECK_EQ(retry_stats(sht_20_retry()).retries, 1);
+    CHECK_EQ(retry_stats(sht_20_retry()).failures, 0);
+
+    after = sim_stats(I2C_SIM_SHT_20_ADDR);
+    CHECK_EQ(after.bad_crcs - before.bad_crcs,
+             FAULTS[i] == I2C_SIM_FAULT_BAD_CRC);
+    CHECK_EQ(after.timeouts - before.timeouts,
+             FAULTS[i] == I2C_SIM_FAULT_TIMEOUT);
+    if (FAULTS[i] == I2C_SIM_FAULT_TIMEOUT)
+      CHECK(now_ms() - start >= TIMEOUT_MS + 86);
+    // a bad checksum consumes the result, the conversion is started again
+    if (FAULTS[i] == I2C_SIM_FAULT_BAD_CRC)
+      CHECK(now_ms() - start >= 2 * 86);
+  }
+}
+
+/// A dead sensor trips its breaker, is skipped without touching the bus, and
+/// is probed again once it's back
+static void test_sht_20_breaker(void) {
+  retry_t *r = sht_20_retry();
+  uint32_t txns;
+  float temp;
+
+  setup();
+  CHECK_EQ(i2c_sim_inject(I2C_SIM_SHT_20_ADDR, I2C_SIM_FAULT_NACK, UINT32_MAX),
+           ESP_OK);
+  for (int i = 0; i < RETRY_TRIP_FAILURES; i++) {
+    CHECK_EQ(r->state, RETRY_CLOSED);
+    CHECK_EQ(read_temp(&temp), ESP_FAIL);
+  }
+  CHECK_EQ(r->state, RETRY_OPEN);
+  CHECK_EQ(retry_stats(r).retries,
+           RETRY_TRIP_FAILURES * (RETRY_MAX_ATTEMPTS - 1));
+  CHECK_EQ(retry_stats(r).trips, 1);
+
+  txns = sim_stats(I2C_SIM_SHT_20_ADDR).txns;
+  for (int i = 0; i < RETRY_OPEN_READS; i++)
+    CHECK_EQ(read_temp(&temp), RETRY_ERR_OPEN);
+  CHECK_EQ(sim_stats(I2C_SIM_SHT_20_ADDR).txns, txns);
+  CHECK_EQ(retry_stats(r).skipped, RETRY_OPEN_READS);
+
+  // a failed probe gets one attempt, and opens the breaker again
+  CHECK_EQ(read_temp(&temp), ESP_FAIL);
+  CHECK_EQ(sim_stats(I2C_SIM_SHT_20_ADDR).txns, txns + 1);
+  CHECK_EQ(r->state, RETRY_OPEN);
+  CHECK_EQ(retry_stats(r).trips, 2);
+
+  CHECK_EQ(i2c_sim_inject(I2C_SIM_SHT_20_ADDR, I2C_SIM_FAULT_NONE, 0), ESP_OK);
+  for (int i = 0; i < RETRY_OPEN_READS; i++)
+    CHECK_EQ(read_rel_humd(&temp), RETRY_ERR_OPEN);
+  CHECK_EQ(read_temp(&temp), ESP_OK);
+  CHECK_EQ(r->state, RETRY_CLOSED);
+  CHECK(fabsf(temp - 21.5f) < 0.05f);
+}
+
+/// A failed read powers the sensor back on, and waits out a full integration
+static void test_apds_3901_faults(void) {
+  int64_t start;
+  float lux;
+
+  setup();
+  CHECK_EQ(read_lux(&lux), ESP_OK);
+
+  CHECK_EQ(i2c_sim_inject(I2C_SIM_APDS_3901_ADDR, I2C_SIM_FAULT_NACK, 1),
+           ESP_OK);
+  start = now_ms();
+  CHECK_EQ(read_lux(&lux), ESP_OK);
+  CHECK(fabsf(lux - expected_lux(1000, 200)) < 0.01f * expected_lux(1000, 200));
+  CHECK_EQ(retry_stats(apds_3901_retry()).retries, 1);
+  CHECK(now_ms() - start >= 402);
+
+  CHECK_EQ(i2c_sim_inject(I2C_SIM_APDS_3901_ADDR, I2C_SIM_FAULT_TIMEOUT, 1),
+           ESP_OK);
+  CHECK_EQ(read_lux(&lux), ESP_OK);
+  CHECK_EQ(retry_stats(apds_3901_retry()).retries, 2);
+
+  CHECK_EQ(i2c_sim_inject(I2C_SIM_APDS_3901_ADDR, I2C_SIM_FAULT_NACK,
+                          UINT32_MAX),
+           ESP_OK);
+  CHECK(read_lux(&lux) != ESP_OK);
+  CHECK_EQ(retry_stats(apds_3901_retry()).failures, 1);
+}
+
+/// Light rising from darkness past full scale and falling back. At each level
+/// the first reading may re-measure after saturating, later ones are accurate
+/// to a fraction of a percent. The conversion after a power failure shows
+/// which integration time the driver has picked.
+static void test_apds_3901_lux_sweep(void) {
+  i2c_sim_env_t env = {
+      .temp = 21.5f, .humd = 45.0f, .ch0 = 0, .ch1 = 0, .moist = 600};
+  // brightest light before ch0 saturates at 13.7 ms integration
+  const uint32_t max_ch0 = 5047 * 402 / 13.7f;
+  float lux, want, full_scale = 0, brightest = 0;
+  uint32_t retries, took_ms;
+  int64_t start;
+  int level;
+
+  setup();
+  for (int i = 0; i <= 96; i++) {
+    level = i <= 48 ? i : 96 - i;
+    env.ch0 = level == 0 ? 0 : (uint32_t)powf(10, level / 8.0f);
+    env.ch1 = env.ch0 / 5;
+    want = expected_lux(env.ch0, env.ch1);
+    i2c_sim_set_env(&env);
+
+    for (int j = 0; j < 3; j++) {
+      retries = retry_stats(apds_3901_retry()).retries;
+      CHECK_EQ(read_lux(&lux), ESP_OK);
+      CHECK(retry_stats(apds_3901_retry()).retries - retries <= (j == 0));
+      if (j == 0)
+        continue;
+
+      if (env.ch0 < max_ch0) {
+        CHECK(fabsf(lux - want) <= 0.005f * want + 0.01f);
+        if (lux > brightest)
+          brightest = lux;
+        continue;
+      }
+      // clipped, the full scale of the least sensitive range
+      if (full_scale == 0)
+        full_scale = lux;
+      CHECK_EQ(lux, full_scale);
+      CHECK(full_scale > brightest);
+    }
+
+    CHECK_EQ(i2c_sim_inject(I2C_SIM_APDS_3901_ADDR, I2C_SIM_FAULT_NACK, 1),
+             ESP_OK);
+    start = now_ms();
+    CHECK_EQ(read_lux(&lux), ESP_OK);
+    took_ms = (uint32_t)(now_ms() - start);
+    // dusk gets the longest integration, daylight the shortest
+    if (env.ch0 <= 1000)
+      CHECK(took_ms >= 402);
+    if (env.ch0 >= 74989)
+      CHECK(took_ms < 101);
+  }
+  CHECK(full_scale > 0);
+}
+
+/// Invalid replies are read again without starting another conversion
+static void test_seesaw_faults(void) {
+  uint32_t invalid = sim_stats(I2C_SIM_SEESAW_ADDR).invalid;
+  int64_t start;
+  uint16_t moist;
+  int ok = 0;
+
+  setup();
+  i2c_sim_set_invalid_rate(300);
+  for (int i = 0; i < 50; i++) {
+    start = now_ms();
+    if (read_soil_moisture(&moist) != ESP_OK)
+      continue;
+    ok++;
+    CHECK_EQ(moist, 600);
+    // one conversion, plus at most the retry delays
+    CHECK(now_ms() - start < 1000 + RETRY_MAX_ATTEMPTS * RETRY_MAX_MS);
+  }
+  invalid = sim_stats(I2C_SIM_SEESAW_ADDR).invalid - invalid;
+  CHECK(invalid > 0);
+  CHECK(ok >= 45);
+  CHECK_EQ(retry_stats(seesaw_soil_retry()).retries, invalid);
+
+  setup();
+  CHECK_EQ(i2c_sim_inject(I2C_SIM_SEESAW_ADDR, I2C_SIM_FAULT_NACK, 1), ESP_OK);
+  CHECK_EQ(read_soil_moisture(&moist), ESP_OK);
+  CHECK_EQ(moist, 600);
+  CHECK_EQ(i2c_sim_inject(I2C_SIM_SEESAW_ADDR, I2C_SIM_FAULT_TIMEOUT, 1),
+           ESP_OK);
+  CHECK_EQ(read_soil_moisture(&moist), ESP_OK);
+  CHECK_EQ(moist, 600);
+  CHECK_EQ(retry_stats(seesaw_soil_retry()).retries, 2);
+}
+
+int main(void) {
+  i2c_sim_reset(7);
+  CHECK_EQ(init_i2c_master(), ESP_OK);
+  CHECK_EQ(init_sht_20(I2C_BUS), ESP_OK);
+  CHECK_EQ(init_apds_3901(I2C_BUS, I2C_SIM_APDS_3901_ADDR), ESP_OK);
+  CHECK_EQ(init_soil_sensor(I2C_BUS, I2C_SIM_SEESAW_ADDR), ESP_OK);
+
+  test_readings();
+  test_sht_20_faults();
+  test_sht_20_breaker();
+  test_apds_3901_faults();
+  test_apds_3901_lux_sweep();
+  test_seesaw_faults();
+  return 0;
+}
@@ -0,0 +1,218 @@
+// Deep-sleep duty cycle state machine, driven through whole cycles by a
+// simulated clock the way `run_duty_cycle` drives it
+
+#include "duty_cycle.h"
+#include "test.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PERIOD_MS 60000
+#define TIMEOUT_MS 10000
+
+/// How long each step takes in a simulated cycle, -1 if it never succeeds
+typedef struct cycle_plan {
+  int32_t sample_ms;
+  int32_t connect_ms;
+  int32_t publish_ms;
+  bool skip; // readings within their deadbands
+} cycle_plan_t;
+
+typedef struct cycle_result {
+  duty_state_t states[8];
+  int n_states;
+  uint32_t awake_ms;
+  uint32_t sleep_ms;
+} cycle_result_t;
+
+/// Global vars
+static uint32_t NOW_MS;
+
+/// Step that succeeds after `took_ms`, or blocks until the timeout if < 0
+static bool step(const duty_cycle_t *dc, int32_t took_ms) {
+  uint32_t left = duty_cycle_remaining_ms(dc, NOW_MS);
+
+  if (took_ms < 0 || (uint32_t)took_ms >= left) {
+    NOW_MS += left;
+    return false;
+  }
+  NOW_MS += took_ms;
+  return true;
+}
+
+/// One wakeup, from boot to the deep sleep call
+static cycle_result_t run_cycle(duty_cycle_t *dc, const cycle_plan_t *plan,
+                                uint32_t boot_ms) {
+  cycle_result_t res = {0};
+  duty_state_t state;
+
+  NOW_MS = boot_ms;
+  duty_cycle_begin(dc, NOW_MS);
+
+  while ((state = duty_cycle_state(dc, NOW_MS)) != DUTY_SLEEP) {
+    CHECK(res.n_states < 8);
+    res.states[res.n_states++] = state;
+
+    switch (state) {
+    case DUTY_SAMPLE:
+      step(dc, plan->sample_ms);
+      duty_cycle_event(dc, DUTY_SAMPLED);
+      if (plan->skip)
+        duty_cycle_event(dc, DUTY_SKIPPED);
+      break;
+    case DUTY_CONNECT:
+      if (step(dc, plan->connect_ms))
+        duty_cycle_event(dc, DUTY_CONNECTED);
+      break;
+    case DUTY_PUBLISH:
+      if (step(dc, plan->publish_ms))
+        duty_cycle_event(dc, DUTY_PUBLISHED);
+      break;
+    default:
+      break;
+    }
+  }
+
+  res.sleep_ms = duty_cycle_end(dc, NOW_MS);
+  res.awake_ms = dc->last_awake_ms;
+  return res;
+}
+
+static void test_publish(void) {
+  duty_cycle_t dc;
+  cycle_plan_t plan = {.sample_ms = 150, .connect_ms = 800, .publish_ms = 60};
+  cycle_result_t res;
+
+  duty_cycle_init(&dc, PERIOD_MS, TIMEOUT_MS);
+  res = run_cycle(&dc, &plan, 30);
+
+  CHECK_EQ(res.n_states, 3);
+  CHECK_EQ(res.states[0], DUTY_SAMPLE);
+  CHECK_EQ(res.states[1], DUTY_CONNECT);
+  CHECK_EQ(res.states[2], DUTY_PUBLISH);
+  CHECK_EQ(res.awake_ms, 1010);
+  CHECK_EQ(res.sleep_ms, PERIOD_MS - 1010);
+  CHECK_EQ(dc.cycles, 1);
+  CHECK_EQ(dc.timeouts, 0);
+}
+
+/// No network: give up at the timeout, and still keep the period
+static void test_connect_timeout(void) {
+  duty_cycle_t dc;
+  cycle_plan_t plan = {.sample_ms = 150, .connect_ms = -1, .publish_ms = 60};
+  cycle_result_t res;
+
+  duty_cycle_init(&dc, PERIOD_MS, TIMEOUT_MS);
+  res = run_cycle(&dc, &plan, 0);
+
+  CHECK_EQ(res.n_states, 2);
+  CHECK_EQ(res.states[1], DUTY_CONNECT);
+  CHECK_EQ(res.awake_ms, TIMEOUT_MS);
+  CHECK_EQ(res.sleep_ms, PERIOD_MS - TIMEOUT_MS);
+  CHECK_EQ(dc.timeouts, 1);
+}
+
+/// Connected, but the PUBACK never came
+static void test_publish_timeout(void) {
+  duty_cycle_t dc;
+  cycle_plan_t plan = {.sample_ms = 150, .connect_ms = 800, .publish_ms = -1};
+  cycle_result_t res;
+
+  duty_cycle_init(&dc, PERIOD_MS, TIMEOUT_MS);
+  res = run_cycle(&dc, &plan, 0);
+
+  CHECK_EQ(res.n_states, 3);
+  CHECK_EQ(res.awake_ms, TIMEOUT_MS);
+  CHECK_EQ(dc.timeouts, 1);
+}
+
+/// Nothing moved out of its deadband: the radio is never started
+static void test_skip(void) {
+  duty_cycle_t dc;
+  cycle_plan_t plan = {.sample_ms = 150, .skip = true};
+  cycle_result_t res;
+
+  duty_cycle_init(&dc, PERIOD_MS, TIMEOUT_MS);
+  res = run_cycle(&dc, &plan, 0);
+
+  CHECK_EQ(res.n_states, 1);
+  CHECK_EQ(res.states[0], DUTY_SAMPLE);
+  CHECK_EQ(res.awake_ms, 150);
+  CHECK_EQ(dc.timeouts, 0);
+}
+
+/// The network may come up while sensors are still being sampled
+static void test_connected_early(void) {
+  duty_cycle_t dc;
+
+  duty_cycle_init(&dc, PERIOD_MS, TIMEOUT_MS);
+  duty_cycle_begin(&dc, 0);
+  duty_cycle_event(&dc, DUTY_CONNECTED);
+  CHECK_EQ(duty_cycle_state(&dc, 100), DUTY_SAMPLE);
+  duty_cycle_event(&dc, DUTY_SAMPLED);
+  CHECK_EQ(duty_cycle_state(&dc, 200), DUTY_PUBLISH);
+  CHECK_EQ(duty_cycle_state(&dc, TIMEOUT_MS), DUTY_SLEEP);
+}
+
+/// A cycle that overran its period still sleeps for the minimum
+static void test_overrun(void) {
+  duty_cycle_t dc;
+  cycle_plan_t plan = {.sample_ms = 150, .connect_ms = 3000, .publish_ms = 60};
+  cycle_result_t res;
+
+  duty_cycle_init(&dc, 2000, TIMEOUT_MS);
+  res = run_cycle(&dc, &plan, 0);
+
+  CHECK_EQ(res.awake_ms, 3210);
+  CHECK_EQ(res.sleep_ms, DUTY_CYCLE_MIN_SLEEP_MS);
+}
+
+/// Across many wakeups, awake plus sleep time adds up to the period, and the
+/// previous cycle's awake time is available for the next snapshot
+static void test_many_cycles(void) {
+  duty_cycle_t dc;
+  cycle_plan_t plans[] = {
+      {.sample_ms = 150, .connect_ms = 800, .publish_ms = 60},
+      {.sample_ms = 150, .connect_ms = -1},
+      {.sample_ms = 140, .skip = true},
+      {.sample_ms = 160, .connect_ms = 2500, .publish_ms = -1},
+  };
+  uint32_t prev_awake = 0;
+  cycle_result_t res;
+
+  duty_cycle_init(&dc, PERIOD_MS, TIMEOUT_MS);
+  for (uint32_t i = 0; i < 100; i++) {
+    CHECK_EQ(dc.last_awake_ms, prev_awake);
+    // esp_timer restarts from 0 on every wakeup, plus some boot time
+    res = run_cycle(&dc, &plans[i % 4], 25 + i % 7);
+    CHECK_EQ(res.awake_ms + res.sleep_ms, PERIOD_MS);
+    prev_awake = res.awake_ms;
+  }
+  CHECK_EQ(dc.cycles, 100);
+  CHECK_EQ(dc.timeouts, 50);
+}
+
+/// The clock may wrap within a cycle
+static void test_wrap(void) {
+  duty_cycle_t dc;
+  cycle_plan_t plan = {.sample_ms = 150, .connect_ms = 800, .publish_ms = 60};
+  cycle_result_t res;
+
+  duty_cycle_init(&dc, PERIOD_MS, TIMEOUT_MS);
+  res = run_cycle(&dc, &plan, UINT32_MAX - 500);
+
+  CHECK_EQ(res.n_states, 3);
+  CHECK_EQ(res.awake_ms, 1010);
+  CHECK_EQ(dc.timeouts, 0);
+}
+
+int main(void) {
+  test_publish();
+  test_connect_timeout();
+  test_publish_timeout();
+  test_skip();
+  test_connected_early();
+  test_overrun();
+  test_many_cycles();
+  test_wrap();
+  return 0;
+}
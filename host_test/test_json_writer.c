@@ -0,0 +1,238 @@
+// JSON writer fuzzing: random sequences of writes into buffers of every size
+// must never write past the buffer, and must either match the output of an
+// unbounded buffer or fail with a NUL-terminated prefix of it. Numbers and
+// timestamps are checked against the C library.
+
+#include "json_writer.h"
+#include "test.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#define FUZZ_RUNS 2000
+#define MAX_OPS 24
+#define MAX_OUT 1024
+#define GUARD 16
+
+typedef enum op_kind {
+  OP_BEGIN,
+  OP_END,
+  OP_KEY,
+  OP_ARRAY_BEGIN,
+  OP_ARRAY_END,
+  OP_ITEM,
+  OP_STRING,
+  OP_UINT,
+  OP_INT,
+  OP_FIXED,
+  OP_ISO_8601,
+  OP_KINDS
+} op_kind_t;
+
+typedef struct op {
+  op_kind_t kind;
+  char str[12];
+  uint32_t u;
+  float f;
+  uint8_t decimals;
+} op_t;
+
+/// Global vars
+static uint64_t RNG = 0x9e3779b97f4a7c15ULL;
+
+/// xorshift64
+static uint32_t rnd(void) {
+  RNG ^= RNG << 13;
+  RNG ^= RNG >> 7;
+  RNG ^= RNG << 17;
+  return (uint32_t)(RNG >> 32);
+}
+
+static float rnd_float(void) {
+  static const float SPECIAL[] = {0,         -0.0f,     0.5f,      -0.004f,
+                                  0.995f,    99.995f,   -1e-7f,    4294967040.0f,
+                                  4.3e9f,    -4.3e9f,   INFINITY,  NAN};
+  uint32_t bits;
+  float f;
+
+  switch (rnd() % 3) {
+  case 0:
+    return SPECIAL[rnd() % (sizeof(SPECIAL) / sizeof(SPECIAL[0]))];
+  case 1:
+    return (float)((int32_t)rnd() % 200000) / 100.0f;
+  default:
+    bits = rnd();
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+  }
+}
+
+static op_t rnd_op(void) {
+  static const char CHARS[] = "ab\"\\ z";
+  op_t op = {.kind = rnd() % OP_KINDS};
+  size_t n = rnd() % (sizeof(op.str) - 1);
+
+  for (size_t i = 0; i < n; i++)
+    op.str[i] = CHARS[rnd() % (sizeof(CHARS) - 1)];
+  op.u = rnd() % 4 ? rnd() % 100000 : rnd();
+  op.f = rnd_float();
+  op.decimals = rnd() % 8;
+  return op;
+}
+
+static void apply(json_writer_t *w, json_iso_8601_cache_t *cache,
+                  const op_t *op) {
+  switch (op->kind) {
+  case OP_BEGIN:
+    json_write_begin(w);
+    break;
+  case OP_END:
+    json_write_end(w);
+    break;
+  case OP_KEY:
+    json_write_key(w, op->str);
+    break;
+  case OP_ARRAY_BEGIN:
+    json_write_array_begin(w);
+    break;
+  case OP_ARRAY_END:
+    json_write_array_end(w);
+    break;
+  case OP_ITEM:
+    json_write_item(w);
+    break;
+  case OP_STRING:
+    json_write_string(w, op->str);
+    break;
+  case OP_UINT:
+    json_write_uint(w, op->u);
+    break;
+  case OP_INT:
+    json_write_int(w, (int32_t)op->u);
+    break;
+  case OP_FIXED:
+    json_write_fixed(w, op->f, op->decimals);
+    break;
+  default:
+    json_write_iso_8601(w, cache, (time_t)op->u * 7);
+    break;
+  }
+}
+
+/// Write `ops` into a buffer of `len` bytes inside guard bytes
+static esp_err_t run(const op_t *ops, size_t n_ops, char *buf, size_t len,
+                     size_t *out_len) {
+  json_iso_8601_cache_t cache = JSON_ISO_8601_CACHE_INIT;
+  json_writer_t w;
+
+  json_write_init(&w, buf, len);
+  for (size_t i = 0; i < n_ops; i++)
+    apply(&w, &cache, &ops[i]);
+  return json_write_finish(&w, out_len);
+}
+
+static void test_fuzz(void) {
+  static char full[MAX_OUT], area[GUARD + MAX_OUT + GUARD];
+  op_t ops[MAX_OPS];
+  size_t n_ops, full_len, len, out_len;
+  char *buf = area + GUARD;
+  esp_err_t err;
+
+  for (int i = 0; i < FUZZ_RUNS; i++) {
+    n_ops = 1 + rnd() % MAX_OPS;
+    for (size_t j = 0; j < n_ops; j++)
+      ops[j] = rnd_op();
+    CHECK_EQ(run(ops, n_ops, full, sizeof(full), &full_len), ESP_OK);
+    CHECK_EQ(strlen(full), full_len);
+
+    for (len = 0; len <= full_len + 2; len++) {
+      memset(area, 0x5a, sizeof(area));
+      out_len = SIZE_MAX;
+      err = run(ops, n_ops, buf, len, &out_len);
+
+      for (size_t k = 0; k < GUARD; k++)
+        CHECK_EQ((uint8_t)area[k], 0x5a);
+      for (size_t k = GUARD + len; k < sizeof(area); k++)
+        CHECK_EQ((uint8_t)area[k], 0x5a);
+
+      if (len > full_len) {
+        CHECK_EQ(err, ESP_OK);
+        CHECK_EQ(out_len, full_len);
+        CHECK(strcmp(buf, full) == 0);
+        continue;
+      }
+      CHECK_EQ(err, ESP_ERR_INVALID_SIZE);
+      CHECK_EQ(out_len, SIZE_MAX);
+      if (len > 0) {
+        CHECK(strlen(buf) < len);
+        CHECK(strncmp(buf, full, strlen(buf)) == 0);
+      }
+    }
+  }
+}
+
+/// Fixed-point output is within half a unit of the last decimal of the value,
+/// apart from single-precision rounding
+static void test_fixed(void) {
+  char buf[32];
+  json_writer_t w;
+  size_t n;
+  double parsed, unit;
+  float f;
+
+  for (int i = 0; i < 200000; i++) {
+    f = rnd_float();
+    json_write_init(&w, buf, sizeof(buf));
+    json_write_fixed(&w, f, i % 7);
+    CHECK_EQ(json_write_finish(&w, &n), ESP_OK);
+
+    if (isnan(f) || fabsf(f) >= 4294967295.0f) {
+      CHECK(strcmp(buf, "null") == 0);
+      continue;
+    }
+    parsed = strtod(buf, NULL);
+    // no "-0.00"
+    if (parsed == 0)
+      CHECK(buf[0] != '-');
+    unit = pow(10, -(i % 7));
+    CHECK(fabs(parsed - f) <= unit / 2 + fabs(f) * 0x1p-23 + 1e-12);
+  }
+}
+
+/// The cached timestamp matches gmtime, stepping forwards and backwards
+static void test_iso_8601(void) {
+  json_iso_8601_cache_t cache = JSON_ISO_8601_CACHE_INIT;
+  char out[JSON_ISO_8601_LEN + 1] = {0}, want[32];
+  int64_t t = 1700000000;
+  struct tm tm;
+  time_t when;
+
+  for (int i = 0; i < 200000; i++) {
+    switch (rnd() % 4) {
+    case 0:
+      t += 1;
+      break;
+    case 1:
+      t += rnd() % 100000;
+      break;
+    case 2:
+      t -= rnd() % 100000;
+      break;
+    default:
+      t = rnd();
+      break;
+    }
+    when = (time_t)t;
+    json_format_iso_8601(&cache, when, out);
+    gmtime_r(&when, &tm);
+    strftime(want, sizeof(want), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    CHECK(strcmp(out, want) == 0);
+  }
+}
+
+int main(void) {
+  test_fuzz();
+  test_fixed();
+  test_iso_8601();
+  return 0;
+}
@@ -0,0 +1,390 @@
+// Payload encoding: CBOR payloads are decoded again by an independent reader
+// and compared with what was encoded, JSON payloads are compared as text, and
+// the size of both formats is printed
+
+#include "cbor_writer.h"
+#include "freertos/FreeRTOS.h"
+#include "payload.h"
+#include "test.h"
+#include "timebase.h"
+#include <math.h>
+#include <string.h>
+
+/// 2023-11-14T22:13:20.123Z, synced at monotonic time `SYNC_MS`
+#define SYNC_UTC_MS 1700000000123LL
+#define SYNC_MS 10000
+
+/// Decoding resolution of each sensor, as encoded
+static const float MAX_ERR[SENSOR_MAX] = {0.01f, 0.04f, 0.5f, 0, 0};
+
+typedef struct cbor_reader {
+  const uint8_t *buf;
+  size_t len;
+  size_t n;
+} cbor_reader_t;
+
+typedef struct cbor_item {
+  uint8_t major;
+  uint8_t info;
+  uint64_t val; // argument, or the raw bits of a float
+} cbor_item_t;
+
+static uint8_t byte(cbor_reader_t *r) {
+  CHECK(r->n < r->len);
+  return r->buf[r->n++];
+}
+
+static cbor_item_t next(cbor_reader_t *r) {
+  uint8_t head = byte(r);
+  cbor_item_t item = {.major = head >> 5, .info = head & 0x1f};
+  size_t n;
+
+  if (item.info < 24) {
+    item.val = item.info;
+    return item;
+  }
+  CHECK(item.info <= 27);
+  n = 1u << (item.info - 24);
+  for (size_t i = 0; i < n; i++)
+    item.val = item.val << 8 | byte(r);
+  return item;
+}
+
+static uint64_t next_uint(cbor_reader_t *r) {
+  cbor_item_t item = next(r);
+  CHECK_EQ(item.major, 0);
+  return item.val;
+}
+
+static void next_head(cbor_reader_t *r, uint8_t major, uint64_t val) {
+  cbor_item_t item = next(r);
+  CHECK_EQ(item.major, major);
+  CHECK_EQ(item.val, val);
+}
+
+/// Half precision, decoded without the writer's own conversion
+static double half_value(uint16_t half) {
+  int exp = (half >> 10) & 0x1f, mant = half & 0x3ff;
+  double val;
+
+  if (exp == 0x1f)
+    val = mant ? NAN : INFINITY;
+  else if (exp == 0)
+    val = ldexp(mant, -24);
+  else
+    val = ldexp(mant | 0x400, exp - 25);
+  return half & 0x8000 ? -val : val;
+}
+
+static double next_float(cbor_reader_t *r) {
+  cbor_item_t item = next(r);
+  uint32_t bits = (uint32_t)item.val;
+  float single;
+
+  CHECK_EQ(item.major, 7);
+  if (item.info == 25)
+    return half_value((uint16_t)item.val);
+  CHECK_EQ(item.info, 26);
+  memcpy(&single, &bits, sizeof(single));
+  return single;
+}
+
+static void next_number(cbor_reader_t *r, sensor_id_t sensor, float value) {
+  if (sensor == SENSOR_SOIL_MOISTURE || sensor == SENSOR_BATTERY_VOLTAGE)
+    CHECK_EQ(next_uint(r), (uint32_t)value);
+  else
+    CHECK(fabs(next_float(r) - value) <= MAX_ERR[sensor]);
+}
+
+static void next_timestamp(cbor_reader_t *r, int64_t utc_s) {
+  CHECK_EQ(next_uint(r), 0x10);
+  next_head(r, 6, 1);
+  CHECK_EQ(next_uint(r), utc_s);
+}
+
+static cbor_reader_t reader(const char *buf, int n) {
+  CHECK(n > 0);
+  return (cbor_reader_t){.buf = (const uint8_t *)buf, .len = (size_t)n};
+}
+
+/// UTC seconds of a monotonic time
+static int64_t utc_s(int64_t mono_ms) {
+  return (mono_ms + SYNC_UTC_MS - SYNC_MS) / 1000;
+}
+
+static float snap_value(const snapshot_t *snap, sensor_id_t s) {
+  float values[SENSOR_MAX] = {snap->temp, snap->humd, snap->lux, snap->moist,
+                              snap->batt};
+  return values[s];
+}
+
+/// Every half converts back to itself, and rounding is to nearest even
+static void test_half(void) {
+  for (uint32_t h = 0; h <= 0xffff; h++) {
+    float val = cbor_half_to_float((uint16_t)h);
+
+    if (isnan(val))
+      continue;
+    CHECK(val == half_value((uint16_t)h));
+    CHECK_EQ(cbor_float_to_half(val), h);
+  }
+
+  CHECK_EQ(cbor_float_to_half(1.0f + 0x1p-11f), 0x3c00);
+  CHECK_EQ(cbor_float_to_half(1.0f + 0x3p-11f), 0x3c02);
+  CHECK_EQ(cbor_float_to_half(65520.0f), 0x7c00);
+  CHECK_EQ(cbor_float_to_half(0x1p-25f), 0);
+  CHECK_EQ(cbor_float_to_half(0x3p-26f), 1);
+  CHECK(isnan(cbor_half_to_float(cbor_float_to_half(NAN))));
+}
+
+static void test_reading(void) {
+  static const float VALUES[] = {0, 21.37f, -12.5f, 99.99f, 4095, 65535};
+  char buf[PAYLOAD_BUF_LEN];
+  reading_t r = {.captured_ms = 9000};
+  cbor_reader_t rd;
+
+  set_payload_format(MQTT_PAYLOAD_CBOR);
+  for (sensor_id_t s = 0; s < SENSOR_MAX; s++) {
+    for (size_t i = 0; i < sizeof(VALUES) / sizeof(VALUES[0]); i++) {
+      r.sensor = s;
+      r.value = VALUES[i];
+      if (s >= SENSOR_SOIL_MOISTURE && r.value < 0)
+        continue;
+      rd = reader(buf, encode_reading(buf, sizeof(buf), &r));
+      next_head(&rd, 5, 2);
+      CHECK_EQ(next_uint(&rd), s);
+      next_number(&rd, s, r.value);
+      next_timestamp(&rd, utc_s(9000));
+      CHECK_EQ(rd.n, rd.len);
+    }
+  }
+}
+
+/// Every combination of valid readings
+static void test_snapshot(void) {
+  char buf[SNAPSHOT_BUF_LEN];
+  snapshot_t snap = {.captured_ms = 8500,
+                     .temp = 23.45f,
+                     .humd = 61.3f,
+                     .lux = 1234.5f,
+                     .moist = 812,
+                     .batt = 3987};
+  cbor_reader_t rd;
+  size_t pairs;
+
+  set_payload_format(MQTT_PAYLOAD_CBOR);
+  for (uint8_t valid = 0; valid <= SENSOR_ALL_BITS; valid++) {
+    for (uint32_t awake_ms = 0; awake_ms <= 1500; awake_ms += 1500) {
+      snap.valid = valid;
+      snap.awake_ms = awake_ms;
+      pairs = 1 + __builtin_popcount(valid) + (awake_ms > 0);
+
+      rd = reader(buf, encode_snapshot(buf, sizeof(buf), &snap));
+      next_head(&rd, 5, pairs);
+      for (sensor_id_t s = 0; s < SENSOR_MAX; s++) {
+        if (!(valid & SENSOR_BIT(s)))
+          continue;
+        CHECK_EQ(next_uint(&rd), s);
+        next_number(&rd, s, snap_value(&snap, s));
+      }
+      if (awake_ms) {
+        CHECK_EQ(next_uint(&rd), 0x11);
+        CHECK_EQ(next_uint(&rd), awake_ms);
+      }
+      next_timestamp(&rd, utc_s(8500));
+      CHECK_EQ(rd.n, rd.len);
+    }
+  }
+}
+
+static void test_summary(void) {
+  char buf[PAYLOAD_BUF_LEN];
+  win_summary_t sum = {.count = 60,
+                       .min = 18.25f,
+                       .max = 24.5f,
+                       .mean = 21.125f,
+                       .stddev = 1.75f,
+                       .last = 22.0f};
+  cbor_reader_t rd;
+
+  set_payload_format(MQTT_PAYLOAD_CBOR);
+  rd = reader(buf, encode_summary(buf, sizeof(buf), SENSOR_TEMPERATURE, &sum,
+                                  9999));
+  next_head(&rd, 5, 2);
+  CHECK_EQ(next_uint(&rd), SENSOR_TEMPERATURE);
+  next_head(&rd, 5, 6);
+  CHECK_EQ(next_uint(&rd), 0);
+  CHECK_EQ(next_uint(&rd), 60);
+  CHECK_EQ(next_uint(&rd), 1);
+  CHECK(next_float(&rd) == 18.25);
+  CHECK_EQ(next_uint(&rd), 2);
+  CHECK(next_float(&rd) == 24.5);
+  CHECK_EQ(next_uint(&rd), 3);
+  CHECK(next_float(&rd) == 21.125);
+  CHECK_EQ(next_uint(&rd), 4);
+  CHECK(next_float(&rd) == 1.75);
+  CHECK_EQ(next_uint(&rd), 5);
+  CHECK(next_float(&rd) == 22.0);
+  next_timestamp(&rd, utc_s(9999));
+  CHECK_EQ(rd.n, rd.len);
+}
+
+static void test_log_chunk(void) {
+  char buf[LOG_BUF_LEN];
+  ts_log_record_t recs[20];
+  cbor_reader_t rd;
+
+  for (size_t i = 0; i < 20; i++)
+    recs[i] = (ts_log_record_t){.time_s = 1700000000 + i * 30,
+                                .value = 15.0f + i * 0.25f,
+                                .tag = (uint16_t)(i * 37 % 1000)};
+
+  set_payload_format(MQTT_PAYLOAD_CBOR);
+  for (size_t n = 0; n <= 20; n++) {
+    uint32_t next_s = n < 20 ? recs[n].time_s : 0;
+
+    rd = reader(buf, encode_log_chunk(buf, sizeof(buf), SENSOR_LUX, recs, n,
+                                      next_s));
+    next_head(&rd, 5, 1 + (n > 0) + (next_s > 0));
+    CHECK_EQ(next_uint(&rd), SENSOR_LUX);
+    next_head(&rd, 4, n);
+    for (size_t i = 0; i < n; i++) {
+      next_head(&rd, 4, 2);
+      CHECK_EQ(next_uint(&rd), i * 30000 + TS_LOG_MS(&recs[i]));
+      next_number(&rd, SENSOR_LUX, recs[i].value);
+    }
+    if (n > 0) {
+      CHECK_EQ(next_uint(&rd), 0x10);
+      next_head(&rd, 6, 1);
+      CHECK_EQ(next_uint(&rd), recs[0].time_s);
+    }
+    if (next_s) {
+      CHECK_EQ(next_uint(&rd), 0x12);
+      CHECK_EQ(next_uint(&rd), next_s);
+    }
+    CHECK_EQ(rd.n, rd.len);
+  }
+}
+
+/// A failed log query ends with an empty chunk naming the error
+static void test_log_error(void) {
+  char buf[LOG_BUF_LEN];
+  cbor_reader_t rd;
+  int n;
+
+  set_payload_format(MQTT_PAYLOAD_CBOR);
+  rd = reader(buf, encode_log_error(buf, sizeof(buf), SENSOR_HUMIDITY,
+                                    1700000030, ESP_ERR_INVALID_SIZE));
+  next_head(&rd, 5, 3);
+  CHECK_EQ(next_uint(&rd), SENSOR_HUMIDITY);
+  next_head(&rd, 4, 0);
+  CHECK_EQ(next_uint(&rd), 0x12);
+  CHECK_EQ(next_uint(&rd), 1700000030);
+  CHECK_EQ(next_uint(&rd), 0x13);
+  next_head(&rd, 3, strlen("ESP_ERR_INVALID_SIZE"));
+  CHECK(memcmp(rd.buf + rd.n, "ESP_ERR_INVALID_SIZE",
+               strlen("ESP_ERR_INVALID_SIZE")) == 0);
+  CHECK_EQ(rd.n + strlen("ESP_ERR_INVALID_SIZE"), rd.len);
+
+  set_payload_format(MQTT_PAYLOAD_JSON);
+  n = encode_log_error(buf, sizeof(buf), SENSOR_HUMIDITY, 0, ESP_FAIL);
+  CHECK(n > 0);
+  CHECK(strcmp(buf, "{\"humidity\":[],\"error\":\"ESP_FAIL\"}") == 0);
+}
+
+static void test_json(void) {
+  char buf[SNAPSHOT_BUF_LEN];
+  reading_t r = {.captured_ms = 9000, .value = 21.37f, .sensor = 0};
+  snapshot_t snap = {.captured_ms = 8500,
+                     .valid = SENSOR_ALL_BITS,
+                     .temp = 23.45f,
+                     .humd = 61.3f,
+                     .lux = 1234.5f,
+                     .moist = 812,
+                     .batt = 3987,
+                     .awake_ms = 1500};
+  int n;
+
+  set_payload_format(MQTT_PAYLOAD_JSON);
+  n = encode_reading(buf, sizeof(buf), &r);
+  CHECK(n > 0);
+  CHECK(strcmp(buf, "{\"temperature\":21.37,"
+                    "\"timestamp\":\"2023-11-14T22:13:19.123Z\"}") == 0);
+
+  n = encode_snapshot(buf, sizeof(buf), &snap);
+  CHECK(n > 0);
+  CHECK(strcmp(buf, "{\"temperature\":23.45,\"humidity\":61.30,"
+                    "\"lux\":1234.50,\"soil_moisture\":812,"
+                    "\"battery_voltage\":3987,\"awake_ms\":1500,"
+                    "\"timestamp\":\"2023-11-14T22:13:18.623Z\"}") == 0);
+}
+
+/// Every buffer too short for a payload fails, and nothing past it is written
+static void test_truncated(void) {
+  char buf[SNAPSHOT_BUF_LEN + 1];
+  snapshot_t snap = {.captured_ms = 8500,
+                     .valid = SENSOR_ALL_BITS,
+                     .temp = 23.45f,
+                     .lux = 1234.5f,
+                     .batt = 3987};
+  int full;
+
+  for (int f = MQTT_PAYLOAD_JSON; f <= MQTT_PAYLOAD_CBOR; f++) {
+    set_payload_format(f);
+    full = encode_snapshot(buf, SNAPSHOT_BUF_LEN, &snap);
+    CHECK(full > 0);
+    // JSON needs room for its NUL
+    for (int len = 0; len < full + (f == MQTT_PAYLOAD_JSON); len++) {
+      memset(buf, 0xa5, sizeof(buf));
+      CHECK_EQ(encode_snapshot(buf, len, &snap), -1);
+      for (size_t i = len; i < sizeof(buf); i++)
+        CHECK_EQ((uint8_t)buf[i], 0xa5);
+    }
+  }
+}
+
+/// Typical payloads in both formats
+static void test_size(void) {
+  char buf[SNAPSHOT_BUF_LEN];
+  reading_t r = {.captured_ms = 9000, .value = 21.37f, .sensor = 0};
+  snapshot_t snap = {.captured_ms = 8500,
+                     .valid = SENSOR_ALL_BITS,
+                     .temp = 23.45f,
+                     .humd = 61.3f,
+                     .lux = 1234.5f,
+                     .moist = 812,
+                     .batt = 3987,
+                     .awake_ms = 1500};
+  int json, cbor;
+
+  set_payload_format(MQTT_PAYLOAD_JSON);
+  json = encode_reading(buf, sizeof(buf), &r);
+  set_payload_format(MQTT_PAYLOAD_CBOR);
+  cbor = encode_reading(buf, sizeof(buf), &r);
+  printf("reading: json %d B, cbor %d B\n", json, cbor);
+  CHECK(cbor > 0 && cbor < json);
+
+  set_payload_format(MQTT_PAYLOAD_JSON);
+  json = encode_snapshot(buf, sizeof(buf), &snap);
+  set_payload_format(MQTT_PAYLOAD_CBOR);
+  cbor = encode_snapshot(buf, sizeof(buf), &snap);
+  printf("snapshot: json %d B, cbor %d B\n", json, cbor);
+  CHECK(cbor > 0 && cbor < json);
+}
+
+int main(void) {
+  init_payload();
+  host_advance_us(SYNC_MS * 1000);
+  timebase_sync(SYNC_UTC_MS);
+
+  test_half();
+  test_reading();
+  test_snapshot();
+  test_summary();
+  test_log_chunk();
+  test_log_error();
+  test_json();
+  test_truncated();
+  test_size();
+  return 0;
+}
@@ -0,0 +1,275 @@
+// Reading buffer: overflow policies, windowed sending with acknowledgements,
+// and a randomized comparison against a plain array model
+
+#include "reading_buf.h"
+#include "test.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CAPACITY 16
+
+/// Global vars, what the sink saw, and whether it accepts
+static reading_t SEEN[1024];
+static int N_SEEN;
+static int ACCEPT_LEFT; // sink rejects once this reaches 0, < 0 never
+
+static esp_err_t sink(const reading_t *reading, void *arg) {
+  if (ACCEPT_LEFT == 0)
+    return ESP_FAIL;
+  if (ACCEPT_LEFT > 0)
+    ACCEPT_LEFT--;
+  SEEN[N_SEEN++ % 1024] = *reading;
+  return ESP_OK;
+}
+
+static reading_t make(uint32_t ms, uint8_t sensor) {
+  reading_t r = {.captured_ms = ms, .value = ms * 0.5f, .sensor = sensor};
+  return r;
+}
+
+static bool push(reading_buf_t *buf, uint32_t ms, uint8_t sensor) {
+  reading_t r = make(ms, sensor);
+  return reading_buf_push(buf, &r);
+}
+
+static const reading_t *at(const reading_buf_t *buf, uint16_t i) {
+  return &buf->records[(buf->head + i) % buf->capacity];
+}
+
+static void reset(reading_buf_t *buf, reading_t *records,
+                  reading_buf_policy_t policy) {
+  reading_buf_init(buf, records, CAPACITY, policy);
+  N_SEEN = 0;
+  ACCEPT_LEFT = -1;
+}
+
+/// Sent readings stay until acknowledged, and go out again after a resend
+static void test_send_ack(void) {
+  reading_t records[CAPACITY];
+  reading_buf_t buf;
+
+  reset(&buf, records, READING_BUF_DROP_OLDEST);
+  for (uint32_t i = 0; i < 10; i++)
+    CHECK(push(&buf, i, i % SENSOR_MAX));
+
+  CHECK_EQ(reading_buf_send(&buf, sink, NULL, 4), 4);
+  CHECK_EQ(buf.sent, 4);
+  CHECK_EQ(buf.count, 10);
+  // the window is full
+  CHECK_EQ(reading_buf_send(&buf, sink, NULL, 4), 0);
+
+  CHECK_EQ(reading_buf_ack(&buf, 3), 3);
+  CHECK_EQ(buf.count, 7);
+  CHECK_EQ(buf.sent, 1);
+  CHECK_EQ(at(&buf, 0)->captured_ms, 3);
+  CHECK_EQ(reading_buf_send(&buf, sink, NULL, 4), 3);
+  CHECK_EQ(SEEN[6].captured_ms, 6);
+
+  // acknowledging more than was sent only removes what was sent
+  CHECK_EQ(reading_buf_ack(&buf, 100), 4);
+  CHECK_EQ(buf.count, 3);
+  CHECK_EQ(buf.drained, 7);
+
+  reading_buf_send(&buf, sink, NULL, 4);
+  reading_buf_resend(&buf);
+  CHECK_EQ(buf.sent, 0);
+  CHECK_EQ(buf.resent, 3);
+  N_SEEN = 0;
+  CHECK_EQ(reading_buf_send(&buf, sink, NULL, 8), 3);
+  CHECK_EQ(SEEN[0].captured_ms, 7);
+  CHECK_EQ(reading_buf_ack(&buf, 3), 3);
+  CHECK_EQ(buf.count, 0);
+  CHECK_EQ(buf.head, 0);
+}
+
+/// A rejected reading stays unsent, and stops the send
+static void test_sink_rejects(void) {
+  reading_t records[CAPACITY];
+  reading_buf_t buf;
+
+  reset(&buf, records, READING_BUF_DROP_OLDEST);
+  for (uint32_t i = 0; i < 5; i++)
+    push(&buf, i, 0);
+
+  ACCEPT_LEFT = 2;
+  CHECK_EQ(reading_buf_send(&buf, sink, NULL, 8), 2);
+  CHECK_EQ(buf.sent, 2);
+  ACCEPT_LEFT = -1;
+  CHECK_EQ(reading_buf_send(&buf, sink, NULL, 8), 3);
+  for (int i = 0; i < 5; i++)
+    CHECK_EQ(SEEN[i].captured_ms, i);
+}
+
+static void test_drop_oldest(void) {
+  reading_t records[CAPACITY];
+  reading_buf_t buf;
+
+  reset(&buf, records, READING_BUF_DROP_OLDEST);
+  for (uint32_t i = 0; i < CAPACITY; i++)
+    CHECK(push(&buf, i, 0));
+  CHECK(!push(&buf, 100, 0));
+  CHECK_EQ(buf.count, CAPACITY);
+  CHECK_EQ(buf.dropped, 1);
+  CHECK_EQ(at(&buf, 0)->captured_ms, 1);
+  CHECK_EQ(at(&buf, CAPACITY - 1)->captured_ms, 100);
+
+  // readings waiting for their PUBACK stay in front, the oldest unsent goes
+  reading_buf_send(&buf, sink, NULL, 3);
+  CHECK(!push(&buf, 101, 0));
+  CHECK_EQ(buf.sent, 3);
+  CHECK_EQ(at(&buf, 0)->captured_ms, 1);
+  CHECK_EQ(at(&buf, 1)->captured_ms, 2);
+  CHECK_EQ(at(&buf, 2)->captured_ms, 3);
+  CHECK_EQ(at(&buf, 3)->captured_ms, 5);
+  CHECK_EQ(at(&buf, CAPACITY - 1)->captured_ms, 101);
+
+  // so acknowledging them removes the right ones
+  reading_buf_ack(&buf, 3);
+  CHECK_EQ(at(&buf, 0)->captured_ms, 5);
+}
+
+static void test_drop_newest(void) {
+  reading_t records[CAPACITY];
+  reading_buf_t buf;
+
+  reset(&buf, records, READING_BUF_DROP_NEWEST);
+  for (uint32_t i = 0; i < CAPACITY + 4; i++)
+    push(&buf, i, 0);
+  CHECK_EQ(buf.count, CAPACITY);
+  CHECK_EQ(buf.dropped, 4);
+  CHECK_EQ(at(&buf, CAPACITY - 1)->captured_ms, CAPACITY - 1);
+}
+
+/// Every sent reading fills the buffer: nothing can be dropped but the new one
+static void test_all_sent(void) {
+  reading_t records[CAPACITY];
+  reading_buf_t buf;
+
+  reset(&buf, records, READING_BUF_DROP_OLDEST);
+  for (uint32_t i = 0; i < CAPACITY; i++)
+    push(&buf, i, 0);
+  reading_buf_send(&buf, sink, NULL, CAPACITY);
+  CHECK(!push(&buf, 100, 0));
+  CHECK_EQ(at(&buf, 0)->captured_ms, 0);
+  CHECK_EQ(at(&buf, CAPACITY - 1)->captured_ms, CAPACITY - 1);
+}
+
+static void test_coalesce(void) {
+  reading_t records[CAPACITY];
+  reading_buf_t buf;
+
+  reset(&buf, records, READING_BUF_COALESCE);
+  for (uint32_t i = 0; i < CAPACITY; i++)
+    push(&buf, i, i % 3);
+  reading_buf_send(&buf, sink, NULL, 2);
+
+  CHECK(!push(&buf, 100, 4));
+  CHECK_EQ(buf.dropped, 0);
+  // the two sent, then the latest of sensors 0, 1 and 2, and the new one
+  CHECK_EQ(buf.count, 6);
+  CHECK_EQ(buf.coalesced, CAPACITY - 5);
+  CHECK_EQ(at(&buf, 0)->captured_ms, 0);
+  CHECK_EQ(at(&buf, 1)->captured_ms, 1);
+  CHECK_EQ(at(&buf, 2)->captured_ms, 13);
+  CHECK_EQ(at(&buf, 3)->captured_ms, 14);
+  CHECK_EQ(at(&buf, 4)->captured_ms, 15);
+  CHECK_EQ(at(&buf, 5)->captured_ms, 100);
+  CHECK_EQ(buf.sent, 2);
+}
+
+/// Plain array model of the buffer
+typedef struct model {
+  reading_t r[CAPACITY];
+  int count;
+  int sent;
+} model_t;
+
+static void model_remove(model_t *m, int i) {
+  memmove(&m->r[i], &m->r[i + 1], (m->count - i - 1) * sizeof(reading_t));
+  m->count--;
+}
+
+static void model_push(model_t *m, reading_buf_policy_t policy,
+                       const reading_t *r) {
+  if (m->count == CAPACITY && policy == READING_BUF_COALESCE) {
+    for (int i = m->count - 1; i >= m->sent; i--)
+      for (int j = m->sent; j < i; j++)
+        if (m->r[j].sensor == m->r[i].sensor) {
+          model_remove(m, j);
+          i--;
+          j--;
+        }
+  }
+  if (m->count == CAPACITY) {
+    if (policy == READING_BUF_DROP_NEWEST || m->sent == m->count)
+      return;
+    model_remove(m, m->sent);
+  }
+  m->r[m->count++] = *r;
+}
+
+static uint32_t RNG = 12345;
+
+static uint32_t rnd(uint32_t n) {
+  RNG ^= RNG << 13;
+  RNG ^= RNG >> 17;
+  RNG ^= RNG << 5;
+  return RNG % n;
+}
+
+static void test_model(reading_buf_policy_t policy) {
+  reading_t records[CAPACITY];
+  reading_buf_t buf;
+  model_t m = {0};
+  reading_t r;
+  uint32_t ms = 0;
+  int n;
+
+  reset(&buf, records, policy);
+  for (int op = 0; op < 20000; op++) {
+    switch (rnd(8)) {
+    case 0:
+      n = rnd(6);
+      CHECK_EQ(reading_buf_ack(&buf, n), n < m.sent ? n : m.sent);
+      for (int i = 0; i < n && m.sent > 0; i++, m.sent--)
+        model_remove(&m, 0);
+      break;
+    case 1:
+      n = rnd(CAPACITY / 2 + 1);
+      ACCEPT_LEFT = rnd(4) == 0 ? (int)rnd(3) : -1;
+      n = reading_buf_send(&buf, sink, NULL, n);
+      m.sent += n;
+      break;
+    case 2:
+      if (rnd(8) == 0) {
+        reading_buf_resend(&buf);
+        m.sent = 0;
+      }
+      break;
+    default:
+      r = make(++ms, rnd(SENSOR_MAX));
+      reading_buf_push(&buf, &r);
+      model_push(&m, policy, &r);
+      break;
+    }
+
+    CHECK_EQ(buf.count, m.count);
+    CHECK_EQ(buf.sent, m.sent);
+    for (int i = 0; i < m.count; i++)
+      CHECK_EQ(at(&buf, i)->captured_ms, m.r[i].captured_ms);
+  }
+}
+
+int main(void) {
+  test_send_ack();
+  test_sink_rejects();
+  test_drop_oldest();
+  test_drop_newest();
+  test_all_sent();
+  test_coalesce();
+  test_model(READING_BUF_DROP_OLDEST);
+  test_model(READING_BUF_DROP_NEWEST);
+  test_model(READING_BUF_COALESCE);
+  return 0;
+}
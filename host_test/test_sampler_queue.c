@@ -0,0 +1,223 @@
+// Sampler timer queue, driven by a simulated millisecond tick the way
+// `sampler_task` drives it: run what's due, then sleep until the next deadline
+
+#include "sampler.h"
+#include "test.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MAX_RUNS 256
+
+typedef struct run {
+  const char *name;
+  uint32_t at_ms;
+} run_t;
+
+/// Global vars
+static run_t RUNS[MAX_RUNS];
+static int N_RUNS;
+static uint32_t NOW_MS;
+
+static void job(void *arg) {
+  CHECK(N_RUNS < MAX_RUNS);
+  RUNS[N_RUNS].name = (const char *)arg;
+  RUNS[N_RUNS].at_ms = NOW_MS;
+  N_RUNS++;
+}
+
+static int count_runs(const char *name) {
+  int n = 0;
+
+  for (int i = 0; i < N_RUNS; i++)
+    n += strcmp(RUNS[i].name, name) == 0;
+  return n;
+}
+
+/// Sleep to each deadline in turn until `until_ms`, returns the wakeups
+static int run_until(sampler_queue_t *q, uint32_t until_ms) {
+  uint32_t deadline;
+  int wakeups = 0;
+
+  while (sampler_queue_next(q, &deadline) &&
+         (int32_t)(deadline - until_ms) <= 0) {
+    if ((int32_t)(deadline - NOW_MS) > 0)
+      NOW_MS = deadline;
+    if (sampler_queue_run_due(q, NOW_MS) > 0)
+      wakeups++;
+  }
+  NOW_MS = until_ms;
+  return wakeups;
+}
+
+static void reset(sampler_queue_t *q, uint32_t coalesce_ms, uint32_t now_ms) {
+  sampler_queue_init(q, coalesce_ms);
+  N_RUNS = 0;
+  NOW_MS = now_ms;
+}
+
+/// Without coalescing, jobs run on their own deadlines, in deadline order
+static void test_order(void) {
+  sampler_queue_t q;
+
+  reset(&q, 0, 0);
+  CHECK_EQ(sampler_queue_add(&q, "a", job, "a", 3000, NOW_MS), ESP_OK);
+  CHECK_EQ(sampler_queue_add(&q, "b", job, "b", 5000, NOW_MS), ESP_OK);
+  CHECK_EQ(sampler_queue_add(&q, "c", job, "c", 7000, NOW_MS), ESP_OK);
+
+  run_until(&q, 21000);
+
+  for (int i = 1; i < N_RUNS; i++)
+    CHECK((int32_t)(RUNS[i].at_ms - RUNS[i - 1].at_ms) >= 0);
+  for (int i = 0; i < N_RUNS; i++) {
+    uint32_t period = RUNS[i].name[0] == 'a'   ? 3000
+                      : RUNS[i].name[0] == 'b' ? 5000
+                                               : 7000;
+    CHECK_EQ(RUNS[i].at_ms % period, 0);
+  }
+  CHECK_EQ(count_runs("a"), 8);
+  CHECK_EQ(count_runs("b"), 5);
+  CHECK_EQ(count_runs("c"), 4);
+
+  // 0, 3, 5, 6, 7, 9, 10, 12, 14, 15, 18, 20, 21 s
+  CHECK_EQ(q.wakeups, 13);
+  CHECK_EQ(q.runs, 17);
+}
+
+/// Jobs due within the window share a wakeup, and still keep their phase
+static int coalesced_wakeups(uint32_t coalesce_ms) {
+  sampler_queue_t q;
+  int wakeups;
+
+  reset(&q, coalesce_ms, 0);
+  sampler_queue_add(&q, "temp", job, "temp", 10000, NOW_MS);
+  sampler_queue_add(&q, "lux", job, "lux", 10500, NOW_MS);
+  sampler_queue_add(&q, "soil", job, "soil", 30000, NOW_MS);
+
+  wakeups = run_until(&q, 300000);
+
+  CHECK_EQ(wakeups, q.wakeups);
+  CHECK_EQ(q.runs, N_RUNS);
+  CHECK_EQ(count_runs("temp"), 31);
+  CHECK_EQ(count_runs("lux"), 29);
+  CHECK_EQ(count_runs("soil"), 11);
+
+  // sampled early by at most the window, never late
+  for (int i = 0; i < N_RUNS; i++) {
+    if (strcmp(RUNS[i].name, "lux") == 0) {
+      uint32_t late = RUNS[i].at_ms % 10500;
+      CHECK(late == 0 || late >= 10500 - coalesce_ms);
+    }
+  }
+  return wakeups;
+}
+
+static void test_coalesce(void) {
+  // soil always lands on a temp deadline, lux only at 0 s and 210 s
+  CHECK_EQ(coalesced_wakeups(0), 58);
+  // lux also joins temp whenever it's due within 1 s of it
+  CHECK_EQ(coalesced_wakeups(1000), 52);
+}
+
+/// A period shorter than the window runs once per wakeup, not repeatedly
+static void test_short_period(void) {
+  sampler_queue_t q;
+
+  reset(&q, 1000, 0);
+  sampler_queue_add(&q, "fast", job, "fast", 100, NOW_MS);
+  CHECK_EQ(sampler_queue_run_due(&q, NOW_MS), 1);
+  CHECK_EQ(N_RUNS, 1);
+}
+
+/// Falling more than a period behind runs once, then keeps the period from now
+static void test_fall_behind(void) {
+  sampler_queue_t q;
+  uint32_t deadline;
+
+  reset(&q, 0, 0);
+  sampler_queue_add(&q, "a", job, "a", 1000, NOW_MS);
+  run_until(&q, 0);
+  CHECK_EQ(N_RUNS, 1);
+
+  NOW_MS = 5500;
+  CHECK_EQ(sampler_queue_run_due(&q, NOW_MS), 1);
+  CHECK(sampler_queue_next(&q, &deadline));
+  CHECK_EQ(deadline, 6500);
+}
+
+/// Pausing leaves a job out of the queue, resuming runs it right away
+static void test_pause_resume(void) {
+  sampler_queue_t q;
+  uint32_t deadline;
+
+  reset(&q, 0, 0);
+  sampler_queue_add(&q, "a", job, "a", 1000, NOW_MS);
+  sampler_queue_add(&q, "b", job, "b", 0, NOW_MS);
+  run_until(&q, 2500);
+  CHECK_EQ(count_runs("a"), 3);
+  CHECK_EQ(count_runs("b"), 0);
+
+  CHECK_EQ(sampler_queue_set_period(&q, "a", 0, NOW_MS), ESP_OK);
+  CHECK(!sampler_queue_next(&q, &deadline));
+  CHECK_EQ(sampler_queue_set_period(&q, "b", 2000, NOW_MS), ESP_OK);
+  CHECK(sampler_queue_next(&q, &deadline));
+  CHECK_EQ(deadline, 2500);
+
+  run_until(&q, 6500);
+  CHECK_EQ(count_runs("a"), 3);
+  CHECK_EQ(count_runs("b"), 3);
+
+  // the new period counts from the last run, at 6.5 s
+  CHECK_EQ(sampler_queue_set_period(&q, "b", 4000, NOW_MS), ESP_OK);
+  CHECK(sampler_queue_next(&q, &deadline));
+  CHECK_EQ(deadline, 10500);
+  CHECK_EQ(sampler_queue_set_period(&q, "b", 100, NOW_MS), ESP_OK);
+  CHECK(sampler_queue_next(&q, &deadline));
+  CHECK_EQ(deadline, 6600);
+
+  // but is never overdue
+  NOW_MS = 7000;
+  CHECK_EQ(sampler_queue_set_period(&q, "b", 50, NOW_MS), ESP_OK);
+  CHECK(sampler_queue_next(&q, &deadline));
+  CHECK_EQ(deadline, 7000);
+
+  CHECK_EQ(sampler_queue_set_period(&q, "none", 100, NOW_MS),
+           ESP_ERR_NOT_FOUND);
+}
+
+/// Deadlines stay ordered across the 32-bit millisecond wrap (~49.7 days)
+static void test_wrap(void) {
+  sampler_queue_t q;
+
+  reset(&q, 0, UINT32_MAX - 4500);
+  sampler_queue_add(&q, "a", job, "a", 2000, NOW_MS);
+  sampler_queue_add(&q, "b", job, "b", 3000, NOW_MS);
+
+  run_until(&q, NOW_MS + 12000);
+
+  for (int i = 1; i < N_RUNS; i++)
+    CHECK((int32_t)(RUNS[i].at_ms - RUNS[i - 1].at_ms) >= 0);
+  CHECK_EQ(count_runs("a"), 7);
+  CHECK_EQ(count_runs("b"), 5);
+}
+
+static void test_full(void) {
+  sampler_queue_t q;
+
+  reset(&q, 0, 0);
+  for (int i = 0; i < SAMPLER_MAX_JOBS; i++)
+    CHECK_EQ(sampler_queue_add(&q, "x", job, "x", 1000, NOW_MS), ESP_OK);
+  CHECK_EQ(sampler_queue_add(&q, "x", job, "x", 1000, NOW_MS), ESP_ERR_NO_MEM);
+  CHECK_EQ(sampler_queue_add(&q, "y", NULL, NULL, 1000, NOW_MS),
+           ESP_ERR_INVALID_ARG);
+}
+
+int main(void) {
+  test_order();
+  test_coalesce();
+  test_short_period();
+  test_fall_behind();
+  test_pause_resume();
+  test_wrap();
+  test_full();
+  return 0;
+}
@@ -0,0 +1,179 @@
+// Sweeps of fake devices, one of them measured by two steps sharing a circuit
+// breaker the way the SHT-20's temperature and humidity do
+
+#include "retry.h"
+#include "sweep.h"
+#include "test.h"
+
+#define CONVERSION_MS 50
+
+enum { DEV_A, DEV_B };
+
+/// A fake measurement, failing to start while `fail` is set
+typedef struct fake {
+  bool fail;
+  uint32_t starts;
+  uint32_t ready_ms;
+} fake_t;
+
+/// Global vars
+static uint32_t NOW_MS;
+static fake_t TEMP, HUMD, LUX;
+static retry_t RETRY_A = RETRY_INIT("A");
+static retry_t RETRY_B = RETRY_INIT("B");
+
+static esp_err_t start(fake_t *f) {
+  f->starts++;
+  if (f->fail)
+    return ESP_FAIL;
+  f->ready_ms = NOW_MS + CONVERSION_MS;
+  return ESP_OK;
+}
+
+static bool poll_ready(fake_t *f, uint32_t *wait_ms) {
+  if ((int32_t)(f->ready_ms - NOW_MS) <= 0)
+    return true;
+  *wait_ms = f->ready_ms - NOW_MS;
+  return false;
+}
+
+static esp_err_t start_temp(void) { return start(&TEMP); }
+static esp_err_t start_humd(void) { return start(&HUMD); }
+static esp_err_t start_lux(void) { return start(&LUX); }
+static bool temp_ready(uint32_t *wait_ms) { return poll_ready(&TEMP, wait_ms); }
+static bool humd_ready(uint32_t *wait_ms) { return poll_ready(&HUMD, wait_ms); }
+static bool lux_ready(uint32_t *wait_ms) { return poll_ready(&LUX, wait_ms); }
+
+static esp_err_t collect(float *val) {
+  *val = 1;
+  return ESP_OK;
+}
+
+static void setup(sweep_t *s) {
+  TEMP = (fake_t){0};
+  HUMD = (fake_t){0};
+  LUX = (fake_t){0};
+  retry_init(&RETRY_A, "A");
+  retry_init(&RETRY_B, "B");
+  sweep_init(s);
+  CHECK_EQ(sweep_add(s, "temperature", DEV_A, &start_temp, &temp_ready,
+                     &collect, &RETRY_A),
+           ESP_OK);
+  CHECK_EQ(sweep_add(s, "humidity", DEV_A, &start_humd, &humd_ready, &collect,
+                     &RETRY_A),
+           ESP_OK);
+  CHECK_EQ(sweep_add(s, "lux", DEV_B, &start_lux, &lux_ready, &collect,
+                     &RETRY_B),
+           ESP_OK);
+}
+
+static void run(sweep_t *s) {
+  uint32_t wait_ms;
+
+  sweep_begin(s, NOW_MS);
+  while (!sweep_poll(s, NOW_MS, &wait_ms))
+    NOW_MS += wait_ms > 0 ? wait_ms : 1;
+}
+
+static retry_stats_t stats(const retry_t *r) {
+  retry_stats_t stats;
+
+  retry_get_stats(r, &stats);
+  return stats;
+}
+
+/// Steps sharing a breaker count as one read of the device
+static void test_shared_reads(void) {
+  sweep_t s;
+
+  setup(&s);
+  for (int i = 0; i < 3; i++) {
+    run(&s);
+    for (uint8_t j = 0; j < s.n_steps; j++)
+      CHECK_EQ(s.steps[j].err, ESP_OK);
+  }
+  CHECK_EQ(stats(&RETRY_A).reads, 3);
+  CHECK_EQ(stats(&RETRY_B).reads, 3);
+  CHECK_EQ(TEMP.starts, 3);
+  CHECK_EQ(HUMD.starts, 3);
+}
+
+/// A failing step fails the device once per sweep. Once that opens the
+/// breaker, the other step is skipped, and each skipped sweep uses up one
+/// skipped read.
+static void test_shared_breaker(void) {
+  uint32_t humd_starts;
+  sweep_t s;
+
+  setup(&s);
+  TEMP.fail = true;
+  for (int i = 1; i < RETRY_TRIP_FAILURES; i++) {
+    run(&s);
+    CHECK_EQ(s.steps[0].err, ESP_FAIL);
+    CHECK_EQ(s.steps[1].err, ESP_OK);
+    CHECK_EQ(stats(&RETRY_A).failures, i);
+  }
+  CHECK_EQ(TEMP.starts, (RETRY_TRIP_FAILURES - 1) * RETRY_MAX_ATTEMPTS);
+
+  // the failure that trips the breaker skips humidity, without touching it
+  humd_starts = HUMD.starts;
+  run(&s);
+  CHECK(retry_is_open(&RETRY_A));
+  CHECK_EQ(stats(&RETRY_A).trips, 1);
+  CHECK_EQ(s.steps[0].err, ESP_FAIL);
+  CHECK_EQ(s.steps[1].err, RETRY_ERR_OPEN);
+  CHECK_EQ(s.steps[2].err, ESP_OK);
+  CHECK_EQ(HUMD.starts, humd_starts);
+
+  for (int i = 1; i <= RETRY_OPEN_READS; i++) {
+    run(&s);
+    CHECK_EQ(s.steps[0].err, RETRY_ERR_OPEN);
+    CHECK_EQ(s.steps[1].err, RETRY_ERR_OPEN);
+    CHECK_EQ(stats(&RETRY_A).skipped, i);
+  }
+  CHECK_EQ(TEMP.starts, RETRY_TRIP_FAILURES * RETRY_MAX_ATTEMPTS);
+  CHECK_EQ(HUMD.starts, humd_starts);
+
+  // a failed probe gets a single attempt, and skips humidity again
+  run(&s);
+  CHECK_EQ(TEMP.starts, RETRY_TRIP_FAILURES * RETRY_MAX_ATTEMPTS + 1);
+  CHECK_EQ(HUMD.starts, humd_starts);
+  CHECK_EQ(stats(&RETRY_A).trips, 2);
+
+  // a successful probe closes it once both steps succeed
+  TEMP.fail = false;
+  for (int i = 0; i < RETRY_OPEN_READS; i++)
+    run(&s);
+  run(&s);
+  CHECK_EQ(s.steps[0].err, ESP_OK);
+  CHECK_EQ(s.steps[1].err, ESP_OK);
+  CHECK_EQ(RETRY_A.state, RETRY_CLOSED);
+  CHECK_EQ(stats(&RETRY_B).failures, 0);
+}
+
+/// Only a closed breaker retries
+static void test_backoff(void) {
+  uint32_t delay_ms;
+  retry_t r;
+
+  retry_init(&r, "r");
+  for (uint8_t i = 1; i < RETRY_MAX_ATTEMPTS; i++) {
+    CHECK(retry_backoff(&r, i, &delay_ms));
+    CHECK(delay_ms <= RETRY_MAX_MS);
+    CHECK(delay_ms >= RETRY_BASE_MS / 2);
+  }
+  CHECK(!retry_backoff(&r, RETRY_MAX_ATTEMPTS, &delay_ms));
+
+  for (int i = 0; i < RETRY_TRIP_FAILURES; i++)
+    retry_end(&r, ESP_FAIL);
+  CHECK(retry_is_open(&r));
+  CHECK(!retry_backoff(&r, 1, &delay_ms));
+  CHECK_EQ(stats(&r).retries, RETRY_MAX_ATTEMPTS - 1);
+}
+
+int main(void) {
+  test_shared_reads();
+  test_shared_breaker();
+  test_backoff();
+  return 0;
+}
@@ -0,0 +1,389 @@
+// Time-series log on an emulated NOR flash. Each boot is a child process, so
+// the log is mounted from flash like after a power-on, and the power is cut
+// part way through every kind of flash write: sector erases, sector headers
+// and records. After each cut, the log must mount with every acknowledged
+// record that fits, in order, and carry on appending.
+
+#include "esp_partition.h"
+#include "test.h"
+#include "ts_log.h"
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SECTORS 3
+#define RECORDS TS_LOG_RECORDS_PER_SECTOR
+#define MAX_RECORDS (SECTORS * RECORDS)
+#define BASE_MS 1700000000000LL
+
+/// Appends of the power-loss workload, wrapping around the partition
+#define WORKLOAD (RECORDS * 4 + 20)
+#define MAX_OPS (WORKLOAD * 2)
+
+typedef struct shared {
+  uint32_t acked;
+  uint32_t n_ops;
+  host_flash_op_t ops[MAX_OPS];
+} shared_t;
+
+typedef struct collected {
+  uint32_t n;
+  uint32_t ids[MAX_RECORDS];
+} collected_t;
+
+typedef void (*boot_fn_t)(void *arg);
+
+/// Global vars
+static char PATH[] = "/tmp/ts_log_XXXXXX";
+static shared_t *SHARED;
+
+/// Record `id` of a workload: its value is its id, and it's 1.5 s after the
+/// previous one
+static int64_t id_ms(uint32_t id) { return BASE_MS + (int64_t)id * 1500; }
+
+static void append(uint32_t id) {
+  CHECK_EQ(ts_log_append(id % 5, (float)id, id_ms(id)), ESP_OK);
+  SHARED->acked = id + 1;
+}
+
+static void append_range(uint32_t from, uint32_t to) {
+  for (uint32_t id = from; id < to; id++)
+    append(id);
+}
+
+static bool collect(const ts_log_record_t *rec, int64_t utc_ms, void *arg) {
+  collected_t *c = arg;
+  uint32_t id = (uint32_t)rec->value;
+
+  CHECK(rec->value == (float)id);
+  CHECK_EQ(utc_ms, id_ms(id));
+  CHECK_EQ(TS_LOG_SENSOR(rec), id % 5);
+  CHECK(c->n < MAX_RECORDS);
+  c->ids[c->n++] = id;
+  return true;
+}
+
+static void query(uint32_t sensors, int64_t from_ms, int64_t to_ms,
+                  collected_t *c) {
+  c->n = 0;
+  CHECK_EQ(ts_log_query(sensors, from_ms, to_ms, &collect, c), ESP_OK);
+}
+
+static void query_all(collected_t *c) { query(~0u, 0, INT64_MAX, c); }
+
+/// Records `from` to `to`, excluding `to`, are all there, in order
+static void check_ids(const collected_t *c, uint32_t from, uint32_t to) {
+  CHECK_EQ(c->n, to - from);
+  for (uint32_t i = 0; i < c->n; i++)
+    CHECK_EQ(c->ids[i], from + i);
+}
+
+/// Start from an erased partition
+static void erase_flash(void) { CHECK(truncate(PATH, 0) == 0); }
+
+/// Boot a process on the flash, mount the log and call `fn`
+static int boot(boot_fn_t fn, void *arg) {
+  pid_t pid;
+  int status;
+
+  fflush(NULL);
+  CHECK((pid = fork()) >= 0);
+  if (pid == 0) {
+    host_flash_open(PATH, TS_LOG_PARTITION, SECTORS * TS_LOG_SECTOR_SIZE);
+    CHECK_EQ(ts_log_init(), ESP_OK);
+    fn(arg);
+    exit(0);
+  }
+
+  CHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFEXITED(status));
+  return WEXITSTATUS(status);
+}
+
+static void read_flash(uint32_t addr, void *buf, size_t len) {
+  FILE *f = fopen(PATH, "rb");
+
+  CHECK(f != NULL);
+  CHECK(fseek(f, addr, SEEK_SET) == 0);
+  CHECK_EQ(fread(buf, 1, len, f), len);
+  fclose(f);
+}
+
+static void erase_flash_range(uint32_t addr, size_t len) {
+  uint8_t erased[TS_LOG_SECTOR_SIZE];
+  FILE *f = fopen(PATH, "r+b");
+
+  memset(erased, 0xff, sizeof(erased));
+  CHECK(f != NULL && len <= sizeof(erased));
+  CHECK(fseek(f, addr, SEEK_SET) == 0);
+  CHECK_EQ(fwrite(erased, 1, len, f), len);
+  fclose(f);
+}
+
+/// Flash address of the `id`th record appended to an erased partition
+static uint32_t id_addr(uint32_t id) {
+  return (id / RECORDS % SECTORS) * TS_LOG_SECTOR_SIZE + TS_LOG_HEADER_SIZE +
+         id % RECORDS * TS_LOG_RECORD_SIZE;
+}
+
+/// Oldest record kept after appending `n` to an erased partition
+static uint32_t oldest_id(uint32_t n) {
+  uint32_t opened = (n + RECORDS - 1) / RECORDS;
+
+  return opened > SECTORS ? (opened - SECTORS) * RECORDS : 0;
+}
+
+static void boot_append(void *arg) { append_range(0, *(uint32_t *)arg); }
+
+static void boot_check_wrap(void *arg) {
+  uint32_t n = *(uint32_t *)arg, oldest = oldest_id(n);
+  ts_log_stats_t stats;
+  collected_t c;
+
+  ts_log_get_stats(&stats);
+  CHECK_EQ(stats.sectors, SECTORS);
+  CHECK_EQ(stats.used_sectors, SECTORS);
+  query_all(&c);
+  check_ids(&c, oldest, n);
+
+  // a range across a sector boundary, excluding its end
+  query(~0u, id_ms(RECORDS * 6 - 7), id_ms(RECORDS * 6 + 9), &c);
+  check_ids(&c, RECORDS * 6 - 7, RECORDS * 6 + 9);
+
+  // one sensor, from before the oldest record
+  query(1u << 3, 0, id_ms(oldest + 40), &c);
+  CHECK_EQ(c.n, 8);
+  for (uint32_t i = 0; i < c.n; i++)
+    CHECK_EQ(c.ids[i] % 5, 3);
+}
+
+/// Older sectors are erased to make room, and a mount finds the same log
+static void test_ring_wrap(void) {
+  uint32_t n = RECORDS * 7 + 13;
+
+  erase_flash();
+  CHECK_EQ(boot(&boot_append, &n), 0);
+  CHECK_EQ(boot(&boot_check_wrap, &n), 0);
+}
+
+static void boot_append_next(void *arg) {
+  uint32_t n = *(uint32_t *)arg;
+  collected_t c;
+
+  append(n);
+  query_all(&c);
+  check_ids(&c, oldest_id(n + 1), n + 1);
+}
+
+/// Mounting finds the next free slot of the newest sector, whether it's
+/// empty, partly written or full
+static void test_mount_next(void) {
+  const uint32_t FILLS[] = {1,
+                            2,
+                            RECORDS / 2,
+                            RECORDS - 1,
+                            RECORDS,
+                            RECORDS + 1,
+                            RECORDS * 2 - 1,
+                            RECORDS * 4,
+                            RECORDS * 4 + 170,
+                            RECORDS * 5 - 1};
+  ts_log_record_t rec;
+
+  for (size_t i = 0; i < sizeof(FILLS) / sizeof(FILLS[0]); i++) {
+    uint32_t n = FILLS[i];
+
+    erase_flash();
+    CHECK_EQ(boot(&boot_append, &n), 0);
+    CHECK_EQ(boot(&boot_append_next, &n), 0);
+
+    read_flash(id_addr(n), &rec, sizeof(rec));
+    CHECK(rec.value == (float)n);
+  }
+}
+
+static void boot_check_erased_tail(void *arg) {
+  collected_t c, want = {0};
+  ts_log_stats_t stats;
+  uint32_t id;
+
+  // the oldest sector keeps its first 200 records
+  for (id = RECORDS; id < RECORDS + 200; id++)
+    want.ids[want.n++] = id;
+  for (id = RECORDS * 2; id < RECORDS * 3 + 5; id++)
+    want.ids[want.n++] = id;
+
+  query_all(&c);
+  CHECK_EQ(c.n, want.n);
+  CHECK(memcmp(c.ids, want.ids, c.n * sizeof(uint32_t)) == 0);
+
+  // starting in the erased part
+  query(~0u, id_ms(RECORDS + 250), INT64_MAX, &c);
+  check_ids(&c, RECORDS * 2, RECORDS * 3 + 5);
+
+  ts_log_get_stats(&stats);
+  CHECK_EQ(stats.torn, 0);
+}
+
+/// A sector whose erase was cut off with its header still intact: its erased
+/// slots are skipped, not counted as torn
+static void test_erased_tail(void) {
+  uint32_t n = RECORDS * 3 + 5;
+
+  erase_flash();
+  CHECK_EQ(boot(&boot_append, &n), 0);
+  // sector 1 is the oldest
+  erase_flash_range(id_addr(RECORDS + 200),
+                    TS_LOG_SECTOR_SIZE -
+                        id_addr(RECORDS + 200) % TS_LOG_SECTOR_SIZE);
+  CHECK_EQ(boot(&boot_check_erased_tail, NULL), 0);
+}
+
+static void boot_check_read_error(void *arg) {
+  uint32_t bad = *(uint32_t *)arg, good;
+  collected_t c = {0};
+
+  host_flash_fail_reads(id_addr(bad), TS_LOG_RECORD_SIZE);
+  CHECK_EQ(ts_log_query(~0u, 0, INT64_MAX, &collect, &c), ESP_FAIL);
+
+  // the query stops before the batch it couldn't read, instead of skipping it
+  CHECK(c.n > 0 && c.n <= bad);
+  check_ids(&c, 0, c.n);
+
+  // and only queries reaching that batch fail
+  good = c.n - 1;
+  query(~0u, 0, id_ms(good), &c);
+  check_ids(&c, 0, good);
+  host_flash_fail_reads(0, 0);
+  query_all(&c);
+  check_ids(&c, 0, RECORDS * 2);
+}
+
+/// A flash read error ends a query with the error
+static void test_read_error(void) {
+  uint32_t n = RECORDS * 2, bad = RECORDS + 100;
+
+  erase_flash();
+  CHECK_EQ(boot(&boot_append, &n), 0);
+  CHECK_EQ(boot(&boot_check_read_error, &bad), 0);
+}
+
+static void boot_workload(void *arg) {
+  uint32_t *cut = arg;
+
+  if (cut != NULL)
+    host_flash_power_cut(cut[0], cut[1]);
+  append_range(0, WORKLOAD);
+}
+
+static void boot_trace(void *arg) {
+  host_flash_trace(SHARED->ops, MAX_OPS, &SHARED->n_ops);
+  boot_workload(NULL);
+}
+
+static void boot_check_cut(void *arg) {
+  uint32_t acked = SHARED->acked, first, last;
+  ts_log_stats_t stats;
+  collected_t c, after;
+
+  query_all(&c);
+  ts_log_get_stats(&stats);
+  CHECK(stats.torn <= 1);
+
+  // every acknowledged record that fits, in order, and maybe the one being
+  // written if all of its bytes made it
+  CHECK(c.n >= (acked < RECORDS * (SECTORS - 2) ? acked
+                                                 : RECORDS * (SECTORS - 2)));
+  if (c.n > 0) {
+    first = c.ids[0];
+    last = c.ids[c.n - 1];
+    CHECK(last + 1 == acked || last == acked);
+    check_ids(&c, first, last + 1);
+  }
+
+  // and it carries on after them
+  append_range(WORKLOAD, WORKLOAD + 3);
+  query_all(&after);
+  CHECK(after.n >= 3);
+  for (uint32_t i = 0; i < 3; i++)
+    CHECK_EQ(after.ids[after.n - 3 + i], WORKLOAD + i);
+  for (uint32_t i = 1; i < after.n - 3; i++)
+    CHECK_EQ(after.ids[i], after.ids[i - 1] + 1);
+}
+
+/// Cut the power during op `op`, after `bytes` of it, then mount and check
+static void cut_at(uint32_t op, uint32_t bytes) {
+  uint32_t cut[2] = {op, bytes};
+
+  erase_flash();
+  SHARED->acked = 0;
+  CHECK_EQ(boot(&boot_workload, cut), HOST_FLASH_POWER_CUT);
+  CHECK_EQ(boot(&boot_check_cut, NULL), 0);
+}
+
+static void test_power_loss(void) {
+  const uint32_t ERASE_BYTES[] = {0, 1, 15, 16, 17, 2048, 4095};
+  uint32_t erases = 0, headers = 0, records = 0, n_ops;
+  host_flash_op_t *ops = SHARED->ops;
+
+  erase_flash();
+  CHECK_EQ(boot(&boot_trace, NULL), 0);
+  n_ops = SHARED->n_ops;
+  CHECK(n_ops <= MAX_OPS);
+
+  for (uint32_t op = 0; op < n_ops; op++) {
+    bool near_erase = false;
+
+    // partially erased sectors
+    if (ops[op] == HOST_FLASH_ERASE) {
+      for (size_t i = 0; i < sizeof(ERASE_BYTES) / sizeof(uint32_t); i++)
+        cut_at(op, ERASE_BYTES[i]);
+      erases++;
+      continue;
+    }
+
+    // torn headers
+    if (op > 0 && ops[op - 1] == HOST_FLASH_ERASE) {
+      for (uint32_t b = 0; b < TS_LOG_HEADER_SIZE; b++)
+        cut_at(op, b);
+      headers++;
+      continue;
+    }
+
+    // torn records, all of them around sector changes and some in between
+    for (uint32_t d = 1; d <= 3; d++)
+      near_erase |= (op >= d && ops[op - d] == HOST_FLASH_ERASE) ||
+                    (op + d < n_ops && ops[op + d] == HOST_FLASH_ERASE);
+    if (near_erase || op % 61 == 0) {
+      for (uint32_t b = 0; b < TS_LOG_RECORD_SIZE; b++)
+        cut_at(op, b);
+      records++;
+    }
+  }
+
+  CHECK(erases > SECTORS);
+  CHECK_EQ(headers, erases);
+  printf("power cuts in %u erases, %u headers, %u records\n", erases, headers,
+         records);
+}
+
+int main(void) {
+  int fd = mkstemp(PATH);
+
+  CHECK(fd >= 0);
+  close(fd);
+  SHARED = mmap(NULL, sizeof(shared_t), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  CHECK(SHARED != MAP_FAILED);
+
+  test_ring_wrap();
+  test_mount_next();
+  test_erased_tail();
+  test_read_error();
+  test_power_loss();
+
+  unlink(PATH);
+  return 0;
+}
@@ -0,0 +1,125 @@
+// Windowed statistics in single precision, against two-pass double precision
+// references, on windows where a naive sum of squares falls apart: a spread
+// that is tiny next to the mean, and long windows
+
+#include "test.h"
+#include "win_stats.h"
+#include <math.h>
+
+#define MAX_SAMPLES 100000
+
+/// Global vars
+static uint64_t RNG = 0x9e3779b97f4a7c15ULL;
+static float SAMPLES[MAX_SAMPLES];
+
+/// xorshift64, uniform in [0, 1)
+static double rnd(void) {
+  RNG ^= RNG << 13;
+  RNG ^= RNG >> 7;
+  RNG ^= RNG << 17;
+  return (RNG >> 11) * 0x1p-53;
+}
+
+/// Summarize `n` samples, and check against two passes in double precision
+static void check(size_t n, double mean_tol, double stddev_tol,
+                  double *stddev_err) {
+  double mean = 0, m2 = 0, min = INFINITY, max = -INFINITY;
+  win_summary_t sum;
+  win_stats_t s;
+
+  win_stats_reset(&s);
+  for (size_t i = 0; i < n; i++) {
+    win_stats_add(&s, SAMPLES[i]);
+    mean += SAMPLES[i];
+    min = fmin(min, SAMPLES[i]);
+    max = fmax(max, SAMPLES[i]);
+  }
+  mean /= n;
+  for (size_t i = 0; i < n; i++)
+    m2 += (SAMPLES[i] - mean) * (SAMPLES[i] - mean);
+
+  CHECK(win_stats_summary(&s, &sum));
+  CHECK_EQ(sum.count, n);
+  CHECK(sum.min == min);
+  CHECK(sum.max == max);
+  CHECK(sum.last == SAMPLES[n - 1]);
+  CHECK(fabs(sum.mean - mean) <= mean_tol);
+  *stddev_err = n > 1 ? fabs(sum.stddev - sqrt(m2 / (n - 1))) : sum.stddev;
+  CHECK(*stddev_err <= stddev_tol);
+}
+
+/// Float single pass sum of squares, what Welford's update avoids
+static float naive_stddev(size_t n) {
+  float sum = 0, sum_sq = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    sum += SAMPLES[i];
+    sum_sq += SAMPLES[i] * SAMPLES[i];
+  }
+  return sqrtf(fmaxf(sum_sq - sum * sum / n, 0) / (n - 1));
+}
+
+static void test_empty(void) {
+  win_summary_t sum;
+  win_stats_t s;
+  double err;
+
+  win_stats_reset(&s);
+  CHECK(!win_stats_summary(&s, &sum));
+
+  SAMPLES[0] = 21.5f;
+  check(1, 0, 0, &err);
+}
+
+/// Lux in full daylight, varying by a fraction of a lux, over a window of a
+/// sample a second up to a day
+static void test_large_offset(void) {
+  double err, naive;
+
+  for (size_t i = 0; i < MAX_SAMPLES; i++)
+    SAMPLES[i] = 50000 + (float)(rnd() - 0.5);
+
+  for (size_t n = 2; n <= MAX_SAMPLES; n *= 10) {
+    // within an ulp of the mean, whose spacing is 0.004 at 50000
+    check(n, 50000 * 0x1p-23, 0.002, &err);
+    naive = fabs(naive_stddev(n) - 1 / sqrt(12));
+    printf("n %6zu: stddev error %.2g, naive %.2g\n", n, err, naive);
+  }
+}
+
+/// A constant signal, stddev stays 0 however long the window
+static void test_constant(void) {
+  double err;
+
+  for (size_t i = 0; i < MAX_SAMPLES; i++)
+    SAMPLES[i] = 3701.0f;
+  check(MAX_SAMPLES, 0, 0, &err);
+}
+
+/// A cloud passing over the lux sensor, one sample in a window
+static void test_spike(void) {
+  double err;
+
+  for (size_t i = 0; i < 60; i++)
+    SAMPLES[i] = i == 31 ? 200.0f : 42000.0f + (float)rnd() * 10;
+  check(60, 0.01, 0.5, &err);
+}
+
+/// Temperature drifting across a long window, plus noise. The mean's
+/// increments are far below its rounding, so they need compensating.
+static void test_drift(void) {
+  double err;
+
+  for (size_t i = 0; i < MAX_SAMPLES; i++)
+    SAMPLES[i] = 15.0f + 10.0f * i / MAX_SAMPLES + (float)rnd() * 0.01f;
+  check(MAX_SAMPLES, 1e-5, 1e-5, &err);
+}
+
+int main(void) {
+  test_empty();
+  test_large_offset();
+  test_constant();
+  test_spike();
+  test_drift();
+  return 0;
+}
@@ -1,16 +1,26 @@
+#include "esp_attr.h"
 #include "esp_err.h"
 #include "esp_log.h"
-#include "esp_pm.h"
-#include "esp_spi_flash.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/portmacro.h"
 #include "freertos/projdefs.h"
 #include "freertos/task.h"
 #include <stdio.h>
 
+#if CONFIG_IDF_TARGET_LINUX
+#include "timebase.h"
+#include <time.h>
+#else
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_spi_flash.h"
+#endif
+
 #include "apds_3901.h"
 #include "batt.h"
+#include "duty_cycle.h"
 #include "i2c.h"
 #include "mqtt.h"
 #include "seesaw_soil.h"
@@ -23,14 +33,12 @@
 
 static const char *TAG = "ESP32 Garden Monitor";
 
-void read_sensors(void) {
+static esp_err_t init_sensors(void) {
   esp_err_t err;
 
-  /* Init sensors and read forever */
   if ((err = init_i2c_master()) != ESP_OK) {
     ESP_LOGE(TAG, "Error initializing I2C bus: %s", esp_err_to_name(err));
-    vTaskDelay(pdMS_TO_TICKS(5000));
-    return;
+    return err;
   }
 
   if ((err = init_batt_adc()) != ESP_OK) {
@@ -55,11 +63,144 @@ void read_sensors(void) {
     // don't return here, sensor can be re-initialized on read
   }
 
+  return ESP_OK;
+}
+
+void read_sensors(void) {
+  /* Init sensors and read forever */
+  if (init_sensors() != ESP_OK) {
+    vTaskDelay(pdMS_TO_TICKS(5000));
+    return;
+  }
+
   // read and publish sensor readings continuously
   mqtt_publish_all();
 }
 
+#if CONFIG_DEEP_SLEEP_MODE
+/// Duty cycle state, kept in RTC memory across deep sleep
+static RTC_DATA_ATTR duty_cycle_t CYCLE = {0};
+
+static uint32_t now_ms(void) { return (uint32_t)(esp_timer_get_time() / 1000); }
+
+/**
+ * @brief Sample every sensor, publish a single snapshot, and go into deep
+ * sleep until the next cycle. Does not return.
+ */
+static void run_duty_cycle(void) {
+  snapshot_t snap;
+  mqtt_config_t cfg;
+  wifi_stats_t wifi;
+  duty_state_t state;
+  uint32_t sleep_ms;
+
+  if (CYCLE.period_ms == 0)
+    duty_cycle_init(&CYCLE, CONFIG_DEEP_SLEEP_PERIOD_MS,
+                    CONFIG_DEEP_SLEEP_AWAKE_TIMEOUT_MS);
+  duty_cycle_begin(&CYCLE, now_ms());
+  ESP_LOGI(TAG, "Duty cycle %u, wakeup cause %d", CYCLE.cycles,
+           esp_sleep_get_wakeup_cause());
+
+#if !CONFIG_MQTT_DEADBAND
+  init_wifi(); // connects in the background while sensors are sampled
+#endif
+  init_sensors();
+
+  while ((state = duty_cycle_state(&CYCLE, now_ms())) != DUTY_SLEEP) {
+    switch (state) {
+    case DUTY_SAMPLE:
+      mqtt_read_snapshot(&snap);
+      snap.awake_ms = CYCLE.last_awake_ms;
+      duty_cycle_event(&CYCLE, DUTY_SAMPLED);
+#if CONFIG_MQTT_DEADBAND
+      // only wake the radio if a reading moved or a heartbeat is due
+      if (mqtt_snapshot_due(&snap))
+        init_wifi();
+      else
+        duty_cycle_event(&CYCLE, DUTY_SKIPPED);
+#endif
+      break;
+    case DUTY_CONNECT:
+      if (mqtt_wait_connected(duty_cycle_remaining_ms(&CYCLE, now_ms())) ==
+          ESP_OK)
+        duty_cycle_event(&CYCLE, DUTY_CONNECTED);
+      break;
+    case DUTY_PUBLISH:
+#if CONFIG_DIAG
+      mqtt_publish_diag_due(); // goes out ahead of the snapshot
+#endif
+      if (mqtt_publish_snapshot_sync(
+              &snap, duty_cycle_remaining_ms(&CYCLE, now_ms())) == ESP_OK)
+        duty_cycle_event(&CYCLE, DUTY_PUBLISHED);
+      break;
+    default:
+      break;
+    }
+  }
+
+  // keep readings that didn't make it out for the next cycle
+  if ((CYCLE.events & DUTY_SAMPLED) &&
+      !(CYCLE.events & (DUTY_PUBLISHED | DUTY_SKIPPED)))
+    mqtt_buffer_snapshot(&snap);
+
+  // the period may have been changed over the config topic
+  mqtt_get_config(&cfg);
+  CYCLE.period_ms = cfg.snapshot_ms;
+
+  sleep_ms = duty_cycle_end(&CYCLE, now_ms());
+  ESP_LOGI(TAG, "Awake for %u ms, sleeping for %u ms (%u timeouts)",
+           CYCLE.last_awake_ms, sleep_ms, CYCLE.timeouts);
+
+  wifi_get_stats(&wifi);
+  ESP_LOGI(TAG, "IP after %u ms, first publish after %u ms (%u/%u direct "
+           "connects failed)",
+           (uint32_t)(wifi.ip_us / 1000),
+           (uint32_t)(mqtt_first_publish_us() / 1000), wifi.fast_failures,
+           wifi.fast_connects);
+
+  esp_sleep_enable_timer_wakeup((uint64_t)sleep_ms * 1000);
+  esp_deep_sleep_start();
+}
+#endif
+
+#if CONFIG_IDF_TARGET_LINUX
+/// One simulated hour
+#define SIM_REPORT_MS (60 * 60 * 1000)
+
+/**
+ * @brief Log publishes and CPU time once per simulated hour. The simulation
+ * runs until it's killed, so this does not return.
+ */
+static void report_sim(void) {
+  uint32_t hours = 0, acked, last_acked = 0;
+  clock_t cpu, last_cpu = 0;
+  uint64_t cpu_us;
+
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(SIM_REPORT_MS / TIMEBASE_SCALE));
+    acked = mqtt_acked_count() - last_acked;
+    cpu = clock();
+    cpu_us = (uint64_t)(cpu - last_cpu) * 1000000 / CLOCKS_PER_SEC;
+    hours++;
+
+    ESP_LOGI(TAG, "Simulated hour %u: %u publishes acknowledged, %u ms CPU "
+             "time (%u us per publish)",
+             hours, acked, (uint32_t)(cpu_us / 1000),
+             acked > 0 ? (uint32_t)(cpu_us / acked) : 0);
+
+    last_acked += acked;
+    last_cpu = cpu;
+  }
+}
+#endif
+
 void app_main(void) {
+#if CONFIG_IDF_TARGET_LINUX
+  ESP_LOGI(TAG, "Simulating on Linux, %ux speed", TIMEBASE_SCALE);
+  init_wifi();
+  read_sensors();
+  report_sim();
+#else
   esp_chip_info_t chip_info;
 
   /* Print chip information */
@@ -83,6 +224,11 @@ void app_main(void) {
   ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
 #endif
 
+#if CONFIG_DEEP_SLEEP_MODE
+  run_duty_cycle();
+#else
   init_wifi();
   read_sensors();
+#endif
+#endif
 }
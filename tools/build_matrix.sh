@@ -0,0 +1,60 @@
+#!/usr/bin/env bash
+# Build the firmware once per Kconfig combination, with every warning an
+# error. Run from an ESP-IDF environment (`. $IDF_PATH/export.sh`):
+#   tools/build_matrix.sh [name...]
+# Each combination builds in build/matrix/<name>, from the Kconfig defaults
+# plus its options below. The linux combination needs ESP-IDF v5 or later.
+set -u
+
+cd "$(dirname "$0")/.."
+
+NAMES=(default wifi_static_ip wifi_lease diag snapshot_cbor summary
+       deadband_sleep linux)
+
+declare -A TARGET=([linux]=linux)
+
+declare -A OPTIONS=(
+  [default]=""
+  [wifi_static_ip]="CONFIG_WIFI_FAST_CONNECT=y CONFIG_WIFI_STATIC_IP=y"
+  [wifi_lease]="CONFIG_WIFI_FAST_CONNECT=y CONFIG_WIFI_REUSE_LEASE=y"
+  [diag]="CONFIG_DIAG_HISTOGRAMS=y CONFIG_DIAG_MEMORY=y CONFIG_DIAG_SIZE_REPORT=y CONFIG_TS_LOG=y"
+  [snapshot_cbor]="CONFIG_MQTT_PUBLISH_SNAPSHOT=y CONFIG_MQTT_PAYLOAD_FORMAT_CBOR=y"
+  [summary]="CONFIG_MQTT_PUBLISH_SUMMARY=y CONFIG_MQTT_OUTBOX_LIMIT=8192"
+  [deadband_sleep]="CONFIG_MQTT_DEADBAND=y CONFIG_DEEP_SLEEP_MODE=y CONFIG_MQTT_READING_QOS=0"
+  [linux]="CONFIG_DIAG_HISTOGRAMS=y CONFIG_DIAG_MEMORY=y CONFIG_TS_LOG=y"
+)
+
+if [ $# -gt 0 ]; then
+  NAMES=("$@")
+fi
+
+failed=()
+for name in "${NAMES[@]}"; do
+  if [ -z "${OPTIONS[$name]+set}" ]; then
+    echo "Unknown combination: $name" >&2
+    exit 2
+  fi
+
+  dir="build/matrix/$name"
+  target="${TARGET[$name]:-esp32}"
+  mkdir -p "$dir"
+  rm -f "$dir/sdkconfig"
+  tr ' ' '\n' <<< "${OPTIONS[$name]}" > "$dir/sdkconfig.defaults"
+
+  echo "== $name ($target): ${OPTIONS[$name]:-defaults}"
+  preview=()
+  [ "$target" = linux ] && preview=(--preview)
+  if ! idf.py "${preview[@]}" -B "$dir" -DIDF_TARGET="$target" \
+      -DSDKCONFIG="$dir/sdkconfig" \
+      -DSDKCONFIG_DEFAULTS="$dir/sdkconfig.defaults" \
+      -DGM_WERROR=1 build > "$dir/build.log" 2>&1; then
+    echo "   FAILED, see $dir/build.log"
+    failed+=("$name")
+  fi
+done
+
+if [ ${#failed[@]} -gt 0 ]; then
+  echo "Failed: ${failed[*]}"
+  exit 1
+fi
+echo "All ${#NAMES[@]} combinations built"
@@ -0,0 +1,95 @@
+#!/usr/bin/env bash
+# End-to-end run of the Linux build against a local mosquitto. Run from an
+# ESP-IDF v5 environment (`. $IDF_PATH/export.sh`) with mosquitto and the
+# mosquitto clients installed:
+#   tools/e2e_linux.sh [hours]
+# Builds the firmware for the Linux target in build/e2e, starts a broker on
+# E2E_PORT (default 18830) and the firmware at SIM_TIME_SCALE (default 360x),
+# runs for `hours` simulated hours (default 4) and prints, per simulated hour,
+# the publishes acknowledged by the broker and the CPU time per cycle (one
+# reading sampled and published), then the totals and the number of messages
+# a subscriber received. Exits non-zero if nothing was published.
+set -u
+
+cd "$(dirname "$0")/.."
+
+HOURS=${1:-4}
+PORT=${E2E_PORT:-18830}
+SCALE=${SIM_TIME_SCALE:-360}
+DIR=build/e2e
+
+for tool in idf.py mosquitto mosquitto_sub; do
+  if ! command -v "$tool" > /dev/null; then
+    echo "$tool not found" >&2
+    exit 2
+  fi
+done
+
+mkdir -p "$DIR"
+rm -f "$DIR/sdkconfig"
+cat > "$DIR/sdkconfig.defaults" << EOF
+CONFIG_MQTT_BROKER_URI="mqtt://localhost:$PORT"
+CONFIG_SIM_TIME_SCALE=$SCALE
+EOF
+
+echo "== Building for linux in $DIR"
+if ! idf.py --preview -B "$DIR" -DIDF_TARGET=linux \
+    -DSDKCONFIG="$DIR/sdkconfig" \
+    -DSDKCONFIG_DEFAULTS="$DIR/sdkconfig.defaults" build \
+    > "$DIR/build.log" 2>&1; then
+  echo "   FAILED, see $DIR/build.log"
+  exit 1
+fi
+
+pids=()
+cleanup() {
+  [ ${#pids[@]} -gt 0 ] && kill "${pids[@]}" 2> /dev/null
+  wait 2> /dev/null
+}
+trap cleanup EXIT
+
+mosquitto -p "$PORT" > "$DIR/mosquitto.log" 2>&1 &
+pids+=($!)
+for _ in $(seq 50); do
+  mosquitto_sub -p "$PORT" -t '$SYS/broker/version' -C 1 -W 1 \
+    > /dev/null 2>&1 && break
+  sleep 0.1
+done
+
+# every message the broker routes, one line per publish
+mosquitto_sub -p "$PORT" -t 'garden/#' -F '%t' > "$DIR/received.log" \
+  2> /dev/null &
+pids+=($!)
+
+# one simulated hour is 3600 / SCALE seconds, plus time to connect
+seconds=$(((HOURS * 3600 + SCALE - 1) / SCALE + 10))
+echo "== Running $HOURS simulated hours at ${SCALE}x (${seconds} s)"
+timeout --signal=INT "$seconds" "$DIR/garden-monitor.elf" \
+  > "$DIR/firmware.log" 2>&1 &
+pids+=($!)
+
+n=0
+while [ "$n" -lt "$HOURS" ] && kill -0 "${pids[-1]}" 2> /dev/null; do
+  sleep 1
+  n=$(grep -c 'Simulated hour' "$DIR/firmware.log")
+done
+cleanup
+pids=()
+
+awk -v received="$(wc -l < "$DIR/received.log")" '
+  BEGIN { print "hour,acked,cpu_ms,cpu_us_per_cycle" }
+  /Simulated hour/ {
+    match($0, /Simulated hour [0-9]+: [0-9]+ publishes acknowledged, [0-9]+ ms CPU time \([0-9]+ us/)
+    split(substr($0, RSTART, RLENGTH), f, /[^0-9]+/)
+    printf "%d,%d,%d,%d\n", f[2], f[3], f[4], f[5]
+    acked += f[3]; cpu_ms += f[4]; n++
+  }
+  END {
+    if (n == 0 || acked == 0) {
+      print "No publishes, see firmware.log" > "/dev/stderr"
+      exit 1
+    }
+    printf "== %.1f publishes per simulated hour (%d received by the " \
+           "subscriber), %d us CPU per cycle\n",
+           acked / n, received, cpu_ms * 1000 / acked
+  }' "$DIR/firmware.log"